@@ -49,13 +49,28 @@ typedef enum {
     LB_ERROR_NO_RESOURCES = 6,            /**< No resource of that type avail */
     LB_ERROR_MEMEORY_ALLOCATION = 7,      /**< Memory allocation fail */
     LB_ERROR_SD_BUS_CALL_FAIL = 8,        /**< sd_bus call failure */
+    LB_ERROR_TIMEOUT = 9,                 /**< Operation did not complete in time */
+    LB_ERROR_CANCELLED = 10,              /**< Operation was cancelled */
 
     LB_ERROR_UNSPECIFIED = 99 /**< Unknown Error */
 } lb_result_t;
 
+/**
+ * Freshness policy of a characteristic read
+ */
+typedef enum {
+    LB_READ_REMOTE = 0,      /**< Always read the value from the device */
+    LB_READ_CACHED_ONLY = 1, /**< Only return the cached value, never read from the device */
+    LB_READ_MAX_AGE = 2,     /**< Return the cached value if it is younger than max_age_ms */
+} lb_read_policy_t;
+
 typedef struct ble_characteristic {
-    const char* char_path; /**< device path under dbus */
-    const char* uuid;      /**< uuid of the characteristic. */
+    const char* char_path;    /**< device path under dbus */
+    const char* uuid;         /**< uuid of the characteristic. */
+    uint8_t* value;           /**< last known value of the characteristic, NULL if none */
+    size_t value_size;        /**< size of the last known value */
+    size_t value_capacity;    /**< allocated size of the value buffer */
+    uint64_t value_timestamp; /**< CLOCK_MONOTONIC usec of the last value update, 0 if none */
 } lb_ble_char;
 
 typedef struct ble_service {
@@ -66,14 +81,167 @@ typedef struct ble_service {
     int characteristics_size;      /**< count of characteristics in the service */
 } lb_ble_service;
 
+/**
+ * Device properties reported by BlueZ, see lb_bl_device_properties.known
+ */
+typedef enum {
+    LB_DEVICE_PROPERTY_RSSI = (1 << 0),              /**< rssi is valid */
+    LB_DEVICE_PROPERTY_TX_POWER = (1 << 1),          /**< tx_power is valid */
+    LB_DEVICE_PROPERTY_APPEARANCE = (1 << 2),        /**< appearance is valid */
+    LB_DEVICE_PROPERTY_MANUFACTURER_DATA = (1 << 3), /**< manufacturer data is valid */
+    LB_DEVICE_PROPERTY_SERVICE_DATA = (1 << 4),      /**< service data is valid, advertisements only */
+} lb_device_property_t;
+
+/**
+ * Device kind and readiness flags, see lb_bl_device.flags
+ */
+typedef enum {
+    LB_DEVICE_FLAG_BL = (1 << 0),      /**< object implements org.bluez.Device1 */
+    LB_DEVICE_FLAG_BLE = (1 << 1),     /**< device exposes GATT services */
+    LB_DEVICE_FLAG_REMOVED = (1 << 2), /**< device object was removed by BlueZ */
+} lb_device_flag_t;
+
+typedef struct bl_device_properties {
+    uint32_t known;                /**< mask of lb_device_property_t fields reported by BlueZ */
+    int16_t rssi;                  /**< received signal strength indication in dBm */
+    int16_t tx_power;              /**< advertised transmit power in dBm */
+    bool connected;                /**< is the device connected */
+    bool paired;                   /**< is the device paired */
+    bool trusted;                  /**< is the device trusted */
+    bool services_resolved;        /**< were the GATT services of the device resolved */
+    uint16_t appearance;           /**< external appearance of the device */
+    uint16_t manufacturer_id;      /**< company identifier of the manufacturer data */
+    uint8_t* manufacturer_data;    /**< manufacturer specific data */
+    size_t manufacturer_data_size; /**< size of the manufacturer specific data */
+    uint64_t timestamp;            /**< CLOCK_MONOTONIC usec of the last update */
+    uint64_t last_seen;            /**< CLOCK_MONOTONIC usec the device was last seen in range */
+} lb_bl_device_properties;
+
 typedef struct bl_device {
-    const char* device_path;   /**< device path under dbus */
-    const char* address;       /**< address of the bluetooth device */
-    const char* name;          /**< name of the bluetooth device */
-    lb_ble_service** services; /**< list of the service inside the device */
-    int services_size;         /**< count of services in the device */
+    const char* device_path;            /**< device path under dbus */
+    const char* address;                /**< address of the bluetooth device */
+    const char* name;                   /**< name of the bluetooth device */
+    lb_ble_service** services;          /**< list of the service inside the device */
+    int services_size;                  /**< count of services in the device */
+    lb_bl_device_properties properties; /**< cached properties of the device */
+    uint32_t flags;                     /**< mask of lb_device_flag_t kind and readiness flags */
 } lb_bl_device;
 
+/**
+ * Criteria of lb_filter_devices, zeroed fields match every device
+ */
+typedef struct bl_device_filter {
+    const char* address_prefix; /**< leading octets of the address like "00:1A:7D", NULL for any */
+    const char* name;           /**< exact name of the device, NULL for any */
+    int16_t min_rssi;           /**< minimal rssi in dBm, 0 for any including unknown rssi */
+    uint32_t flags_set;         /**< mask of lb_device_flag_t the device must have */
+    uint32_t flags_clear;       /**< mask of lb_device_flag_t the device must not have */
+    uint64_t seen_since;        /**< CLOCK_MONOTONIC usec the properties must be updated after */
+} lb_device_filter;
+
+#define LB_ADVERTISEMENT_DATA_SIZE 31 /**< bytes of manufacturer or service data kept per record */
+
+/**
+ * Advertisement record delivered by lb_read_advertisements
+ *
+ * Every record holds the latest value of each field seen from the device, not only the ones which
+ * changed with this advertisement. Data longer than LB_ADVERTISEMENT_DATA_SIZE is truncated.
+ */
+typedef struct bl_advertisement {
+    char address[18];                                 /**< address of the advertising device */
+    uint32_t known;                                   /**< mask of lb_device_property_t fields set */
+    int16_t rssi;                                     /**< received signal strength in dBm */
+    uint16_t manufacturer_id;                         /**< company identifier of the data */
+    uint8_t manufacturer_data_size;                   /**< count of bytes in manufacturer_data */
+    uint8_t manufacturer_data[LB_ADVERTISEMENT_DATA_SIZE]; /**< manufacturer specific data */
+    char service_uuid[37];                            /**< uuid the service data belongs to */
+    uint8_t service_data_size;                        /**< count of bytes in service_data */
+    uint8_t service_data[LB_ADVERTISEMENT_DATA_SIZE]; /**< service data */
+    uint64_t timestamp;                               /**< CLOCK_MONOTONIC usec of reception */
+} lb_advertisement;
+
+/**
+ * Configuration of lb_start_advertisement_scan, zeroed fields take their defaults
+ */
+typedef struct advertisement_options {
+    int ring_size;       /**< records buffered between reads, rounded to a power of two, 1024 if 0 */
+    int dedup_window_ms; /**< repeats of unchanged data from a device within it are dropped, 0 keeps all */
+} lb_advertisement_options;
+
+/**
+ * Counters of the advertisement scan, see lb_get_advertisement_stats
+ */
+typedef struct advertisement_stats {
+    uint64_t received;    /**< advertisement signals parsed */
+    uint64_t duplicates;  /**< records dropped by the dedup window */
+    uint64_t overruns;    /**< records overwritten before they were read */
+    uint64_t advertisers; /**< devices whose latest advertisement is kept, idle ones are dropped */
+} lb_advertisement_stats;
+
+/**
+ * Called when a device enters or leaves, see lb_start_presence_tracking
+ *
+ * @param dev that entered or left, freed as soon as a leave callback returns
+ * @param userdata given in lb_presence_options
+ */
+typedef void (*lb_presence_callback)(lb_bl_device* dev, void* userdata);
+
+/**
+ * Configuration of lb_start_presence_tracking, zeroed fields take their defaults
+ */
+typedef struct presence_options {
+    int idle_timeout_ms;           /**< devices not seen for this long leave, 30000 if 0 */
+    lb_presence_callback on_enter; /**< called once for every device tracked, may be NULL */
+    lb_presence_callback on_leave; /**< called before a device is removed, may be NULL */
+    void* userdata;                /**< passed to the callbacks */
+} lb_presence_options;
+
+/**
+ * Borrowed view of a read characteristic value, see lb_read_from_characteristic_view
+ */
+typedef struct read_view {
+    const uint8_t* data;     /**< value bytes, owned by the reply message */
+    size_t size;             /**< count of bytes in data */
+    sd_bus_message* message; /**< reference on the reply kept until lb_read_release */
+} lb_read_view;
+
+
+/**
+ * Priority class of a queued GATT operation
+ */
+typedef enum {
+    LB_PRIORITY_CONTROL = 0, /**< commands, sent before any waiting bulk operation */
+    LB_PRIORITY_BULK = 1,    /**< transfers, the class of the calls taking no options */
+} lb_priority_t;
+
+#define LB_PRIORITY_CLASSES 2 /**< count of lb_priority_t classes */
+
+/**
+ * Options of a single bus call, NULL options are LB_PRIORITY_BULK without deadline and the
+ * timeout set with lb_set_call_timeout. priority and deadline_ms only apply to GATT operations.
+ */
+typedef struct call_options {
+    lb_priority_t priority;   /**< class the operation waits in */
+    unsigned int deadline_ms; /**< dropped with LB_ERROR_TIMEOUT if not sent within, 0 for never */
+    unsigned int timeout_ms;  /**< fails with LB_ERROR_TIMEOUT without a reply within, 0 for default */
+} lb_call_options;
+
+/**
+ * Read of a lb_read_batch
+ */
+typedef struct read_op {
+    lb_bl_device* dev; /**< BLE device to search the characteristic in */
+    const char* uuid;  /**< of the characteristic to read */
+} lb_read_op;
+
+/**
+ * Outcome of a read of a lb_read_batch
+ */
+typedef struct read_result {
+    lb_result_t result; /**< result of the read, LB_ERROR_NO_RESOURCES if the value did not fit */
+    size_t offset;      /**< of the value in the buffer */
+    size_t size;        /**< of the value, also set when it did not fit */
+} lb_read_result;
 
 /**
  * Initialize littleb.
@@ -91,9 +259,53 @@ lb_result_t lb_init();
  */
 lb_result_t lb_destroy();
 
+/**
+ * Enable the persistent GATT cache
+ *
+ * Must be called before lb_init. The file is memory mapped by lb_init and lb_get_ble_device_services
+ * populates devices whose address is found in it without any bus round trip. Cached layouts are
+ * trusted and validated lazily: when BlueZ reports a cached object as unknown the device entry is
+ * dropped and it's services are rediscovered on the next lb_get_ble_device_services. New layouts
+ * are written back on lb_save_gatt_cache and lb_destroy.
+ *
+ * @param path of the cache file, NULL to disable the cache
+ * @return Result of operation
+ */
+lb_result_t lb_set_gatt_cache_file(const char* path);
+
+/**
+ * Write the discovered GATT layouts to the cache file set with lb_set_gatt_cache_file
+ *
+ * @return Result of operation
+ */
+lb_result_t lb_save_gatt_cache();
+
+/**
+ * Set how long every bus call waits for it's reply
+ *
+ * Applies to the calls made after it, synchronous or not, that are not given a timeout_ms of their
+ * own. A call without a reply in time fails with LB_ERROR_TIMEOUT, a future completes with it.
+ *
+ * @param timeout_ms to wait for a reply, 0 for the sd-bus default of 25 seconds
+ * @return Result of operation
+ */
+lb_result_t lb_set_call_timeout(unsigned int timeout_ms);
+
+/**
+ * Get the timeout set with lb_set_call_timeout
+ *
+ * @param timeout_ms_ret to populate with the timeout, 0 for the sd-bus default
+ * @return Result of operation
+ */
+lb_result_t lb_get_call_timeout(unsigned int* timeout_ms_ret);
+
 /**
  * Populate internal list of bl devices found in a scan of specified length
  *
+ * A rescan reconciles the list with what BlueZ reports: devices already known are updated in
+ * place and their lb_bl_device stays valid, new devices are added and devices BlueZ does not
+ * report anymore are removed and freed, or leave through on_leave while tracking presence.
+ *
  * @param seconds to perform device scan
  * @return Result of operation
  */
@@ -109,6 +321,15 @@ lb_result_t lb_get_bl_devices(int seconds);
  */
 lb_result_t lb_connect_device(lb_bl_device* dev);
 
+/**
+ * lb_connect_device with a timeout of it's own
+ *
+ * @param dev to connect to
+ * @param options of the call, only timeout_ms applies, NULL for the defaults
+ * @return Result of operation, LB_ERROR_TIMEOUT if the device did not connect in time
+ */
+lb_result_t lb_connect_device_with_options(lb_bl_device* dev, const lb_call_options* options);
+
 /**
  * Disconnect from a specific bluetooth device
  *
@@ -117,6 +338,15 @@ lb_result_t lb_connect_device(lb_bl_device* dev);
  */
 lb_result_t lb_disconnect_device(lb_bl_device* dev);
 
+/**
+ * lb_disconnect_device with a timeout of it's own
+ *
+ * @param dev to disconnect from
+ * @param options of the call, only timeout_ms applies, NULL for the defaults
+ * @return Result of operation, LB_ERROR_TIMEOUT if the device did not disconnect in time
+ */
+lb_result_t lb_disconnect_device_with_options(lb_bl_device* dev, const lb_call_options* options);
+
 /**
  * Pair with specific bluetooth device
  *
@@ -125,6 +355,15 @@ lb_result_t lb_disconnect_device(lb_bl_device* dev);
  */
 lb_result_t lb_pair_device(lb_bl_device* dev);
 
+/**
+ * lb_pair_device with a timeout of it's own
+ *
+ * @param dev to pair with
+ * @param options of the call, only timeout_ms applies, NULL for the defaults
+ * @return Result of operation, LB_ERROR_TIMEOUT if pairing did not complete in time
+ */
+lb_result_t lb_pair_device_with_options(lb_bl_device* dev, const lb_call_options* options);
+
 /**
  * Cancel pairing with specific bluetooth device
  *
@@ -133,6 +372,35 @@ lb_result_t lb_pair_device(lb_bl_device* dev);
  */
 lb_result_t lb_unpair_device(lb_bl_device* dev);
 
+/**
+ * lb_unpair_device with a timeout of it's own
+ *
+ * @param dev to cancel pair with
+ * @param options of the call, only timeout_ms applies, NULL for the defaults
+ * @return Result of operation, LB_ERROR_TIMEOUT if BlueZ did not answer in time
+ */
+lb_result_t lb_unpair_device_with_options(lb_bl_device* dev, const lb_call_options* options);
+
+/**
+ * Get the cached properties of a bluetooth device
+ *
+ * The properties are fetched with a single GetAll when the device is found and kept up to date
+ * from PropertiesChanged signals, so no bus round trip is done here
+ *
+ * @param dev to get the properties of
+ * @param properties_ret to populate with the device properties
+ * @return Result of operation
+ */
+lb_result_t lb_get_device_properties(lb_bl_device* dev, const lb_bl_device_properties** properties_ret);
+
+/**
+ * Refetch all the properties of a bluetooth device with a single GetAll call
+ *
+ * @param dev to refresh the properties of
+ * @return Result of operation
+ */
+lb_result_t lb_refresh_device_properties(lb_bl_device* dev);
+
 /**
  * Populate ble_char with characteristic found by using it's device path under dbus
  *
@@ -184,6 +452,9 @@ lb_result_t lb_get_ble_service_by_uuid(lb_bl_device* dev,
 /**
  * Populate the BLE device with it's services
  *
+ * Like lb_get_bl_devices a rescan keeps the services and characteristics still reported, with
+ * their cached values, and only frees the ones that disappeared.
+ *
  * @param bl_dev to scan services
  * @return Result of operation
  */
@@ -218,9 +489,55 @@ lb_result_t lb_get_device_by_device_name(const char* name, lb_bl_device** bl_dev
  */
 lb_result_t lb_get_device_by_device_address(const char* address, lb_bl_device** bl_device_ret);
 
+/**
+ * Get bluetooth device by it's index in the devices found in a scan
+ *
+ * @param index of the device, as returned by lb_filter_devices
+ * @param lb_bl_device_ret to populate with the found device
+ * @return Result of operation
+ */
+lb_result_t lb_get_device_by_index(int index, lb_bl_device** bl_device_ret);
+
+/**
+ * Find every device matching a filter in a single pass
+ *
+ * The address, rssi, flags, last update and name of the devices are mirrored in contiguous arrays
+ * which are scanned linearly, no device struct is dereferenced. Matching devices are returned as
+ * indices for lb_get_device_by_index, in the order they were found.
+ *
+ * @param filter to match, NULL matches every device
+ * @param indices to populate with the indices of the matching devices
+ * @param capacity of indices
+ * @param count_ret to populate with the count of matching devices, can be larger than capacity
+ * @return Result of operation, -LB_ERROR_NO_RESOURCES if only capacity indices were written
+ */
+lb_result_t lb_filter_devices(const lb_device_filter* filter, int* indices, int capacity, int* count_ret);
+
+#define LB_ATT_DEFAULT_MTU 23      /**< ATT MTU of a link before an exchange */
+#define LB_ATT_MAX_VALUE_SIZE 512  /**< longest attribute value a write can carry */
+
+/**
+ * Get the ATT MTU of the link to a characteristic
+ *
+ * Read from the MTU property BlueZ exposes on characteristics and cached, an update BlueZ signals
+ * after an exchange replaces it. LB_ATT_DEFAULT_MTU is reported if BlueZ does not expose it. A
+ * notification or write without response carries MTU - 3 bytes at most.
+ *
+ * @param dev BLE device to search the characteristic in
+ * @param uuid of the characteristic
+ * @param mtu_ret to populate with the MTU
+ * @return Result of operation
+ */
+lb_result_t lb_get_characteristic_mtu(lb_bl_device* dev, const char* uuid, uint16_t* mtu_ret);
+
 /**
  * Write to a specific BLE device characteristic using it's uuid
  *
+ * The write waits in the operation queue of the device as LB_PRIORITY_BULK, so calls from
+ * several threads are sent one after the other instead of failing with InProgress. A value longer
+ * than the MTU allows is sent by BlueZ as a long write, up to LB_ATT_MAX_VALUE_SIZE bytes, larger
+ * payloads have to go through lb_stream_write_message.
+ *
  * @param dev BLE device to search the characteristic in
  * @param uuid of the characteristic to write to
  * @param size of the uint8 array to be written
@@ -230,41 +547,1152 @@ lb_result_t lb_get_device_by_device_address(const char* address, lb_bl_device**
 lb_result_t
 lb_write_to_characteristic(lb_bl_device* dev, const char* uuid, int size, uint8_t* value);
 
+/**
+ * lb_write_to_characteristic with a priority, a deadline and a timeout, see
+ * lb_read_from_characteristic_queued
+ *
+ * @param dev BLE device to search the characteristic in
+ * @param uuid of the characteristic to write to
+ * @param size of value
+ * @param value to write
+ * @param options of the write, NULL for the defaults
+ * @return Result of operation, LB_ERROR_TIMEOUT if it expired or got no reply in time
+ */
+lb_result_t lb_write_to_characteristic_with_options(lb_bl_device* dev,
+                                                    const char* uuid,
+                                                    int size,
+                                                    const uint8_t* value,
+                                                    const lb_call_options* options);
+
+/**
+ * Counters of the latest value wins writes of a characteristic
+ */
+typedef struct latest_write_stats {
+    uint64_t submitted;      /**< values given to lb_write_to_characteristic_latest */
+    uint64_t written;        /**< writes BlueZ completed */
+    uint64_t elided;         /**< values replaced by a newer one before they were sent */
+    uint64_t failed;         /**< writes that failed */
+    lb_result_t last_result; /**< result of the last write completed */
+    bool busy;               /**< a write is queued or in flight */
+} lb_latest_write_stats;
+
+/**
+ * Write a value of which only the newest matters, a setpoint or the state of a LED
+ *
+ * Returns without waiting. While a write to the characteristic is queued or in flight the value
+ * waits in a single slot, a newer value replaces it and counts as elided, and it is sent once the
+ * write completes. A write still queued behind other operations of the device takes the newer
+ * value itself. So at most one write is in flight per characteristic and the last value given is
+ * always the last written.
+ *
+ * @param dev BLE device to search the characteristic in
+ * @param uuid of the characteristic to write to
+ * @param size of value, at most LB_ATT_MAX_VALUE_SIZE
+ * @param value to write, copied
+ * @param options of the writes sent from now on, NULL for the defaults
+ * @return Result of operation, failed writes are reported by lb_get_latest_write_stats
+ */
+lb_result_t lb_write_to_characteristic_latest(lb_bl_device* dev,
+                                              const char* uuid,
+                                              int size,
+                                              const uint8_t* value,
+                                              const lb_call_options* options);
+
+/**
+ * Wait until the latest value given to lb_write_to_characteristic_latest was written
+ *
+ * @param dev BLE device to search the characteristic in
+ * @param uuid of the characteristic written to
+ * @param timeout_ms to wait at most, negative to wait forever
+ * @return Result of the last write, LB_ERROR_TIMEOUT if writes are still pending
+ */
+lb_result_t lb_wait_latest_write(lb_bl_device* dev, const char* uuid, int timeout_ms);
+
+/**
+ * Get the counters of the latest value wins writes of a characteristic
+ *
+ * @param dev BLE device to search the characteristic in
+ * @param uuid of the characteristic written to
+ * @param stats_ret to populate, zeroed if no value was written that way
+ * @return Result of operation
+ */
+lb_result_t lb_get_latest_write_stats(lb_bl_device* dev, const char* uuid, lb_latest_write_stats* stats_ret);
+
 /**
  * Read from a specific BLE device characteristic using it's uuid
  *
+ * Like lb_write_to_characteristic the read waits in the operation queue of the device.
+ *
  * @param dev BLE device to search the characteristic in
  * @param uuid of the characteristic to read from
  * @param size of the uint8 array that was read
- * @param the array of byte buffer that was read
+ * @param the array of byte buffer that was read, valid until the value is next updated
  * @return Result of operation
  */
 lb_result_t
 lb_read_from_characteristic(lb_bl_device* dev, const char* uuid, size_t* size, uint8_t** result);
 
 /**
- * Register a callback function for an event of characteristic value change
+ * lb_read_from_characteristic with a priority, a deadline and a timeout
  *
  * @param dev BLE device to search the characteristic in
  * @param uuid of the characteristic to read from
- * @param callback function to be called when char value changed
- * @param userdata to pass in the callback function
+ * @param options of the read, NULL for the defaults
+ * @param size of the uint8 array that was read
+ * @param result buffer owned by the characteristic, valid until it's value is next updated
+ * @return Result of operation, LB_ERROR_TIMEOUT if it expired or got no reply in time
+ */
+lb_result_t lb_read_from_characteristic_with_options(lb_bl_device* dev,
+                                                     const char* uuid,
+                                                     const lb_call_options* options,
+                                                     size_t* size,
+                                                     uint8_t** result);
+
+/**
+ * Read from a specific BLE device characteristic using it's uuid and a freshness policy
+ *
+ * The value of every known characteristic is cached and kept up to date from remote reads,
+ * notifications and PropertiesChanged signals, so slow changing characteristics can be served
+ * without a radio round trip. The cache starts with the value BlueZ lists when the services are
+ * fetched, it's age counts from then.
+ *
+ * @param dev BLE device to search the characteristic in
+ * @param uuid of the characteristic to read from
+ * @param policy deciding whether the cached value may be used
+ * @param max_age_ms maximum age of the cached value with LB_READ_MAX_AGE
+ * @param size of the uint8 array that was read
+ * @param result buffer owned by the characteristic, valid until it's value is next updated
+ * @return Result of operation, -LB_ERROR_NO_RESOURCES if LB_READ_CACHED_ONLY found no value
+ */
+lb_result_t lb_read_from_characteristic_cached(lb_bl_device* dev,
+                                               const char* uuid,
+                                               lb_read_policy_t policy,
+                                               unsigned int max_age_ms,
+                                               size_t* size,
+                                               uint8_t** result);
+
+/**
+ * Read from a specific BLE device characteristic into a caller provided buffer
+ *
+ * The value is copied straight out of the reply and the characteristic value cache is not
+ * updated, which suits tight polling loops. Once littleb has warmed up the read reuses a freed
+ * operation, so littleb allocates nothing per read, sd-bus still allocates the call and reply
+ * messages.
+ *
+ * @param dev BLE device to search the characteristic in
+ * @param uuid of the characteristic to read from
+ * @param buffer to copy the value into
+ * @param capacity of buffer in bytes
+ * @param size of the value that was read, also set when it does not fit in buffer
+ * @return Result of operation, -LB_ERROR_NO_RESOURCES if the value is larger than capacity
+ */
+lb_result_t lb_read_from_characteristic_into(lb_bl_device* dev,
+                                             const char* uuid,
+                                             uint8_t* buffer,
+                                             size_t capacity,
+                                             size_t* size);
+
+/**
+ * Read from a specific BLE device characteristic without copying the value
+ *
+ * The view points into the reply message, which stays referenced until lb_read_release is
+ * called on the view.
+ *
+ * @param dev BLE device to search the characteristic in
+ * @param uuid of the characteristic to read from
+ * @param view to populate, must be released with lb_read_release on success
  * @return Result of operation
  */
-lb_result_t lb_register_characteristic_read_event(lb_bl_device* dev,
-                                                  const char* uuid,
-                                                  sd_bus_message_handler_t callback,
-                                                  void* userdata);
+lb_result_t lb_read_from_characteristic_view(lb_bl_device* dev, const char* uuid, lb_read_view* view);
 
 /**
- * Special function to parse uart tx line buffer
+ * Release the reply held by a view from lb_read_from_characteristic_view
  *
- * @param message sd_bus_message to prase the buffer array from
- * @param result buffer to accommodate the result
- * @param size of the buffer
+ * Releasing an already released view is a no-op
+ *
+ * @param view to release
  * @return Result of operation
  */
-lb_result_t lb_parse_uart_service_message(sd_bus_message* message, const void** result, size_t* size);
+lb_result_t lb_read_release(lb_read_view* view);
+
+/**
+ * Read many characteristics, of any number of devices, at once
+ *
+ * Every read is queued before any is waited for, so devices answer concurrently and the batch
+ * takes about as long as the slowest device's reads, which still go one at a time. The values are
+ * packed into buffer in the order of ops. A read that failed or did not fit in what is left of the
+ * buffer takes no room and the reads after it are still gathered. The values are copied straight
+ * out of the replies and the characteristic value cache is not updated. littleb allocates one
+ * array of count pointers per batch, the reads reuse freed operations once it has warmed up.
+ *
+ * @param ops reads to make
+ * @param count of ops
+ * @param options of every read, NULL for the defaults
+ * @param buffer to pack the values into
+ * @param capacity of buffer in bytes
+ * @param results count entries to populate, one per op
+ * @return Result of operation, the result of the first read that failed if any did
+ */
+lb_result_t lb_read_batch(const lb_read_op* ops,
+                          int count,
+                          const lb_call_options* options,
+                          uint8_t* buffer,
+                          size_t capacity,
+                          lb_read_result* results);
+
+/**
+ * Get the characteristic value cache counters
+ *
+ * Reads with LB_READ_REMOTE are not counted
+ *
+ * @param hits count of reads served from the cache
+ * @param misses count of reads that could not be served from the cache
+ * @return Result of operation
+ */
+lb_result_t lb_get_value_cache_stats(uint64_t* hits, uint64_t* misses);
+
+/**
+ * Get the size of the table the object paths, uuids, names and addresses are interned in
+ *
+ * Strings of departed devices are dropped once the table fills up, so the size follows the
+ * devices known rather than every device ever seen
+ *
+ * @param strings count of strings stored
+ * @param bytes memory used by the table
+ * @return Result of operation
+ */
+lb_result_t lb_get_string_table_stats(uint64_t* strings, uint64_t* bytes);
+
+/**
+ * Start passive collection of advertisements
+ *
+ * Discovery is started with duplicate reporting enabled and every RSSI, ManufacturerData and
+ * ServiceData update BlueZ signals is turned into a record in a preallocated ring, which is read
+ * with lb_read_advertisements. Devices do not need to be found with lb_get_bl_devices first. When
+ * the ring is full the oldest records are overwritten. The latest fields of a device are kept
+ * while it advertises, a device silent for 30 seconds may be forgotten and starts over.
+ *
+ * @param options of the scan, NULL for the defaults
+ * @return Result of operation
+ */
+lb_result_t lb_start_advertisement_scan(const lb_advertisement_options* options);
+
+/**
+ * Stop the advertisement scan and drop the records not read yet
+ *
+ * @return Result of operation
+ */
+lb_result_t lb_stop_advertisement_scan();
+
+/**
+ * Read the buffered advertisements, oldest first
+ *
+ * @param records to populate
+ * @param capacity of records
+ * @param timeout_ms to wait for a first record when none is buffered, 0 to return immediately
+ * @param count_ret to populate with the count of records read
+ * @return Result of operation
+ */
+lb_result_t
+lb_read_advertisements(lb_advertisement* records, int capacity, int timeout_ms, int* count_ret);
+
+/**
+ * Get the counters of the running advertisement scan
+ *
+ * @param stats_ret to populate
+ * @return Result of operation
+ */
+lb_result_t lb_get_advertisement_stats(lb_advertisement_stats* stats_ret);
+
+/**
+ * Keep the device list bounded by the devices actually in range
+ *
+ * Discovery is started and kept running until lb_stop_presence_tracking. A device is seen every
+ * time BlueZ reports it's RSSI or advertised data, devices BlueZ reports which are not in the list
+ * yet are added to it. Devices not seen for idle_timeout_ms, or removed by BlueZ, leave: they are
+ * removed from the list and freed, the last device of the list taking the index of the removed
+ * one. Every device of the list, including the ones found before, is announced with on_enter.
+ *
+ * Expiry runs on a timer wheel with a resolution of a 32nd of the idle timeout. Callbacks are
+ * called from lb_process_events, lb_process and lb_read_advertisements only, never from the calls
+ * taking a device, so a lb_bl_device is never freed while littleb uses it.
+ *
+ * @param options of the tracking, NULL for the defaults
+ * @return Result of operation
+ */
+lb_result_t lb_start_presence_tracking(const lb_presence_options* options);
+
+/**
+ * Stop presence tracking, the devices in the list are kept
+ *
+ * @return Result of operation
+ */
+lb_result_t lb_stop_presence_tracking();
+
+/**
+ * Wait for bus signals and timers and dispatch them
+ *
+ * Drives presence tracking and the advertisement scan of applications which do not read
+ * advertisements.
+ *
+ * @param timeout_ms to wait for a first event, 0 to only dispatch what is pending
+ * @return Result of operation
+ */
+lb_result_t lb_process_events(int timeout_ms);
+
+/**
+ * Get the file descriptor to poll when littleb runs inside the application event loop
+ *
+ * The bus connection and every timer of littleb are sources of this descriptor. Once it was
+ * requested, lb_register_characteristic_read_event no longer starts a thread, the callbacks are
+ * dispatched by lb_process like every other signal. Poll the descriptor for lb_get_events with a
+ * timeout of lb_get_timeout_us, call lb_process when it is readable or the timeout elapsed.
+ *
+ * @return the file descriptor, or a negative Result of operation
+ */
+int lb_get_fd();
+
+/**
+ * Get the poll events to wait for on lb_get_fd
+ *
+ * @return poll events mask, the same value for poll and epoll
+ */
+int lb_get_events();
+
+/**
+ * Get the time left before lb_process must be called even if lb_get_fd is not readable
+ *
+ * Must be called right before polling, after any other littleb call.
+ *
+ * @param timeout_ret to populate with the relative timeout in usec, UINT64_MAX for none
+ * @return Result of operation
+ */
+lb_result_t lb_get_timeout_us(uint64_t* timeout_ret);
+
+/**
+ * Dispatch the signals and timers ready on lb_get_fd without blocking
+ *
+ * At most a bounded number of events is dispatched by one call, lb_get_timeout_us is 0 while more
+ * are ready.
+ *
+ * @return Result of operation
+ */
+lb_result_t lb_process();
+
+/**
+ * Handle of an asynchronous operation
+ *
+ * Futures are completed from lb_process_events, lb_process, lb_read_advertisements and the
+ * lb_future_wait calls. The queued GATT operations and the future calls may be used from several
+ * threads, one of them runs the loop at a time and completes the futures of all, the rest of the
+ * API expects a single thread. A future is owned by the application and must be freed with
+ * lb_future_free, completed or not.
+ */
+typedef struct lb_future lb_future;
+
+/**
+ * Counters of the GATT operation queue of a device
+ */
+typedef struct gatt_queue_stats {
+    uint64_t dispatched; /**< operations sent to the device */
+    uint64_t expired;    /**< operations dropped at their deadline before being sent */
+    int depth;           /**< operations waiting, not counting the one in flight */
+    int max_depth;       /**< highest depth reached */
+} lb_gatt_queue_stats;
+
+/**
+ * Called once when a future completes, including when it is cancelled
+ *
+ * @param future completed, can be freed by the callback
+ * @param userdata given to lb_future_set_callback
+ */
+typedef void (*lb_future_callback)(lb_future* future, void* userdata);
+
+/**
+ * Asynchronous lb_get_bl_devices, discovery runs for seconds without blocking
+ *
+ * @param seconds to scan for devices
+ * @param future_ret to populate with the future of the scan
+ * @return Result of operation
+ */
+lb_result_t lb_get_bl_devices_async(int seconds, lb_future** future_ret);
+
+/**
+ * Asynchronous lb_connect_device
+ *
+ * @param dev to connect
+ * @param future_ret to populate with the future of the connection
+ * @return Result of operation
+ */
+lb_result_t lb_connect_device_async(lb_bl_device* dev, lb_future** future_ret);
+
+/**
+ * Asynchronous lb_pair_device
+ *
+ * @param dev to pair
+ * @param future_ret to populate with the future of the pairing
+ * @return Result of operation
+ */
+lb_result_t lb_pair_device_async(lb_bl_device* dev, lb_future** future_ret);
+
+/**
+ * Asynchronous lb_get_ble_device_services, the device is paired first if needed
+ *
+ * The device is found again by it's path when the reply arrives, the future fails with
+ * LB_ERROR_INVALID_DEVICE if it left the list in between.
+ *
+ * @param dev to get the services of
+ * @param future_ret to populate with the future of the discovery
+ * @return Result of operation
+ */
+lb_result_t lb_get_ble_device_services_async(lb_bl_device* dev, lb_future** future_ret);
+
+/**
+ * Asynchronous lb_read_from_characteristic, the value is kept in the future
+ *
+ * @param dev to read from
+ * @param uuid of the characteristic to read
+ * @param future_ret to populate with the future of the read, see lb_future_get_value
+ * @return Result of operation
+ */
+lb_result_t lb_read_from_characteristic_async(lb_bl_device* dev, const char* uuid, lb_future** future_ret);
+
+/**
+ * Queue a read of a characteristic with a priority and a deadline
+ *
+ * Each device sends one GATT operation at a time, the next queued one as soon as the previous
+ * replied: every LB_PRIORITY_CONTROL operation before any LB_PRIORITY_BULK one, in submission
+ * order within a class. An operation not sent by it's deadline completes with LB_ERROR_TIMEOUT
+ * without reaching the device. Freeing the future of the operation in flight lets the next one go
+ * right away.
+ *
+ * @param dev to read from
+ * @param uuid of the characteristic to read
+ * @param options of the operation, NULL for the defaults
+ * @param future_ret to populate with the future of the read, see lb_future_get_value
+ * @return Result of operation
+ */
+lb_result_t lb_read_from_characteristic_queued(lb_bl_device* dev,
+                                               const char* uuid,
+                                               const lb_call_options* options,
+                                               lb_future** future_ret);
+
+/**
+ * Queue a write of a characteristic with a priority and a deadline, see
+ * lb_read_from_characteristic_queued
+ *
+ * @param dev to write to
+ * @param uuid of the characteristic to write
+ * @param size of value
+ * @param value to write, copied
+ * @param options of the operation, NULL for the defaults
+ * @param future_ret to populate with the future of the write
+ * @return Result of operation
+ */
+lb_result_t lb_write_to_characteristic_queued(lb_bl_device* dev,
+                                              const char* uuid,
+                                              int size,
+                                              const uint8_t* value,
+                                              const lb_call_options* options,
+                                              lb_future** future_ret);
+
+/**
+ * Get the counters of the GATT operation queue of a device
+ *
+ * @param dev to get the counters of
+ * @param stats_ret to populate
+ * @return Result of operation
+ */
+lb_result_t lb_get_gatt_queue_stats(lb_bl_device* dev, lb_gatt_queue_stats* stats_ret);
+
+/**
+ * Run the event loop until a future completes
+ *
+ * @param future to wait for
+ * @param timeout_ms to wait at most, negative to wait forever
+ * @return result of the operation, LB_ERROR_TIMEOUT if it did not complete in time
+ */
+lb_result_t lb_future_wait(lb_future* future, int timeout_ms);
+
+/**
+ * Run the event loop until one of the futures completes
+ *
+ * @param futures to wait for, NULL entries are skipped
+ * @param count of futures
+ * @param timeout_ms to wait at most, negative to wait forever
+ * @param index_ret to populate with the index of a completed future
+ * @return Result of operation, LB_ERROR_TIMEOUT if none completed in time
+ */
+lb_result_t lb_future_wait_any(lb_future** futures, int count, int timeout_ms, int* index_ret);
+
+/**
+ * Run the event loop until every future completed
+ *
+ * @param futures to wait for, NULL entries are skipped
+ * @param count of futures
+ * @param timeout_ms to wait at most, negative to wait forever
+ * @return Result of operation, LB_ERROR_TIMEOUT if some did not complete in time
+ */
+lb_result_t lb_future_wait_all(lb_future** futures, int count, int timeout_ms);
+
+/**
+ * Check whether a future completed
+ *
+ * @param future to check
+ * @return true if the result is available
+ */
+bool lb_future_is_done(const lb_future* future);
+
+/**
+ * Get the result of a completed future
+ *
+ * @param future to get the result of
+ * @return result of the operation, LB_ERROR_NO_RESOURCES while it is pending
+ */
+lb_result_t lb_future_result(const lb_future* future);
+
+/**
+ * Get the value of a completed lb_read_from_characteristic_async, or the response of
+ * lb_transact_async
+ *
+ * @param future of the read
+ * @param value_ret to populate with the value, valid until the future is freed
+ * @param size_ret to populate with the size of the value
+ * @return Result of operation
+ */
+lb_result_t lb_future_get_value(const lb_future* future, const uint8_t** value_ret, size_t* size_ret);
+
+/**
+ * Set the callback called when the future completes, right away if it already did
+ *
+ * @param future to set the callback of
+ * @param callback to call, NULL to remove it
+ * @param userdata passed to callback
+ * @return Result of operation
+ */
+lb_result_t lb_future_set_callback(lb_future* future, lb_future_callback callback, void* userdata);
+
+/**
+ * Cancel a pending future, it completes with LB_ERROR_CANCELLED
+ *
+ * The bus call already sent is not aborted on the device side, it's reply is ignored.
+ *
+ * @param future to cancel
+ * @return Result of operation
+ */
+lb_result_t lb_future_cancel(lb_future* future);
+
+/**
+ * Free a future, a pending one is cancelled without calling it's callback
+ *
+ * @param future to free
+ * @return Result of operation
+ */
+lb_result_t lb_future_free(lb_future* future);
+
+/**
+ * Register a callback function for an event of characteristic value change
+ *
+ * The callback is called from a thread of littleb, or from lb_process once lb_get_fd was called.
+ *
+ * @param dev BLE device to search the characteristic in
+ * @param uuid of the characteristic to read from
+ * @param callback function to be called when char value changed
+ * @param userdata to pass in the callback function
+ * @return Result of operation
+ */
+lb_result_t lb_register_characteristic_read_event(lb_bl_device* dev,
+                                                  const char* uuid,
+                                                  sd_bus_message_handler_t callback,
+                                                  void* userdata);
+
+/**
+ * lb_register_characteristic_read_event with a timeout of it's own for StartNotify
+ *
+ * @param dev BLE device to search the characteristic in
+ * @param uuid of the characteristic to read from
+ * @param callback function to be called when char value changed
+ * @param userdata to pass in the callback function
+ * @param options of the StartNotify call, only timeout_ms applies, NULL for the defaults
+ * @return Result of operation, LB_ERROR_TIMEOUT if notifications were not started in time
+ */
+lb_result_t lb_register_characteristic_read_event_with_options(lb_bl_device* dev,
+                                                               const char* uuid,
+                                                               sd_bus_message_handler_t callback,
+                                                               void* userdata,
+                                                               const lb_call_options* options);
+
+/**
+ * Special function to parse uart tx line buffer
+ *
+ * @param message sd_bus_message to prase the buffer array from
+ * @param result buffer to accommodate the result
+ * @param size of the buffer
+ * @return Result of operation
+ */
+lb_result_t lb_parse_uart_service_message(sd_bus_message* message, const void** result, size_t* size);
+
+#define LB_DECODER_MAX_CHANNELS 16 /**< interleaved channels a payload layout can declare */
+
+/**
+ * Little endian sample types of a packed payload
+ */
+typedef enum {
+    LB_SAMPLE_INT16 = 0,  /**< signed 16-bit */
+    LB_SAMPLE_UINT16 = 1, /**< unsigned 16-bit */
+    LB_SAMPLE_INT24 = 2,  /**< signed 24-bit */
+    LB_SAMPLE_UINT24 = 3, /**< unsigned 24-bit */
+} lb_sample_type_t;
+
+/**
+ * Layout of a notification payload of interleaved samples
+ *
+ * A payload is header_size bytes followed by frames of one sample per channel, a trailing partial
+ * frame is ignored. Channel c of a sample decodes to raw * scale[c] + offset[c].
+ */
+typedef struct payload_layout {
+    lb_sample_type_t type;                 /**< type of every sample */
+    int channels;                          /**< samples per frame, 1 to LB_DECODER_MAX_CHANNELS */
+    int header_size;                       /**< bytes skipped at the start of every payload */
+    float scale[LB_DECODER_MAX_CHANNELS];  /**< factor of each channel */
+    float offset[LB_DECODER_MAX_CHANNELS]; /**< added to each channel after scaling */
+} lb_payload_layout;
+
+/**
+ * Accumulates payloads of one layout and decodes them a batch at a time
+ */
+typedef struct lb_decoder lb_decoder;
+
+/**
+ * Called with every decoded batch
+ *
+ * @param channels one float array per channel, valid until the callback returns
+ * @param frames count of samples in every channel array
+ * @param userdata given to lb_decoder_new
+ */
+typedef void (*lb_samples_callback)(const float* const* channels, int frames, void* userdata);
+
+/**
+ * Decode payloads into one float array per channel
+ *
+ * Uses AVX2, SSE4.1 or NEON kernels when the CPU has them, a scalar loop otherwise.
+ *
+ * @param layout of every payload
+ * @param payloads to decode
+ * @param sizes of the payloads in bytes
+ * @param count of payloads
+ * @param channels layout->channels arrays of capacity floats, frames are appended in order
+ * @param capacity of every channel array
+ * @param frames_ret to populate with the count of frames decoded
+ * @return Result of operation, -LB_ERROR_NO_RESOURCES if the frames did not fit in capacity
+ */
+lb_result_t lb_decode_payloads(const lb_payload_layout* layout,
+                               const void* const* payloads,
+                               const size_t* sizes,
+                               int count,
+                               float* const* channels,
+                               int capacity,
+                               int* frames_ret);
+
+/**
+ * Get the name of the kernel lb_decode_payloads and decoders run on this CPU
+ *
+ * @return "avx2", "sse4.1", "neon" or "scalar"
+ */
+const char* lb_decoder_kernel();
+
+/**
+ * Create a decoder calling back every batch_frames frames
+ *
+ * @param layout of the payloads pushed, copied
+ * @param batch_frames frames decoded per callback
+ * @param callback to call with every batch
+ * @param userdata passed to callback
+ * @param decoder_ret to populate with the new decoder
+ * @return Result of operation
+ */
+lb_result_t lb_decoder_new(const lb_payload_layout* layout,
+                           int batch_frames,
+                           lb_samples_callback callback,
+                           void* userdata,
+                           lb_decoder** decoder_ret);
+
+/**
+ * Append the frames of a payload, a full batch is decoded and passed to the callback
+ *
+ * A decoder is not locked, once registered it must only be pushed and flushed from the thread
+ * calling it back.
+ *
+ * @param decoder to push to
+ * @param payload to append
+ * @param size of payload in bytes
+ * @return Result of operation
+ */
+lb_result_t lb_decoder_push(lb_decoder* decoder, const void* payload, size_t size);
+
+/**
+ * Decode the frames pushed so far and pass them to the callback even if the batch is not full
+ *
+ * @param decoder to flush
+ * @return Result of operation
+ */
+lb_result_t lb_decoder_flush(lb_decoder* decoder);
+
+/**
+ * Free a decoder, frames not flushed are dropped
+ *
+ * @param decoder to free
+ * @return Result of operation
+ */
+lb_result_t lb_decoder_free(lb_decoder* decoder);
+
+/**
+ * Push every notification of a characteristic to a decoder
+ *
+ * The decoder is called back from the same thread as lb_register_characteristic_read_event
+ * callbacks and must outlive the context.
+ *
+ * @param dev BLE device to search the characteristic in
+ * @param uuid of the characteristic notifying the payloads
+ * @param decoder to push the payloads to
+ * @return Result of operation
+ */
+lb_result_t lb_register_characteristic_decoder(lb_bl_device* dev, const char* uuid, lb_decoder* decoder);
+
+/**
+ * Write without response stream to a characteristic
+ *
+ * Bytes are buffered and written in chunks with WriteValue of type command, several in flight at
+ * once up to a credit window. The window shrinks when BlueZ refuses a write because the
+ * controller buffers are full and grows back while writes go through. A refused write is sent
+ * again together with every newer one, in order, so no byte is lost or sent ahead of an older
+ * refused one. A stream BlueZ keeps refusing for 5 seconds fails with LB_ERROR_TIMEOUT. Streams
+ * are driven by the event loop like futures.
+ */
+typedef struct lb_stream lb_stream;
+
+/**
+ * Sizing of a stream, zero fields take the default
+ */
+typedef struct stream_options {
+    unsigned int window; /**< writes in flight at most, default 8 */
+    size_t chunk_size;   /**< bytes per write, default the ATT MTU of the link - 3 */
+    size_t buffer_size;  /**< bytes buffered ahead of the link, default 16384 */
+} lb_stream_options;
+
+/**
+ * Counters of a stream
+ */
+typedef struct stream_stats {
+    uint64_t bytes_accepted; /**< bytes taken by lb_stream_write */
+    uint64_t bytes_sent;     /**< bytes BlueZ accepted for the link */
+    uint64_t writes;         /**< writes accepted */
+    uint64_t retries;        /**< writes sent again after BlueZ refused them or an older one */
+    uint64_t short_writes;   /**< lb_stream_write calls that took less than offered */
+    uint64_t throughput;     /**< bytes per second sent over the last 100ms measured */
+    uint64_t latency_us;     /**< smoothed time BlueZ takes to accept a write */
+    size_t buffered;         /**< bytes accepted and not sent yet */
+    int in_flight;           /**< writes waiting for BlueZ */
+    int window;              /**< current credit window */
+} lb_stream_stats;
+
+/**
+ * Called from the event loop once a stream turned bytes away has room for half it's buffer, or
+ * with room 0 once it failed
+ *
+ * @param stream with room, can be closed by the callback
+ * @param room bytes lb_stream_write takes now
+ * @param userdata given to lb_stream_set_callback
+ */
+typedef void (*lb_stream_callback)(lb_stream* stream, size_t room, void* userdata);
+
+/**
+ * Open a write without response stream on a characteristic
+ *
+ * @param dev BLE device to search the characteristic in
+ * @param uuid of the characteristic to write to
+ * @param options of the stream, NULL for the defaults
+ * @param stream_ret to populate with the stream, closed with lb_stream_close
+ * @return Result of operation
+ */
+lb_result_t lb_stream_open(lb_bl_device* dev,
+                           const char* uuid,
+                           const lb_stream_options* options,
+                           lb_stream** stream_ret);
+
+/**
+ * Queue bytes on a stream without blocking
+ *
+ * Takes as many bytes as the buffer has room for, fewer than size is back-pressure: wait for the
+ * stream callback, or a flush, before offering the rest.
+ *
+ * @param stream to write to
+ * @param data to write, copied
+ * @param size of data
+ * @param written_ret to populate with the count of bytes taken
+ * @return Result of operation, the error the stream failed with if a write could not be sent
+ */
+lb_result_t lb_stream_write(lb_stream* stream, const uint8_t* data, size_t size, size_t* written_ret);
+
+#define LB_FRAME_HEADER_SIZE 2     /**< little endian length in front of every framed message */
+#define LB_FRAME_MAX_SIZE 65535    /**< longest framed message */
+
+/**
+ * Queue a message on a stream with a length prefix, so a lb_frame_reader on the device side
+ * or a firmware parsing the same framing can find it's end in the chunks it receives
+ *
+ * The prefix goes out with the first bytes of the message. If fewer than size bytes are taken the
+ * rest of the message has to be offered next, as data + written and size - written, before
+ * another message can start.
+ *
+ * @param stream to write to
+ * @param data of the message, copied
+ * @param size of data, at most LB_FRAME_MAX_SIZE
+ * @param written_ret to populate with the count of bytes of data taken
+ * @return Result of operation
+ */
+lb_result_t lb_stream_write_message(lb_stream* stream, const uint8_t* data, size_t size, size_t* written_ret);
+
+/**
+ * Set the callback of a stream, replacing the previous one
+ *
+ * @param stream to call back for
+ * @param callback called when room is available again, NULL to remove it
+ * @param userdata passed to callback
+ * @return Result of operation
+ */
+lb_result_t lb_stream_set_callback(lb_stream* stream, lb_stream_callback callback, void* userdata);
+
+/**
+ * Get a future completing once every byte taken by the stream was written
+ *
+ * One flush may be pending per stream at a time.
+ *
+ * @param stream to flush
+ * @param future_ret to populate with the future of the flush
+ * @return Result of operation
+ */
+lb_result_t lb_stream_flush(lb_stream* stream, lb_future** future_ret);
+
+/**
+ * Get the counters of a stream
+ *
+ * @param stream to get the counters of
+ * @param stats_ret to populate
+ * @return Result of operation
+ */
+lb_result_t lb_stream_get_stats(lb_stream* stream, lb_stream_stats* stats_ret);
+
+/**
+ * Close a stream, bytes not written yet are dropped and a pending flush is cancelled
+ *
+ * @param stream to close
+ * @return Result of operation
+ */
+lb_result_t lb_stream_close(lb_stream* stream);
+
+/**
+ * Reassembly of length prefixed messages split over notifications
+ *
+ * Every message is LB_FRAME_HEADER_SIZE bytes of little endian length followed by the message,
+ * the framing of lb_stream_write_message. A message can span any number of payloads and a payload
+ * can hold the end of one message and the start of others. The reader has to see the payloads from
+ * a message boundary on, reset it when the link is established again.
+ */
+typedef struct lb_frame_reader lb_frame_reader;
+
+/**
+ * Called with every message reassembled, from lb_frame_reader_push or the event loop
+ *
+ * @param message reassembled, valid until the callback returns
+ * @param size of message in bytes
+ * @param userdata given to lb_frame_reader_new
+ */
+typedef void (*lb_frame_callback)(const uint8_t* message, size_t size, void* userdata);
+
+/**
+ * Counters of a frame reader
+ */
+typedef struct frame_reader_stats {
+    uint64_t messages;  /**< messages passed to the callback */
+    uint64_t oversized; /**< messages longer than max_size skipped */
+    uint64_t bytes;     /**< bytes pushed */
+} lb_frame_reader_stats;
+
+/**
+ * Create a frame reader
+ *
+ * @param max_size of a message, longer ones are skipped, at most LB_FRAME_MAX_SIZE
+ * @param callback to call with every message
+ * @param userdata passed to callback
+ * @param reader_ret to populate with the new reader, freed with lb_frame_reader_free
+ * @return Result of operation
+ */
+lb_result_t lb_frame_reader_new(size_t max_size,
+                                lb_frame_callback callback,
+                                void* userdata,
+                                lb_frame_reader** reader_ret);
+
+/**
+ * Append received bytes, the callback is called for every message they complete
+ *
+ * @param reader to push to
+ * @param payload received
+ * @param size of payload in bytes
+ * @return Result of operation
+ */
+lb_result_t lb_frame_reader_push(lb_frame_reader* reader, const void* payload, size_t size);
+
+/**
+ * Drop a partly received message, the next byte pushed starts a new length prefix
+ *
+ * @param reader to reset
+ * @return Result of operation
+ */
+lb_result_t lb_frame_reader_reset(lb_frame_reader* reader);
+
+/**
+ * Get the counters of a frame reader
+ *
+ * @param reader to get the counters of
+ * @param stats_ret to populate
+ * @return Result of operation
+ */
+lb_result_t lb_frame_reader_get_stats(lb_frame_reader* reader, lb_frame_reader_stats* stats_ret);
+
+/**
+ * Free a frame reader
+ *
+ * @param reader to free
+ * @return Result of operation
+ */
+lb_result_t lb_frame_reader_free(lb_frame_reader* reader);
+
+/**
+ * Push every notification of a characteristic to a frame reader
+ *
+ * The reader is called back from the same thread as lb_register_characteristic_read_event
+ * callbacks and must outlive the context.
+ *
+ * @param dev BLE device to search the characteristic in
+ * @param uuid of the characteristic to listen to
+ * @param reader to push notifications to
+ * @return Result of operation
+ */
+lb_result_t lb_register_characteristic_frame_reader(lb_bl_device* dev, const char* uuid, lb_frame_reader* reader);
+
+#define LB_UART_SERVICE_UUID "6e400001-b5a3-f393-e0a9-e50e24dcca9e" /**< Nordic UART Service */
+#define LB_UART_RX_UUID "6e400002-b5a3-f393-e0a9-e50e24dcca9e"      /**< written by us */
+#define LB_UART_TX_UUID "6e400003-b5a3-f393-e0a9-e50e24dcca9e"      /**< notified by the device */
+
+/**
+ * Byte stream over the Nordic UART Service
+ *
+ * Writes go through a lb_stream on the RX characteristic: bytes written while earlier commands
+ * are in flight wait in it's buffer and leave as full MTU - 3 byte commands, an idle link sends
+ * a small write at once. Notifications of the TX characteristic are appended to a receive ring
+ * allocated at open, bytes arriving while it is full are dropped and counted. Like futures a UART
+ * only makes progress while the event loop runs, in a blocking call or lb_process_events.
+ */
+typedef struct lb_uart lb_uart;
+
+/**
+ * Sizing of a UART, zero fields take the default
+ */
+typedef struct uart_options {
+    size_t rx_buffer_size; /**< bytes received ahead of lb_uart_read, default 16384 */
+    size_t tx_buffer_size; /**< bytes written ahead of the link, default 16384 */
+    unsigned int window;   /**< commands in flight at most, default 8 */
+} lb_uart_options;
+
+/**
+ * Counters of a UART
+ */
+typedef struct uart_stats {
+    uint64_t rx_bytes;      /**< bytes notified */
+    uint64_t rx_dropped;    /**< bytes notified while the receive ring was full */
+    uint64_t notifications; /**< notifications received */
+    uint64_t tx_bytes;      /**< bytes BlueZ accepted for the link */
+    uint64_t tx_writes;     /**< commands accepted, tx_bytes / tx_writes is the coalescing reached */
+    size_t rx_buffered;     /**< bytes waiting for lb_uart_read */
+    size_t tx_buffered;     /**< bytes written and not sent yet */
+} lb_uart_stats;
+
+/**
+ * Open a byte stream over the Nordic UART Service of a device and enable it's notifications
+ *
+ * @param dev BLE device with the service, it's services resolved
+ * @param options of the UART, NULL for the defaults
+ * @param uart_ret to populate with the UART, closed with lb_uart_close
+ * @return Result of operation
+ */
+lb_result_t lb_uart_open(lb_bl_device* dev, const lb_uart_options* options, lb_uart** uart_ret);
+
+/**
+ * Read received bytes
+ *
+ * Returns as soon as any byte is buffered, with as many as fit size. A timeout of 0 does not
+ * block, negative blocks until a byte arrives.
+ *
+ * @param uart to read from
+ * @param buffer to copy to
+ * @param size of buffer
+ * @param timeout_ms to wait for a byte at most
+ * @param read_ret to populate with the count of bytes read, 0 if none arrived in time
+ * @return Result of operation
+ */
+lb_result_t lb_uart_read(lb_uart* uart, uint8_t* buffer, size_t size, int timeout_ms, size_t* read_ret);
+
+/**
+ * Write bytes
+ *
+ * Waits for room until every byte is taken. A timeout of 0 takes what fits without blocking,
+ * negative blocks until all is taken.
+ *
+ * @param uart to write to
+ * @param data to write, copied
+ * @param size of data
+ * @param timeout_ms to wait for room at most
+ * @param written_ret to populate with the count of bytes taken
+ * @return Result of operation, the error the TX stream failed with if a write could not be sent
+ */
+lb_result_t
+lb_uart_write(lb_uart* uart, const uint8_t* data, size_t size, int timeout_ms, size_t* written_ret);
+
+/**
+ * Get a descriptor to poll for POLLIN, readable while bytes wait for lb_uart_read or a short
+ * lb_uart_write can continue, or would fail
+ *
+ * The event loop still has to run for it to change, on another thread or by polling lb_get_fd in
+ * the same set.
+ *
+ * @param uart to get the descriptor of, owned by the UART
+ * @return descriptor or negative lb_result_t
+ */
+int lb_uart_get_fd(lb_uart* uart);
+
+/**
+ * Get the counters of a UART
+ *
+ * @param uart to get the counters of
+ * @param stats_ret to populate
+ * @return Result of operation
+ */
+lb_result_t lb_uart_get_stats(lb_uart* uart, lb_uart_stats* stats_ret);
+
+/**
+ * Close a UART, notifications are disabled and bytes not written yet are dropped
+ *
+ * @param uart to close
+ * @return Result of operation
+ */
+lb_result_t lb_uart_close(lb_uart* uart);
+
+/**
+ * Decide whether a notification answers a request
+ *
+ * @param request written
+ * @param request_size of request in bytes
+ * @param response notified, a whole message for framed transactions
+ * @param response_size of response in bytes
+ * @param userdata of the matcher
+ * @return true if response answers request
+ */
+typedef bool (*lb_response_matcher)(const uint8_t* request,
+                                    size_t request_size,
+                                    const uint8_t* response,
+                                    size_t response_size,
+                                    void* userdata);
+
+/**
+ * How the responses of a transaction are recognized
+ *
+ * A response is offered to the pending transactions of the characteristic from the oldest on and
+ * answers the first one it matches, a response matching none is dropped and counted.
+ */
+typedef struct transact_matcher {
+    lb_response_matcher match; /**< predicate, NULL to compare prefix_size bytes instead */
+    void* userdata;            /**< passed to match */
+    size_t prefix_size;        /**< bytes the response starts with alike the request, 0 for any */
+    bool framed;               /**< request and responses are messages framed as by lb_stream_write_message */
+} lb_transact_matcher;
+
+/**
+ * Counters of the transactions answered on a characteristic
+ */
+typedef struct transact_stats {
+    uint64_t started;   /**< transactions started */
+    uint64_t answered;  /**< transactions completed with a response */
+    uint64_t timed_out; /**< transactions without a response in time */
+    uint64_t failed;    /**< transactions of which the request could not be written */
+    uint64_t unmatched; /**< responses that answered no pending transaction */
+    size_t pending;     /**< transactions waiting for their response */
+} lb_transact_stats;
+
+/**
+ * Write a request and complete a future with the notification answering it
+ *
+ * The transaction is pending before the request is written, so a response notified before the
+ * write is acknowledged is not missed. Notifications of rx_uuid are enabled by the first
+ * transaction and stay enabled while the characteristic exists, every transaction on it has to
+ * agree on matcher->framed. Any number of transactions may be pending per device, the requests
+ * are written in the operation queue of the device.
+ *
+ * @param dev BLE device with both characteristics, it's services resolved
+ * @param tx_uuid of the characteristic the request is written to
+ * @param rx_uuid of the characteristic notifying the response
+ * @param request to write, copied, at most LB_ATT_MAX_VALUE_SIZE bytes with it's framing
+ * @param size of request in bytes
+ * @param matcher recognizing the response, NULL for the first response to answer
+ * @param timeout_ms to wait for the response, 0 for the call timeout, negative to wait forever
+ * @param future_ret to populate with the future, it's value is the response
+ * @return Result of operation
+ */
+lb_result_t lb_transact_async(lb_bl_device* dev,
+                              const char* tx_uuid,
+                              const char* rx_uuid,
+                              const uint8_t* request,
+                              size_t size,
+                              const lb_transact_matcher* matcher,
+                              int timeout_ms,
+                              lb_future** future_ret);
+
+/**
+ * Write a request and wait for the notification answering it, see lb_transact_async
+ *
+ * @param dev BLE device with both characteristics, it's services resolved
+ * @param tx_uuid of the characteristic the request is written to
+ * @param rx_uuid of the characteristic notifying the response
+ * @param request to write
+ * @param size of request in bytes
+ * @param matcher recognizing the response, NULL for the first response to answer
+ * @param timeout_ms to wait for the response, 0 for the call timeout, negative to wait forever
+ * @param response buffer to copy the response into
+ * @param capacity of response in bytes
+ * @param response_size_ret to populate with the size of the response, also when it does not fit
+ * @return Result of operation, LB_ERROR_TIMEOUT if no response matched in time,
+ * -LB_ERROR_NO_RESOURCES if the response is larger than capacity
+ */
+lb_result_t lb_transact(lb_bl_device* dev,
+                        const char* tx_uuid,
+                        const char* rx_uuid,
+                        const uint8_t* request,
+                        size_t size,
+                        const lb_transact_matcher* matcher,
+                        int timeout_ms,
+                        uint8_t* response,
+                        size_t capacity,
+                        size_t* response_size_ret);
+
+/**
+ * Get the counters of the transactions answered on a characteristic
+ *
+ * @param dev BLE device to search the characteristic in
+ * @param rx_uuid of the characteristic notifying the responses
+ * @param stats_ret to populate, zeroed if no transaction was started on it
+ * @return Result of operation
+ */
+lb_result_t lb_get_transact_stats(lb_bl_device* dev, const char* rx_uuid, lb_transact_stats* stats_ret);
 
 #ifdef __cplusplus
 }
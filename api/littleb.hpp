@@ -0,0 +1,773 @@
+/*
+ * Author: Shiran Ben-Melech <shiran.ben-melech@intel.com>
+ * Copyright © 2016 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#pragma once
+
+/*
+ * Header only C++ binding of littleb.
+ *
+ * Context and Device are move-only owners, payloads are handed out as std::span views of the
+ * bus messages and callbacks are bound through a template trampoline per handler type, the
+ * handler itself is never copied or allocated. Errors are reported as littleb::Error.
+ */
+
+#if __cplusplus < 202002L
+#error "littleb.hpp needs C++20"
+#endif
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "littleb.h"
+
+namespace littleb
+{
+
+using Payload = std::span<const std::uint8_t>;
+
+/**
+ * Failure of a littleb call, code is the positive lb_result_t
+ */
+class Error : public std::runtime_error
+{
+  public:
+    Error(lb_result_t code, const char* call) : std::runtime_error(call), code_(code)
+    {
+    }
+
+    lb_result_t
+    code() const noexcept
+    {
+        return code_;
+    }
+
+  private:
+    lb_result_t code_;
+};
+
+namespace detail
+{
+
+inline void
+check(lb_result_t r, const char* call)
+{
+    // littleb returns the codes negated
+    if (static_cast<int>(r) < 0) {
+        throw Error(static_cast<lb_result_t>(-static_cast<int>(r)), call);
+    }
+}
+
+constexpr int
+hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * Stateless handlers are rebuilt in the trampoline, nothing is passed through userdata
+ */
+template <class H>
+inline constexpr bool is_stateless_v =
+std::is_empty_v<std::remove_cv_t<H>> && std::is_default_constructible_v<std::remove_cv_t<H>>;
+
+template <class H>
+H&
+handler_from(void* userdata)
+{
+    if constexpr (is_stateless_v<H>) {
+        static std::remove_cv_t<H> stateless{};
+        return stateless;
+    } else {
+        return *static_cast<H*>(userdata);
+    }
+}
+
+template <class H>
+int
+notify_trampoline(sd_bus_message* message, void* userdata, sd_bus_error*)
+{
+    const void* value = nullptr;
+    std::size_t size = 0;
+
+    if (!sd_bus_message_is_signal(message, "org.freedesktop.DBus.Properties", "PropertiesChanged") ||
+        lb_parse_uart_service_message(message, &value, &size) < 0) {
+        return 0;
+    }
+
+    handler_from<H>(userdata)(Payload(static_cast<const std::uint8_t*>(value), size));
+    return 0;
+}
+
+template <class H>
+void
+future_trampoline(lb_future* future, void* userdata)
+{
+    handler_from<H>(userdata)(lb_future_result(future));
+}
+
+template <class F>
+void*
+handler_userdata(F&& handler)
+{
+    using H = std::remove_reference_t<F>;
+
+    if constexpr (is_stateless_v<H>) {
+        return nullptr;
+    } else {
+        static_assert(std::is_lvalue_reference_v<F>,
+                      "stateful handlers are not copied, pass one that outlives the registration");
+        return const_cast<void*>(static_cast<const void*>(std::addressof(handler)));
+    }
+}
+
+inline int
+to_ms(std::chrono::milliseconds timeout)
+{
+    return timeout.count() < 0 ? -1 : static_cast<int>(timeout.count());
+}
+
+} // namespace detail
+
+/**
+ * 128-bit UUID, parsed and validated at compile time from a _uuid literal
+ *
+ * The canonical lower case text is kept next to the bytes, it is what littleb interns and
+ * compares, so no formatting happens at lookup time.
+ */
+struct Uuid {
+    std::array<std::uint8_t, 16> bytes{};
+    std::array<char, 37> text{};
+
+    constexpr const char*
+    c_str() const noexcept
+    {
+        return text.data();
+    }
+
+    friend constexpr bool
+    operator==(const Uuid& a, const Uuid& b) noexcept
+    {
+        return a.bytes == b.bytes;
+    }
+
+    /**
+     * Parse "xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx", a malformed literal does not compile
+     */
+    static consteval Uuid
+    parse(const char* str, std::size_t len)
+    {
+        Uuid uuid;
+        std::size_t i, byte = 0;
+        int high, low;
+
+        if (len != 36) {
+            throw "uuid literal must be 36 characters long";
+        }
+
+        for (i = 0; i < 36;) {
+            if (i == 8 || i == 13 || i == 18 || i == 23) {
+                if (str[i] != '-') {
+                    throw "uuid literal has a misplaced hyphen";
+                }
+                uuid.text[i] = '-';
+                i++;
+                continue;
+            }
+
+            high = detail::hex_digit(str[i]);
+            low = detail::hex_digit(str[i + 1]);
+            if (high < 0 || low < 0) {
+                throw "uuid literal has a non hexadecimal digit";
+            }
+            uuid.bytes[byte++] = static_cast<std::uint8_t>((high << 4) | low);
+            uuid.text[i] = "0123456789abcdef"[high];
+            uuid.text[i + 1] = "0123456789abcdef"[low];
+            i += 2;
+        }
+        uuid.text[36] = '\0';
+
+        return uuid;
+    }
+};
+
+inline namespace literals
+{
+
+consteval Uuid operator""_uuid(const char* str, std::size_t len)
+{
+    return Uuid::parse(str, len);
+}
+
+} // namespace literals
+
+/**
+ * Zero copy characteristic value, the reply it points into is released with the view
+ */
+class ReadView
+{
+  public:
+    ReadView() noexcept = default;
+
+    ReadView(ReadView&& other) noexcept : view_(std::exchange(other.view_, lb_read_view{}))
+    {
+    }
+
+    ReadView&
+    operator=(ReadView&& other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            view_ = std::exchange(other.view_, lb_read_view{});
+        }
+        return *this;
+    }
+
+    ReadView(const ReadView&) = delete;
+    ReadView& operator=(const ReadView&) = delete;
+
+    ~ReadView()
+    {
+        reset();
+    }
+
+    Payload
+    data() const noexcept
+    {
+        return Payload(static_cast<const std::uint8_t*>(view_.data), view_.size);
+    }
+
+    void
+    reset() noexcept
+    {
+        lb_read_release(&view_);
+    }
+
+  private:
+    friend class Device;
+
+    lb_read_view view_{};
+};
+
+/**
+ * Owner of a lb_future, a pending future is cancelled when it is destroyed
+ */
+class Future
+{
+  public:
+    Future() noexcept = default;
+
+    explicit Future(lb_future* future) noexcept : future_(future)
+    {
+    }
+
+    Future(Future&& other) noexcept : future_(std::exchange(other.future_, nullptr))
+    {
+    }
+
+    Future&
+    operator=(Future&& other) noexcept
+    {
+        if (this != &other) {
+            lb_future_free(future_);
+            future_ = std::exchange(other.future_, nullptr);
+        }
+        return *this;
+    }
+
+    Future(const Future&) = delete;
+    Future& operator=(const Future&) = delete;
+
+    ~Future()
+    {
+        lb_future_free(future_);
+    }
+
+    /**
+     * Run the event loop until the future completes, throws the failure of the operation
+     *
+     * @return false if the timeout elapsed first
+     */
+    bool
+    wait(std::chrono::milliseconds timeout = std::chrono::milliseconds(-1))
+    {
+        lb_result_t r = lb_future_wait(future_, detail::to_ms(timeout));
+
+        if (r == -LB_ERROR_TIMEOUT) {
+            return false;
+        }
+        detail::check(r, "lb_future_wait");
+        return true;
+    }
+
+    bool
+    done() const noexcept
+    {
+        return lb_future_is_done(future_);
+    }
+
+    lb_result_t
+    result() const noexcept
+    {
+        return lb_future_result(future_);
+    }
+
+    /**
+     * Value of a completed read, valid as long as the future
+     */
+    Payload
+    value() const
+    {
+        const std::uint8_t* value = nullptr;
+        std::size_t size = 0;
+
+        detail::check(lb_future_get_value(future_, &value, &size), "lb_future_get_value");
+        return Payload(value, size);
+    }
+
+    /**
+     * Call handler(lb_result_t) on completion, a stateful handler must outlive the future
+     */
+    template <class F>
+    void
+    then(F&& handler)
+    {
+        using H = std::remove_reference_t<F>;
+
+        static_assert(std::is_invocable_v<H&, lb_result_t>, "handler must be callable with lb_result_t");
+        detail::check(lb_future_set_callback(future_, &detail::future_trampoline<H>,
+                                             detail::handler_userdata(std::forward<F>(handler))),
+                      "lb_future_set_callback");
+    }
+
+    void
+    cancel()
+    {
+        detail::check(lb_future_cancel(future_), "lb_future_cancel");
+    }
+
+    lb_future*
+    get() const noexcept
+    {
+        return future_;
+    }
+
+    /**
+     * Run the event loop until every future completed
+     *
+     * @return false if the timeout elapsed first
+     */
+    static bool
+    wait_all(std::span<Future> futures, std::chrono::milliseconds timeout = std::chrono::milliseconds(-1))
+    {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        std::chrono::milliseconds left = timeout;
+
+        for (Future& future : futures) {
+            if (timeout.count() >= 0) {
+                left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+                left = left.count() < 0 ? std::chrono::milliseconds(0) : left;
+            }
+            lb_result_t r = lb_future_wait(future.future_, detail::to_ms(left));
+            if (r == -LB_ERROR_TIMEOUT) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * Run the event loop until one of the futures completes
+     *
+     * @return index of a completed future, -1 if the timeout elapsed first
+     */
+    static int
+    wait_any(std::span<Future> futures, std::chrono::milliseconds timeout = std::chrono::milliseconds(-1))
+    {
+        std::vector<lb_future*> raw;
+        int index = -1;
+
+        raw.reserve(futures.size());
+        for (Future& future : futures) {
+            raw.push_back(future.future_);
+        }
+
+        lb_result_t r = lb_future_wait_any(raw.data(), static_cast<int>(raw.size()), detail::to_ms(timeout), &index);
+        if (r == -LB_ERROR_TIMEOUT) {
+            return -1;
+        }
+        detail::check(r, "lb_future_wait_any");
+        return index;
+    }
+
+  private:
+    lb_future* future_ = nullptr;
+};
+
+/**
+ * Handle of a device of the context, disconnects on destruction if it connected
+ *
+ * The lb_bl_device stays owned by the context, a Device must not outlive it.
+ */
+class Device
+{
+  public:
+    explicit Device(lb_bl_device* dev) noexcept : dev_(dev)
+    {
+    }
+
+    Device(Device&& other) noexcept
+    : dev_(std::exchange(other.dev_, nullptr)), connected_(std::exchange(other.connected_, false))
+    {
+    }
+
+    Device&
+    operator=(Device&& other) noexcept
+    {
+        if (this != &other) {
+            release();
+            dev_ = std::exchange(other.dev_, nullptr);
+            connected_ = std::exchange(other.connected_, false);
+        }
+        return *this;
+    }
+
+    Device(const Device&) = delete;
+    Device& operator=(const Device&) = delete;
+
+    ~Device()
+    {
+        release();
+    }
+
+    std::string_view
+    address() const noexcept
+    {
+        return dev_->address != nullptr ? dev_->address : "";
+    }
+
+    std::string_view
+    name() const noexcept
+    {
+        return dev_->name != nullptr ? dev_->name : "";
+    }
+
+    std::string_view
+    path() const noexcept
+    {
+        return dev_->device_path;
+    }
+
+    void
+    connect()
+    {
+        detail::check(lb_connect_device(dev_), "lb_connect_device");
+        connected_ = true;
+    }
+
+    void
+    disconnect()
+    {
+        connected_ = false;
+        detail::check(lb_disconnect_device(dev_), "lb_disconnect_device");
+    }
+
+    void
+    pair()
+    {
+        detail::check(lb_pair_device(dev_), "lb_pair_device");
+    }
+
+    void
+    discover_services()
+    {
+        detail::check(lb_get_ble_device_services(dev_), "lb_get_ble_device_services");
+    }
+
+    bool
+    has_characteristic(const Uuid& uuid) const
+    {
+        lb_ble_char* characteristic = nullptr;
+
+        return lb_get_ble_characteristic_by_uuid(dev_, uuid.c_str(), &characteristic) == LB_SUCCESS;
+    }
+
+    /**
+     * Read a characteristic without copying it's value
+     */
+    ReadView
+    read(const Uuid& uuid)
+    {
+        ReadView view;
+
+        detail::check(lb_read_from_characteristic_view(dev_, uuid.c_str(), &view.view_),
+                      "lb_read_from_characteristic_view");
+        return view;
+    }
+
+    /**
+     * Read a characteristic into a caller buffer
+     *
+     * @return the part of buffer holding the value
+     */
+    std::span<std::uint8_t>
+    read_into(const Uuid& uuid, std::span<std::uint8_t> buffer)
+    {
+        std::size_t size = 0;
+
+        detail::check(lb_read_from_characteristic_into(dev_, uuid.c_str(), buffer.data(), buffer.size(), &size),
+                      "lb_read_from_characteristic_into");
+        return buffer.first(size);
+    }
+
+    void
+    write(const Uuid& uuid, Payload value)
+    {
+        // WriteValue only reads the buffer
+        detail::check(lb_write_to_characteristic(dev_, uuid.c_str(), static_cast<int>(value.size()),
+                                                 const_cast<std::uint8_t*>(value.data())),
+                      "lb_write_to_characteristic");
+    }
+
+    Future
+    connect_async()
+    {
+        lb_future* future = nullptr;
+
+        detail::check(lb_connect_device_async(dev_, &future), "lb_connect_device_async");
+        connected_ = true;
+        return Future(future);
+    }
+
+    Future
+    discover_services_async()
+    {
+        lb_future* future = nullptr;
+
+        detail::check(lb_get_ble_device_services_async(dev_, &future), "lb_get_ble_device_services_async");
+        return Future(future);
+    }
+
+    Future
+    read_async(const Uuid& uuid)
+    {
+        lb_future* future = nullptr;
+
+        detail::check(lb_read_from_characteristic_async(dev_, uuid.c_str(), &future),
+                      "lb_read_from_characteristic_async");
+        return Future(future);
+    }
+
+    /**
+     * Call handler(Payload) on every notification of a characteristic
+     *
+     * A capture-less lambda is rebuilt in the trampoline, a stateful handler is referenced and
+     * must outlive the context.
+     */
+    template <class F>
+    void
+    on_notify(const Uuid& uuid, F&& handler)
+    {
+        using H = std::remove_reference_t<F>;
+
+        static_assert(std::is_invocable_v<H&, Payload>, "handler must be callable with a Payload");
+        detail::check(lb_register_characteristic_read_event(dev_, uuid.c_str(), &detail::notify_trampoline<H>,
+                                                            detail::handler_userdata(std::forward<F>(handler))),
+                      "lb_register_characteristic_read_event");
+    }
+
+    lb_bl_device*
+    get() const noexcept
+    {
+        return dev_;
+    }
+
+  private:
+    void
+    release() noexcept
+    {
+        if (dev_ != nullptr && connected_) {
+            lb_disconnect_device(dev_);
+        }
+        connected_ = false;
+    }
+
+    lb_bl_device* dev_ = nullptr;
+    bool connected_ = false;
+};
+
+/**
+ * Owner of the littleb context, lb_init on construction and lb_destroy on destruction
+ *
+ * littleb has a single context per process, only one Context may be alive at a time.
+ */
+class Context
+{
+  public:
+    Context()
+    {
+        detail::check(lb_init(), "lb_init");
+        owned_ = true;
+    }
+
+    Context(Context&& other) noexcept : owned_(std::exchange(other.owned_, false))
+    {
+    }
+
+    Context&
+    operator=(Context&& other) noexcept
+    {
+        if (this != &other) {
+            release();
+            owned_ = std::exchange(other.owned_, false);
+        }
+        return *this;
+    }
+
+    Context(const Context&) = delete;
+    Context& operator=(const Context&) = delete;
+
+    ~Context()
+    {
+        release();
+    }
+
+    void
+    scan(int seconds)
+    {
+        detail::check(lb_get_bl_devices(seconds), "lb_get_bl_devices");
+    }
+
+    Future
+    scan_async(int seconds)
+    {
+        lb_future* future = nullptr;
+
+        detail::check(lb_get_bl_devices_async(seconds, &future), "lb_get_bl_devices_async");
+        return Future(future);
+    }
+
+    Device
+    device_by_address(const char* address)
+    {
+        lb_bl_device* dev = nullptr;
+
+        detail::check(lb_get_device_by_device_address(address, &dev), "lb_get_device_by_device_address");
+        return Device(dev);
+    }
+
+    Device
+    device_by_name(const char* name)
+    {
+        lb_bl_device* dev = nullptr;
+
+        detail::check(lb_get_device_by_device_name(name, &dev), "lb_get_device_by_device_name");
+        return Device(dev);
+    }
+
+    Device
+    device_by_path(const char* path)
+    {
+        lb_bl_device* dev = nullptr;
+
+        detail::check(lb_get_device_by_device_path(path, &dev), "lb_get_device_by_device_path");
+        return Device(dev);
+    }
+
+    Device
+    device_by_index(int index)
+    {
+        lb_bl_device* dev = nullptr;
+
+        detail::check(lb_get_device_by_index(index, &dev), "lb_get_device_by_index");
+        return Device(dev);
+    }
+
+    void
+    process_events(std::chrono::milliseconds timeout)
+    {
+        detail::check(lb_process_events(detail::to_ms(timeout)), "lb_process_events");
+    }
+
+    /**
+     * Descriptor to poll for events() when running inside an application event loop
+     */
+    int
+    fd()
+    {
+        int fd = lb_get_fd();
+
+        detail::check(static_cast<lb_result_t>(fd < 0 ? fd : 0), "lb_get_fd");
+        return fd;
+    }
+
+    int
+    events() const noexcept
+    {
+        return lb_get_events();
+    }
+
+    std::uint64_t
+    timeout_us()
+    {
+        std::uint64_t timeout = 0;
+
+        detail::check(lb_get_timeout_us(&timeout), "lb_get_timeout_us");
+        return timeout;
+    }
+
+    void
+    process()
+    {
+        detail::check(lb_process(), "lb_process");
+    }
+
+  private:
+    void
+    release() noexcept
+    {
+        if (owned_) {
+            lb_destroy();
+        }
+        owned_ = false;
+    }
+
+    bool owned_ = false;
+};
+
+} // namespace littleb
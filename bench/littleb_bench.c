@@ -0,0 +1,1992 @@
+/*
+ * Copyright (c) 2016 Intel Corporation.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * End to end littleb benchmarks against mock_bluez.
+ *
+ * Brings up a private dbus-daemon standing in for the system bus, starts mock_bluez on it and runs
+ * the public littleb API against it. Results are printed one benchmark per line as key=value pairs
+ * so runs can be compared with plain text tools.
+ *
+ * With --stress the enumeration and lookup APIs are measured at each device count of
+ * --stress-steps instead, every step in a fresh process against a fresh mock so memory and CPU time
+ * are reported per step.
+ *
+ * With --decode no bus is started, lb_decode_payloads is measured on packed sensor payloads against
+ * the scalar loop applications used to unpack them with. Baselines of every mode are kept in
+ * bench/baselines.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "littleb.h"
+
+#ifndef MOCK_BLUEZ_PATH
+#define MOCK_BLUEZ_PATH "./mock_bluez"
+#endif
+#ifndef MOCK_BUS_CONFIG_PATH
+#define MOCK_BUS_CONFIG_PATH "./mock_bus.conf"
+#endif
+#ifndef DBUS_DAEMON_PATH
+#define DBUS_DAEMON_PATH "dbus-daemon"
+#endif
+
+#define BENCH_READ_UUID "6e400002-b5a3-f393-e0a9-e50e24dcca9e"
+#define BENCH_NOTIFY_UUID "6e400003-b5a3-f393-e0a9-e50e24dcca9e"
+#define BENCH_FIRST_ADDRESS "00:B1:00:00:00:00"
+#define BENCH_UART_ADDRESS "00:B1:00:00:00:01"
+#define BENCH_NOTIFY_SAMPLES_MAX 1000000
+#define BENCH_STRESS_SERVICE_SAMPLES 10
+#define BENCH_ADVERTISEMENT_BATCH 256
+#define BENCH_DECODE_PAYLOADS 512
+#define BENCH_QUEUE_BULK 32
+#define BENCH_WRITE_THREADS 4
+#define BENCH_STREAM_BYTES 65536
+#define BENCH_STREAM_BUFFER 4096
+#define BENCH_UART_BYTES 65536
+#define BENCH_UART_WRITE 8
+#define BENCH_TRANSACT_PENDING 4
+#define BENCH_CHECK_ADDRESS "00:B1:00:00:00:02"
+#define BENCH_CHECK_DEVICE 2
+#define BENCH_CHECK_LATENCY_US 20000
+#define BENCH_CHURN_DEVICE 1
+#define BENCH_CHURN_ROUNDS 100
+
+typedef struct bench_samples {
+    uint64_t* usec;
+    size_t size;
+    size_t capacity;
+} bench_samples;
+
+static struct {
+    int devices;
+    int services;
+    int characteristics;
+    unsigned int value_size;
+    unsigned int latency_usec;
+    unsigned int notify_hz;
+    int iterations;
+    int notify_seconds;
+    unsigned int churn_hz;
+    unsigned int advertise_hz;
+    unsigned int advertise_repeat;
+    unsigned int link_rate;
+    int external_loop;
+    int decode;
+    int stress;
+    int check;
+    const char* stress_steps;
+    const char* mock;
+    const char* bus_config;
+    const char* dbus_daemon;
+} config = { 8, 1, 2, 20, 0, 1000, 1000, 2, 0, 2000, 4, 100000, 0, 0, 0, 0, "100,1000,5000,10000",
+             MOCK_BLUEZ_PATH, MOCK_BUS_CONFIG_PATH, DBUS_DAEMON_PATH };
+
+static pid_t bus_pid = 0;
+static pid_t mock_pid = 0;
+static bench_samples notify_samples;
+static uint64_t notify_count = 0;
+
+static uint64_t
+_now_usec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t
+_cpu_usec()
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return (uint64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + usage.ru_utime.tv_usec +
+           usage.ru_stime.tv_usec;
+}
+
+static long
+_rss_kb()
+{
+    long pages = 0, resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+
+    if (statm == NULL) {
+        return 0;
+    }
+    if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(statm);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int
+_samples_init(bench_samples* samples, size_t capacity)
+{
+    samples->usec = malloc(capacity * sizeof(uint64_t));
+    samples->size = 0;
+    samples->capacity = capacity;
+    return samples->usec == NULL ? -ENOMEM : 0;
+}
+
+static void
+_samples_add(bench_samples* samples, uint64_t usec)
+{
+    if (samples->size < samples->capacity) {
+        samples->usec[samples->size++] = usec;
+    }
+}
+
+static int
+_compare_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+
+    return (x > y) - (x < y);
+}
+
+static void
+_report(const char* name, bench_samples* samples, const char* extra)
+{
+    size_t i;
+    uint64_t sum = 0;
+
+    if (samples->size == 0) {
+        printf("benchmark=%s n=0%s\n", name, extra);
+        return;
+    }
+
+    qsort(samples->usec, samples->size, sizeof(uint64_t), _compare_u64);
+    for (i = 0; i < samples->size; i++) {
+        sum += samples->usec[i];
+    }
+
+    printf("benchmark=%s n=%zu p50_us=%" PRIu64 " p99_us=%" PRIu64 " mean_us=%" PRIu64 "%s\n", name,
+           samples->size, samples->usec[(samples->size - 1) * 50 / 100],
+           samples->usec[(samples->size - 1) * 99 / 100], sum / samples->size, extra);
+    fflush(stdout);
+}
+
+static int
+_start_bus()
+{
+    int fds[2];
+    char address[512], fd_arg[32], config_arg[1024];
+    ssize_t size;
+    char* newline;
+
+    if (pipe(fds) < 0) {
+        return -errno;
+    }
+
+    bus_pid = fork();
+    if (bus_pid < 0) {
+        return -errno;
+    }
+
+    if (bus_pid == 0) {
+        // a crashed bench must not leave the bus behind, ctest waits for it's output to close
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        close(fds[0]);
+        snprintf(fd_arg, sizeof(fd_arg), "--print-address=%d", fds[1]);
+        snprintf(config_arg, sizeof(config_arg), "--config-file=%s", config.bus_config);
+        execlp(config.dbus_daemon, config.dbus_daemon, config_arg, "--nofork", fd_arg, (char*) NULL);
+        fprintf(stderr, "littleb_bench: failed to run %s: %s\n", config.dbus_daemon, strerror(errno));
+        _exit(127);
+    }
+
+    close(fds[1]);
+    size = read(fds[0], address, sizeof(address) - 1);
+    close(fds[0]);
+    if (size <= 0) {
+        return -EIO;
+    }
+
+    address[size] = '\0';
+    newline = strchr(address, '\n');
+    if (newline != NULL) {
+        *newline = '\0';
+    }
+
+    // littleb and the mock both connect with sd_bus_open_system
+    return setenv("DBUS_SYSTEM_BUS_ADDRESS", address, 1) < 0 ? -errno : 0;
+}
+
+static int
+_start_mock()
+{
+    char devices[16], services[16], characteristics[16], value_size[16], latency[16], notify_hz[16],
+    churn_hz[16], advertise_hz[16], advertise_repeat[16], link_rate[16];
+
+    snprintf(devices, sizeof(devices), "%d", config.devices);
+    snprintf(services, sizeof(services), "%d", config.services);
+    snprintf(characteristics, sizeof(characteristics), "%d", config.characteristics);
+    snprintf(value_size, sizeof(value_size), "%u", config.value_size);
+    snprintf(latency, sizeof(latency), "%u", config.latency_usec);
+    snprintf(notify_hz, sizeof(notify_hz), "%u", config.notify_hz);
+    snprintf(churn_hz, sizeof(churn_hz), "%u", config.churn_hz);
+    snprintf(advertise_hz, sizeof(advertise_hz), "%u", config.advertise_hz);
+    snprintf(advertise_repeat, sizeof(advertise_repeat), "%u", config.advertise_repeat);
+    snprintf(link_rate, sizeof(link_rate), "%u", config.link_rate);
+
+    mock_pid = fork();
+    if (mock_pid < 0) {
+        return -errno;
+    }
+
+    if (mock_pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        execl(config.mock, config.mock, "--devices", devices, "--services", services,
+              "--characteristics", characteristics, "--value-size", value_size, "--latency-us",
+              latency, "--notify-hz", notify_hz, "--churn-hz", churn_hz, "--advertise-hz", advertise_hz,
+              "--advertise-repeat", advertise_repeat, "--link-rate", link_rate, "--echo-device", "1", (char*) NULL);
+        fprintf(stderr, "littleb_bench: failed to run %s: %s\n", config.mock, strerror(errno));
+        _exit(127);
+    }
+
+    return 0;
+}
+
+static int
+_wait_for_mock(int timeout_ms)
+{
+    int r, has_owner = 0;
+    sd_bus* bus = NULL;
+    sd_bus_message* reply = NULL;
+    uint64_t deadline = _now_usec() + (uint64_t) timeout_ms * 1000;
+
+    r = sd_bus_open_system(&bus);
+    if (r < 0) {
+        return r;
+    }
+
+    while (!has_owner && _now_usec() < deadline) {
+        r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                               "NameHasOwner", NULL, &reply, "s", "org.bluez");
+        if (r >= 0) {
+            sd_bus_message_read(reply, "b", &has_owner);
+        }
+        reply = sd_bus_message_unref(reply);
+        if (!has_owner) {
+            usleep(10000);
+        }
+    }
+
+    sd_bus_flush_close_unref(bus);
+    return has_owner ? 0 : -ETIMEDOUT;
+}
+
+static void
+_stop_children()
+{
+    if (mock_pid > 0) {
+        kill(mock_pid, SIGTERM);
+        waitpid(mock_pid, NULL, 0);
+        mock_pid = 0;
+    }
+    if (bus_pid > 0) {
+        kill(bus_pid, SIGTERM);
+        waitpid(bus_pid, NULL, 0);
+    }
+}
+
+static int
+_notify_callback(sd_bus_message* message, void* userdata, sd_bus_error* error)
+{
+    const void* value = NULL;
+    size_t size = 0;
+    uint64_t sent;
+
+    if (!sd_bus_message_is_signal(message, "org.freedesktop.DBus.Properties", "PropertiesChanged")) {
+        return 0;
+    }
+
+    if (lb_parse_uart_service_message(message, &value, &size) < 0 || size < sizeof(sent)) {
+        return 0;
+    }
+
+    // mock_bluez puts the monotonic send time at the start of the value
+    memcpy(&sent, value, sizeof(sent));
+    _samples_add(&notify_samples, _now_usec() - sent);
+    __atomic_add_fetch(&notify_count, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int
+_run_external_notify(lb_bl_device* dev)
+{
+    int r, fd;
+    uint64_t start, timeout;
+    char extra[64];
+    struct pollfd pfd;
+
+    fd = lb_get_fd();
+    if (fd < 0) {
+        fprintf(stderr, "littleb_bench: lb_get_fd failed\n");
+        return fd;
+    }
+    pfd.fd = fd;
+    pfd.events = (short) lb_get_events();
+
+    r = lb_register_characteristic_read_event(dev, BENCH_NOTIFY_UUID, _notify_callback, NULL);
+    if (r < 0) {
+        fprintf(stderr, "littleb_bench: lb_register_characteristic_read_event failed\n");
+        return r;
+    }
+
+    // the whole window runs on this thread, littleb only dispatches from lb_process
+    start = _now_usec();
+    while (_now_usec() - start < (uint64_t) config.notify_seconds * 1000000) {
+        r = lb_get_timeout_us(&timeout);
+        if (r < 0) {
+            break;
+        }
+        if (timeout > 100000) {
+            timeout = 100000;
+        }
+        poll(&pfd, 1, (int) ((timeout + 999) / 1000));
+
+        r = lb_process();
+        if (r < 0) {
+            break;
+        }
+    }
+    if (r < 0) {
+        fprintf(stderr, "littleb_bench: external loop failed\n");
+        return r;
+    }
+
+    snprintf(extra, sizeof(extra), " per_second=%" PRIu64,
+             notify_count * 1000000 / (_now_usec() - start));
+    _report("notify_external", &notify_samples, extra);
+
+    return 0;
+}
+
+static int
+_run_advertisements()
+{
+    int r, i, count;
+    uint64_t start, sent, received = 0;
+    char extra[160];
+    bench_samples samples;
+    lb_advertisement records[BENCH_ADVERTISEMENT_BATCH];
+    lb_advertisement_stats stats;
+    lb_advertisement_options options = { 4096, 1000 };
+
+    r = _samples_init(&samples, BENCH_NOTIFY_SAMPLES_MAX);
+    if (r < 0) {
+        return r;
+    }
+
+    r = lb_start_advertisement_scan(&options);
+    if (r < 0) {
+        fprintf(stderr, "littleb_bench: lb_start_advertisement_scan failed\n");
+        free(samples.usec);
+        return r;
+    }
+
+    start = _now_usec();
+    while (_now_usec() - start < (uint64_t) config.notify_seconds * 1000000) {
+        r = lb_read_advertisements(records, BENCH_ADVERTISEMENT_BATCH, 100, &count);
+        if (r < 0) {
+            fprintf(stderr, "littleb_bench: lb_read_advertisements failed\n");
+            break;
+        }
+
+        for (i = 0; i < count; i++) {
+            // mock_bluez puts the monotonic send time at the start of the manufacturer data
+            if (records[i].manufacturer_data_size < sizeof(sent)) {
+                continue;
+            }
+            memcpy(&sent, records[i].manufacturer_data, sizeof(sent));
+            _samples_add(&samples, _now_usec() - sent);
+        }
+        received += count;
+    }
+
+    if (r >= 0) {
+        r = lb_get_advertisement_stats(&stats);
+    }
+    if (r >= 0) {
+        snprintf(extra, sizeof(extra),
+                 " per_second=%" PRIu64 " received=%" PRIu64 " duplicates=%" PRIu64 " overruns=%" PRIu64
+                 " advertisers=%" PRIu64,
+                 received * 1000000 / (_now_usec() - start), stats.received, stats.duplicates,
+                 stats.overruns, stats.advertisers);
+        _report("advertisements", &samples, extra);
+    }
+
+    lb_stop_advertisement_scan();
+    free(samples.usec);
+    return r;
+}
+
+/**
+ * Read the same characteristic of every device concurrently, one sample per batch
+ */
+static int
+_run_read_async()
+{
+    int r = 0, i, round;
+    uint64_t start;
+    char extra[32];
+    char address[18];
+    bench_samples samples;
+    lb_bl_device** devices = (lb_bl_device**) calloc(config.devices, sizeof(lb_bl_device*));
+    lb_future** futures = (lb_future**) calloc(config.devices, sizeof(lb_future*));
+
+    if (devices == NULL || futures == NULL || _samples_init(&samples, config.iterations) < 0) {
+        free(devices);
+        free(futures);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < config.devices && r >= 0; i++) {
+        snprintf(address, sizeof(address), "00:B1:00:%02X:%02X:%02X", (i >> 16) & 0xff, (i >> 8) & 0xff,
+                 i & 0xff);
+        r = lb_get_device_by_device_address(address, &devices[i]);
+    }
+
+    for (round = 0; round < config.iterations && r >= 0; round++) {
+        start = _now_usec();
+        for (i = 0; i < config.devices && r >= 0; i++) {
+            r = lb_read_from_characteristic_async(devices[i], BENCH_READ_UUID, &futures[i]);
+        }
+        if (r >= 0) {
+            r = lb_future_wait_all(futures, config.devices, 10000);
+        }
+        for (i = 0; i < config.devices; i++) {
+            if (r >= 0 && lb_future_result(futures[i]) < 0) {
+                r = lb_future_result(futures[i]);
+            }
+            lb_future_free(futures[i]);
+            futures[i] = NULL;
+        }
+        _samples_add(&samples, _now_usec() - start);
+    }
+
+    if (r < 0) {
+        fprintf(stderr, "littleb_bench: lb_read_from_characteristic_async failed\n");
+    } else {
+        snprintf(extra, sizeof(extra), " devices=%d", config.devices);
+        _report("read_async", &samples, extra);
+    }
+
+    free(samples.usec);
+    free(devices);
+    free(futures);
+    return r;
+}
+
+/**
+ * Read the same characteristic of every device with one lb_read_batch, one sample per batch. The
+ * same reads made one after the other with lb_read_from_characteristic_into are reported as
+ * sequential_mean_us.
+ */
+static int
+_run_read_batch()
+{
+    int r = 0, i, round;
+    uint64_t start, sequential = 0;
+    size_t size;
+    char extra[64];
+    char address[18];
+    bench_samples samples;
+    lb_read_op* ops = (lb_read_op*) calloc(config.devices, sizeof(lb_read_op));
+    lb_read_result* results = (lb_read_result*) calloc(config.devices, sizeof(lb_read_result));
+    uint8_t* buffer = (uint8_t*) malloc((size_t) config.devices * config.value_size);
+
+    if (ops == NULL || results == NULL || buffer == NULL || _samples_init(&samples, config.iterations) < 0) {
+        free(ops);
+        free(results);
+        free(buffer);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < config.devices && r >= 0; i++) {
+        snprintf(address, sizeof(address), "00:B1:00:%02X:%02X:%02X", (i >> 16) & 0xff, (i >> 8) & 0xff,
+                 i & 0xff);
+        r = lb_get_device_by_device_address(address, &ops[i].dev);
+        ops[i].uuid = BENCH_READ_UUID;
+    }
+
+    for (round = 0; round < config.iterations && r >= 0; round++) {
+        start = _now_usec();
+        r = lb_read_batch(ops, config.devices, NULL, buffer, (size_t) config.devices * config.value_size,
+                          results);
+        _samples_add(&samples, _now_usec() - start);
+    }
+
+    for (round = 0; round < config.iterations && r >= 0; round++) {
+        start = _now_usec();
+        for (i = 0; i < config.devices && r >= 0; i++) {
+            r = lb_read_from_characteristic_into(ops[i].dev, BENCH_READ_UUID, buffer, config.value_size,
+                                                 &size);
+        }
+        sequential += _now_usec() - start;
+    }
+
+    if (r < 0) {
+        fprintf(stderr, "littleb_bench: lb_read_batch failed\n");
+    } else {
+        snprintf(extra, sizeof(extra), " devices=%d sequential_mean_us=%" PRIu64, config.devices,
+                 sequential / config.iterations);
+        _report("read_batch", &samples, extra);
+    }
+
+    free(samples.usec);
+    free(ops);
+    free(results);
+    free(buffer);
+    return r;
+}
+
+/**
+ * Time a write queued behind BENCH_QUEUE_BULK bulk reads, as control or as one more bulk operation
+ */
+static int
+_run_gatt_queue(lb_bl_device* dev, lb_priority_t priority, const char* name)
+{
+    int r = 0, i, round;
+    uint64_t start;
+    uint8_t value[20] = { 0 };
+    char extra[96];
+    bench_samples samples;
+    lb_future* bulk[BENCH_QUEUE_BULK] = { NULL };
+    lb_future* control = NULL;
+    lb_call_options bulk_options = { LB_PRIORITY_BULK, 0 };
+    lb_call_options control_options = { priority, 0 };
+    lb_gatt_queue_stats stats;
+
+    if (_samples_init(&samples, config.iterations) < 0) {
+        return -ENOMEM;
+    }
+
+    for (round = 0; round < config.iterations && r >= 0; round++) {
+        for (i = 0; i < BENCH_QUEUE_BULK && r >= 0; i++) {
+            r = lb_read_from_characteristic_queued(dev, BENCH_READ_UUID, &bulk_options, &bulk[i]);
+        }
+
+        value[0] = (uint8_t) round;
+        start = _now_usec();
+        if (r >= 0) {
+            r = lb_write_to_characteristic_queued(dev, BENCH_READ_UUID, sizeof(value), value,
+                                                  &control_options, &control);
+        }
+        if (r >= 0) {
+            r = lb_future_wait(control, 10000);
+        }
+        _samples_add(&samples, _now_usec() - start);
+
+        if (r >= 0) {
+            r = lb_future_wait_all(bulk, BENCH_QUEUE_BULK, 10000);
+        }
+        for (i = 0; i < BENCH_QUEUE_BULK; i++) {
+            lb_future_free(bulk[i]);
+            bulk[i] = NULL;
+        }
+        lb_future_free(control);
+        control = NULL;
+    }
+
+    if (r < 0) {
+        fprintf(stderr, "littleb_bench: queued GATT operations failed\n");
+    } else {
+        lb_get_gatt_queue_stats(dev, &stats);
+        snprintf(extra, sizeof(extra), " bulk=%d dispatched=%" PRIu64 " expired=%" PRIu64 " max_depth=%d",
+                 BENCH_QUEUE_BULK, stats.dispatched, stats.expired, stats.max_depth);
+        _report(name, &samples, extra);
+    }
+
+    free(samples.usec);
+    return r;
+}
+
+static void
+_on_stream_room(lb_stream* stream, size_t room, void* userdata)
+{
+    *(int*) userdata = 1;
+}
+
+/**
+ * Stream BENCH_STREAM_BYTES through write without response against the mock link rate, the
+ * samples are the lb_stream_write calls which must never block
+ */
+static int
+_run_stream(lb_bl_device* dev)
+{
+    int r, room = 0;
+    uint8_t data[BENCH_STREAM_BUFFER];
+    size_t offset = 0, size, written, i;
+    uint64_t start, elapsed;
+    char extra[192];
+    bench_samples samples;
+    lb_stream* stream = NULL;
+    lb_stream_options options = { 8, 0, BENCH_STREAM_BUFFER };
+    lb_stream_stats stats;
+    lb_future* flush = NULL;
+
+    if (_samples_init(&samples, BENCH_STREAM_BYTES / config.value_size) < 0) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t) i;
+    }
+
+    r = lb_stream_open(dev, BENCH_READ_UUID, &options, &stream);
+    if (r >= 0) {
+        r = lb_stream_set_callback(stream, _on_stream_room, &room);
+    }
+
+    start = _now_usec();
+    while (r >= 0 && offset < BENCH_STREAM_BYTES) {
+        size = BENCH_STREAM_BYTES - offset;
+        if (size > sizeof(data)) {
+            size = sizeof(data);
+        }
+
+        elapsed = _now_usec();
+        r = lb_stream_write(stream, data, size, &written);
+        _samples_add(&samples, _now_usec() - elapsed);
+        offset += written;
+
+        // back-pressure, the callback tells when half the buffer is free
+        room = 0;
+        while (r >= 0 && written < size && !room) {
+            r = lb_process_events(100);
+        }
+    }
+    if (r >= 0) {
+        r = lb_stream_flush(stream, &flush);
+    }
+    if (r >= 0) {
+        r = lb_future_wait(flush, 30000);
+    }
+    elapsed = _now_usec() - start;
+
+    if (r < 0) {
+        fprintf(stderr, "littleb_bench: stream failed\n");
+    } else {
+        lb_stream_get_stats(stream, &stats);
+        snprintf(extra, sizeof(extra),
+                 " bytes=%d per_second=%" PRIu64 " link_rate=%u lost=%" PRIu64 " retries=%" PRIu64
+                 " short_writes=%" PRIu64 " window=%d",
+                 BENCH_STREAM_BYTES, (uint64_t) BENCH_STREAM_BYTES * 1000000 / elapsed, config.link_rate,
+                 stats.bytes_accepted - stats.bytes_sent, stats.retries, stats.short_writes, stats.window);
+        _report("stream", &samples, extra);
+    }
+
+    lb_future_free(flush);
+    lb_stream_close(stream);
+    free(samples.usec);
+    return r;
+}
+
+/**
+ * --iterations values written back to back with lb_write_to_characteristic_latest, the samples
+ * are the calls, which never wait for the bus. The value read back afterwards must be the last.
+ */
+static int
+_run_latest_write(lb_bl_device* dev)
+{
+    int r = 0, i, last_ok = 0;
+    uint8_t value[20] = { 0 };
+    uint8_t* read_back = NULL;
+    size_t size = 0;
+    uint64_t start;
+    char extra[128];
+    bench_samples samples;
+    lb_latest_write_stats stats;
+
+    if (_samples_init(&samples, config.iterations) < 0) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < config.iterations && r >= 0; i++) {
+        value[0] = (uint8_t) i;
+        value[1] = (uint8_t)(i >> 8);
+        start = _now_usec();
+        r = lb_write_to_characteristic_latest(dev, BENCH_READ_UUID, sizeof(value), value, NULL);
+        _samples_add(&samples, _now_usec() - start);
+    }
+    if (r >= 0) {
+        r = lb_wait_latest_write(dev, BENCH_READ_UUID, 5000);
+    }
+    if (r >= 0) {
+        r = lb_read_from_characteristic(dev, BENCH_READ_UUID, &size, &read_back);
+    }
+
+    if (r < 0) {
+        fprintf(stderr, "littleb_bench: latest_write failed\n");
+    } else {
+        last_ok = size == sizeof(value) && memcmp(read_back, value, sizeof(value)) == 0;
+        lb_get_latest_write_stats(dev, BENCH_READ_UUID, &stats);
+        snprintf(extra, sizeof(extra), " written=%" PRIu64 " elided=%" PRIu64 " failed=%" PRIu64 " last_ok=%d",
+                 stats.written, stats.elided, stats.failed, last_ok);
+        _report("latest_write", &samples, extra);
+    }
+
+    free(samples.usec);
+    return r;
+}
+
+/**
+ * Echo BENCH_UART_BYTES through lb_uart in BENCH_UART_WRITE byte writes, the mock notifies every
+ * command to BENCH_UART_ADDRESS back. The samples are the time from writing a byte to reading it
+ * back.
+ */
+static int
+_run_uart()
+{
+    int r;
+    uint8_t pattern[BENCH_UART_WRITE + 251], buffer[BENCH_STREAM_BUFFER];
+    size_t sent = 0, received = 0, size, written, n, i, mismatches = 0;
+    uint64_t start, elapsed, *written_at;
+    char extra[192];
+    bench_samples samples;
+    lb_uart* uart = NULL;
+    lb_uart_stats stats;
+    lb_bl_device* dev = NULL;
+
+    written_at = malloc((BENCH_UART_BYTES / BENCH_UART_WRITE + 1) * sizeof(uint64_t));
+    if (written_at == NULL || _samples_init(&samples, BENCH_UART_BYTES) < 0) {
+        free(written_at);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < sizeof(pattern); i++) {
+        pattern[i] = (uint8_t)(i % 251);
+    }
+
+    r = lb_get_device_by_device_address(BENCH_UART_ADDRESS, &dev);
+    if (r >= 0) {
+        r = lb_uart_open(dev, NULL, &uart);
+    }
+
+    start = _now_usec();
+    while (r >= 0 && received < BENCH_UART_BYTES) {
+        // small writes as fast as they are taken, the UART coalesces them into full commands
+        while (r >= 0 && sent < BENCH_UART_BYTES) {
+            size = BENCH_UART_BYTES - sent;
+            if (size > BENCH_UART_WRITE) {
+                size = BENCH_UART_WRITE;
+            }
+            written_at[sent / BENCH_UART_WRITE] = _now_usec();
+            r = lb_uart_write(uart, pattern + sent % 251, size, 0, &written);
+            sent += written;
+            if (written < size) {
+                break;
+            }
+        }
+
+        if (r >= 0) {
+            r = lb_uart_read(uart, buffer, sizeof(buffer), 100, &n);
+        }
+        if (r < 0 || n == 0) {
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            if (buffer[i] != (uint8_t)((received + i) % 251)) {
+                mismatches++;
+            }
+        }
+        received += n;
+        _samples_add(&samples, _now_usec() - written_at[(received - 1) / BENCH_UART_WRITE]);
+    }
+    elapsed = _now_usec() - start;
+
+    if (r < 0) {
+        fprintf(stderr, "littleb_bench: uart failed\n");
+    } else {
+        lb_uart_get_stats(uart, &stats);
+        snprintf(extra, sizeof(extra),
+                 " bytes=%d per_second=%" PRIu64 " lost=%zu mismatches=%zu dropped=%" PRIu64
+                 " bytes_per_write=%" PRIu64,
+                 BENCH_UART_BYTES, (uint64_t) received * 1000000 / elapsed, BENCH_UART_BYTES - received,
+                 mismatches, stats.rx_dropped, stats.tx_writes > 0 ? stats.tx_bytes / stats.tx_writes : 0);
+        _report("uart", &samples, extra);
+    }
+
+    lb_uart_close(uart);
+    free(written_at);
+    free(samples.usec);
+    return r;
+}
+
+/**
+ * --iterations requests echoed back by BENCH_UART_ADDRESS through lb_transact, the samples are the
+ * round trips. The same count is then kept BENCH_TRANSACT_PENDING at a time in flight with
+ * lb_transact_async, the pending requests told apart by their first byte.
+ */
+static int
+_run_transact()
+{
+    int r, i, index, active = 0, started = 0, mismatches = 0;
+    unsigned int used = 0;
+    uint8_t request[8] = { 0 }, response[8], requests[BENCH_TRANSACT_PENDING][8];
+    size_t size = 0;
+    uint64_t start, elapsed;
+    char extra[192];
+    const uint8_t* value;
+    bench_samples samples;
+    lb_transact_stats stats;
+    lb_bl_device* dev = NULL;
+    lb_future* pending[BENCH_TRANSACT_PENDING];
+    int slots[BENCH_TRANSACT_PENDING];
+    lb_transact_matcher matcher = { NULL, NULL, 1, false };
+
+    if (_samples_init(&samples, config.iterations) < 0) {
+        return -ENOMEM;
+    }
+
+    r = lb_get_device_by_device_address(BENCH_UART_ADDRESS, &dev);
+    for (i = 0; i < config.iterations && r >= 0; i++) {
+        memcpy(request + 1, &i, sizeof(i));
+        start = _now_usec();
+        r = lb_transact(dev, BENCH_READ_UUID, BENCH_NOTIFY_UUID, request, sizeof(request), &matcher,
+                        5000, response, sizeof(response), &size);
+        _samples_add(&samples, _now_usec() - start);
+        if (r >= 0 && (size != sizeof(request) || memcmp(request, response, size) != 0)) {
+            mismatches++;
+        }
+    }
+
+    start = _now_usec();
+    while (r >= 0 && (started < config.iterations || active > 0)) {
+        while (r >= 0 && started < config.iterations && active < BENCH_TRANSACT_PENDING) {
+            for (index = 0; used & (1u << index); index++) {
+            }
+            requests[index][0] = (uint8_t) index;
+            memcpy(requests[index] + 1, &started, sizeof(started));
+            r = lb_transact_async(dev, BENCH_READ_UUID, BENCH_NOTIFY_UUID, requests[index],
+                                  sizeof(requests[index]), &matcher, 5000, &pending[active]);
+            if (r >= 0) {
+                used |= 1u << index;
+                slots[active++] = index;
+                started++;
+            }
+        }
+
+        if (r >= 0) {
+            r = lb_future_wait_any(pending, active, 5000, &i);
+        }
+        if (r >= 0) {
+            r = lb_future_result(pending[i]);
+        }
+        if (r >= 0) {
+            lb_future_get_value(pending[i], &value, &size);
+            if (size != sizeof(requests[0]) || memcmp(requests[slots[i]], value, size) != 0) {
+                mismatches++;
+            }
+            lb_future_free(pending[i]);
+            used &= ~(1u << slots[i]);
+            pending[i] = pending[--active];
+            slots[i] = slots[active];
+        }
+    }
+    elapsed = _now_usec() - start;
+    for (i = 0; i < active; i++) {
+        lb_future_free(pending[i]);
+    }
+
+    if (r < 0) {
+        fprintf(stderr, "littleb_bench: transact failed\n");
+    } else {
+        lb_get_transact_stats(dev, BENCH_NOTIFY_UUID, &stats);
+        snprintf(extra, sizeof(extra),
+                 " pipelined_per_second=%" PRIu64 " mismatches=%d timed_out=%" PRIu64
+                 " unmatched=%" PRIu64,
+                 elapsed > 0 ? (uint64_t) config.iterations * 1000000 / elapsed : 0, mismatches,
+                 stats.timed_out, stats.unmatched);
+        _report("transact", &samples, extra);
+    }
+
+    free(samples.usec);
+    return r;
+}
+
+/**
+ * Samples and failures of one thread of the write_threads benchmark
+ */
+typedef struct bench_writer {
+    pthread_t thread;
+    lb_bl_device* dev;
+    bench_samples samples;
+    int failures;
+} bench_writer;
+
+static void*
+_write_thread(void* arg)
+{
+    bench_writer* writer = (bench_writer*) arg;
+    uint8_t value[20] = { 0 };
+    uint64_t start;
+    int i;
+
+    for (i = 0; i < config.iterations / BENCH_WRITE_THREADS; i++) {
+        value[0] = (uint8_t) i;
+        start = _now_usec();
+        if (lb_write_to_characteristic(writer->dev, BENCH_READ_UUID, sizeof(value), value) < 0) {
+            writer->failures++;
+            continue;
+        }
+        _samples_add(&writer->samples, _now_usec() - start);
+    }
+
+    return NULL;
+}
+
+/**
+ * Synchronous writes to one device from BENCH_WRITE_THREADS threads at once
+ */
+static int
+_run_write_threads(lb_bl_device* dev)
+{
+    int i, failures = 0;
+    char extra[64];
+    bench_samples samples;
+    bench_writer writers[BENCH_WRITE_THREADS];
+    size_t j;
+
+    if (_samples_init(&samples, config.iterations) < 0) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < BENCH_WRITE_THREADS; i++) {
+        writers[i].dev = dev;
+        writers[i].failures = 0;
+        if (_samples_init(&writers[i].samples, config.iterations / BENCH_WRITE_THREADS) < 0) {
+            return -ENOMEM;
+        }
+        pthread_create(&writers[i].thread, NULL, _write_thread, &writers[i]);
+    }
+
+    for (i = 0; i < BENCH_WRITE_THREADS; i++) {
+        pthread_join(writers[i].thread, NULL);
+        for (j = 0; j < writers[i].samples.size; j++) {
+            _samples_add(&samples, writers[i].samples.usec[j]);
+        }
+        failures += writers[i].failures;
+        free(writers[i].samples.usec);
+    }
+
+    snprintf(extra, sizeof(extra), " threads=%d failures=%d", BENCH_WRITE_THREADS, failures);
+    _report("write_threads", &samples, extra);
+    free(samples.usec);
+
+    return (failures > 0) ? -EIO : 0;
+}
+
+/**
+ * Packed payload decoded by the --decode benchmarks
+ */
+typedef struct bench_decode_case {
+    const char* name;
+    lb_sample_type_t type;
+    int channels;
+    int payload_size;
+} bench_decode_case;
+
+static const bench_decode_case decode_cases[] = {
+    { "imu_int16x6", LB_SAMPLE_INT16, 6, 120 },
+    { "adc_int24x4", LB_SAMPLE_INT24, 4, 180 },
+    { "mono_int16", LB_SAMPLE_INT16, 1, 120 },
+};
+
+/**
+ * Unpack the payloads one sample at a time, the way applications did before lb_decode_payloads
+ */
+static int
+_decode_scalar(const lb_payload_layout* layout, const uint8_t* payloads, int payload_size, int count, float** channels)
+{
+    int i, f, c, frames, frame = 0;
+    int sample_size = (layout->type == LB_SAMPLE_INT16 || layout->type == LB_SAMPLE_UINT16) ? 2 : 3;
+    const uint8_t* p;
+    int32_t raw;
+
+    frames = payload_size / (sample_size * layout->channels);
+    for (i = 0; i < count; i++) {
+        p = payloads + (size_t) i * payload_size;
+        for (f = 0; f < frames; f++, frame++) {
+            for (c = 0; c < layout->channels; c++, p += sample_size) {
+                if (sample_size == 2) {
+                    raw = (layout->type == LB_SAMPLE_INT16) ? (int16_t)(p[0] | (p[1] << 8)) : (p[0] | (p[1] << 8));
+                } else {
+                    raw = p[0] | (p[1] << 8) | (p[2] << 16);
+                    if (layout->type == LB_SAMPLE_INT24 && (raw & 0x800000)) {
+                        raw -= 0x1000000;
+                    }
+                }
+                channels[c][frame] = (float) raw * layout->scale[c] + layout->offset[c];
+            }
+        }
+    }
+
+    return frame;
+}
+
+static int
+_run_decode_case(const bench_decode_case* decode_case)
+{
+    int r = 0, i, c, frames = 0, frames_scalar = 0, capacity;
+    uint64_t start, scalar_p50;
+    char name[64], extra[96];
+    float error, max_error = 0;
+    bench_samples samples = { NULL, 0, 0 };
+    lb_payload_layout layout;
+    uint8_t* payloads = malloc((size_t) BENCH_DECODE_PAYLOADS * decode_case->payload_size);
+    const void** pointers = malloc(BENCH_DECODE_PAYLOADS * sizeof(void*));
+    size_t* sizes = malloc(BENCH_DECODE_PAYLOADS * sizeof(size_t));
+    float* decoded[LB_DECODER_MAX_CHANNELS] = { NULL };
+    float* reference[LB_DECODER_MAX_CHANNELS] = { NULL };
+
+    memset(&layout, 0, sizeof(layout));
+    layout.type = decode_case->type;
+    layout.channels = decode_case->channels;
+    for (c = 0; c < layout.channels; c++) {
+        layout.scale[c] = 1.0f / (1 << (c + 4));
+        layout.offset[c] = (float) c;
+    }
+
+    capacity = BENCH_DECODE_PAYLOADS * decode_case->payload_size / 2;
+    for (c = 0; c < layout.channels; c++) {
+        decoded[c] = malloc(capacity * sizeof(float));
+        reference[c] = malloc(capacity * sizeof(float));
+        if (decoded[c] == NULL || reference[c] == NULL) {
+            r = -ENOMEM;
+        }
+    }
+    if (payloads == NULL || pointers == NULL || sizes == NULL || r < 0 ||
+        _samples_init(&samples, config.iterations) < 0) {
+        r = -ENOMEM;
+        goto out;
+    }
+
+    srand(1);
+    for (i = 0; i < BENCH_DECODE_PAYLOADS * decode_case->payload_size; i++) {
+        payloads[i] = (uint8_t) rand();
+    }
+    for (i = 0; i < BENCH_DECODE_PAYLOADS; i++) {
+        pointers[i] = payloads + (size_t) i * decode_case->payload_size;
+        sizes[i] = decode_case->payload_size;
+    }
+
+    for (i = 0; i < config.iterations; i++) {
+        start = _now_usec();
+        frames_scalar = _decode_scalar(&layout, payloads, decode_case->payload_size, BENCH_DECODE_PAYLOADS, reference);
+        _samples_add(&samples, _now_usec() - start);
+    }
+    snprintf(name, sizeof(name), "decode_%s_scalar", decode_case->name);
+    snprintf(extra, sizeof(extra), " payloads=%d samples=%d", BENCH_DECODE_PAYLOADS, frames_scalar * layout.channels);
+    _report(name, &samples, extra);
+    scalar_p50 = samples.usec[(samples.size - 1) * 50 / 100];
+
+    samples.size = 0;
+    for (i = 0; i < config.iterations && r >= 0; i++) {
+        start = _now_usec();
+        r = lb_decode_payloads(&layout, pointers, sizes, BENCH_DECODE_PAYLOADS, decoded, capacity, &frames);
+        _samples_add(&samples, _now_usec() - start);
+    }
+    if (r < 0 || frames != frames_scalar) {
+        fprintf(stderr, "littleb_bench: lb_decode_payloads failed\n");
+        r = r < 0 ? r : -EINVAL;
+        goto out;
+    }
+
+    for (c = 0; c < layout.channels; c++) {
+        for (i = 0; i < frames; i++) {
+            error = decoded[c][i] - reference[c][i];
+            error = error < 0 ? -error : error;
+            max_error = error > max_error ? error : max_error;
+        }
+    }
+
+    // sorted by _report, the p50 is at the same index
+    qsort(samples.usec, samples.size, sizeof(uint64_t), _compare_u64);
+    snprintf(name, sizeof(name), "decode_%s", decode_case->name);
+    snprintf(extra, sizeof(extra), " payloads=%d samples=%d kernel=%s speedup=%.1f max_error=%g",
+             BENCH_DECODE_PAYLOADS, frames * layout.channels, lb_decoder_kernel(),
+             (double) scalar_p50 / (double) (samples.usec[(samples.size - 1) * 50 / 100] | 1), max_error);
+    _report(name, &samples, extra);
+
+out:
+    for (c = 0; c < LB_DECODER_MAX_CHANNELS; c++) {
+        free(decoded[c]);
+        free(reference[c]);
+    }
+    free(samples.usec);
+    free(payloads);
+    free(pointers);
+    free(sizes);
+    return r;
+}
+
+static int
+_run_decode()
+{
+    size_t i;
+    int r;
+
+    for (i = 0; i < sizeof(decode_cases) / sizeof(decode_cases[0]); i++) {
+        r = _run_decode_case(&decode_cases[i]);
+        if (r < 0) {
+            return r;
+        }
+    }
+
+    return 0;
+}
+
+static int
+_run_benchmarks()
+{
+    int r, i;
+    uint64_t start, count;
+    size_t size = 0;
+    uint8_t* value = NULL;
+    uint8_t buffer[512];
+    uint8_t write_value[20] = { 0 };
+    char extra[64];
+    bench_samples samples;
+    lb_bl_device* dev = NULL;
+
+    r = _samples_init(&samples, config.iterations > config.devices ? config.iterations : config.devices);
+    if (r < 0) {
+        return r;
+    }
+
+    start = _now_usec();
+    r = lb_get_bl_devices(0);
+    if (r < 0) {
+        fprintf(stderr, "littleb_bench: lb_get_bl_devices failed\n");
+        return r;
+    }
+    _samples_add(&samples, _now_usec() - start);
+    _report("get_bl_devices", &samples, "");
+
+    samples.size = 0;
+    for (i = 0; i < config.devices; i++) {
+        char address[18];
+
+        snprintf(address, sizeof(address), "00:B1:00:%02X:%02X:%02X", (i >> 16) & 0xff, (i >> 8) & 0xff,
+                 i & 0xff);
+        r = lb_get_device_by_device_address(address, &dev);
+        if (r < 0) {
+            fprintf(stderr, "littleb_bench: device %s not found\n", address);
+            return r;
+        }
+
+        start = _now_usec();
+        r = lb_get_ble_device_services(dev);
+        if (r < 0) {
+            fprintf(stderr, "littleb_bench: lb_get_ble_device_services failed on %s\n", address);
+            return r;
+        }
+        _samples_add(&samples, _now_usec() - start);
+    }
+    _report("get_ble_device_services", &samples, "");
+
+    r = lb_get_device_by_device_address(BENCH_FIRST_ADDRESS, &dev);
+    if (r < 0) {
+        return r;
+    }
+
+    r = lb_connect_device(dev);
+    if (r < 0) {
+        fprintf(stderr, "littleb_bench: lb_connect_device failed\n");
+        return r;
+    }
+
+    samples.size = 0;
+    for (i = 0; i < config.iterations; i++) {
+        start = _now_usec();
+        r = lb_read_from_characteristic(dev, BENCH_READ_UUID, &size, &value);
+        if (r < 0) {
+            fprintf(stderr, "littleb_bench: lb_read_from_characteristic failed\n");
+            return r;
+        }
+        _samples_add(&samples, _now_usec() - start);
+    }
+    _report("read", &samples, "");
+
+    samples.size = 0;
+    for (i = 0; i < config.iterations; i++) {
+        start = _now_usec();
+        r = lb_read_from_characteristic_into(dev, BENCH_READ_UUID, buffer, sizeof(buffer), &size);
+        if (r < 0) {
+            fprintf(stderr, "littleb_bench: lb_read_from_characteristic_into failed\n");
+            return r;
+        }
+        _samples_add(&samples, _now_usec() - start);
+    }
+    _report("read_into", &samples, "");
+
+    samples.size = 0;
+    for (i = 0; i < config.iterations; i++) {
+        write_value[0] = (uint8_t) i;
+        start = _now_usec();
+        r = lb_write_to_characteristic(dev, BENCH_READ_UUID, sizeof(write_value), write_value);
+        if (r < 0) {
+            fprintf(stderr, "littleb_bench: lb_write_to_characteristic failed\n");
+            return r;
+        }
+        _samples_add(&samples, _now_usec() - start);
+    }
+    _report("write", &samples, "");
+    free(samples.usec);
+
+    r = _run_write_threads(dev);
+    if (r < 0) {
+        return r;
+    }
+
+    r = _run_gatt_queue(dev, LB_PRIORITY_BULK, "gatt_queue_fifo");
+    if (r < 0) {
+        return r;
+    }
+
+    r = _run_gatt_queue(dev, LB_PRIORITY_CONTROL, "gatt_queue_control");
+    if (r < 0) {
+        return r;
+    }
+
+    r = _run_stream(dev);
+    if (r < 0) {
+        return r;
+    }
+
+    r = _run_latest_write(dev);
+    if (r < 0) {
+        return r;
+    }
+
+    if (config.devices > 1) {
+        r = _run_uart();
+        if (r < 0) {
+            return r;
+        }
+
+        r = _run_transact();
+        if (r < 0) {
+            return r;
+        }
+    }
+
+    r = _run_read_async();
+    if (r < 0) {
+        return r;
+    }
+
+    r = _run_read_batch();
+    if (r < 0) {
+        return r;
+    }
+
+    if (config.advertise_hz > 0 && config.notify_seconds > 0) {
+        r = _run_advertisements();
+        if (r < 0) {
+            return r;
+        }
+    }
+
+    if (config.notify_hz == 0 || config.notify_seconds <= 0) {
+        return 0;
+    }
+
+    r = _samples_init(&notify_samples, BENCH_NOTIFY_SAMPLES_MAX);
+    if (r < 0) {
+        return r;
+    }
+
+    if (config.external_loop) {
+        return _run_external_notify(dev);
+    }
+
+    r = lb_register_characteristic_read_event(dev, BENCH_NOTIFY_UUID, _notify_callback, NULL);
+    if (r < 0) {
+        fprintf(stderr, "littleb_bench: lb_register_characteristic_read_event failed\n");
+        return r;
+    }
+
+    // only count notifications delivered in the measured window
+    count = __atomic_load_n(&notify_count, __ATOMIC_RELAXED);
+    start = _now_usec();
+    sleep(config.notify_seconds);
+    count = __atomic_load_n(&notify_count, __ATOMIC_RELAXED) - count;
+    snprintf(extra, sizeof(extra), " per_second=%" PRIu64, count * 1000000 / (_now_usec() - start));
+    _report("notify", &notify_samples, extra);
+
+    return 0;
+}
+
+/**
+ * Remove or add back a device of the mock through it's org.littleb.Mock1 interface
+ */
+static int
+_call_mock(const char* method, const char* types, ...)
+{
+    int r;
+    va_list ap;
+    sd_bus* bus = NULL;
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+
+    r = sd_bus_open_system(&bus);
+    if (r < 0) {
+        return r;
+    }
+
+    va_start(ap, types);
+    r = sd_bus_call_methodv(bus, "org.bluez", "/org/bluez/hci0", "org.littleb.Mock1", method, &error, NULL,
+                            types, ap);
+    va_end(ap);
+    if (r < 0) {
+        fprintf(stderr, "littleb_bench: %s failed: %s\n", method, error.message);
+    }
+
+    sd_bus_error_free(&error);
+    sd_bus_flush_close_unref(bus);
+    return r;
+}
+
+/**
+ * Free a device while a latest value wins write is in flight on it and another value is pending.
+ * GetManagedObjects is answered without the mock latency, so the device is freed before the write
+ * completes. Completing the write must not queue the pending value on the freed device.
+ */
+static int
+_check_latest_write_remove()
+{
+    int r;
+    uint8_t value[20] = { 0 };
+    lb_bl_device* dev = NULL;
+
+    r = lb_get_bl_devices(0);
+    if (r >= 0) {
+        r = lb_get_device_by_device_address(BENCH_CHECK_ADDRESS, &dev);
+    }
+    if (r >= 0) {
+        r = lb_get_ble_device_services(dev);
+    }
+    if (r >= 0) {
+        r = lb_connect_device(dev);
+    }
+    if (r < 0) {
+        fprintf(stderr, "littleb_bench: failed to set up %s\n", BENCH_CHECK_ADDRESS);
+        return r;
+    }
+
+    r = lb_write_to_characteristic_latest(dev, BENCH_READ_UUID, sizeof(value), value, NULL);
+    if (r >= 0) {
+        value[0] = 1;
+        r = lb_write_to_characteristic_latest(dev, BENCH_READ_UUID, sizeof(value), value, NULL);
+    }
+    if (r < 0) {
+        fprintf(stderr, "littleb_bench: lb_write_to_characteristic_latest failed\n");
+        return r;
+    }
+
+    r = _call_mock("SetDevicePresent", "ub", (uint32_t) BENCH_CHECK_DEVICE, 0);
+    if (r >= 0) {
+        r = lb_get_bl_devices(0);
+    }
+    if (r < 0) {
+        return r;
+    }
+    r = lb_get_device_by_device_address(BENCH_CHECK_ADDRESS, &dev);
+    if (r >= 0) {
+        fprintf(stderr, "littleb_bench: %s was not removed\n", BENCH_CHECK_ADDRESS);
+        return -EINVAL;
+    }
+
+    // the reply of the write in flight arrives after the device is gone
+    r = lb_process_events(BENCH_CHECK_LATENCY_US * 3 / 1000);
+    if (r >= 0) {
+        r = _call_mock("SetDevicePresent", "ub", (uint32_t) BENCH_CHECK_DEVICE, 1);
+    }
+    return r;
+}
+
+/**
+ * Replace a device by a new one with a new path and address again and again. The strings of the
+ * departed devices have to be dropped, so the second half of the rounds must not need a larger
+ * string table than the first.
+ */
+static int
+_check_string_churn()
+{
+    int r = 0, i;
+    uint64_t strings, most[2] = { 0, 0 };
+    char address[18];
+    lb_bl_device* dev = NULL;
+
+    for (i = 0; i < 2 * BENCH_CHURN_ROUNDS && r >= 0; i++) {
+        r = _call_mock("ReplaceDevice", "u", (uint32_t) BENCH_CHURN_DEVICE);
+        if (r >= 0) {
+            r = lb_get_bl_devices(0);
+        }
+        if (r >= 0) {
+            // the mock counts the replacements in the first and third octet
+            snprintf(address, sizeof(address), "%02X:B1:%02X:00:00:%02X", ((i + 1) >> 8) & 0xff,
+                     (i + 1) & 0xff, BENCH_CHURN_DEVICE);
+            r = lb_get_device_by_device_address(address, &dev);
+        }
+        if (r >= 0) {
+            r = lb_get_ble_device_services(dev);
+        }
+        if (r >= 0) {
+            r = lb_get_string_table_stats(&strings, NULL);
+        }
+        if (r >= 0 && strings > most[i / BENCH_CHURN_ROUNDS]) {
+            most[i / BENCH_CHURN_ROUNDS] = strings;
+        }
+    }
+    if (r < 0) {
+        fprintf(stderr, "littleb_bench: replacing device %d failed in round %d\n", BENCH_CHURN_DEVICE, i);
+        return r;
+    }
+
+    if (most[1] > most[0]) {
+        fprintf(stderr, "littleb_bench: string table grew from %" PRIu64 " to %" PRIu64 " strings\n", most[0],
+                most[1]);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Fetch the services of a device never read from, the cache must hold the value BlueZ lists right
+ * away so a cached only read hits
+ */
+static int
+_check_cached_value_seed()
+{
+    int r;
+    uint64_t hits = 0, hits_before = 0;
+    size_t size = 0;
+    uint8_t* value = NULL;
+    lb_bl_device* dev = NULL;
+
+    r = lb_get_bl_devices(0);
+    if (r >= 0) {
+        r = lb_get_device_by_device_address(BENCH_FIRST_ADDRESS, &dev);
+    }
+    if (r >= 0) {
+        r = lb_get_ble_device_services(dev);
+    }
+    if (r >= 0) {
+        r = lb_get_value_cache_stats(&hits_before, NULL);
+    }
+    if (r < 0) {
+        fprintf(stderr, "littleb_bench: failed to set up %s\n", BENCH_FIRST_ADDRESS);
+        return r;
+    }
+
+    r = lb_read_from_characteristic_cached(dev, BENCH_READ_UUID, LB_READ_CACHED_ONLY, 0, &size, &value);
+    if (r >= 0) {
+        r = lb_get_value_cache_stats(&hits, NULL);
+    }
+    if (r < 0 || hits != hits_before + 1 || size != config.value_size) {
+        fprintf(stderr, "littleb_bench: no cached value of %s after fetching services\n", BENCH_READ_UUID);
+        return r < 0 ? r : -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Run the regression checks, best built with -fsanitize=address so a use after free fails them
+ */
+static int
+_run_checks()
+{
+    static const struct {
+        const char* name;
+        int (*run)();
+    } checks[] = {
+        { "latest_write_remove", _check_latest_write_remove },
+        { "string_churn", _check_string_churn },
+        { "cached_value_seed", _check_cached_value_seed },
+    };
+    size_t i;
+    int r, failed = 0;
+
+    for (i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+        r = checks[i].run();
+        printf("check=%s result=%s\n", checks[i].name, r < 0 ? "failed" : "ok");
+        fflush(stdout);
+        if (r < 0) {
+            failed++;
+        }
+    }
+
+    return failed > 0 ? -EINVAL : 0;
+}
+
+static void
+_stress_report(const char* name, bench_samples* samples, uint64_t cpu_start)
+{
+    char extra[128];
+    long objects = (long) config.devices * (1 + config.services * (1 + config.characteristics));
+
+    snprintf(extra, sizeof(extra), " devices=%d objects=%ld cpu_us=%" PRIu64 " rss_kb=%ld", config.devices,
+             objects, _cpu_usec() - cpu_start, _rss_kb());
+    _report(name, samples, extra);
+    samples->size = 0;
+}
+
+/**
+ * Measure every enumeration and lookup API at the current device count, runs in it's own process
+ */
+static int
+_run_stress_step()
+{
+    int r, i, device, service_samples;
+    uint64_t start, cpu_start;
+    char key[96];
+    bench_samples samples;
+    lb_bl_device* dev = NULL;
+    lb_ble_char* characteristic = NULL;
+    lb_ble_service* service = NULL;
+    lb_device_filter filter = { "00:B1:00:00:00", NULL, -100, LB_DEVICE_FLAG_BL, LB_DEVICE_FLAG_REMOVED, 0 };
+    int* indices = NULL;
+    int count = 0;
+
+    r = _samples_init(&samples, config.iterations);
+    if (r < 0) {
+        return r;
+    }
+
+    r = lb_init();
+    if (r < 0) {
+        fprintf(stderr, "littleb_bench: lb_init failed\n");
+        return r;
+    }
+
+    cpu_start = _cpu_usec();
+    start = _now_usec();
+    r = lb_get_bl_devices(0);
+    if (r < 0) {
+        fprintf(stderr, "littleb_bench: lb_get_bl_devices failed\n");
+        return r;
+    }
+    _samples_add(&samples, _now_usec() - start);
+    _stress_report("stress_get_bl_devices", &samples, cpu_start);
+
+    // a second scan reconciles against the populated table
+    cpu_start = _cpu_usec();
+    start = _now_usec();
+    r = lb_get_bl_devices(0);
+    if (r < 0) {
+        fprintf(stderr, "littleb_bench: lb_get_bl_devices rescan failed\n");
+        return r;
+    }
+    _samples_add(&samples, _now_usec() - start);
+    _stress_report("stress_rescan_bl_devices", &samples, cpu_start);
+
+    // spread lookups over the whole device table
+    cpu_start = _cpu_usec();
+    for (i = 0; i < config.iterations; i++) {
+        device = (int) (((uint64_t) i * 7919) % config.devices);
+        snprintf(key, sizeof(key), "00:B1:00:%02X:%02X:%02X", (device >> 16) & 0xff, (device >> 8) & 0xff,
+                 device & 0xff);
+        start = _now_usec();
+        r = lb_get_device_by_device_address(key, &dev);
+        _samples_add(&samples, _now_usec() - start);
+    }
+    _stress_report("stress_get_device_by_address", &samples, cpu_start);
+
+    cpu_start = _cpu_usec();
+    for (i = 0; i < config.iterations; i++) {
+        snprintf(key, sizeof(key), "MOCK%d", (int) (((uint64_t) i * 7919) % config.devices));
+        start = _now_usec();
+        r = lb_get_device_by_device_name(key, &dev);
+        _samples_add(&samples, _now_usec() - start);
+    }
+    _stress_report("stress_get_device_by_name", &samples, cpu_start);
+
+    cpu_start = _cpu_usec();
+    for (i = 0; i < config.iterations; i++) {
+        device = (int) (((uint64_t) i * 7919) % config.devices);
+        snprintf(key, sizeof(key), "/org/bluez/hci0/dev_00_B1_00_%02X_%02X_%02X", (device >> 16) & 0xff,
+                 (device >> 8) & 0xff, device & 0xff);
+        start = _now_usec();
+        r = lb_get_device_by_device_path(key, &dev);
+        _samples_add(&samples, _now_usec() - start);
+    }
+    _stress_report("stress_get_device_by_path", &samples, cpu_start);
+
+    // the prefix matches the first 256 devices, the whole table is scanned regardless
+    indices = (int*) calloc(config.devices, sizeof(int));
+    if (indices == NULL) {
+        return -1;
+    }
+    cpu_start = _cpu_usec();
+    for (i = 0; i < config.iterations; i++) {
+        start = _now_usec();
+        r = lb_filter_devices(&filter, indices, config.devices, &count);
+        _samples_add(&samples, _now_usec() - start);
+    }
+    // churned devices are flagged removed and drop out of the match
+    if (config.churn_hz == 0 && (r < 0 || count != (config.devices < 256 ? config.devices : 256))) {
+        fprintf(stderr, "littleb_bench: lb_filter_devices matched %d devices\n", count);
+    }
+    free(indices);
+    _stress_report("stress_filter_devices", &samples, cpu_start);
+
+    service_samples = config.devices < BENCH_STRESS_SERVICE_SAMPLES ? config.devices : BENCH_STRESS_SERVICE_SAMPLES;
+    cpu_start = _cpu_usec();
+    for (i = 0; i < service_samples; i++) {
+        device = (int) (((uint64_t) i * config.devices) / service_samples);
+        snprintf(key, sizeof(key), "00:B1:00:%02X:%02X:%02X", (device >> 16) & 0xff, (device >> 8) & 0xff,
+                 device & 0xff);
+        if (lb_get_device_by_device_address(key, &dev) < 0) {
+            continue;
+        }
+        start = _now_usec();
+        r = lb_get_ble_device_services(dev);
+        if (r < 0) {
+            fprintf(stderr, "littleb_bench: lb_get_ble_device_services failed on %s\n", key);
+            continue;
+        }
+        _samples_add(&samples, _now_usec() - start);
+    }
+    _stress_report("stress_get_ble_device_services", &samples, cpu_start);
+
+    r = lb_get_device_by_device_address(BENCH_FIRST_ADDRESS, &dev);
+    if (r < 0) {
+        return r;
+    }
+
+    // the last characteristic of the last service is the worst case of a linear search
+    snprintf(key, sizeof(key), "6e40%04x-b5a3-f393-e0a9-e50e24dcca9e",
+             ((config.services - 1) << 8) | (config.characteristics + 1));
+    cpu_start = _cpu_usec();
+    for (i = 0; i < config.iterations; i++) {
+        start = _now_usec();
+        r = lb_get_ble_characteristic_by_uuid(dev, key, &characteristic);
+        _samples_add(&samples, _now_usec() - start);
+    }
+    _stress_report("stress_get_ble_characteristic_by_uuid", &samples, cpu_start);
+
+    snprintf(key, sizeof(key), "6e40%04x-b5a3-f393-e0a9-e50e24dcca9e", ((config.services - 1) << 8) | 0x01);
+    cpu_start = _cpu_usec();
+    for (i = 0; i < config.iterations; i++) {
+        start = _now_usec();
+        r = lb_get_ble_service_by_uuid(dev, key, &service);
+        _samples_add(&samples, _now_usec() - start);
+    }
+    _stress_report("stress_get_ble_service_by_uuid", &samples, cpu_start);
+
+    free(samples.usec);
+    return 0;
+}
+
+static int
+_run_stress()
+{
+    int r = 0, status, devices;
+    const char* step = config.stress_steps;
+    char* end;
+    pid_t pid;
+
+    while (*step != '\0') {
+        devices = (int) strtol(step, &end, 10);
+        if (end == step || devices < 1) {
+            fprintf(stderr, "littleb_bench: invalid --stress-steps %s\n", config.stress_steps);
+            return -EINVAL;
+        }
+        step = *end == ',' ? end + 1 : end;
+        config.devices = devices;
+
+        r = _start_mock();
+        if (r >= 0) {
+            r = _wait_for_mock(60000);
+        }
+        if (r < 0) {
+            fprintf(stderr, "littleb_bench: failed to start mock_bluez: %s\n", strerror(-r));
+            return r;
+        }
+
+        // a fresh process per step keeps the memory figures and the library state independent
+        fflush(stdout);
+        pid = fork();
+        if (pid == 0) {
+            r = _run_stress_step();
+            fflush(stdout);
+            _exit(r < 0 ? 1 : 0);
+        }
+
+        if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+            r = -errno;
+        } else if (WIFSIGNALED(status)) {
+            printf("benchmark=stress devices=%d failed_signal=%d\n", devices, WTERMSIG(status));
+        } else if (WEXITSTATUS(status) != 0) {
+            printf("benchmark=stress devices=%d failed_status=%d\n", devices, WEXITSTATUS(status));
+        }
+        fflush(stdout);
+
+        kill(mock_pid, SIGTERM);
+        waitpid(mock_pid, NULL, 0);
+        mock_pid = 0;
+        if (r < 0) {
+            return r;
+        }
+    }
+
+    return 0;
+}
+
+static void
+_usage(const char* name)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --devices N          devices exposed by the mock (default %d)\n"
+            "  --services N         services per device (default %d)\n"
+            "  --characteristics N  characteristics per service, at least 2 (default %d)\n"
+            "  --value-size N       characteristic value size in bytes (default %u)\n"
+            "  --latency-us N       mock reply latency (default %u)\n"
+            "  --notify-hz N        mock notification rate, 0 to skip (default %u)\n"
+            "  --iterations N       samples per round-trip benchmark (default %d)\n"
+            "  --notify-seconds N   notification measurement window (default %d)\n"
+            "  --churn-hz N         mock device removals and additions per second (default %u)\n"
+            "  --advertise-hz N     mock advertisements per second, 0 to skip (default %u)\n"
+            "  --advertise-repeat N mock advertisements of a device sharing the same data (default %u)\n"
+            "  --link-rate N        bytes per second the mock link drains write without response at,\n"
+            "                       0 for no limit (default %u)\n"
+            "  --external-loop      deliver notifications through lb_get_fd and lb_process in a poll\n"
+            "                       loop of the benchmark instead of the littleb thread\n"
+            "  --decode             measure lb_decode_payloads against a scalar loop, no bus is started\n"
+            "  --stress             measure enumeration and lookups at each of --stress-steps devices,\n"
+            "                       with 1 service of 9 characteristics per device unless given\n"
+            "  --stress-steps LIST  comma separated device counts (default %s)\n"
+            "  --check              run the regression checks against the mock instead of measuring\n"
+            "  --mock PATH          mock_bluez binary (default %s)\n"
+            "  --bus-config PATH    dbus-daemon configuration (default %s)\n"
+            "  --dbus-daemon PATH   dbus-daemon binary (default %s)\n",
+            name, config.devices, config.services, config.characteristics, config.value_size,
+            config.latency_usec, config.notify_hz, config.iterations, config.notify_seconds,
+            config.churn_hz, config.advertise_hz, config.advertise_repeat, config.link_rate,
+            config.stress_steps, config.mock,
+            config.bus_config, config.dbus_daemon);
+}
+
+int
+main(int argc, char* argv[])
+{
+    int r, opt, services_set = 0, characteristics_set = 0, latency_set = 0;
+    static const struct option options[] = {
+        { "devices", required_argument, NULL, 'd' },
+        { "services", required_argument, NULL, 's' },
+        { "characteristics", required_argument, NULL, 'c' },
+        { "value-size", required_argument, NULL, 'v' },
+        { "latency-us", required_argument, NULL, 'l' },
+        { "notify-hz", required_argument, NULL, 'n' },
+        { "iterations", required_argument, NULL, 'i' },
+        { "notify-seconds", required_argument, NULL, 't' },
+        { "churn-hz", required_argument, NULL, 'C' },
+        { "advertise-hz", required_argument, NULL, 'a' },
+        { "advertise-repeat", required_argument, NULL, 'A' },
+        { "link-rate", required_argument, NULL, 'L' },
+        { "external-loop", no_argument, NULL, 'E' },
+        { "decode", no_argument, NULL, 'X' },
+        { "stress", no_argument, NULL, 'S' },
+        { "stress-steps", required_argument, NULL, 'T' },
+        { "check", no_argument, NULL, 'K' },
+        { "mock", required_argument, NULL, 'm' },
+        { "bus-config", required_argument, NULL, 'b' },
+        { "dbus-daemon", required_argument, NULL, 'D' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        switch (opt) {
+            case 'd':
+                config.devices = atoi(optarg);
+                break;
+            case 's':
+                config.services = atoi(optarg);
+                services_set = 1;
+                break;
+            case 'c':
+                config.characteristics = atoi(optarg);
+                characteristics_set = 1;
+                break;
+            case 'v':
+                config.value_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'l':
+                config.latency_usec = strtoul(optarg, NULL, 10);
+                latency_set = 1;
+                break;
+            case 'n':
+                config.notify_hz = strtoul(optarg, NULL, 10);
+                break;
+            case 'i':
+                config.iterations = atoi(optarg);
+                break;
+            case 't':
+                config.notify_seconds = atoi(optarg);
+                break;
+            case 'C':
+                config.churn_hz = strtoul(optarg, NULL, 10);
+                break;
+            case 'a':
+                config.advertise_hz = strtoul(optarg, NULL, 10);
+                break;
+            case 'A':
+                config.advertise_repeat = strtoul(optarg, NULL, 10);
+                break;
+            case 'L':
+                config.link_rate = strtoul(optarg, NULL, 10);
+                break;
+            case 'E':
+                config.external_loop = 1;
+                break;
+            case 'X':
+                config.decode = 1;
+                break;
+            case 'S':
+                config.stress = 1;
+                break;
+            case 'T':
+                config.stress_steps = optarg;
+                break;
+            case 'K':
+                config.check = 1;
+                break;
+            case 'm':
+                config.mock = optarg;
+                break;
+            case 'b':
+                config.bus_config = optarg;
+                break;
+            case 'D':
+                config.dbus_daemon = optarg;
+                break;
+            default:
+                _usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    // 10 GATT objects per device, 100k at the default top step
+    if (config.stress) {
+        config.services = services_set ? config.services : 1;
+        config.characteristics = characteristics_set ? config.characteristics : 9;
+        config.notify_hz = 0;
+        config.advertise_hz = 0;
+    }
+
+    // the checks need replies that are still outstanding when the bench acts
+    if (config.check) {
+        config.latency_usec = latency_set ? config.latency_usec : BENCH_CHECK_LATENCY_US;
+        config.notify_hz = 0;
+        config.advertise_hz = 0;
+        if (config.devices <= BENCH_CHECK_DEVICE) {
+            fprintf(stderr, "littleb_bench: --check needs at least %d devices\n", BENCH_CHECK_DEVICE + 1);
+            return 1;
+        }
+    }
+
+    if (config.devices < 1 || config.services < 1 || config.characteristics < 2 || config.iterations < 1) {
+        fprintf(stderr, "littleb_bench: needs at least 1 device, 1 service and 2 characteristics\n");
+        return 1;
+    }
+
+    if (config.decode) {
+        printf("# littleb_bench decode payloads=%d iterations=%d\n", BENCH_DECODE_PAYLOADS, config.iterations);
+        return _run_decode() < 0 ? 1 : 0;
+    }
+
+    if (config.check) {
+        printf("# littleb_bench check devices=%d latency_us=%u\n", config.devices, config.latency_usec);
+    } else if (config.stress) {
+        printf("# littleb_bench stress steps=%s services=%d characteristics=%d churn_hz=%u iterations=%d\n",
+               config.stress_steps, config.services, config.characteristics, config.churn_hz,
+               config.iterations);
+    } else {
+        printf("# littleb_bench devices=%d services=%d characteristics=%d value_size=%u latency_us=%u "
+               "notify_hz=%u churn_hz=%u advertise_hz=%u advertise_repeat=%u link_rate=%u\n",
+               config.devices, config.services, config.characteristics, config.value_size,
+               config.latency_usec, config.notify_hz, config.churn_hz, config.advertise_hz,
+               config.advertise_repeat, config.link_rate);
+    }
+
+    r = _start_bus();
+    if (r < 0) {
+        fprintf(stderr, "littleb_bench: failed to start dbus-daemon: %s\n", strerror(-r));
+        _stop_children();
+        return 1;
+    }
+
+    if (config.stress) {
+        r = _run_stress();
+        _stop_children();
+        return r < 0 ? 1 : 0;
+    }
+
+    r = _start_mock();
+    if (r >= 0) {
+        r = _wait_for_mock(10000);
+    }
+    if (r < 0) {
+        fprintf(stderr, "littleb_bench: failed to start mock_bluez: %s\n", strerror(-r));
+        _stop_children();
+        return 1;
+    }
+
+    r = lb_init();
+    if (r < 0) {
+        fprintf(stderr, "littleb_bench: lb_init failed\n");
+        _stop_children();
+        return 1;
+    }
+
+    r = config.check ? _run_checks() : _run_benchmarks();
+
+    // lb_destroy expects the notification thread to exist
+    if (config.notify_hz > 0 && config.notify_seconds > 0 && r >= 0) {
+        lb_destroy();
+    }
+    _stop_children();
+
+    return r < 0 ? 1 : 0;
+}
@@ -0,0 +1,1326 @@
+/*
+ * Copyright (c) 2016 Intel Corporation.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Minimal fake org.bluez service for benchmarking littleb without a radio.
+ *
+ * Owns org.bluez on the bus given by DBUS_SYSTEM_BUS_ADDRESS and exposes an ObjectManager at /, an
+ * Adapter1 at /org/bluez/hci0 and a configurable number of Device1, GattService1 and
+ * GattCharacteristic1 objects below it. Objects are served through fallback vtables so their count
+ * only costs memory for their state, not for bus registrations.
+ *
+ * With --churn-hz devices are removed and added back at the given rate with the InterfacesRemoved and
+ * InterfacesAdded signals BlueZ sends, device 0 is never removed so clients always have a target.
+ *
+ * With --advertise-hz and while discovering, devices take turns to advertise: each advertisement is a
+ * Device1 PropertiesChanged of RSSI, ManufacturerData and ServiceData like BlueZ emits with
+ * DuplicateData. The manufacturer data starts with the monotonic send time in usec, refreshed every
+ * --advertise-repeat advertisements of a device so repeats carry identical data.
+ *
+ * The org.littleb.Mock1 interface of the adapter lets a test drive the mock: SetDevicePresent
+ * removes a device or adds it back right away, with the same signals as --churn-hz. ReplaceDevice
+ * removes a device and adds it back as a new one, the first and third octet of it's address count
+ * the replacements.
+ *
+ * Characteristic UUIDs follow the Nordic UART layout, service n is 6e40nn01-... and it's
+ * characteristics are 6e40nn02-..., 6e40nn03-... and so on. Notifications put the monotonic send
+ * time in usec in the first 8 bytes of the value so receivers can measure delivery latency.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+#include <time.h>
+
+#define MOCK_ADAPTER_PATH "/org/bluez/hci0"
+#define MOCK_DEVICE_PATH_FMT MOCK_ADAPTER_PATH "/dev_%02X_B1_%02X_%02X_%02X_%02X"
+#define MOCK_ADDRESS_FMT "%02X:B1:%02X:%02X:%02X:%02X"
+#define MOCK_UUID_FMT "6e40%04x-b5a3-f393-e0a9-e50e24dcca9e"
+#define MOCK_PATH_MAX 96
+#define MOCK_SERVICE_DATA_UUID "0000feaa-0000-1000-8000-00805f9b34fb"
+#define MOCK_SECOND_SERVICE_DATA_UUID "0000fe9f-0000-1000-8000-00805f9b34fb"
+
+typedef struct mock_device {
+    int index;
+    char address[18];
+    char name[24];
+    int paired;
+    int connected;
+    int present;
+    unsigned int generation;
+    int16_t rssi;
+    uint64_t advertised;
+    uint8_t manufacturer_data[12];
+} mock_device;
+
+typedef struct mock_service {
+    int device;
+    int index;
+} mock_service;
+
+typedef struct mock_char {
+    int device;
+    int service;
+    int index;
+    uint8_t* value;
+    size_t value_size;
+    int notifying;
+} mock_char;
+
+static struct {
+    int devices;
+    int services;
+    int characteristics;
+    size_t value_size;
+    uint64_t latency_usec;
+    unsigned int notify_hz;
+    unsigned int churn_hz;
+    unsigned int advertise_hz;
+    unsigned int advertise_repeat;
+    uint64_t link_rate;
+    uint64_t link_buffer;
+    unsigned int mtu;
+    int echo_device;
+} config = { 8, 1, 2, 20, 0, 100, 0, 0, 1, 0, 512, 23, -1 };
+
+static sd_bus* bus = NULL;
+static sd_event* event = NULL;
+static int discovering = 0;
+static mock_device* devices = NULL;
+static mock_service* services = NULL;
+static mock_char* characteristics = NULL;
+static mock_char** notifying = NULL;
+static int notifying_size = 0;
+static uint64_t notify_start = 0;
+static uint64_t notify_sent = 0;
+static uint64_t churn_start = 0;
+static uint64_t churn_done = 0;
+static int churn_removed = -1;
+static uint64_t advertise_start = 0;
+static uint64_t advertise_sent = 0;
+static uint64_t link_level = 0;
+static uint64_t link_drained_at = 0;
+static int link_full = 0;
+
+static uint64_t
+_now_usec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+_device_path(int device, char* path)
+{
+    const mock_device* dev = &devices[device];
+
+    snprintf(path, MOCK_PATH_MAX, MOCK_DEVICE_PATH_FMT, (dev->generation >> 8) & 0xff, dev->generation & 0xff,
+             (device >> 16) & 0xff, (device >> 8) & 0xff, device & 0xff);
+}
+
+static void
+_service_path(int device, int service, char* path)
+{
+    size_t n;
+
+    _device_path(device, path);
+    n = strlen(path);
+    snprintf(path + n, MOCK_PATH_MAX - n, "/service%04x", service & 0xffff);
+}
+
+static void
+_char_path(const mock_char* ch, char* path)
+{
+    size_t n;
+
+    _service_path(ch->device, ch->service, path);
+    n = strlen(path);
+    snprintf(path + n, MOCK_PATH_MAX - n, "/char%04x", ch->index & 0xffff);
+}
+
+static void
+_device_address(int device)
+{
+    mock_device* dev = &devices[device];
+
+    snprintf(dev->address, sizeof(dev->address), MOCK_ADDRESS_FMT, (dev->generation >> 8) & 0xff,
+             dev->generation & 0xff, (device >> 16) & 0xff, (device >> 8) & 0xff, device & 0xff);
+}
+
+/**
+ * Map an object path to it's device, service and characteristic indexes
+ *
+ * @return depth of the path, 1 for a device, 2 for a service, 3 for a characteristic, 0 if the path
+ * is not a mock object
+ */
+static int
+_parse_path(const char* path, int* device, int* service, int* characteristic)
+{
+    unsigned int g1, g0, a, b, c, index;
+    int n = 0;
+
+    if (sscanf(path, MOCK_ADAPTER_PATH "/dev_%2X_B1_%2X_%2X_%2X_%2X%n", &g1, &g0, &a, &b, &c, &n) != 5 || n == 0) {
+        return 0;
+    }
+    *device = (int) ((a << 16) | (b << 8) | c);
+    if (*device >= config.devices || !devices[*device].present ||
+        devices[*device].generation != ((g1 << 8) | g0)) {
+        return 0;
+    }
+    path += n;
+    if (*path == '\0') {
+        return 1;
+    }
+
+    n = 0;
+    if (sscanf(path, "/service%4x%n", &index, &n) != 1 || n == 0 || index >= (unsigned int) config.services) {
+        return 0;
+    }
+    *service = (int) index;
+    path += n;
+    if (*path == '\0') {
+        return 2;
+    }
+
+    n = 0;
+    if (sscanf(path, "/char%4x%n", &index, &n) != 1 || n == 0 ||
+        index >= (unsigned int) config.characteristics || path[n] != '\0') {
+        return 0;
+    }
+    *characteristic = (int) index;
+    return 3;
+}
+
+static mock_char*
+_get_char(int device, int service, int characteristic)
+{
+    return &characteristics[((size_t) device * config.services + service) * config.characteristics + characteristic];
+}
+
+static int
+_reply_due(sd_event_source* source, uint64_t usec, void* userdata)
+{
+    sd_bus_message* reply = userdata;
+
+    sd_bus_send(NULL, reply, NULL);
+    sd_bus_message_unref(reply);
+    sd_event_source_unref(source);
+    return 0;
+}
+
+/**
+ * Send a reply now or after the configured latency, takes the reference of reply
+ */
+static int
+_send_reply(sd_bus_message* reply)
+{
+    int r;
+
+    if (config.latency_usec == 0) {
+        r = sd_bus_send(NULL, reply, NULL);
+        sd_bus_message_unref(reply);
+        return r;
+    }
+
+    r = sd_event_add_time_relative(event, NULL, CLOCK_MONOTONIC, config.latency_usec, 1, _reply_due, reply);
+    if (r < 0) {
+        sd_bus_message_unref(reply);
+        return r;
+    }
+
+    // the call is handled, the reply follows from the timer
+    return 1;
+}
+
+static int
+_reply_empty(sd_bus_message* call)
+{
+    int r;
+    sd_bus_message* reply = NULL;
+
+    r = sd_bus_message_new_method_return(call, &reply);
+    if (r < 0) {
+        return r;
+    }
+
+    return _send_reply(reply);
+}
+
+static int
+_method_set_discovering(sd_bus_message* call, void* userdata, sd_bus_error* error)
+{
+    discovering = sd_bus_message_is_method_call(call, NULL, "StartDiscovery");
+    if (discovering) {
+        advertise_start = _now_usec();
+        advertise_sent = 0;
+    }
+    return _reply_empty(call);
+}
+
+static int
+_method_set_discovery_filter(sd_bus_message* call, void* userdata, sd_bus_error* error)
+{
+    // advertisements are always reported as if Transport=le and DuplicateData=true were set
+    return _reply_empty(call);
+}
+
+static int
+_get_adapter_property(sd_bus* bus,
+                      const char* path,
+                      const char* interface,
+                      const char* property,
+                      sd_bus_message* reply,
+                      void* userdata,
+                      sd_bus_error* error)
+{
+    if (strcmp(property, "Address") == 0) {
+        return sd_bus_message_append(reply, "s", "00:B1:FF:00:00:00");
+    } else if (strcmp(property, "Powered") == 0) {
+        return sd_bus_message_append(reply, "b", 1);
+    }
+    return sd_bus_message_append(reply, "b", discovering);
+}
+
+static int
+_find_adapter(sd_bus* bus, const char* path, const char* interface, void* userdata, void** found, sd_bus_error* error)
+{
+    // sd-bus does not allow mixing object and fallback vtables on one path
+    if (strcmp(path, MOCK_ADAPTER_PATH) != 0) {
+        return 0;
+    }
+    *found = NULL;
+    return 1;
+}
+
+static const sd_bus_vtable adapter_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_PROPERTY("Address", "s", _get_adapter_property, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+    SD_BUS_PROPERTY("Powered", "b", _get_adapter_property, 0, 0),
+    SD_BUS_PROPERTY("Discovering", "b", _get_adapter_property, 0, 0),
+    SD_BUS_METHOD("StartDiscovery", "", "", _method_set_discovering, 0),
+    SD_BUS_METHOD("StopDiscovery", "", "", _method_set_discovering, 0),
+    SD_BUS_METHOD("SetDiscoveryFilter", "a{sv}", "", _method_set_discovery_filter, 0),
+    SD_BUS_VTABLE_END
+};
+
+static int
+_find_device(sd_bus* bus, const char* path, const char* interface, void* userdata, void** found, sd_bus_error* error)
+{
+    int device, service, characteristic;
+
+    if (_parse_path(path, &device, &service, &characteristic) != 1) {
+        return 0;
+    }
+    *found = &devices[device];
+    return 1;
+}
+
+static int
+_get_device_property(sd_bus* bus,
+                     const char* path,
+                     const char* interface,
+                     const char* property,
+                     sd_bus_message* reply,
+                     void* userdata,
+                     sd_bus_error* error)
+{
+    int r;
+    mock_device* dev = userdata;
+    uint8_t service_data[] = { 0x10, (uint8_t) dev->index, 0x00, 0x01 };
+
+    if (strcmp(property, "Address") == 0) {
+        return sd_bus_message_append(reply, "s", dev->address);
+    } else if (strcmp(property, "Name") == 0 || strcmp(property, "Alias") == 0) {
+        return sd_bus_message_append(reply, "s", dev->name);
+    } else if (strcmp(property, "Adapter") == 0) {
+        return sd_bus_message_append(reply, "o", MOCK_ADAPTER_PATH);
+    } else if (strcmp(property, "Paired") == 0) {
+        return sd_bus_message_append(reply, "b", dev->paired);
+    } else if (strcmp(property, "Trusted") == 0) {
+        return sd_bus_message_append(reply, "b", 1);
+    } else if (strcmp(property, "Connected") == 0 || strcmp(property, "ServicesResolved") == 0) {
+        return sd_bus_message_append(reply, "b", dev->connected);
+    } else if (strcmp(property, "RSSI") == 0) {
+        return sd_bus_message_append(reply, "n", dev->rssi);
+    } else if (strcmp(property, "TxPower") == 0) {
+        return sd_bus_message_append(reply, "n", (int16_t) 4);
+    } else if (strcmp(property, "Appearance") == 0) {
+        return sd_bus_message_append(reply, "q", (uint16_t) 0x0540);
+    } else if (strcmp(property, "ServiceData") == 0) {
+        r = sd_bus_message_open_container(reply, 'a', "{sv}");
+        if (r < 0)
+            return r;
+        r = sd_bus_message_open_container(reply, 'e', "sv");
+        if (r < 0)
+            return r;
+        r = sd_bus_message_append(reply, "s", MOCK_SERVICE_DATA_UUID);
+        if (r < 0)
+            return r;
+        r = sd_bus_message_open_container(reply, 'v', "ay");
+        if (r < 0)
+            return r;
+        r = sd_bus_message_append_array(reply, 'y', service_data, sizeof(service_data));
+        if (r < 0)
+            return r;
+        r = sd_bus_message_close_container(reply);
+        if (r < 0)
+            return r;
+        r = sd_bus_message_close_container(reply);
+        if (r < 0)
+            return r;
+        // devices often carry more than one record, littleb keeps the first
+        r = sd_bus_message_append(reply, "{sv}", MOCK_SECOND_SERVICE_DATA_UUID, "ay", 1, 0x00);
+        if (r < 0)
+            return r;
+        return sd_bus_message_close_container(reply);
+    }
+
+    // ManufacturerData
+    r = sd_bus_message_open_container(reply, 'a', "{qv}");
+    if (r < 0)
+        return r;
+    r = sd_bus_message_open_container(reply, 'e', "qv");
+    if (r < 0)
+        return r;
+    r = sd_bus_message_append(reply, "q", (uint16_t) 0x0059);
+    if (r < 0)
+        return r;
+    r = sd_bus_message_open_container(reply, 'v', "ay");
+    if (r < 0)
+        return r;
+    r = sd_bus_message_append_array(reply, 'y', dev->manufacturer_data, sizeof(dev->manufacturer_data));
+    if (r < 0)
+        return r;
+    r = sd_bus_message_close_container(reply);
+    if (r < 0)
+        return r;
+    r = sd_bus_message_close_container(reply);
+    if (r < 0)
+        return r;
+    r = sd_bus_message_append(reply, "{qv}", (uint16_t) 0x004c, "ay", 2, 0x02, 0x15);
+    if (r < 0)
+        return r;
+    return sd_bus_message_close_container(reply);
+}
+
+static int
+_method_device(sd_bus_message* call, void* userdata, sd_bus_error* error)
+{
+    mock_device* dev = userdata;
+    const char* member = sd_bus_message_get_member(call);
+    const char* property = "Connected";
+    char path[MOCK_PATH_MAX];
+
+    if (strcmp(member, "Connect") == 0) {
+        dev->connected = 1;
+    } else if (strcmp(member, "Disconnect") == 0) {
+        dev->connected = 0;
+    } else {
+        dev->paired = strcmp(member, "Pair") == 0;
+        property = "Paired";
+    }
+
+    _device_path(dev->index, path);
+    sd_bus_emit_properties_changed(bus, path, "org.bluez.Device1", property, NULL);
+    return _reply_empty(call);
+}
+
+static const sd_bus_vtable device_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_PROPERTY("Address", "s", _get_device_property, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+    SD_BUS_PROPERTY("Name", "s", _get_device_property, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+    SD_BUS_PROPERTY("Alias", "s", _get_device_property, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+    SD_BUS_PROPERTY("Adapter", "o", _get_device_property, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+    SD_BUS_PROPERTY("Paired", "b", _get_device_property, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+    SD_BUS_PROPERTY("Trusted", "b", _get_device_property, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+    SD_BUS_PROPERTY("Connected", "b", _get_device_property, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+    SD_BUS_PROPERTY("ServicesResolved", "b", _get_device_property, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+    SD_BUS_PROPERTY("RSSI", "n", _get_device_property, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+    SD_BUS_PROPERTY("TxPower", "n", _get_device_property, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+    SD_BUS_PROPERTY("Appearance", "q", _get_device_property, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+    SD_BUS_PROPERTY("ManufacturerData", "a{qv}", _get_device_property, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+    SD_BUS_PROPERTY("ServiceData", "a{sv}", _get_device_property, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+    SD_BUS_METHOD("Connect", "", "", _method_device, 0),
+    SD_BUS_METHOD("Disconnect", "", "", _method_device, 0),
+    SD_BUS_METHOD("Pair", "", "", _method_device, 0),
+    SD_BUS_METHOD("CancelPairing", "", "", _method_device, 0),
+    SD_BUS_VTABLE_END
+};
+
+static int
+_find_service(sd_bus* bus, const char* path, const char* interface, void* userdata, void** found, sd_bus_error* error)
+{
+    int device, service, characteristic;
+
+    if (_parse_path(path, &device, &service, &characteristic) != 2) {
+        return 0;
+    }
+    *found = &services[(size_t) device * config.services + service];
+    return 1;
+}
+
+static int
+_get_service_property(sd_bus* bus,
+                      const char* path,
+                      const char* interface,
+                      const char* property,
+                      sd_bus_message* reply,
+                      void* userdata,
+                      sd_bus_error* error)
+{
+    mock_service* service = userdata;
+    char buffer[MOCK_PATH_MAX];
+
+    if (strcmp(property, "UUID") == 0) {
+        snprintf(buffer, sizeof(buffer), MOCK_UUID_FMT, (service->index << 8) | 0x01);
+        return sd_bus_message_append(reply, "s", buffer);
+    } else if (strcmp(property, "Primary") == 0) {
+        return sd_bus_message_append(reply, "b", service->index == 0);
+    }
+    _device_path(service->device, buffer);
+    return sd_bus_message_append(reply, "o", buffer);
+}
+
+static const sd_bus_vtable service_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_PROPERTY("UUID", "s", _get_service_property, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+    SD_BUS_PROPERTY("Primary", "b", _get_service_property, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+    SD_BUS_PROPERTY("Device", "o", _get_service_property, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+    SD_BUS_VTABLE_END
+};
+
+static int
+_find_char(sd_bus* bus, const char* path, const char* interface, void* userdata, void** found, sd_bus_error* error)
+{
+    int device, service, characteristic;
+
+    if (_parse_path(path, &device, &service, &characteristic) != 3) {
+        return 0;
+    }
+    *found = _get_char(device, service, characteristic);
+    return 1;
+}
+
+static int
+_append_value_changed(sd_bus_message* m, const mock_char* ch)
+{
+    int r;
+
+    r = sd_bus_message_append(m, "s", "org.bluez.GattCharacteristic1");
+    if (r < 0)
+        return r;
+    r = sd_bus_message_open_container(m, 'a', "{sv}");
+    if (r < 0)
+        return r;
+    r = sd_bus_message_open_container(m, 'e', "sv");
+    if (r < 0)
+        return r;
+    r = sd_bus_message_append(m, "s", "Value");
+    if (r < 0)
+        return r;
+    r = sd_bus_message_open_container(m, 'v', "ay");
+    if (r < 0)
+        return r;
+    r = sd_bus_message_append_array(m, 'y', ch->value, ch->value_size);
+    if (r < 0)
+        return r;
+    r = sd_bus_message_close_container(m);
+    if (r < 0)
+        return r;
+    r = sd_bus_message_close_container(m);
+    if (r < 0)
+        return r;
+    r = sd_bus_message_close_container(m);
+    if (r < 0)
+        return r;
+    return sd_bus_message_append(m, "as", 0);
+}
+
+static int
+_emit_value_changed(const mock_char* ch)
+{
+    int r;
+    sd_bus_message* m = NULL;
+    char path[MOCK_PATH_MAX];
+
+    _char_path(ch, path);
+    r = sd_bus_message_new_signal(bus, &m, path, "org.freedesktop.DBus.Properties", "PropertiesChanged");
+    if (r < 0)
+        return r;
+
+    r = _append_value_changed(m, ch);
+    if (r >= 0) {
+        r = sd_bus_send(bus, m, NULL);
+    }
+
+    sd_bus_message_unref(m);
+    return r;
+}
+
+static int
+_get_char_property(sd_bus* bus,
+                   const char* path,
+                   const char* interface,
+                   const char* property,
+                   sd_bus_message* reply,
+                   void* userdata,
+                   sd_bus_error* error)
+{
+    mock_char* ch = userdata;
+    char buffer[MOCK_PATH_MAX];
+
+    if (strcmp(property, "UUID") == 0) {
+        snprintf(buffer, sizeof(buffer), MOCK_UUID_FMT, (ch->service << 8) | (ch->index + 2));
+        return sd_bus_message_append(reply, "s", buffer);
+    } else if (strcmp(property, "Service") == 0) {
+        _service_path(ch->device, ch->service, buffer);
+        return sd_bus_message_append(reply, "o", buffer);
+    } else if (strcmp(property, "Value") == 0) {
+        return sd_bus_message_append_array(reply, 'y', ch->value, ch->value_size);
+    } else if (strcmp(property, "Notifying") == 0) {
+        return sd_bus_message_append(reply, "b", ch->notifying);
+    } else if (strcmp(property, "MTU") == 0) {
+        return sd_bus_message_append(reply, "q", (uint16_t) config.mtu);
+    }
+    return sd_bus_message_append(reply, "as", 4, "read", "write", "write-without-response", "notify");
+}
+
+static int
+_method_read_value(sd_bus_message* call, void* userdata, sd_bus_error* error)
+{
+    int r;
+    mock_char* ch = userdata;
+    sd_bus_message* reply = NULL;
+
+    r = sd_bus_message_new_method_return(call, &reply);
+    if (r < 0)
+        return r;
+
+    r = sd_bus_message_append_array(reply, 'y', ch->value, ch->value_size);
+    if (r < 0) {
+        sd_bus_message_unref(reply);
+        return r;
+    }
+
+    return _send_reply(reply);
+}
+
+/*
+ * Check whether the WriteValue options ask for a write without response
+ */
+static int
+_is_command_write(sd_bus_message* call)
+{
+    int r, command = 0;
+    const char *key, *type;
+
+    r = sd_bus_message_enter_container(call, 'a', "{sv}");
+    if (r < 0)
+        return r;
+
+    while ((r = sd_bus_message_enter_container(call, 'e', "sv")) > 0) {
+        r = sd_bus_message_read_basic(call, 's', &key);
+        if (r >= 0 && strcmp(key, "type") == 0) {
+            r = sd_bus_message_read(call, "v", "s", &type);
+            command = r >= 0 && strcmp(type, "command") == 0;
+        } else if (r >= 0) {
+            r = sd_bus_message_skip(call, "v");
+        }
+        if (r >= 0)
+            r = sd_bus_message_exit_container(call);
+        if (r < 0)
+            return r;
+    }
+    if (r < 0)
+        return r;
+
+    r = sd_bus_message_exit_container(call);
+    return r < 0 ? r : command;
+}
+
+/*
+ * Queue a write without response on the simulated link, which drains at --link-rate. Once full it
+ * refuses every write until half of it drained, like a controller returning buffer credits in
+ * batches, so a write is never accepted ahead of an older one that was refused.
+ */
+static int
+_link_accept(size_t size)
+{
+    uint64_t now = _now_usec(), drained;
+
+    if (config.link_rate == 0)
+        return 1;
+
+    drained = (now - link_drained_at) * config.link_rate / 1000000;
+    if (drained >= link_level) {
+        link_level = 0;
+        link_drained_at = now;
+    } else {
+        link_level -= drained;
+        link_drained_at += drained * 1000000 / config.link_rate;
+    }
+
+    if (link_full && link_level > config.link_buffer / 2)
+        return 0;
+    link_full = 0;
+
+    if (link_level + size > config.link_buffer) {
+        link_full = 1;
+        return 0;
+    }
+
+    link_level += size;
+    return 1;
+}
+
+/**
+ * Notify a write echoed on peer, with the written value instead of the one peer holds
+ */
+static int
+_echo_write(const mock_char* peer, const void* value, size_t size)
+{
+    mock_char echo;
+
+    if (!peer->notifying) {
+        return 0;
+    }
+
+    echo = *peer;
+    echo.value = (uint8_t*) value;
+    echo.value_size = size;
+    return _emit_value_changed(&echo);
+}
+
+static int
+_method_write_value(sd_bus_message* call, void* userdata, sd_bus_error* error)
+{
+    int r, command;
+    mock_char* ch = userdata;
+    const void* value = NULL;
+    size_t size = 0;
+    uint8_t* new_value;
+    sd_bus_message* refusal = NULL;
+
+    r = sd_bus_message_read_array(call, 'y', &value, &size);
+    if (r < 0)
+        return r;
+
+    command = _is_command_write(call);
+    if (command < 0)
+        return command;
+
+    // a command has to fit one ATT PDU, a request is sent as a long write
+    if (size > (command ? config.mtu - 3 : 512)) {
+        r = sd_bus_message_new_method_errorf(call, &refusal, "org.bluez.Error.InvalidValueLength",
+                                             "Invalid value length");
+        return r < 0 ? r : _send_reply(refusal);
+    }
+
+    // like BlueZ when the controller buffers are full, replies keep their order under --latency-us
+    if (command && !_link_accept(size)) {
+        r = sd_bus_message_new_method_errorf(call, &refusal, "org.bluez.Error.Failed",
+                                             "Failed to initiate write");
+        return r < 0 ? r : _send_reply(refusal);
+    }
+
+    if (size > ch->value_size) {
+        new_value = realloc(ch->value, size);
+        if (new_value == NULL)
+            return -ENOMEM;
+        ch->value = new_value;
+    }
+    if (size > 0) {
+        memcpy(ch->value, value, size);
+    }
+    ch->value_size = size;
+
+    // a UART peripheral looping it's RX characteristic back to TX
+    if (ch->device == config.echo_device && ch->index == 0 && config.characteristics > 1) {
+        r = _echo_write(_get_char(ch->device, ch->service, 1), value, size);
+        if (r < 0)
+            return r;
+    }
+
+    // write without response does not expect a reply
+    if (!sd_bus_message_get_expect_reply(call)) {
+        return 1;
+    }
+    return _reply_empty(call);
+}
+
+static int
+_method_notify(sd_bus_message* call, void* userdata, sd_bus_error* error)
+{
+    int i;
+    mock_char* ch = userdata;
+    mock_char** new_notifying;
+    int start = sd_bus_message_is_method_call(call, NULL, "StartNotify");
+
+    if (start && !ch->notifying) {
+        new_notifying = realloc(notifying, (notifying_size + 1) * sizeof(mock_char*));
+        if (new_notifying == NULL)
+            return -ENOMEM;
+        notifying = new_notifying;
+        notifying[notifying_size++] = ch;
+    } else if (!start && ch->notifying) {
+        for (i = 0; i < notifying_size; i++) {
+            if (notifying[i] == ch) {
+                notifying[i] = notifying[--notifying_size];
+                break;
+            }
+        }
+    }
+    ch->notifying = start;
+
+    return _reply_empty(call);
+}
+
+static const sd_bus_vtable char_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_PROPERTY("UUID", "s", _get_char_property, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+    SD_BUS_PROPERTY("Service", "o", _get_char_property, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+    SD_BUS_PROPERTY("Value", "ay", _get_char_property, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+    SD_BUS_PROPERTY("Notifying", "b", _get_char_property, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+    SD_BUS_PROPERTY("Flags", "as", _get_char_property, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+    SD_BUS_PROPERTY("MTU", "q", _get_char_property, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+    SD_BUS_METHOD("ReadValue", "a{sv}", "ay", _method_read_value, 0),
+    SD_BUS_METHOD("WriteValue", "aya{sv}", "", _method_write_value, 0),
+    SD_BUS_METHOD("StartNotify", "", "", _method_notify, 0),
+    SD_BUS_METHOD("StopNotify", "", "", _method_notify, 0),
+    SD_BUS_VTABLE_END
+};
+
+static int
+_strv_push(char*** nodes, size_t* size, size_t* capacity, const char* path)
+{
+    char** new_nodes;
+
+    if (*size + 2 > *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        new_nodes = realloc(*nodes, *capacity * sizeof(char*));
+        if (new_nodes == NULL)
+            return -ENOMEM;
+        *nodes = new_nodes;
+    }
+
+    (*nodes)[*size] = strdup(path);
+    if ((*nodes)[*size] == NULL)
+        return -ENOMEM;
+    (*size)++;
+    (*nodes)[*size] = NULL;
+    return 0;
+}
+
+/**
+ * List the mock objects below prefix, sd-bus filters the result by prefix as well so only the
+ * device and service subtrees are narrowed down to keep Introspect cheap
+ */
+static int
+_enumerate_objects(sd_bus* bus, const char* prefix, void* userdata, char*** nodes_ret, sd_bus_error* error)
+{
+    int r = 0, depth, device = 0, service = 0, characteristic = 0;
+    int first_device = 0, last_device = config.devices;
+    int first_service = 0, last_service = config.services;
+    int d, s, c;
+    char** nodes = NULL;
+    size_t size = 0, capacity = 0;
+    char path[MOCK_PATH_MAX];
+
+    depth = _parse_path(prefix, &device, &service, &characteristic);
+    if (depth == 3) {
+        *nodes_ret = NULL;
+        return 0;
+    } else if (depth >= 1) {
+        first_device = device;
+        last_device = device + 1;
+        if (depth == 2) {
+            first_service = service;
+            last_service = service + 1;
+        }
+    }
+
+    for (d = first_device; d < last_device && r >= 0; d++) {
+        if (!devices[d].present) {
+            continue;
+        }
+        if (depth == 0) {
+            _device_path(d, path);
+            r = _strv_push(&nodes, &size, &capacity, path);
+        }
+        for (s = first_service; s < last_service && r >= 0; s++) {
+            if (depth <= 1) {
+                _service_path(d, s, path);
+                r = _strv_push(&nodes, &size, &capacity, path);
+            }
+            for (c = 0; c < config.characteristics && r >= 0; c++) {
+                _char_path(_get_char(d, s, c), path);
+                r = _strv_push(&nodes, &size, &capacity, path);
+            }
+        }
+    }
+
+    if (r < 0) {
+        while (size > 0)
+            free(nodes[--size]);
+        free(nodes);
+        return r;
+    }
+
+    *nodes_ret = nodes;
+    return 0;
+}
+
+static int
+_notify_tick(sd_event_source* source, uint64_t usec, void* userdata)
+{
+    int i;
+    uint64_t due, now, period = 1000000 / config.notify_hz;
+    mock_char* ch;
+
+    due = (usec - notify_start) * config.notify_hz / 1000000;
+    for (; notify_sent < due; notify_sent++) {
+        now = _now_usec();
+        for (i = 0; i < notifying_size; i++) {
+            ch = notifying[i];
+            if (ch->device == config.echo_device) {
+                continue;
+            }
+            if (ch->value_size >= sizeof(now)) {
+                memcpy(ch->value, &now, sizeof(now));
+            } else if (ch->value_size > 0) {
+                ch->value[0]++;
+            }
+            _emit_value_changed(ch);
+        }
+    }
+
+    if (period < 1000) {
+        period = 1000;
+    }
+    sd_event_source_set_time(source, usec + period);
+    return sd_event_source_set_enabled(source, SD_EVENT_ONESHOT);
+}
+
+static void
+_set_device_present(int device, int present)
+{
+    int s, c;
+    char path[MOCK_PATH_MAX];
+
+    // objects have to be findable while their InterfacesAdded is built
+    if (present) {
+        devices[device].present = 1;
+        _device_path(device, path);
+        sd_bus_emit_interfaces_added(bus, path, "org.bluez.Device1", NULL);
+    }
+
+    for (s = 0; s < config.services; s++) {
+        _service_path(device, s, path);
+        if (present) {
+            sd_bus_emit_interfaces_added(bus, path, "org.bluez.GattService1", NULL);
+        }
+        for (c = 0; c < config.characteristics; c++) {
+            _char_path(_get_char(device, s, c), path);
+            if (present) {
+                sd_bus_emit_interfaces_added(bus, path, "org.bluez.GattCharacteristic1", NULL);
+            } else {
+                sd_bus_emit_interfaces_removed(bus, path, "org.bluez.GattCharacteristic1", NULL);
+            }
+        }
+        if (!present) {
+            _service_path(device, s, path);
+            sd_bus_emit_interfaces_removed(bus, path, "org.bluez.GattService1", NULL);
+        }
+    }
+
+    if (!present) {
+        _device_path(device, path);
+        sd_bus_emit_interfaces_removed(bus, path, "org.bluez.Device1", NULL);
+        devices[device].present = 0;
+    }
+}
+
+static int
+_churn_tick(sd_event_source* source, uint64_t usec, void* userdata)
+{
+    int device;
+    uint64_t due, period = 1000000 / config.churn_hz;
+
+    // every step replaces one device, the previously removed one comes back
+    due = (usec - churn_start) * config.churn_hz / 1000000;
+    for (; churn_done < due; churn_done++) {
+        device = 1 + (int) (churn_done % (config.devices - 1));
+        if (churn_removed >= 0) {
+            _set_device_present(churn_removed, 1);
+        }
+        _set_device_present(device, 0);
+        churn_removed = device;
+    }
+
+    if (period < 1000) {
+        period = 1000;
+    }
+    sd_event_source_set_time(source, usec + period);
+    return sd_event_source_set_enabled(source, SD_EVENT_ONESHOT);
+}
+
+static int
+_method_set_device_present(sd_bus_message* call, void* userdata, sd_bus_error* error)
+{
+    int r, present;
+    uint32_t device;
+
+    r = sd_bus_message_read(call, "ub", &device, &present);
+    if (r < 0) {
+        return r;
+    }
+    if (device >= (uint32_t) config.devices) {
+        return sd_bus_error_set(error, "org.littleb.Mock.Error.InvalidArguments", "No such device");
+    }
+
+    if (devices[device].present != present) {
+        _set_device_present((int) device, present);
+    }
+    // the signals are queued before the reply, the caller sees the change once the call returns
+    return sd_bus_reply_method_return(call, "");
+}
+
+static int
+_method_replace_device(sd_bus_message* call, void* userdata, sd_bus_error* error)
+{
+    int r;
+    uint32_t device;
+
+    r = sd_bus_message_read(call, "u", &device);
+    if (r < 0) {
+        return r;
+    }
+    if (device >= (uint32_t) config.devices) {
+        return sd_bus_error_set(error, "org.littleb.Mock.Error.InvalidArguments", "No such device");
+    }
+
+    if (devices[device].present) {
+        _set_device_present((int) device, 0);
+    }
+    devices[device].generation = (devices[device].generation + 1) & 0xffff;
+    _device_address((int) device);
+    _set_device_present((int) device, 1);
+    return sd_bus_reply_method_return(call, "");
+}
+
+static const sd_bus_vtable control_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_METHOD("SetDevicePresent", "ub", "", _method_set_device_present, 0),
+    SD_BUS_METHOD("ReplaceDevice", "u", "", _method_replace_device, 0),
+    SD_BUS_VTABLE_END
+};
+
+static int
+_advertise_tick(sd_event_source* source, uint64_t usec, void* userdata)
+{
+    int device;
+    uint64_t due, now, period = 1000000 / config.advertise_hz;
+    mock_device* dev;
+    char path[MOCK_PATH_MAX];
+
+    now = _now_usec();
+    due = advertise_sent;
+    if (discovering && now > advertise_start) {
+        due = (now - advertise_start) * config.advertise_hz / 1000000;
+    }
+    for (; advertise_sent < due; advertise_sent++) {
+        device = (int) (advertise_sent % config.devices);
+        dev = &devices[device];
+        if (!dev->present) {
+            continue;
+        }
+
+        if (dev->advertised % config.advertise_repeat == 0) {
+            now = _now_usec();
+            memcpy(dev->manufacturer_data, &now, sizeof(now));
+        }
+        dev->advertised++;
+        dev->rssi = -40 - (int16_t)((device + dev->advertised) % 50);
+
+        _device_path(device, path);
+        sd_bus_emit_properties_changed(bus, path, "org.bluez.Device1", "RSSI", "ManufacturerData",
+                                       "ServiceData", NULL);
+    }
+
+    if (period < 1000) {
+        period = 1000;
+    }
+    sd_event_source_set_time(source, usec + period);
+    return sd_event_source_set_enabled(source, SD_EVENT_ONESHOT);
+}
+
+static int
+_setup_objects()
+{
+    int d, s, c;
+    size_t services_size = (size_t) config.devices * config.services;
+    size_t chars_size = services_size * config.characteristics;
+    mock_char* ch;
+
+    devices = calloc(config.devices, sizeof(mock_device));
+    services = calloc(services_size ? services_size : 1, sizeof(mock_service));
+    characteristics = calloc(chars_size ? chars_size : 1, sizeof(mock_char));
+    if (devices == NULL || services == NULL || characteristics == NULL) {
+        return -ENOMEM;
+    }
+
+    for (d = 0; d < config.devices; d++) {
+        devices[d].index = d;
+        devices[d].present = 1;
+        _device_address(d);
+        snprintf(devices[d].name, sizeof(devices[d].name), "MOCK%d", d);
+        devices[d].rssi = -40 - (d % 50);
+        memset(devices[d].manufacturer_data, 0, sizeof(devices[d].manufacturer_data));
+        devices[d].manufacturer_data[8] = (uint8_t) d;
+        for (s = 0; s < config.services; s++) {
+            services[(size_t) d * config.services + s].device = d;
+            services[(size_t) d * config.services + s].index = s;
+            for (c = 0; c < config.characteristics; c++) {
+                ch = _get_char(d, s, c);
+                ch->device = d;
+                ch->service = s;
+                ch->index = c;
+                ch->value_size = config.value_size;
+                ch->value = calloc(1, config.value_size ? config.value_size : 1);
+                if (ch->value == NULL) {
+                    return -ENOMEM;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void
+_usage(const char* name)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --devices N          Device1 objects (default %d)\n"
+            "  --services N         GattService1 objects per device (default %d)\n"
+            "  --characteristics N  GattCharacteristic1 objects per service (default %d)\n"
+            "  --value-size N       initial characteristic value size in bytes (default %zu)\n"
+            "  --latency-us N       delay of every BlueZ method reply (default %" PRIu64 ")\n"
+            "  --notify-hz N        notifications per second per notifying characteristic (default %u)\n"
+            "  --churn-hz N         devices removed and added back per second (default %u)\n"
+            "  --advertise-hz N     advertisements per second over all devices while discovering (default %u)\n"
+            "  --advertise-repeat N advertisements of a device sharing the same data (default %u)\n"
+            "  --link-rate N        bytes per second write without response drains at, 0 for no limit (default %" PRIu64 ")\n"
+            "  --link-buffer N      bytes of write without response queued before refusing (default %" PRIu64 ")\n"
+            "  --mtu N              ATT MTU of every characteristic (default %u)\n"
+            "  --echo-device N      device notifying the values written to a service's first characteristic\n"
+            "                       on it's second instead of at --notify-hz (default none)\n",
+            name, config.devices, config.services, config.characteristics, config.value_size,
+            config.latency_usec, config.notify_hz, config.churn_hz, config.advertise_hz,
+            config.advertise_repeat, config.link_rate, config.link_buffer, config.mtu);
+}
+
+int
+main(int argc, char* argv[])
+{
+    int r, opt;
+    sd_event_source* notify_source = NULL;
+    sd_event_source* churn_source = NULL;
+    sd_event_source* advertise_source = NULL;
+    static const struct option options[] = {
+        { "devices", required_argument, NULL, 'd' },
+        { "services", required_argument, NULL, 's' },
+        { "characteristics", required_argument, NULL, 'c' },
+        { "value-size", required_argument, NULL, 'v' },
+        { "latency-us", required_argument, NULL, 'l' },
+        { "notify-hz", required_argument, NULL, 'n' },
+        { "churn-hz", required_argument, NULL, 'C' },
+        { "advertise-hz", required_argument, NULL, 'a' },
+        { "advertise-repeat", required_argument, NULL, 'A' },
+        { "link-rate", required_argument, NULL, 'r' },
+        { "link-buffer", required_argument, NULL, 'b' },
+        { "mtu", required_argument, NULL, 'm' },
+        { "echo-device", required_argument, NULL, 'e' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        switch (opt) {
+            case 'd':
+                config.devices = atoi(optarg);
+                break;
+            case 's':
+                config.services = atoi(optarg);
+                break;
+            case 'c':
+                config.characteristics = atoi(optarg);
+                break;
+            case 'v':
+                config.value_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'l':
+                config.latency_usec = strtoull(optarg, NULL, 10);
+                break;
+            case 'n':
+                config.notify_hz = strtoul(optarg, NULL, 10);
+                break;
+            case 'C':
+                config.churn_hz = strtoul(optarg, NULL, 10);
+                break;
+            case 'a':
+                config.advertise_hz = strtoul(optarg, NULL, 10);
+                break;
+            case 'A':
+                config.advertise_repeat = strtoul(optarg, NULL, 10);
+                if (config.advertise_repeat == 0)
+                    config.advertise_repeat = 1;
+                break;
+            case 'r':
+                config.link_rate = strtoull(optarg, NULL, 10);
+                break;
+            case 'b':
+                config.link_buffer = strtoull(optarg, NULL, 10);
+                break;
+            case 'm':
+                config.mtu = strtoul(optarg, NULL, 10);
+                if (config.mtu < 23)
+                    config.mtu = 23;
+                break;
+            case 'e':
+                config.echo_device = atoi(optarg);
+                break;
+            default:
+                _usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    // indexes are encoded in the last 3 address bytes and 4 hex digits of the object paths
+    if (config.devices < 0 || config.devices > 0xffffff || config.services < 0 || config.services > 0xff ||
+        config.characteristics < 0 || config.characteristics > 0xfd) {
+        fprintf(stderr, "mock_bluez: object counts out of range\n");
+        return 1;
+    }
+
+    r = _setup_objects();
+    if (r < 0) {
+        fprintf(stderr, "mock_bluez: failed to allocate objects: %s\n", strerror(-r));
+        return 1;
+    }
+
+    r = sd_event_default(&event);
+    if (r < 0) {
+        fprintf(stderr, "mock_bluez: failed to get event loop: %s\n", strerror(-r));
+        return 1;
+    }
+
+    r = sd_bus_open_system(&bus);
+    if (r < 0) {
+        fprintf(stderr, "mock_bluez: failed to connect to system bus: %s\n", strerror(-r));
+        return 1;
+    }
+
+    r = sd_bus_add_object_manager(bus, NULL, "/");
+    if (r >= 0)
+        r = sd_bus_add_fallback_vtable(bus, NULL, MOCK_ADAPTER_PATH, "org.bluez.Adapter1", adapter_vtable,
+                                       _find_adapter, NULL);
+    if (r >= 0)
+        r = sd_bus_add_fallback_vtable(bus, NULL, MOCK_ADAPTER_PATH, "org.bluez.Device1", device_vtable,
+                                       _find_device, NULL);
+    if (r >= 0)
+        r = sd_bus_add_fallback_vtable(bus, NULL, MOCK_ADAPTER_PATH, "org.bluez.GattService1",
+                                       service_vtable, _find_service, NULL);
+    if (r >= 0)
+        r = sd_bus_add_fallback_vtable(bus, NULL, MOCK_ADAPTER_PATH, "org.bluez.GattCharacteristic1",
+                                       char_vtable, _find_char, NULL);
+    if (r >= 0)
+        r = sd_bus_add_fallback_vtable(bus, NULL, MOCK_ADAPTER_PATH, "org.littleb.Mock1", control_vtable,
+                                       _find_adapter, NULL);
+    if (r >= 0)
+        r = sd_bus_add_node_enumerator(bus, NULL, MOCK_ADAPTER_PATH, _enumerate_objects, NULL);
+    if (r < 0) {
+        fprintf(stderr, "mock_bluez: failed to register objects: %s\n", strerror(-r));
+        return 1;
+    }
+
+    r = sd_bus_attach_event(bus, event, SD_EVENT_PRIORITY_NORMAL);
+    if (r < 0) {
+        fprintf(stderr, "mock_bluez: failed to attach event loop: %s\n", strerror(-r));
+        return 1;
+    }
+
+    if (config.notify_hz > 0) {
+        notify_start = _now_usec();
+        r = sd_event_add_time(event, &notify_source, CLOCK_MONOTONIC, notify_start, 1, _notify_tick, NULL);
+        if (r < 0) {
+            fprintf(stderr, "mock_bluez: failed to add notification timer: %s\n", strerror(-r));
+            return 1;
+        }
+    }
+
+    if (config.churn_hz > 0 && config.devices > 1) {
+        churn_start = _now_usec();
+        r = sd_event_add_time(event, &churn_source, CLOCK_MONOTONIC, churn_start, 1, _churn_tick, NULL);
+        if (r < 0) {
+            fprintf(stderr, "mock_bluez: failed to add churn timer: %s\n", strerror(-r));
+            return 1;
+        }
+    }
+
+    if (config.advertise_hz > 0 && config.devices > 0) {
+        r = sd_event_add_time(event, &advertise_source, CLOCK_MONOTONIC, _now_usec(), 1, _advertise_tick,
+                              NULL);
+        if (r < 0) {
+            fprintf(stderr, "mock_bluez: failed to add advertisement timer: %s\n", strerror(-r));
+            return 1;
+        }
+    }
+
+    // request the name last so clients never see a half registered service
+    r = sd_bus_request_name(bus, "org.bluez", 0);
+    if (r < 0) {
+        fprintf(stderr, "mock_bluez: failed to acquire org.bluez: %s\n", strerror(-r));
+        return 1;
+    }
+
+    r = sd_event_loop(event);
+    if (r < 0) {
+        fprintf(stderr, "mock_bluez: event loop failed: %s\n", strerror(-r));
+    }
+
+    sd_event_source_unref(notify_source);
+    sd_event_source_unref(churn_source);
+    sd_event_source_unref(advertise_source);
+    sd_bus_flush_close_unref(bus);
+    sd_event_unref(event);
+    return r < 0 ? 1 : 0;
+}
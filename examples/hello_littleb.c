@@ -140,14 +140,19 @@ main(int argc, char* argv[])
 
     printf("get_version\n");
     fflush(stdout);
+    // the firmware report answering it starts with the same sysex command
     uint8_t get_version[] = { 0xf0, 0x79, 0xf7 };
-    r = lb_write_to_characteristic(firmata, "6e400002-b5a3-f393-e0a9-e50e24dcca9e", 3, get_version);
-    if (r < 0) {
-        fprintf(stderr, "ERROR: lb_write_to_characteristic\n");
+    uint8_t report[LB_ATT_MAX_VALUE_SIZE];
+    size_t report_size = 0;
+    lb_transact_matcher same_command = { NULL, NULL, 2, false };
+    r = lb_transact(firmata, "6e400002-b5a3-f393-e0a9-e50e24dcca9e",
+                    "6e400003-b5a3-f393-e0a9-e50e24dcca9e", get_version, 3, &same_command, 2000,
+                    report, sizeof(report), &report_size);
+    if (r < 0 || report_size < 4) {
+        fprintf(stderr, "ERROR: lb_transact\n");
+    } else {
+        printf("firmware version %d.%d\n", report[2], report[3]);
     }
-    printf("waiting for callbacks\n");
-    fflush(stdout);
-    sleep(2);
 
 cleanup:
 
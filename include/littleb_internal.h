@@ -0,0 +1,1040 @@
+/*
+ * Copyright (c) 2016 Intel Corporation.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "littleb.h"
+
+struct lb_gatt_cache;
+struct lb_string_table;
+struct lb_advertisement_queue;
+struct lb_timer_wheel;
+
+/**
+ * Intrusive entry of a timer wheel, zeroed when not scheduled
+ */
+struct lb_timer_node {
+    struct lb_timer_node* prev; /**< previous node of the slot, NULL if not scheduled */
+    struct lb_timer_node* next; /**< next node of the slot, NULL if not scheduled */
+    uint64_t expires;           /**< tick the node expires at */
+};
+
+/**
+ * Called by _timer_wheel_advance for every expired node, already unlinked from the wheel
+ */
+typedef void (*lb_timer_expired_t)(struct lb_timer_node* node, void* userdata);
+
+/**
+ * Struct of arrays mirror of the context devices, row i is lb_ctx->devices[i]
+ */
+struct lb_device_table {
+    uint64_t* addresses; /**< 48-bit addresses, first octet most significant, 0 if unknown */
+    int16_t* rssi;       /**< rssi in dBm, INT16_MIN if unknown */
+    uint32_t* flags;     /**< lb_device_flag_t of the device */
+    uint64_t* last_seen; /**< CLOCK_MONOTONIC usec of the last property update */
+    const char** names;  /**< interned names */
+    const char** paths;  /**< interned object paths, NULL past size */
+    int size;            /**< count of rows in use */
+    int capacity;        /**< count of rows allocated in every column */
+    int* index;          /**< open addressing table of rows keyed by path pointer, -1 if empty */
+    int index_capacity;  /**< power of two */
+};
+
+/**
+ * GATT operations of a device waiting for the link, FIFO per priority class
+ */
+struct lb_gatt_queue {
+    lb_future* head[LB_PRIORITY_CLASSES]; /**< oldest operation of each class, NULL if none */
+    lb_future* tail[LB_PRIORITY_CLASSES]; /**< newest operation of each class, NULL if none */
+    lb_future* in_flight;                 /**< operation sent to the device, NULL if the link idles */
+    lb_gatt_queue_stats stats;            /**< counters reported to the user */
+    bool closed;                          /**< device is being freed, nothing is queued or sent */
+};
+
+/**
+ * Allocation behind every lb_ble_service handed out
+ */
+typedef struct lb_service_entry {
+    lb_ble_service service; /**< public part, must stay first */
+    uint64_t generation;    /**< last rescan the service was found in */
+} lb_service_entry;
+
+/**
+ * Allocation behind every lb_ble_char handed out
+ */
+typedef struct lb_char_entry {
+    lb_ble_char characteristic; /**< public part, must stay first */
+    uint64_t generation;        /**< last rescan the characteristic was found in */
+    uint16_t mtu;               /**< ATT MTU of the link, 0 until read from BlueZ */
+    struct lb_latest_write* latest; /**< latest value wins writes, NULL until the first */
+    struct lb_transactions* transactions; /**< transactions answered here, NULL until the first */
+} lb_char_entry;
+
+/**
+ * Operation completed by a future
+ */
+typedef enum {
+    LB_FUTURE_SCAN_DEVICES = 0, /**< lb_get_bl_devices_async */
+    LB_FUTURE_CONNECT = 1,      /**< lb_connect_device_async */
+    LB_FUTURE_PAIR = 2,         /**< lb_pair_device_async */
+    LB_FUTURE_SERVICES = 3,     /**< lb_get_ble_device_services_async */
+    LB_FUTURE_READ = 4,         /**< lb_read_from_characteristic_queued */
+    LB_FUTURE_WRITE = 5,        /**< lb_write_to_characteristic_queued, the value is the payload */
+    LB_FUTURE_FLUSH = 6,        /**< lb_stream_flush */
+    LB_FUTURE_TRANSACT = 7,     /**< lb_transact_async, the value is the response */
+} lb_future_op_t;
+
+#define LB_FUTURE_STAGE_FIRST 0   /**< discovery or pairing before the objects are listed */
+#define LB_FUTURE_STAGE_OBJECTS 1 /**< GetManagedObjects is pending */
+
+/**
+ * Asynchronous operation handed out as lb_future
+ */
+struct lb_future {
+    lb_future_op_t op;           /**< operation run */
+    int stage;                   /**< LB_FUTURE_STAGE_ of a scan or service discovery */
+    bool done;                   /**< the result is final and nothing is pending */
+    lb_result_t result;          /**< result of the operation once done */
+    const char* path;            /**< interned path of the device or characteristic operated on */
+    sd_bus_slot* slot;           /**< pending method call, NULL if none */
+    sd_bus_message* reply;       /**< reply waiting for the next step, NULL if none */
+    sd_event_source* source;     /**< pending timer or next step, NULL if none */
+    bool discovering;            /**< holds a reference on discovery */
+    uint8_t* value;              /**< value read */
+    size_t value_size;           /**< size of the value read */
+    size_t value_capacity;       /**< allocated size of value */
+    lb_future_callback callback; /**< called once when the future completes, NULL if none */
+    void* userdata;              /**< passed to callback */
+    lb_priority_t priority;      /**< class of a GATT operation */
+    uint64_t deadline;           /**< CLOCK_MONOTONIC usec a queued operation expires at, 0 if never */
+    uint64_t timeout;            /**< usec to wait for each reply, 0 for the context default */
+    struct lb_gatt_queue* queue; /**< queue of the device while queued or in flight, NULL if not */
+    lb_future* next;             /**< next operation of the same class in the queue, or spare */
+    bool keep_reply;             /**< a read keeps it's reply in value_reply instead of copying */
+    sd_bus_message* value_reply; /**< reply of a read the value is borrowed from, NULL if none */
+    struct lb_stream* stream;    /**< stream a flush waits to drain, NULL if none */
+    struct lb_transaction* transaction; /**< transaction waiting for it's response, NULL if none */
+};
+
+#define LB_FUTURE_POOL_MAX 64 /**< spare futures kept by a pool */
+
+/**
+ * Futures freed by littleb, kept so GATT operations allocate nothing once it is warmed up
+ */
+struct lb_future_pool {
+    lb_future* spares; /**< released futures linked by next, their value buffers kept */
+    int size;          /**< count of spares, at most LB_FUTURE_POOL_MAX */
+};
+
+/**
+ * State of a write of a stream
+ */
+typedef enum {
+    LB_STREAM_WRITE_FREE = 0,      /**< slot unused */
+    LB_STREAM_WRITE_IN_FLIGHT = 1, /**< WriteValue sent, holds a credit */
+    LB_STREAM_WRITE_RETRY = 2,     /**< refused or newer than a refused write, sent again in order */
+    LB_STREAM_WRITE_DONE = 3,      /**< accepted, retired once every older write is */
+} lb_stream_write_state_t;
+
+/**
+ * Chunk of a stream handed to one WriteValue call
+ */
+struct lb_stream_write {
+    struct lb_stream* stream;      /**< stream the write belongs to */
+    lb_stream_write_state_t state; /**< progress of the write */
+    uint64_t offset;               /**< stream offset of the first byte */
+    size_t size;                   /**< bytes written */
+    uint64_t sent_at;              /**< CLOCK_MONOTONIC usec the write was last sent */
+    sd_bus_slot* slot;             /**< pending WriteValue, NULL if none */
+};
+
+/**
+ * Write without response stream handed out as lb_stream
+ */
+struct lb_stream {
+    const char* path;                /**< interned path of the characteristic */
+    uint8_t* data;                   /**< ring of accepted bytes */
+    size_t capacity;                 /**< power of two */
+    uint64_t head;                   /**< count of bytes accepted */
+    uint64_t sent;                   /**< count of bytes handed to a write */
+    uint64_t acked;                  /**< count of bytes of retired writes */
+    size_t chunk_size;               /**< bytes per write at most */
+    uint8_t* chunk;                  /**< payload of the write being sent */
+    struct lb_stream_write* writes;  /**< ring of writes in send order */
+    int writes_size;                 /**< window configured, the most credits */
+    int first;                       /**< index of the oldest write */
+    int count;                       /**< writes not retired */
+    int in_flight;                   /**< writes holding a credit */
+    int window;                      /**< credits, adapted between 1 and writes_size */
+    int window_acks;                 /**< writes accepted since the window last changed */
+    uint64_t resume_at;              /**< CLOCK_MONOTONIC usec sending pauses until */
+    uint64_t refused_since;          /**< usec of the first refusal since a write was accepted, or 0 */
+    uint64_t rate_start;             /**< CLOCK_MONOTONIC usec the throughput period started */
+    uint64_t rate_bytes;             /**< bytes retired in the throughput period */
+    size_t message_left;             /**< bytes of the framed message still to be taken */
+    bool blocked;                    /**< the producer was turned away, callback is due */
+    lb_result_t result;              /**< error the stream failed with, LB_SUCCESS if none */
+    bool dispatching;                /**< callbacks are running, closing is deferred */
+    bool closed;                     /**< lb_stream_close was called from a callback */
+    sd_event_source* resume_source;  /**< timer ending a pause, NULL if none */
+    lb_future* flush;                /**< pending lb_stream_flush, NULL if none */
+    lb_stream_callback callback;     /**< called when room is available again, NULL if none */
+    void* userdata;                  /**< passed to callback */
+    lb_stream_stats stats;           /**< counters reported to the user */
+};
+
+/**
+ * Latest value wins writes of a characteristic
+ */
+struct lb_latest_write {
+    lb_bl_device* dev;            /**< device owning the characteristic */
+    lb_ble_char* characteristic;  /**< written to */
+    lb_future* in_flight;         /**< write queued or sent, NULL if idle */
+    uint8_t* pending;             /**< value waiting for in_flight to complete */
+    size_t pending_size;          /**< size of pending */
+    size_t pending_capacity;      /**< allocated size of pending */
+    bool has_pending;             /**< pending holds a value */
+    lb_call_options options;      /**< options of the next write */
+    lb_latest_write_stats stats;  /**< counters reported to the user */
+};
+
+/**
+ * Transaction waiting for it's response
+ */
+struct lb_transaction {
+    lb_future* future;             /**< completed with the response */
+    struct lb_transactions* owner; /**< transactions of the characteristic notifying the response */
+    uint8_t* request;              /**< request written, offered to the matcher */
+    size_t request_size;           /**< size of request */
+    lb_transact_matcher matcher;   /**< recognizes the response */
+    lb_future* write;              /**< write of the request until it completes, NULL after */
+    struct lb_transaction* next;   /**< next newer pending transaction */
+};
+
+/**
+ * Pending transactions of a characteristic notifying responses
+ */
+struct lb_transactions {
+    const char* path;              /**< interned path of the characteristic */
+    sd_bus_slot* notify_slot;      /**< match of it's notifications */
+    bool framed;                   /**< responses are framed messages */
+    lb_frame_reader* frames;       /**< reassembles framed responses, NULL if not framed */
+    struct lb_transaction* first;  /**< oldest pending transaction */
+    struct lb_transaction* last;   /**< newest pending transaction */
+    lb_transact_stats stats;       /**< counters reported to the user */
+};
+
+/**
+ * Nordic UART Service byte stream
+ */
+struct lb_uart {
+    uint8_t* rx;                     /**< ring of received bytes */
+    size_t rx_capacity;              /**< power of two */
+    uint64_t rx_head;                /**< count of bytes received */
+    uint64_t rx_tail;                /**< count of bytes read */
+    const char* tx_path;             /**< referenced path of the notifying TX characteristic */
+    sd_bus_slot* notify_slot;        /**< match of the TX notifications */
+    struct lb_stream* tx;            /**< stream writing to the RX characteristic */
+    int event_fd;                    /**< readable while the UART is ready */
+    bool signaled;                   /**< event_fd holds a count */
+    bool writable;                   /**< a short write can continue */
+    lb_uart_stats stats;             /**< counters reported to the user */
+};
+
+/**
+ * Resolved lb_device_filter, every field is compared as is
+ */
+struct lb_device_query {
+    uint64_t address_prefix; /**< packed address octets that must match */
+    uint64_t address_mask;   /**< octets of the address compared */
+    const char* name;        /**< interned name, NULL for any */
+    int16_t min_rssi;        /**< minimal rssi */
+    uint32_t flags_set;      /**< flags the device must have */
+    uint32_t flags_clear;    /**< flags the device must not have */
+    uint64_t seen_since;     /**< minimal last_seen */
+};
+
+/**
+ * Free the services and characteristics of a device and reset it's service list
+ *
+ * @param dev to free the services of
+ */
+void _free_device_services(lb_bl_device* dev);
+
+/**
+ * Open the GATT cache file and memory map it
+ *
+ * A missing file is not an error, an empty cache is returned which will be written on save
+ *
+ * @param path of the cache file
+ * @param cache_ret to populate with the opened cache
+ * @return Result of operation
+ */
+lb_result_t _gatt_cache_open(const char* path, struct lb_gatt_cache** cache_ret);
+
+/**
+ * Unmap and free the GATT cache
+ *
+ * @param cache to close
+ */
+void _gatt_cache_close(struct lb_gatt_cache* cache);
+
+/**
+ * Populate the services and characteristics of a device from the cache
+ *
+ * @param cache to search
+ * @param strings table the paths and uuids of the populated objects are interned in
+ * @param dev to populate, found by it's address
+ * @return LB_SUCCESS on cache hit, -LB_ERROR_NO_RESOURCES on cache miss
+ */
+lb_result_t _gatt_cache_populate(struct lb_gatt_cache* cache,
+                                 struct lb_string_table* strings,
+                                 lb_bl_device* dev);
+
+/**
+ * Mark the cached layout of a device as stale so it is dropped on the next save
+ *
+ * @param cache to update
+ * @param address of the device
+ */
+void _gatt_cache_invalidate(struct lb_gatt_cache* cache, const char* address);
+
+/**
+ * Mark the cache as holding newly discovered layouts
+ *
+ * @param cache to update
+ */
+void _gatt_cache_mark_dirty(struct lb_gatt_cache* cache);
+
+/**
+ * Write the cache file from the still valid mapped entries and the discovered devices
+ *
+ * The file is replaced atomically, only if the cache is dirty
+ *
+ * @param cache to save
+ * @param devices discovered in the current context
+ * @param devices_size count of devices
+ * @return Result of operation
+ */
+lb_result_t _gatt_cache_save(struct lb_gatt_cache* cache, lb_bl_device** devices, int devices_size);
+
+/**
+ * Create an empty string table
+ *
+ * @param table_ret to populate with the new table
+ * @return Result of operation
+ */
+lb_result_t _string_table_new(struct lb_string_table** table_ret);
+
+/**
+ * Free a string table and every string interned in it
+ *
+ * @param table to free
+ */
+void _string_table_free(struct lb_string_table* table);
+
+/**
+ * Intern a string and take a reference on it
+ *
+ * The returned pointer is the same for equal strings and stays valid until the reference is
+ * released with _string_table_release
+ *
+ * @param table to intern in
+ * @param str to intern
+ * @return interned copy of str, NULL on allocation failure
+ */
+const char* _string_table_intern(struct lb_string_table* table, const char* str);
+
+/**
+ * Intern the first len characters of a string and take a reference on it
+ *
+ * @param table to intern in
+ * @param str to intern, does not need to be NUL terminated
+ * @param len count of characters to intern
+ * @return interned copy of the prefix, NULL on allocation failure
+ */
+const char* _string_table_intern_len(struct lb_string_table* table, const char* str, size_t len);
+
+/**
+ * Find an already interned string without adding it or taking a reference
+ *
+ * @param table to search
+ * @param str to find
+ * @return interned copy of str, NULL if it is not interned
+ */
+const char* _string_table_find(struct lb_string_table* table, const char* str);
+
+/**
+ * Take another reference on an interned string
+ *
+ * @param str interned string, NULL is ignored
+ * @return str
+ */
+const char* _string_table_ref(const char* str);
+
+/**
+ * Release a reference taken by _string_table_intern or _string_table_ref
+ *
+ * A string without references is dropped the next time the table would grow
+ *
+ * @param str interned string, NULL is ignored
+ */
+void _string_table_release(const char* str);
+
+/**
+ * Get the size of a string table
+ *
+ * @param table to measure
+ * @param strings to populate with the count of stored strings, NULL to ignore
+ * @param bytes to populate with the memory used by the table, NULL to ignore
+ */
+void _string_table_stats(const struct lb_string_table* table, uint64_t* strings, uint64_t* bytes);
+
+/**
+ * Pack a colon separated address into an integer, first octet most significant
+ *
+ * @param address to pack, a prefix of whole octets is accepted
+ * @param packed_ret to populate with the packed octets
+ * @return count of octets packed, -1 if the address is malformed
+ */
+int _pack_address(const char* address, uint64_t* packed_ret);
+
+/**
+ * Write the filtered fields of a device into a row, growing the table as needed
+ *
+ * @param table to update
+ * @param row of the device
+ * @param dev to copy the fields of
+ * @return Result of operation
+ */
+lb_result_t _device_table_set(struct lb_device_table* table, int row, lb_bl_device* dev);
+
+/**
+ * Free the columns of a table
+ *
+ * @param table to free
+ */
+void _device_table_free(struct lb_device_table* table);
+
+/**
+ * Drop the rows past a size
+ *
+ * @param table to shrink
+ * @param size count of rows to keep
+ */
+void _device_table_truncate(struct lb_device_table* table, int size);
+
+/**
+ * Find the row of a device
+ *
+ * @param table to search
+ * @param path interned object path of the device
+ * @return row of the device, -1 if it is not in the table
+ */
+int _device_table_find(const struct lb_device_table* table, const char* path);
+
+/**
+ * Collect the rows matching a query
+ *
+ * @param table to scan
+ * @param query to match
+ * @param indices to populate with up to capacity matching rows, in row order
+ * @param capacity of indices
+ * @return count of matching rows, can be larger than capacity
+ */
+int _device_table_filter(const struct lb_device_table* table,
+                         const struct lb_device_query* query,
+                         int* indices,
+                         int capacity);
+
+/**
+ * Allocate the advertisement ring and an empty advertiser table
+ *
+ * @param ring_size count of records, rounded up to a power of two
+ * @param dedup_window usec in which unchanged data of an advertiser is not pushed again, 0 to push all
+ * @param queue_ret to populate with the new queue
+ * @return Result of operation
+ */
+lb_result_t
+_advertisement_queue_new(int ring_size, uint64_t dedup_window, struct lb_advertisement_queue** queue_ret);
+
+/**
+ * Free the advertisement ring and advertiser table
+ *
+ * @param queue to free
+ */
+void _advertisement_queue_free(struct lb_advertisement_queue* queue);
+
+/**
+ * Get the latest advertisement state of an advertiser, creating it on first sight. Advertisers
+ * idle for a while may be forgotten to make room, which invalidates earlier returned states.
+ *
+ * @param queue to search
+ * @param path interned object path of the advertiser, a new advertiser takes a reference on it
+ * @param now CLOCK_MONOTONIC usec the advertiser is heard at
+ * @return latest state to update before _advertisement_queue_push, NULL on allocation failure
+ */
+lb_advertisement*
+_advertisement_queue_advertiser(struct lb_advertisement_queue* queue, const char* path, uint64_t now);
+
+/**
+ * Push the latest state of an advertiser into the ring unless the dedup window drops it
+ *
+ * @param queue to push to
+ * @param latest state returned by _advertisement_queue_advertiser
+ * @param now CLOCK_MONOTONIC usec of reception
+ */
+void _advertisement_queue_push(struct lb_advertisement_queue* queue, lb_advertisement* latest, uint64_t now);
+
+/**
+ * Copy the oldest records out of the ring
+ *
+ * @param queue to pop from
+ * @param records to populate
+ * @param capacity of records
+ * @return count of records copied
+ */
+int _advertisement_queue_pop(struct lb_advertisement_queue* queue, lb_advertisement* records, int capacity);
+
+/**
+ * Check whether the ring holds no record
+ *
+ * @param queue to check
+ * @return true if there is nothing to pop
+ */
+bool _advertisement_queue_empty(const struct lb_advertisement_queue* queue);
+
+/**
+ * Get the counters of the queue
+ *
+ * @param queue to get the counters of
+ * @param stats_ret to populate
+ */
+void _advertisement_queue_stats(const struct lb_advertisement_queue* queue, lb_advertisement_stats* stats_ret);
+
+/**
+ * Allocate an empty timer wheel
+ *
+ * @param tick_usec resolution of the wheel, nodes expire on the first tick at or after their time
+ * @param now CLOCK_MONOTONIC usec of the first tick
+ * @param wheel_ret to populate with the new wheel
+ * @return Result of operation
+ */
+lb_result_t _timer_wheel_new(uint64_t tick_usec, uint64_t now, struct lb_timer_wheel** wheel_ret);
+
+/**
+ * Free a timer wheel, scheduled nodes are left as they are
+ *
+ * @param wheel to free
+ */
+void _timer_wheel_free(struct lb_timer_wheel* wheel);
+
+/**
+ * Schedule a node, or move it if it is already scheduled
+ *
+ * @param wheel to schedule in
+ * @param node to schedule
+ * @param expires CLOCK_MONOTONIC usec the node expires at
+ */
+void
+_timer_wheel_schedule(struct lb_timer_wheel* wheel, struct lb_timer_node* node, uint64_t expires);
+
+/**
+ * Unschedule a node, nothing is done if it is not scheduled
+ *
+ * @param wheel the node is scheduled in
+ * @param node to unschedule
+ */
+void _timer_wheel_cancel(struct lb_timer_wheel* wheel, struct lb_timer_node* node);
+
+/**
+ * Get the count of scheduled nodes
+ *
+ * @param wheel to count the nodes of
+ * @return count of scheduled nodes
+ */
+int _timer_wheel_size(const struct lb_timer_wheel* wheel);
+
+/**
+ * Get the time of the next tick to run
+ *
+ * @param wheel to get the next tick of
+ * @return CLOCK_MONOTONIC usec of the next tick
+ */
+uint64_t _timer_wheel_next_tick(const struct lb_timer_wheel* wheel);
+
+/**
+ * Run every tick up to now and report the nodes expiring in them
+ *
+ * @param wheel to advance
+ * @param now CLOCK_MONOTONIC usec to advance to
+ * @param expired called for every expired node, may schedule nodes again
+ * @param userdata passed to expired
+ */
+void _timer_wheel_advance(struct lb_timer_wheel* wheel,
+                          uint64_t now,
+                          lb_timer_expired_t expired,
+                          void* userdata);
+
+/**
+ * Allocate a pending future
+ *
+ * @param op operation the future completes
+ * @param path interned path of the object operated on, the future takes a reference on it
+ * @param future_ret to populate with the new future
+ * @return Result of operation
+ */
+lb_result_t _future_new(lb_future_op_t op, const char* path, lb_future** future_ret);
+
+/**
+ * Take a spare future of the pool, or allocate one when there is none
+ *
+ * @param pool to take from
+ * @param op operation the future completes
+ * @param path interned path of the object operated on, the future takes a reference on it
+ * @param future_ret to populate with the pending future
+ * @return Result of operation
+ */
+lb_result_t _future_take(struct lb_future_pool* pool,
+                         lb_future_op_t op,
+                         const char* path,
+                         lb_future** future_ret);
+
+/**
+ * Release a future and keep it in the pool for _future_take, it's freed if the pool is full
+ *
+ * @param pool to give the future to
+ * @param future to recycle, NULL is ignored
+ */
+void _future_recycle(struct lb_future_pool* pool, lb_future* future);
+
+/**
+ * Free every spare future of the pool
+ *
+ * @param pool to empty
+ */
+void _future_pool_free(struct lb_future_pool* pool);
+
+/**
+ * Drop the pending call, reply and event source of a future, cancelling them
+ *
+ * @param future to release
+ */
+void _future_release(lb_future* future);
+
+/**
+ * Set the result of a future and call it's callback, nothing is done if it is already done
+ *
+ * @param future to complete, may be freed by the callback
+ * @param result of the operation
+ */
+void _future_complete(lb_future* future, lb_result_t result);
+
+/**
+ * Copy a value into the future
+ *
+ * @param future to store the value in
+ * @param value to copy
+ * @param size of value
+ * @return Result of operation
+ */
+lb_result_t _future_set_value(lb_future* future, const void* value, size_t size);
+
+/**
+ * Release and free a future
+ *
+ * @param future to free
+ */
+void _future_free(lb_future* future);
+
+/**
+ * Append an operation to the queue of it's priority class
+ *
+ * @param queue of the device operated on
+ * @param future of the operation, priority and deadline set
+ */
+void _gatt_queue_push(struct lb_gatt_queue* queue, lb_future* future);
+
+/**
+ * Unlink a queued or in flight operation, nothing is done if it is not in the queue
+ *
+ * @param queue the operation was pushed to
+ * @param future of the operation
+ */
+void _gatt_queue_remove(struct lb_gatt_queue* queue, lb_future* future);
+
+/**
+ * Take the next operation to send if the link idles
+ *
+ * Operations past their deadline are completed with LB_ERROR_TIMEOUT on the way.
+ *
+ * @param queue to pop from
+ * @param now CLOCK_MONOTONIC usec
+ * @return operation now in flight, NULL if one already is or nothing is queued
+ */
+lb_future* _gatt_queue_pop(struct lb_gatt_queue* queue, uint64_t now);
+
+/**
+ * Check whether operations wait while the link idles
+ *
+ * @param queue to check
+ * @return true if _gatt_queue_pop has something to send
+ */
+bool _gatt_queue_pending(const struct lb_gatt_queue* queue);
+
+/**
+ * Close the queue, then complete the operation in flight and every queued one. Callbacks of the
+ * completed operations cannot queue new ones, _gatt_queue_op refuses them on a closed queue.
+ *
+ * @param queue to empty
+ * @param result to complete the operations with
+ */
+void _gatt_queue_fail(struct lb_gatt_queue* queue, lb_result_t result);
+
+/**
+ * Allocate a stream and it's ring
+ *
+ * @param path interned path of the characteristic written, the stream takes a reference on it
+ * @param options of the stream, NULL for the defaults
+ * @param stream_ret to populate with the new stream
+ * @return Result of operation
+ */
+lb_result_t _stream_new(const char* path, const lb_stream_options* options, struct lb_stream** stream_ret);
+
+/**
+ * Drop the pending writes and the pause timer of a stream
+ *
+ * @param stream to release
+ */
+void _stream_release(struct lb_stream* stream);
+
+/**
+ * Release and free a stream
+ *
+ * @param stream to free
+ */
+void _stream_free(struct lb_stream* stream);
+
+/**
+ * Copy bytes into the ring of a stream, as many as there is room for
+ *
+ * @param stream to write to
+ * @param data to copy
+ * @param size of data
+ * @return count of bytes accepted
+ */
+size_t _stream_push(struct lb_stream* stream, const uint8_t* data, size_t size);
+
+/**
+ * Copy bytes of a length prefixed message into the ring of a stream, the prefix is pushed with
+ * the first bytes of a message and never on it's own
+ *
+ * @param stream to write to
+ * @param data to copy, the rest of the message if stream->message_left is not 0
+ * @param size of data, the whole message when one starts, at most LB_FRAME_MAX_SIZE
+ * @return count of bytes of data accepted
+ */
+size_t _stream_push_message(struct lb_stream* stream, const uint8_t* data, size_t size);
+
+/**
+ * Take the next write to send if a credit is free, it's payload is copied to stream->chunk
+ *
+ * @param stream to send from
+ * @param now CLOCK_MONOTONIC usec
+ * @return write now in flight, NULL if none can be sent
+ */
+struct lb_stream_write* _stream_next(struct lb_stream* stream, uint64_t now);
+
+/**
+ * Return the credit of a write and adapt the window to the outcome
+ *
+ * @param stream the write belongs to
+ * @param write replied to
+ * @param accepted false if BlueZ refused the write, it and every newer write are sent again
+ * @param now CLOCK_MONOTONIC usec
+ * @return true if a producer turned away should be called back, stream->result is set if the
+ * writes were refused for too long
+ */
+bool _stream_complete(struct lb_stream* stream, struct lb_stream_write* write, bool accepted, uint64_t now);
+
+/**
+ * Check whether every byte accepted was written
+ *
+ * @param stream to check
+ * @return true if nothing is buffered or in flight
+ */
+bool _stream_drained(const struct lb_stream* stream);
+
+/**
+ * Get the count of bytes the ring of a stream has room for
+ *
+ * @param stream to check
+ * @return free bytes
+ */
+size_t _stream_room(const struct lb_stream* stream);
+
+/**
+ * Get the counters of a stream
+ *
+ * @param stream to get the counters of
+ * @param stats_ret to populate
+ */
+void _stream_stats(const struct lb_stream* stream, lb_stream_stats* stats_ret);
+
+/**
+ * Check the fields of a payload layout
+ *
+ * @param layout to check
+ * @return true if the type, channels and header size are in range
+ */
+bool _payload_layout_valid(const lb_payload_layout* layout);
+
+/**
+ * Get the name of the decoding kernels selected for this CPU
+ *
+ * @return "avx2", "sse4.1", "neon" or "scalar"
+ */
+const char* _decoder_kernel_name();
+
+/**
+ * Decode payloads into one float array per channel
+ *
+ * @param layout of every payload, valid
+ * @param payloads to decode
+ * @param sizes of the payloads in bytes
+ * @param count of payloads
+ * @param channels layout->channels arrays of capacity floats
+ * @param capacity of every channel array
+ * @param frames_ret to populate with the count of frames decoded
+ * @return Result of operation, -LB_ERROR_NO_RESOURCES at the first payload not fitting in capacity
+ */
+lb_result_t _decode_payloads(const lb_payload_layout* layout,
+                             const void* const* payloads,
+                             const size_t* sizes,
+                             int count,
+                             float* const* channels,
+                             int capacity,
+                             int* frames_ret);
+
+/**
+ * Allocate a decoder and it's batch buffers
+ *
+ * @param layout of the payloads, valid
+ * @param batch_frames frames decoded per callback, at least 1
+ * @param callback to call with every decoded batch
+ * @param userdata passed to callback
+ * @param decoder_ret to populate with the new decoder
+ * @return Result of operation
+ */
+lb_result_t _decoder_new(const lb_payload_layout* layout,
+                         int batch_frames,
+                         lb_samples_callback callback,
+                         void* userdata,
+                         lb_decoder** decoder_ret);
+
+/**
+ * Free a decoder and it's batch buffers
+ *
+ * @param decoder to free
+ */
+void _decoder_free(lb_decoder* decoder);
+
+/**
+ * Decode the staged frames and pass them to the callback, nothing is done if there are none
+ *
+ * @param decoder to flush
+ */
+void _decoder_flush(lb_decoder* decoder);
+
+/**
+ * Append the whole frames of a payload, calling back for every batch filled
+ *
+ * @param decoder to push to
+ * @param payload to append, starting with the layout header
+ * @param size of payload in bytes
+ */
+void _decoder_push(lb_decoder* decoder, const uint8_t* payload, size_t size);
+
+/**
+ * Allocate a frame reader and it's message buffer
+ *
+ * @param max_size of a message, at most LB_FRAME_MAX_SIZE
+ * @param callback to call with every message reassembled
+ * @param userdata passed to callback
+ * @param reader_ret to populate with the new reader
+ * @return Result of operation
+ */
+lb_result_t _frame_reader_new(size_t max_size,
+                              lb_frame_callback callback,
+                              void* userdata,
+                              lb_frame_reader** reader_ret);
+
+/**
+ * Free a frame reader and it's message buffer
+ *
+ * @param reader to free
+ */
+void _frame_reader_free(lb_frame_reader* reader);
+
+/**
+ * Drop a partly received message, the next byte pushed starts a length prefix
+ *
+ * @param reader to reset
+ */
+void _frame_reader_reset(lb_frame_reader* reader);
+
+/**
+ * Append a payload, calling back for every message it completes
+ *
+ * @param reader to push to
+ * @param payload to append
+ * @param size of payload in bytes
+ */
+void _frame_reader_push(lb_frame_reader* reader, const uint8_t* payload, size_t size);
+
+/**
+ * Get the counters of a frame reader
+ *
+ * @param reader to get the counters of
+ * @param stats_ret to populate
+ */
+void _frame_reader_stats(const lb_frame_reader* reader, lb_frame_reader_stats* stats_ret);
+
+/**
+ * Allocate a UART with it's receive ring and readiness eventfd, the TX stream is opened by the
+ * caller
+ *
+ * @param rx_buffer_size of the receive ring, rounded up to a power of two, 0 for the default
+ * @param uart_ret to populate with the new UART
+ * @return Result of operation
+ */
+lb_result_t _uart_new(size_t rx_buffer_size, struct lb_uart** uart_ret);
+
+/**
+ * Free a UART, it's receive ring and eventfd, the TX stream has to be closed already
+ *
+ * @param uart to free
+ */
+void _uart_free(struct lb_uart* uart);
+
+/**
+ * Append a notification to the receive ring, bytes that do not fit are dropped
+ *
+ * @param uart received on
+ * @param data of the notification
+ * @param size of data
+ */
+void _uart_receive(struct lb_uart* uart, const uint8_t* data, size_t size);
+
+/**
+ * Copy received bytes out of the ring
+ *
+ * @param uart to read from
+ * @param buffer to copy to
+ * @param size of buffer
+ * @return count of bytes copied
+ */
+size_t _uart_read(struct lb_uart* uart, uint8_t* buffer, size_t size);
+
+/**
+ * Whether lb_uart_read or lb_uart_write have something to do
+ *
+ * @param uart to check
+ * @return true if bytes are buffered or a short write can continue, or fail
+ */
+bool _uart_ready(const struct lb_uart* uart);
+
+/**
+ * Make the eventfd of a UART readable exactly while _uart_ready holds
+ *
+ * @param uart to signal
+ */
+void _uart_signal(struct lb_uart* uart);
+
+/**
+ * Get the counters of a UART
+ *
+ * @param uart to get the counters of
+ * @param stats_ret to populate
+ */
+void _uart_stats(const struct lb_uart* uart, lb_uart_stats* stats_ret);
+
+/**
+ * Allocate the pending transactions of a characteristic, the notifications are subscribed by the
+ * caller
+ *
+ * @param path interned path of the characteristic notifying the responses
+ * @param framed reassemble framed messages from the notifications
+ * @param transactions_ret to populate with the new transactions
+ * @return Result of operation
+ */
+lb_result_t _transactions_new(const char* path, bool framed, struct lb_transactions** transactions_ret);
+
+/**
+ * Free the transactions of a characteristic, pending ones complete with LB_ERROR_CANCELLED
+ *
+ * @param transactions to free, can be NULL
+ */
+void _transactions_free(struct lb_transactions* transactions);
+
+/**
+ * Make a future pending on the response to a request
+ *
+ * @param transactions of the characteristic notifying the response
+ * @param future to complete with the response
+ * @param request to match responses against, copied
+ * @param size of request in bytes
+ * @param matcher recognizing the response, NULL for the first response
+ * @param transaction_ret to populate with the transaction, freed along with the future
+ * @return Result of operation
+ */
+lb_result_t _transaction_add(struct lb_transactions* transactions,
+                             lb_future* future,
+                             const uint8_t* request,
+                             size_t size,
+                             const lb_transact_matcher* matcher,
+                             struct lb_transaction** transaction_ret);
+
+/**
+ * Unlink and free a transaction once it's future completes, a write of the request not sent yet
+ * is dropped
+ *
+ * @param transaction to remove
+ */
+void _transaction_remove(struct lb_transaction* transaction);
+
+/**
+ * Offer a notification to the pending transactions, reassembled first if they are framed
+ *
+ * @param transactions of the characteristic notified
+ * @param data of the notification
+ * @param size of data in bytes
+ */
+void _transactions_receive(struct lb_transactions* transactions, const uint8_t* data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
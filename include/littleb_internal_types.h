@@ -28,9 +28,11 @@ extern "C" {
 #endif
 
 #include "littleb.h"
+#include "littleb_internal.h"
 
 #define MAX_LEN 256
-#define MAX_OBJECTS 256
+#define LB_PROCESS_DISPATCH_MAX 64 /**< event sources dispatched by one lb_process call */
+#define LB_TRANSACT_DEFAULT_TIMEOUT 25000000 /**< usec a transaction waits by default, as sd-bus calls */
 
 static const char* BLUEZ_DEST = "org.bluez";
 static const char* BLUEZ_DEVICE = "org.bluez.Device1";
@@ -38,13 +40,68 @@ static const char* BLUEZ_GATT_SERVICE = "org.bluez.GattService1";
 static const char* BLUEZ_GATT_CHARACTERISTICS = "org.bluez.GattCharacteristic1";
 
 struct bl_context {
-    sd_bus* bus;            /**< system bus to be used */
-    lb_bl_device** devices; /**< list of the devices found in a scan */
-    int devices_size;       /**< count of devices found*/
+    sd_bus* bus;                      /**< system bus to be used */
+    sd_event* event;                  /**< loop the bus and the library timers are attached to */
+    lb_bl_device** devices;           /**< list of the devices found in a scan */
+    int devices_size;                 /**< count of devices found*/
+    struct lb_gatt_cache* gatt_cache; /**< persistent GATT layouts, NULL if disabled */
+    struct lb_string_table* strings;  /**< interned paths, uuids, names and addresses */
+    struct lb_device_table device_table; /**< struct of arrays mirror of devices for bulk filters */
+    struct lb_advertisement_queue* advertisements; /**< passive scan records, NULL if not scanning */
+    sd_bus_slot* advertisement_changed_slot; /**< match feeding advertisement updates of devices */
+    sd_bus_slot* advertisement_added_slot;   /**< match feeding advertisements of new devices */
+    int discovery_users;              /**< scans and trackers needing discovery to run */
+    uint64_t generation;              /**< incremented by every rescan, stamps what it found */
+    struct lb_timer_wheel* presence;  /**< idle expiry of the devices, NULL if not tracking */
+    sd_event_source* presence_source; /**< timer advancing the presence wheel */
+    bool external_loop;               /**< lb_get_fd was called, the application drives event */
+    lb_presence_options presence_options; /**< callbacks and idle timeout of the tracking */
+    sd_bus_slot* char_changed_slot;   /**< match keeping characteristic values up to date */
+    sd_bus_slot* device_changed_slot; /**< match keeping device properties up to date */
+    sd_bus_slot* objects_added_slot;  /**< match setting device flags on InterfacesAdded */
+    sd_bus_slot* objects_removed_slot; /**< match clearing device flags on InterfacesRemoved */
+    uint64_t value_cache_hits;        /**< reads served from the value cache */
+    uint64_t value_cache_misses;      /**< reads the value cache could not serve */
+    pthread_mutex_t lock;             /**< recursive, held by the thread using bus and event */
+    pthread_cond_t loop_released;     /**< broadcast when a thread stops blocking in the loop */
+    bool loop_running;                /**< loop_thread blocks in the loop without holding lock */
+    pthread_t loop_thread;            /**< thread blocking in the loop while loop_running */
+    int lock_depth;                   /**< recursion count of lock, 0 while nobody holds it */
+    int lock_waiters;                 /**< threads waiting for the loop to release the bus */
+    int wake_fd;                      /**< eventfd interrupting the loop for waiting threads */
+    sd_event_source* wake_source;     /**< source of wake_fd on event */
+    uint64_t call_timeout;            /**< usec to wait for a reply, 0 for the sd-bus default */
+    struct lb_future_pool futures;    /**< freed futures reused by GATT operations */
 };
 
 typedef struct bl_context* lb_context;
 
+/**
+ * Allocation behind every lb_bl_device handed out
+ */
+typedef struct lb_device_entry {
+    lb_bl_device device;           /**< public part, must stay first */
+    int row;                       /**< row of the device in the device table */
+    struct lb_timer_node presence; /**< idle expiry of the device while tracking presence */
+    bool announced;                /**< on_enter was called for the device */
+    uint64_t generation;           /**< last rescan the device was found in */
+    struct lb_gatt_queue queue;    /**< GATT operations waiting for the link */
+} lb_device_entry;
+
+/**
+ * Streaming cursor over a GetManagedObjects reply
+ *
+ * Paths, interfaces and properties are read straight out of the reply and stay valid until the
+ * iterator is finished, nothing is copied per object.
+ */
+typedef struct lb_object_iter {
+    sd_bus_message* reply;   /**< GetManagedObjects reply everything is borrowed from */
+    const char* path;        /**< current object path */
+    const char* interface;   /**< current interface of the current object */
+    int depth;               /**< containers entered below the object array */
+    bool properties_pending; /**< properties of the current interface not read yet */
+} lb_object_iter;
+
 typedef struct event_matches_callbacks {
     const char* event;
     sd_bus_message_handler_t* callback;
@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2016 Intel Corporation.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Advertisement ring and per advertiser dedup state.
+ *
+ * Every advertiser, keyed by it's interned object path, keeps the latest value of each
+ * advertisement field and a hash of the data it last emitted. A record is pushed when the data
+ * changed or the dedup window since the last push elapsed. Records are copied into a ring
+ * allocated once when the scan starts, a full ring overwrites it's oldest record. Before the
+ * advertiser table grows, advertisers not heard from for ADVERTISER_IDLE_TIMEOUT are forgotten
+ * along with the reference they hold on their path, so the table follows the devices in range
+ * instead of every address ever heard.
+ */
+
+#include <string.h>
+
+#include "littleb_internal.h"
+
+#define FNV1A_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define ADVERTISER_IDLE_TIMEOUT 30000000
+
+struct advertiser {
+    lb_advertisement latest; /**< latest value of every field, must stay first */
+    const char* path;        /**< referenced object path, NULL if the slot is empty */
+    uint64_t emitted_hash;   /**< hash of the data of the last pushed record */
+    uint64_t emitted_at;     /**< timestamp of the last pushed record, 0 if none */
+    uint64_t seen_at;        /**< CLOCK_MONOTONIC usec of the last advertisement */
+};
+
+struct lb_advertisement_queue {
+    lb_advertisement* ring;          /**< preallocated records */
+    uint32_t ring_size;              /**< power of two */
+    uint64_t head;                   /**< count of records pushed */
+    uint64_t tail;                   /**< count of records popped or overwritten */
+    uint64_t dedup_window;           /**< usec, 0 disables dedup */
+    struct advertiser* advertisers;  /**< open addressing table keyed by path pointer */
+    uint32_t advertisers_capacity;   /**< power of two */
+    uint32_t advertisers_used;       /**< count of advertisers seen */
+    lb_advertisement_stats stats;    /**< counters reported to the user */
+};
+
+static uint64_t
+_fnv1a(uint64_t hash, const void* data, size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*) data;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static uint64_t
+_advertisement_hash(const lb_advertisement* advertisement)
+{
+    uint64_t hash = FNV1A_OFFSET_BASIS;
+
+    hash = _fnv1a(hash, &advertisement->manufacturer_id, sizeof(advertisement->manufacturer_id));
+    hash = _fnv1a(hash, advertisement->manufacturer_data, advertisement->manufacturer_data_size);
+    hash = _fnv1a(hash, advertisement->service_uuid, strlen(advertisement->service_uuid));
+    return _fnv1a(hash, advertisement->service_data, advertisement->service_data_size);
+}
+
+static uint32_t
+_path_slot(const char* path, uint32_t capacity)
+{
+    // interned paths are unique pointers, mixing the address is enough of a hash
+    uint64_t key = (uint64_t)(uintptr_t) path;
+
+    return (uint32_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & (capacity - 1);
+}
+
+static void
+_address_from_path(const char* path, char* address)
+{
+    const char* start = strstr(path, "/dev_");
+    int i;
+
+    address[0] = '\0';
+    if (start == NULL || strlen(start + 5) < 17) {
+        return;
+    }
+
+    // dev_00_11_22_33_44_55 -> 00:11:22:33:44:55
+    start += 5;
+    for (i = 0; i < 17; i++) {
+        address[i] = (start[i] == '_') ? ':' : start[i];
+    }
+    address[17] = '\0';
+}
+
+/**
+ * Move the advertisers seen since expire_before into a new table, twice as large if they would
+ * fill the current one past half
+ */
+static bool
+_advertisers_rehash(struct lb_advertisement_queue* queue, uint64_t expire_before)
+{
+    uint32_t new_capacity = queue->advertisers_capacity, kept = 0;
+    struct advertiser* advertisers;
+    uint32_t i, slot;
+
+    for (i = 0; i < queue->advertisers_capacity; i++) {
+        if (queue->advertisers[i].path != NULL && queue->advertisers[i].seen_at >= expire_before) {
+            kept++;
+        }
+    }
+    if ((kept + 1) * 2 > new_capacity) {
+        new_capacity *= 2;
+    }
+
+    advertisers = (struct advertiser*) calloc(new_capacity, sizeof(struct advertiser));
+    if (advertisers == NULL) {
+        return false;
+    }
+
+    for (i = 0; i < queue->advertisers_capacity; i++) {
+        if (queue->advertisers[i].path == NULL) {
+            continue;
+        }
+        if (queue->advertisers[i].seen_at < expire_before) {
+            _string_table_release(queue->advertisers[i].path);
+            continue;
+        }
+        slot = _path_slot(queue->advertisers[i].path, new_capacity);
+        while (advertisers[slot].path != NULL) {
+            slot = (slot + 1) & (new_capacity - 1);
+        }
+        advertisers[slot] = queue->advertisers[i];
+    }
+
+    free(queue->advertisers);
+    queue->advertisers = advertisers;
+    queue->advertisers_capacity = new_capacity;
+    queue->advertisers_used = kept;
+    return true;
+}
+
+lb_result_t
+_advertisement_queue_new(int ring_size, uint64_t dedup_window, struct lb_advertisement_queue** queue_ret)
+{
+    struct lb_advertisement_queue* queue;
+    uint32_t size = 1;
+
+    while (size < (uint32_t) ring_size) {
+        size *= 2;
+    }
+
+    queue = (struct lb_advertisement_queue*) calloc(1, sizeof(struct lb_advertisement_queue));
+    if (queue == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for advertisement queue", __FUNCTION__);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    queue->ring = (lb_advertisement*) calloc(size, sizeof(lb_advertisement));
+    queue->advertisers_capacity = 64;
+    queue->advertisers = (struct advertiser*) calloc(queue->advertisers_capacity, sizeof(struct advertiser));
+    if (queue->ring == NULL || queue->advertisers == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for advertisement queue", __FUNCTION__);
+        _advertisement_queue_free(queue);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    queue->ring_size = size;
+    queue->dedup_window = dedup_window;
+    *queue_ret = queue;
+    return LB_SUCCESS;
+}
+
+void
+_advertisement_queue_free(struct lb_advertisement_queue* queue)
+{
+    uint32_t i;
+
+    if (queue == NULL) {
+        return;
+    }
+
+    if (queue->advertisers != NULL) {
+        for (i = 0; i < queue->advertisers_capacity; i++) {
+            _string_table_release(queue->advertisers[i].path);
+        }
+    }
+    free(queue->ring);
+    free(queue->advertisers);
+    free(queue);
+}
+
+lb_advertisement*
+_advertisement_queue_advertiser(struct lb_advertisement_queue* queue, const char* path, uint64_t now)
+{
+    struct advertiser* advertiser;
+    uint32_t slot = _path_slot(path, queue->advertisers_capacity);
+    uint64_t idle = ADVERTISER_IDLE_TIMEOUT;
+
+    while (queue->advertisers[slot].path != NULL) {
+        if (queue->advertisers[slot].path == path) {
+            queue->advertisers[slot].seen_at = now;
+            return &queue->advertisers[slot].latest;
+        }
+        slot = (slot + 1) & (queue->advertisers_capacity - 1);
+    }
+
+    if ((queue->advertisers_used + 1) * 2 > queue->advertisers_capacity) {
+        // the dedup state of an advertiser must outlive the dedup window
+        if (queue->dedup_window > idle) {
+            idle = queue->dedup_window;
+        }
+        if (!_advertisers_rehash(queue, now > idle ? now - idle : 0)) {
+            syslog(LOG_ERR, "%s: Error allocating memory for advertisers", __FUNCTION__);
+            return NULL;
+        }
+        return _advertisement_queue_advertiser(queue, path, now);
+    }
+
+    advertiser = &queue->advertisers[slot];
+    advertiser->path = _string_table_ref(path);
+    advertiser->seen_at = now;
+    _address_from_path(path, advertiser->latest.address);
+    queue->advertisers_used++;
+
+    return &advertiser->latest;
+}
+
+void
+_advertisement_queue_push(struct lb_advertisement_queue* queue, lb_advertisement* latest, uint64_t now)
+{
+    struct advertiser* advertiser = (struct advertiser*) latest;
+    uint64_t hash = _advertisement_hash(latest);
+
+    queue->stats.received++;
+    latest->timestamp = now;
+
+    if (queue->dedup_window > 0 && advertiser->emitted_at != 0 && hash == advertiser->emitted_hash &&
+        now - advertiser->emitted_at < queue->dedup_window) {
+        queue->stats.duplicates++;
+        return;
+    }
+    advertiser->emitted_hash = hash;
+    advertiser->emitted_at = now;
+
+    if (queue->head - queue->tail == queue->ring_size) {
+        queue->tail++;
+        queue->stats.overruns++;
+    }
+    queue->ring[queue->head & (queue->ring_size - 1)] = *latest;
+    queue->head++;
+}
+
+int
+_advertisement_queue_pop(struct lb_advertisement_queue* queue, lb_advertisement* records, int capacity)
+{
+    uint64_t available = queue->head - queue->tail;
+    uint32_t start, first;
+    int count;
+
+    count = (available < (uint64_t) capacity) ? (int) available : capacity;
+    if (count <= 0) {
+        return 0;
+    }
+
+    // at most two copies, up to the end of the ring and the wrapped rest
+    start = queue->tail & (queue->ring_size - 1);
+    first = queue->ring_size - start;
+    if (first > (uint32_t) count) {
+        first = count;
+    }
+    memcpy(records, &queue->ring[start], first * sizeof(lb_advertisement));
+    memcpy(records + first, queue->ring, (count - first) * sizeof(lb_advertisement));
+    queue->tail += count;
+
+    return count;
+}
+
+bool
+_advertisement_queue_empty(const struct lb_advertisement_queue* queue)
+{
+    return queue->head == queue->tail;
+}
+
+void
+_advertisement_queue_stats(const struct lb_advertisement_queue* queue, lb_advertisement_stats* stats_ret)
+{
+    *stats_ret = queue->stats;
+    stats_ret->advertisers = queue->advertisers_used;
+}
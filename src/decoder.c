@@ -0,0 +1,713 @@
+/*
+ * Copyright (c) 2016 Intel Corporation.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Decoders of packed sensor payloads into one float array per channel.
+ *
+ * A kernel converts a run of interleaved samples to floats, scaling sample i by the channel it
+ * belongs to. The per channel factors are expanded into a pattern of channels * 8 floats, so every
+ * vector of 4 or 8 samples loads it's factors from the pattern without a modulo. Frames are
+ * converted a chunk at a time into an interleaved buffer small enough to stay in L1 and only then
+ * scattered into the channel arrays, with gathers on AVX2. A single channel layout is converted in
+ * place.
+ *
+ * The AVX2 and SSE4.1 kernels are compiled with target attributes and picked at runtime, the NEON
+ * ones are used whenever the compiler targets NEON. Every kernel computes raw * scale + offset with
+ * a separate multiply and add, so they all give the same floats as the scalar loop.
+ */
+
+#include <string.h>
+
+#include "littleb_internal.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DECODER_X86 1
+#include <immintrin.h>
+#define DECODER_TARGET(isa) __attribute__((target(isa)))
+#elif defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define DECODER_NEON 1
+#include <arm_neon.h>
+#endif
+
+#define DECODER_VECTOR 8
+#define DECODER_PATTERN_MAX (LB_DECODER_MAX_CHANNELS * DECODER_VECTOR)
+#define DECODER_CHUNK_FRAMES 64
+
+struct decoder_plan;
+
+typedef void (*decode_kernel_t)(const struct decoder_plan* plan, const uint8_t* raw, int count, float* out);
+typedef void (*scatter_kernel_t)(const float* interleaved, int frames, int channels_count, float* const* channels, int first);
+
+/**
+ * Kernels of one instruction set
+ */
+struct decoder_kernels {
+    const char* name;                   /**< reported by lb_decoder_kernel */
+    decode_kernel_t convert[4];         /**< interleaved conversion of every lb_sample_type_t */
+    scatter_kernel_t scatter;           /**< copy of interleaved frames into the channel arrays */
+};
+
+struct decoder_plan {
+    decode_kernel_t kernel;               /**< conversion of interleaved samples */
+    scatter_kernel_t scatter;             /**< copy of interleaved frames into the channel arrays */
+    lb_sample_type_t type;                /**< type of every sample */
+    int channels;                         /**< samples per frame */
+    int frame_size;                       /**< bytes per frame */
+    int header_size;                      /**< bytes skipped at the start of a payload */
+    int pattern_size;                     /**< channels * DECODER_VECTOR */
+    float scale[DECODER_PATTERN_MAX];     /**< factor of sample i at i % pattern_size */
+    float offset[DECODER_PATTERN_MAX];    /**< offset of sample i at i % pattern_size */
+};
+
+struct lb_decoder {
+    struct decoder_plan plan;                   /**< resolved layout */
+    uint8_t* staged;                            /**< raw frames of the batch being filled */
+    int staged_frames;                          /**< count of frames in staged */
+    int batch_frames;                           /**< frames decoded per callback */
+    float* samples;                             /**< batch_frames floats per channel */
+    float* channels[LB_DECODER_MAX_CHANNELS];   /**< start of every channel in samples */
+    lb_samples_callback callback;               /**< called with every decoded batch */
+    void* userdata;                             /**< passed to callback */
+};
+
+static inline int32_t
+_sample_at(const uint8_t* raw, int i, lb_sample_type_t type)
+{
+    const uint8_t* p;
+    int32_t value;
+
+    switch (type) {
+        case LB_SAMPLE_INT16:
+            p = raw + 2 * i;
+            return (int16_t)(p[0] | (p[1] << 8));
+        case LB_SAMPLE_UINT16:
+            p = raw + 2 * i;
+            return p[0] | (p[1] << 8);
+        case LB_SAMPLE_INT24:
+            p = raw + 3 * i;
+            value = p[0] | (p[1] << 8) | (p[2] << 16);
+            return (value ^ 0x800000) - 0x800000;
+        default:
+            p = raw + 3 * i;
+            return p[0] | (p[1] << 8) | (p[2] << 16);
+    }
+}
+
+/**
+ * Convert samples first to count, also the tail of every vector kernel
+ */
+static inline void
+_decode_scalar_range(const struct decoder_plan* plan,
+                     lb_sample_type_t type,
+                     const uint8_t* raw,
+                     int first,
+                     int count,
+                     float* out)
+{
+    int i, p = first % plan->pattern_size;
+
+    for (i = first; i < count; i++) {
+        out[i] = (float) _sample_at(raw, i, type) * plan->scale[p] + plan->offset[p];
+        if (++p == plan->pattern_size) {
+            p = 0;
+        }
+    }
+}
+
+static void
+_decode_int16_scalar(const struct decoder_plan* plan, const uint8_t* raw, int count, float* out)
+{
+    _decode_scalar_range(plan, LB_SAMPLE_INT16, raw, 0, count, out);
+}
+
+static void
+_decode_uint16_scalar(const struct decoder_plan* plan, const uint8_t* raw, int count, float* out)
+{
+    _decode_scalar_range(plan, LB_SAMPLE_UINT16, raw, 0, count, out);
+}
+
+static void
+_decode_int24_scalar(const struct decoder_plan* plan, const uint8_t* raw, int count, float* out)
+{
+    _decode_scalar_range(plan, LB_SAMPLE_INT24, raw, 0, count, out);
+}
+
+static void
+_decode_uint24_scalar(const struct decoder_plan* plan, const uint8_t* raw, int count, float* out)
+{
+    _decode_scalar_range(plan, LB_SAMPLE_UINT24, raw, 0, count, out);
+}
+
+static inline void
+_scatter_frames(const float* interleaved, int frames, int channels_count, float* const* channels, int first)
+{
+    int c, f;
+
+    for (f = 0; f < frames; f++) {
+        for (c = 0; c < channels_count; c++) {
+            channels[c][first + f] = interleaved[f * channels_count + c];
+        }
+    }
+}
+
+/**
+ * Scatter interleaved frames into the channel arrays, inlined with the common channel counts
+ */
+static void
+_scatter_scalar(const float* interleaved, int frames, int channels_count, float* const* channels, int first)
+{
+    switch (channels_count) {
+        case 2:
+            _scatter_frames(interleaved, frames, 2, channels, first);
+            break;
+        case 3:
+            _scatter_frames(interleaved, frames, 3, channels, first);
+            break;
+        case 4:
+            _scatter_frames(interleaved, frames, 4, channels, first);
+            break;
+        case 6:
+            _scatter_frames(interleaved, frames, 6, channels, first);
+            break;
+        case 8:
+            _scatter_frames(interleaved, frames, 8, channels, first);
+            break;
+        default:
+            _scatter_frames(interleaved, frames, channels_count, channels, first);
+            break;
+    }
+}
+
+static const struct decoder_kernels scalar_kernels = {
+    "scalar",
+    { _decode_int16_scalar, _decode_uint16_scalar, _decode_int24_scalar, _decode_uint24_scalar },
+    _scatter_scalar
+};
+
+#ifdef DECODER_X86
+
+DECODER_TARGET("avx2") static inline void
+_decode16_avx2(const struct decoder_plan* plan, lb_sample_type_t type, const uint8_t* raw, int count, float* out)
+{
+    __m128i packed;
+    __m256 values;
+    int i, p = 0;
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        packed = _mm_loadu_si128((const __m128i*) (raw + 2 * i));
+        values = _mm256_cvtepi32_ps(type == LB_SAMPLE_INT16 ? _mm256_cvtepi16_epi32(packed) :
+                                                              _mm256_cvtepu16_epi32(packed));
+        values = _mm256_add_ps(_mm256_mul_ps(values, _mm256_loadu_ps(plan->scale + p)),
+                               _mm256_loadu_ps(plan->offset + p));
+        _mm256_storeu_ps(out + i, values);
+        p += 8;
+        if (p == plan->pattern_size) {
+            p = 0;
+        }
+    }
+
+    _decode_scalar_range(plan, type, raw, i, count, out);
+}
+
+DECODER_TARGET("avx2") static inline void
+_decode24_avx2(const struct decoder_plan* plan, lb_sample_type_t type, const uint8_t* raw, int count, float* out)
+{
+    // every sample moved to the top 3 bytes of it's lane, then shifted down with or without sign
+    const __m256i shuffle = _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1, 0,
+                                             1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+    __m256i bytes, samples;
+    __m256 values;
+    int i, p = 0;
+
+    // both 16 byte loads read 4 bytes past the 8 samples, keep them inside the run
+    for (i = 0; i + 10 <= count; i += 8) {
+        bytes = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*) (raw + 3 * i)));
+        bytes = _mm256_inserti128_si256(bytes, _mm_loadu_si128((const __m128i*) (raw + 3 * i + 12)), 1);
+        samples = _mm256_shuffle_epi8(bytes, shuffle);
+        samples = (type == LB_SAMPLE_INT24) ? _mm256_srai_epi32(samples, 8) : _mm256_srli_epi32(samples, 8);
+        values = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(samples), _mm256_loadu_ps(plan->scale + p)),
+                               _mm256_loadu_ps(plan->offset + p));
+        _mm256_storeu_ps(out + i, values);
+        p += 8;
+        if (p == plan->pattern_size) {
+            p = 0;
+        }
+    }
+
+    _decode_scalar_range(plan, type, raw, i, count, out);
+}
+
+DECODER_TARGET("avx2") static void
+_decode_int16_avx2(const struct decoder_plan* plan, const uint8_t* raw, int count, float* out)
+{
+    _decode16_avx2(plan, LB_SAMPLE_INT16, raw, count, out);
+}
+
+DECODER_TARGET("avx2") static void
+_decode_uint16_avx2(const struct decoder_plan* plan, const uint8_t* raw, int count, float* out)
+{
+    _decode16_avx2(plan, LB_SAMPLE_UINT16, raw, count, out);
+}
+
+DECODER_TARGET("avx2") static void
+_decode_int24_avx2(const struct decoder_plan* plan, const uint8_t* raw, int count, float* out)
+{
+    _decode24_avx2(plan, LB_SAMPLE_INT24, raw, count, out);
+}
+
+DECODER_TARGET("avx2") static void
+_decode_uint24_avx2(const struct decoder_plan* plan, const uint8_t* raw, int count, float* out)
+{
+    _decode24_avx2(plan, LB_SAMPLE_UINT24, raw, count, out);
+}
+
+DECODER_TARGET("sse4.1") static inline void
+_decode16_sse41(const struct decoder_plan* plan, lb_sample_type_t type, const uint8_t* raw, int count, float* out)
+{
+    __m128i packed;
+    __m128 values;
+    int i, p = 0;
+
+    for (i = 0; i + 4 <= count; i += 4) {
+        packed = _mm_loadl_epi64((const __m128i*) (raw + 2 * i));
+        values = _mm_cvtepi32_ps(type == LB_SAMPLE_INT16 ? _mm_cvtepi16_epi32(packed) :
+                                                           _mm_cvtepu16_epi32(packed));
+        values = _mm_add_ps(_mm_mul_ps(values, _mm_loadu_ps(plan->scale + p)), _mm_loadu_ps(plan->offset + p));
+        _mm_storeu_ps(out + i, values);
+        p += 4;
+        if (p == plan->pattern_size) {
+            p = 0;
+        }
+    }
+
+    _decode_scalar_range(plan, type, raw, i, count, out);
+}
+
+DECODER_TARGET("sse4.1") static inline void
+_decode24_sse41(const struct decoder_plan* plan, lb_sample_type_t type, const uint8_t* raw, int count, float* out)
+{
+    const __m128i shuffle = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+    __m128i samples;
+    __m128 values;
+    int i, p = 0;
+
+    // the 16 byte load reads 4 bytes past the 4 samples, keep them inside the run
+    for (i = 0; i + 6 <= count; i += 4) {
+        samples = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (raw + 3 * i)), shuffle);
+        samples = (type == LB_SAMPLE_INT24) ? _mm_srai_epi32(samples, 8) : _mm_srli_epi32(samples, 8);
+        values = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(samples), _mm_loadu_ps(plan->scale + p)),
+                            _mm_loadu_ps(plan->offset + p));
+        _mm_storeu_ps(out + i, values);
+        p += 4;
+        if (p == plan->pattern_size) {
+            p = 0;
+        }
+    }
+
+    _decode_scalar_range(plan, type, raw, i, count, out);
+}
+
+DECODER_TARGET("sse4.1") static void
+_decode_int16_sse41(const struct decoder_plan* plan, const uint8_t* raw, int count, float* out)
+{
+    _decode16_sse41(plan, LB_SAMPLE_INT16, raw, count, out);
+}
+
+DECODER_TARGET("sse4.1") static void
+_decode_uint16_sse41(const struct decoder_plan* plan, const uint8_t* raw, int count, float* out)
+{
+    _decode16_sse41(plan, LB_SAMPLE_UINT16, raw, count, out);
+}
+
+DECODER_TARGET("sse4.1") static void
+_decode_int24_sse41(const struct decoder_plan* plan, const uint8_t* raw, int count, float* out)
+{
+    _decode24_sse41(plan, LB_SAMPLE_INT24, raw, count, out);
+}
+
+DECODER_TARGET("sse4.1") static void
+_decode_uint24_sse41(const struct decoder_plan* plan, const uint8_t* raw, int count, float* out)
+{
+    _decode24_sse41(plan, LB_SAMPLE_UINT24, raw, count, out);
+}
+
+/**
+ * Gather every channel out of the interleaved frames, they are still in L1
+ */
+DECODER_TARGET("avx2") static void
+_scatter_avx2(const float* interleaved, int frames, int channels_count, float* const* channels, int first)
+{
+    const __m256i strides =
+    _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(channels_count));
+    int c, f;
+
+    for (c = 0; c < channels_count; c++) {
+        for (f = 0; f + 8 <= frames; f += 8) {
+            _mm256_storeu_ps(channels[c] + first + f,
+                             _mm256_i32gather_ps(interleaved + f * channels_count + c, strides, 4));
+        }
+        for (; f < frames; f++) {
+            channels[c][first + f] = interleaved[f * channels_count + c];
+        }
+    }
+}
+
+static const struct decoder_kernels avx2_kernels = {
+    "avx2",
+    { _decode_int16_avx2, _decode_uint16_avx2, _decode_int24_avx2, _decode_uint24_avx2 },
+    _scatter_avx2
+};
+
+static const struct decoder_kernels sse41_kernels = {
+    "sse4.1",
+    { _decode_int16_sse41, _decode_uint16_sse41, _decode_int24_sse41, _decode_uint24_sse41 },
+    _scatter_scalar
+};
+
+#endif
+
+#ifdef DECODER_NEON
+
+static inline void
+_decode16_neon(const struct decoder_plan* plan, lb_sample_type_t type, const uint8_t* raw, int count, float* out)
+{
+    uint16x8_t packed;
+    int32x4_t low, high;
+    int i, p = 0;
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        packed = vld1q_u16((const uint16_t*) (raw + 2 * i));
+        if (type == LB_SAMPLE_INT16) {
+            low = vmovl_s16(vget_low_s16(vreinterpretq_s16_u16(packed)));
+            high = vmovl_s16(vget_high_s16(vreinterpretq_s16_u16(packed)));
+        } else {
+            low = vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(packed)));
+            high = vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(packed)));
+        }
+        vst1q_f32(out + i, vaddq_f32(vmulq_f32(vcvtq_f32_s32(low), vld1q_f32(plan->scale + p)),
+                                     vld1q_f32(plan->offset + p)));
+        vst1q_f32(out + i + 4, vaddq_f32(vmulq_f32(vcvtq_f32_s32(high), vld1q_f32(plan->scale + p + 4)),
+                                         vld1q_f32(plan->offset + p + 4)));
+        p += 8;
+        if (p == plan->pattern_size) {
+            p = 0;
+        }
+    }
+
+    _decode_scalar_range(plan, type, raw, i, count, out);
+}
+
+static inline void
+_decode24_neon(const struct decoder_plan* plan, lb_sample_type_t type, const uint8_t* raw, int count, float* out)
+{
+    uint8x8x3_t bytes;
+    uint16x8_t low16;
+    int16x8_t high16;
+    int32x4_t low, high;
+    int i, p = 0;
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        // de-interleaves the 3 bytes of 8 samples, the top byte carries the sign
+        bytes = vld3_u8(raw + 3 * i);
+        low16 = vorrq_u16(vmovl_u8(bytes.val[0]), vshlq_n_u16(vmovl_u8(bytes.val[1]), 8));
+        high16 = (type == LB_SAMPLE_INT24) ? vmovl_s8(vreinterpret_s8_u8(bytes.val[2])) :
+                                             vreinterpretq_s16_u16(vmovl_u8(bytes.val[2]));
+        low = vorrq_s32(vshlq_n_s32(vmovl_s16(vget_low_s16(high16)), 16),
+                        vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(low16))));
+        high = vorrq_s32(vshlq_n_s32(vmovl_s16(vget_high_s16(high16)), 16),
+                         vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(low16))));
+        vst1q_f32(out + i, vaddq_f32(vmulq_f32(vcvtq_f32_s32(low), vld1q_f32(plan->scale + p)),
+                                     vld1q_f32(plan->offset + p)));
+        vst1q_f32(out + i + 4, vaddq_f32(vmulq_f32(vcvtq_f32_s32(high), vld1q_f32(plan->scale + p + 4)),
+                                         vld1q_f32(plan->offset + p + 4)));
+        p += 8;
+        if (p == plan->pattern_size) {
+            p = 0;
+        }
+    }
+
+    _decode_scalar_range(plan, type, raw, i, count, out);
+}
+
+static void
+_decode_int16_neon(const struct decoder_plan* plan, const uint8_t* raw, int count, float* out)
+{
+    _decode16_neon(plan, LB_SAMPLE_INT16, raw, count, out);
+}
+
+static void
+_decode_uint16_neon(const struct decoder_plan* plan, const uint8_t* raw, int count, float* out)
+{
+    _decode16_neon(plan, LB_SAMPLE_UINT16, raw, count, out);
+}
+
+static void
+_decode_int24_neon(const struct decoder_plan* plan, const uint8_t* raw, int count, float* out)
+{
+    _decode24_neon(plan, LB_SAMPLE_INT24, raw, count, out);
+}
+
+static void
+_decode_uint24_neon(const struct decoder_plan* plan, const uint8_t* raw, int count, float* out)
+{
+    _decode24_neon(plan, LB_SAMPLE_UINT24, raw, count, out);
+}
+
+static const struct decoder_kernels neon_kernels = {
+    "neon",
+    { _decode_int16_neon, _decode_uint16_neon, _decode_int24_neon, _decode_uint24_neon },
+    _scatter_scalar
+};
+
+#endif
+
+static const struct decoder_kernels*
+_select_kernels()
+{
+#if defined(DECODER_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &avx2_kernels;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return &sse41_kernels;
+    }
+#elif defined(DECODER_NEON)
+    return &neon_kernels;
+#endif
+    return &scalar_kernels;
+}
+
+static void
+_plan_init(struct decoder_plan* plan, const lb_payload_layout* layout)
+{
+    const struct decoder_kernels* kernels = _select_kernels();
+    int i;
+
+    plan->kernel = kernels->convert[layout->type];
+    plan->scatter = kernels->scatter;
+    plan->type = layout->type;
+    plan->channels = layout->channels;
+    plan->frame_size =
+    layout->channels * ((layout->type == LB_SAMPLE_INT16 || layout->type == LB_SAMPLE_UINT16) ? 2 : 3);
+    plan->header_size = layout->header_size;
+    plan->pattern_size = layout->channels * DECODER_VECTOR;
+
+    for (i = 0; i < plan->pattern_size; i++) {
+        plan->scale[i] = layout->scale[i % layout->channels];
+        plan->offset[i] = layout->offset[i % layout->channels];
+    }
+}
+
+
+static void
+_decode_frames(const struct decoder_plan* plan, const uint8_t* raw, int frames, float* const* channels, int first)
+{
+    float interleaved[DECODER_CHUNK_FRAMES * LB_DECODER_MAX_CHANNELS];
+    int chunk;
+
+    if (plan->channels == 1) {
+        plan->kernel(plan, raw, frames, channels[0] + first);
+        return;
+    }
+
+    // every chunk starts on a frame, so on the first channel of the pattern
+    for (; frames > 0; frames -= chunk) {
+        chunk = (frames < DECODER_CHUNK_FRAMES) ? frames : DECODER_CHUNK_FRAMES;
+        plan->kernel(plan, raw, chunk * plan->channels, interleaved);
+        plan->scatter(interleaved, chunk, plan->channels, channels, first);
+        raw += chunk * plan->frame_size;
+        first += chunk;
+    }
+}
+
+bool
+_payload_layout_valid(const lb_payload_layout* layout)
+{
+    return layout->type >= LB_SAMPLE_INT16 && layout->type <= LB_SAMPLE_UINT24 && layout->channels >= 1 &&
+           layout->channels <= LB_DECODER_MAX_CHANNELS && layout->header_size >= 0;
+}
+
+const char*
+_decoder_kernel_name()
+{
+    return _select_kernels()->name;
+}
+
+lb_result_t
+_decode_payloads(const lb_payload_layout* layout,
+                 const void* const* payloads,
+                 const size_t* sizes,
+                 int count,
+                 float* const* channels,
+                 int capacity,
+                 int* frames_ret)
+{
+    struct decoder_plan plan;
+    uint8_t staged[DECODER_CHUNK_FRAMES * LB_DECODER_MAX_CHANNELS * 3];
+    const uint8_t* payload;
+    int i, frames, taken, staged_frames = 0, decoded = 0;
+    lb_result_t r = LB_SUCCESS;
+
+    _plan_init(&plan, layout);
+
+    // short payloads are gathered into whole chunks so the kernels run on long runs
+    for (i = 0; i < count; i++) {
+        if (sizes[i] <= (size_t) plan.header_size) {
+            continue;
+        }
+
+        payload = (const uint8_t*) payloads[i] + plan.header_size;
+        frames = (int) ((sizes[i] - plan.header_size) / plan.frame_size);
+        if (frames > capacity - decoded - staged_frames) {
+            r = -LB_ERROR_NO_RESOURCES;
+            break;
+        }
+
+        // a single channel is converted in place whatever the length
+        if (plan.channels == 1 || (staged_frames == 0 && frames >= DECODER_CHUNK_FRAMES)) {
+            _decode_frames(&plan, payload, frames, channels, decoded);
+            decoded += frames;
+            continue;
+        }
+
+        while (frames > 0) {
+            taken = DECODER_CHUNK_FRAMES - staged_frames;
+            taken = (frames < taken) ? frames : taken;
+            memcpy(staged + staged_frames * plan.frame_size, payload, (size_t) taken * plan.frame_size);
+            staged_frames += taken;
+            payload += taken * plan.frame_size;
+            frames -= taken;
+
+            if (staged_frames == DECODER_CHUNK_FRAMES) {
+                _decode_frames(&plan, staged, staged_frames, channels, decoded);
+                decoded += staged_frames;
+                staged_frames = 0;
+            }
+        }
+    }
+
+    if (staged_frames > 0) {
+        _decode_frames(&plan, staged, staged_frames, channels, decoded);
+        decoded += staged_frames;
+    }
+
+    *frames_ret = decoded;
+    return r;
+}
+
+lb_result_t
+_decoder_new(const lb_payload_layout* layout,
+             int batch_frames,
+             lb_samples_callback callback,
+             void* userdata,
+             lb_decoder** decoder_ret)
+{
+    lb_decoder* decoder = (lb_decoder*) calloc(1, sizeof(lb_decoder));
+    int c;
+
+    if (decoder == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for decoder", __FUNCTION__);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    _plan_init(&decoder->plan, layout);
+    decoder->staged = (uint8_t*) malloc((size_t) batch_frames * decoder->plan.frame_size);
+    decoder->samples = (float*) malloc((size_t) batch_frames * layout->channels * sizeof(float));
+    if (decoder->staged == NULL || decoder->samples == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for decoder buffers", __FUNCTION__);
+        _decoder_free(decoder);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    for (c = 0; c < layout->channels; c++) {
+        decoder->channels[c] = decoder->samples + (size_t) c * batch_frames;
+    }
+    decoder->batch_frames = batch_frames;
+    decoder->callback = callback;
+    decoder->userdata = userdata;
+
+    *decoder_ret = decoder;
+    return LB_SUCCESS;
+}
+
+void
+_decoder_free(lb_decoder* decoder)
+{
+    if (decoder == NULL) {
+        return;
+    }
+
+    free(decoder->staged);
+    free(decoder->samples);
+    free(decoder);
+}
+
+void
+_decoder_flush(lb_decoder* decoder)
+{
+    int frames = decoder->staged_frames;
+
+    if (frames == 0) {
+        return;
+    }
+
+    _decode_frames(&decoder->plan, decoder->staged, frames, decoder->channels, 0);
+    decoder->staged_frames = 0;
+    decoder->callback((const float* const*) decoder->channels, frames, decoder->userdata);
+}
+
+void
+_decoder_push(lb_decoder* decoder, const uint8_t* payload, size_t size)
+{
+    const struct decoder_plan* plan = &decoder->plan;
+    int frames, taken;
+
+    if (size <= (size_t) plan->header_size) {
+        return;
+    }
+    payload += plan->header_size;
+    frames = (int) ((size - plan->header_size) / plan->frame_size);
+
+    while (frames > 0) {
+        // whole batches are decoded straight from the payload
+        if (decoder->staged_frames == 0 && frames >= decoder->batch_frames) {
+            taken = decoder->batch_frames;
+            _decode_frames(plan, payload, taken, decoder->channels, 0);
+            decoder->callback((const float* const*) decoder->channels, taken, decoder->userdata);
+        } else {
+            taken = decoder->batch_frames - decoder->staged_frames;
+            taken = (frames < taken) ? frames : taken;
+            memcpy(decoder->staged + (size_t) decoder->staged_frames * plan->frame_size, payload,
+                   (size_t) taken * plan->frame_size);
+            decoder->staged_frames += taken;
+            if (decoder->staged_frames == decoder->batch_frames) {
+                _decoder_flush(decoder);
+            }
+        }
+
+        payload += (size_t) taken * plan->frame_size;
+        frames -= taken;
+    }
+}
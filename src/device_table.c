@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2016 Intel Corporation.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Struct of arrays copy of the fields bulk queries filter on.
+ *
+ * Row i mirrors lb_ctx->devices[i] and is rewritten whenever the device changes, so a filter is a
+ * linear pass over a few contiguous columns instead of a pointer chase per device. Rows are
+ * matched a block at a time: the predicate is evaluated for the whole block into a byte mask, a
+ * loop the compiler can vectorize, and only then are the matching rows collected.
+ *
+ * The table also indexes the rows by interned object path, an open addressing table keyed by the
+ * path pointer, so signals and rescans find their device without walking the list.
+ */
+
+#include <ctype.h>
+#include <string.h>
+
+#include "littleb_internal.h"
+
+#define DEVICE_FILTER_BLOCK 64
+#define DEVICE_INDEX_EMPTY -1
+
+static int
+_hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c = (char) tolower((unsigned char) c);
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+int
+_pack_address(const char* address, uint64_t* packed_ret)
+{
+    uint64_t packed = 0;
+    int octets = 0;
+    int high, low;
+
+    while (octets < 6 && *address != '\0') {
+        high = _hex_digit(address[0]);
+        low = (high < 0) ? -1 : _hex_digit(address[1]);
+        if (low < 0) {
+            return -1;
+        }
+        packed |= (uint64_t)((high << 4) | low) << (8 * (5 - octets));
+        octets++;
+        address += 2;
+
+        if (*address == ':') {
+            address++;
+        } else if (*address != '\0') {
+            return -1;
+        }
+    }
+
+    if (*address != '\0') {
+        return -1;
+    }
+
+    *packed_ret = packed;
+    return octets;
+}
+
+static uint32_t
+_path_slot(const char* path, int capacity)
+{
+    // interned paths are unique pointers, mixing the address is enough of a hash
+    uint64_t key = (uint64_t)(uintptr_t) path;
+
+    return (uint32_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & (uint32_t)(capacity - 1);
+}
+
+static int
+_index_lookup(const struct lb_device_table* table, const char* path)
+{
+    uint32_t slot = _path_slot(path, table->index_capacity);
+    int row;
+
+    while ((row = table->index[slot]) != DEVICE_INDEX_EMPTY) {
+        if (table->paths[row] == path) {
+            break;
+        }
+        slot = (slot + 1) & (uint32_t)(table->index_capacity - 1);
+    }
+
+    return (int) slot;
+}
+
+static void
+_index_remove(struct lb_device_table* table, const char* path, int row)
+{
+    uint32_t mask = (uint32_t)(table->index_capacity - 1);
+    uint32_t hole, slot, home;
+
+    if (path == NULL || table->index_capacity == 0) {
+        return;
+    }
+
+    hole = (uint32_t) _index_lookup(table, path);
+    if (table->index[hole] != row) {
+        return;
+    }
+    table->index[hole] = DEVICE_INDEX_EMPTY;
+
+    // shift the rest of the probe sequence back so lookups never stop at the hole
+    for (slot = (hole + 1) & mask; table->index[slot] != DEVICE_INDEX_EMPTY; slot = (slot + 1) & mask) {
+        home = _path_slot(table->paths[table->index[slot]], table->index_capacity);
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            table->index[hole] = table->index[slot];
+            table->index[slot] = DEVICE_INDEX_EMPTY;
+            hole = slot;
+        }
+    }
+}
+
+static bool
+_index_grow(struct lb_device_table* table)
+{
+    int new_capacity = (table->index_capacity == 0) ? 128 : table->index_capacity * 2;
+    int* index = (int*) malloc((size_t) new_capacity * sizeof(int));
+    int i;
+
+    if (index == NULL) {
+        return false;
+    }
+
+    free(table->index);
+    table->index = index;
+    table->index_capacity = new_capacity;
+    for (i = 0; i < new_capacity; i++) {
+        index[i] = DEVICE_INDEX_EMPTY;
+    }
+
+    for (i = 0; i < table->size; i++) {
+        if (table->paths[i] != NULL) {
+            index[_index_lookup(table, table->paths[i])] = i;
+        }
+    }
+
+    return true;
+}
+
+static bool
+_grow_column(void** column, size_t element_size, int capacity)
+{
+    void* grown = realloc(*column, (size_t) capacity * element_size);
+
+    if (grown == NULL) {
+        return false;
+    }
+
+    *column = grown;
+    return true;
+}
+
+lb_result_t
+_device_table_set(struct lb_device_table* table, int row, lb_bl_device* dev)
+{
+    int new_capacity;
+
+    if (row >= table->capacity) {
+        new_capacity = (table->capacity == 0) ? 64 : table->capacity;
+        while (new_capacity <= row) {
+            new_capacity *= 2;
+        }
+
+        if (!_grow_column((void**) &table->addresses, sizeof(uint64_t), new_capacity) ||
+            !_grow_column((void**) &table->rssi, sizeof(int16_t), new_capacity) ||
+            !_grow_column((void**) &table->flags, sizeof(uint32_t), new_capacity) ||
+            !_grow_column((void**) &table->last_seen, sizeof(uint64_t), new_capacity) ||
+            !_grow_column((void**) &table->names, sizeof(const char*), new_capacity) ||
+            !_grow_column((void**) &table->paths, sizeof(const char*), new_capacity)) {
+            syslog(LOG_ERR, "%s: Error allocating memory for device table", __FUNCTION__);
+            return -LB_ERROR_MEMEORY_ALLOCATION;
+        }
+
+        for (; table->capacity < new_capacity; table->capacity++) {
+            table->paths[table->capacity] = NULL;
+        }
+    }
+
+    // keep the index at most half full, counting the row about to be added
+    if ((row + 1) * 2 > table->index_capacity && !_index_grow(table)) {
+        syslog(LOG_ERR, "%s: Error allocating memory for device index", __FUNCTION__);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    if (table->paths[row] != dev->device_path) {
+        _index_remove(table, table->paths[row], row);
+        table->paths[row] = dev->device_path;
+        table->index[_index_lookup(table, dev->device_path)] = row;
+    }
+
+    if (dev->address == NULL || _pack_address(dev->address, &table->addresses[row]) != 6) {
+        table->addresses[row] = 0;
+    }
+    table->rssi[row] =
+    (dev->properties.known & LB_DEVICE_PROPERTY_RSSI) ? dev->properties.rssi : INT16_MIN;
+    table->flags[row] = dev->flags;
+    table->last_seen[row] = dev->properties.timestamp;
+    table->names[row] = dev->name;
+
+    if (row >= table->size) {
+        table->size = row + 1;
+    }
+
+    return LB_SUCCESS;
+}
+
+void
+_device_table_free(struct lb_device_table* table)
+{
+    free(table->addresses);
+    free(table->rssi);
+    free(table->flags);
+    free(table->last_seen);
+    free(table->names);
+    free(table->paths);
+    free(table->index);
+    memset(table, 0, sizeof(struct lb_device_table));
+}
+
+void
+_device_table_truncate(struct lb_device_table* table, int size)
+{
+    for (; table->size > size; table->size--) {
+        _index_remove(table, table->paths[table->size - 1], table->size - 1);
+        table->paths[table->size - 1] = NULL;
+    }
+}
+
+int
+_device_table_find(const struct lb_device_table* table, const char* path)
+{
+    if (path == NULL || table->index_capacity == 0) {
+        return -1;
+    }
+
+    return table->index[_index_lookup(table, path)];
+}
+
+int
+_device_table_filter(const struct lb_device_table* table,
+                     const struct lb_device_query* query,
+                     int* indices,
+                     int capacity)
+{
+    uint8_t match[DEVICE_FILTER_BLOCK];
+    const uint64_t address_prefix = query->address_prefix;
+    const uint64_t address_mask = query->address_mask;
+    const char* name = query->name;
+    const int16_t min_rssi = query->min_rssi;
+    const uint32_t flags_set = query->flags_set;
+    const uint32_t flags_clear = query->flags_clear;
+    const uint64_t seen_since = query->seen_since;
+    int base, block, i, count = 0;
+
+    for (base = 0; base < table->size; base += DEVICE_FILTER_BLOCK) {
+        const uint64_t* addresses = table->addresses + base;
+        const int16_t* rssi = table->rssi + base;
+        const uint32_t* flags = table->flags + base;
+        const uint64_t* last_seen = table->last_seen + base;
+        const char* const* names = table->names + base;
+
+        block = table->size - base;
+        if (block > DEVICE_FILTER_BLOCK)
+            block = DEVICE_FILTER_BLOCK;
+
+        // no branches in here, every column is read sequentially
+        for (i = 0; i < block; i++) {
+            match[i] = ((addresses[i] & address_mask) == address_prefix) & (rssi[i] >= min_rssi) &
+                       ((flags[i] & flags_set) == flags_set) & ((flags[i] & flags_clear) == 0) &
+                       (last_seen[i] >= seen_since) & ((name == NULL) | (names[i] == name));
+        }
+
+        for (i = 0; i < block; i++) {
+            if (match[i]) {
+                if (count < capacity)
+                    indices[count] = base + i;
+                count++;
+            }
+        }
+    }
+
+    return count;
+}
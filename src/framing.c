@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2016 Intel Corporation.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Reassembly of length prefixed messages.
+ *
+ * Payloads are consumed byte for byte into the length prefix and then copied a run at a time into
+ * the message buffer, so a notification holding the tail of one message and the start of the next
+ * costs two copies and no buffering of the payload itself. A message longer than max_size is
+ * skipped without being copied, it's length still tells where the next one starts.
+ */
+
+#include <string.h>
+
+#include "littleb_internal.h"
+
+struct lb_frame_reader {
+    uint8_t header[LB_FRAME_HEADER_SIZE]; /**< length prefix being received */
+    size_t header_size;                   /**< bytes of header received */
+    size_t length;                        /**< length of the message being received */
+    size_t received;                      /**< bytes of the message received */
+    uint8_t* message;                     /**< max_size bytes */
+    size_t max_size;                      /**< longest message kept */
+    lb_frame_callback callback;           /**< called with every message */
+    void* userdata;                       /**< passed to callback */
+    lb_frame_reader_stats stats;          /**< counters reported to the user */
+};
+
+lb_result_t
+_frame_reader_new(size_t max_size, lb_frame_callback callback, void* userdata, lb_frame_reader** reader_ret)
+{
+    lb_frame_reader* reader;
+
+    reader = (lb_frame_reader*) calloc(1, sizeof(lb_frame_reader));
+    if (reader == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for frame reader", __FUNCTION__);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    // one byte at least so an empty message is passed a valid pointer
+    reader->message = (uint8_t*) malloc(max_size > 0 ? max_size : 1);
+    if (reader->message == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for frame reader", __FUNCTION__);
+        free(reader);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    reader->max_size = max_size;
+    reader->callback = callback;
+    reader->userdata = userdata;
+    *reader_ret = reader;
+    return LB_SUCCESS;
+}
+
+void
+_frame_reader_free(lb_frame_reader* reader)
+{
+    if (reader == NULL) {
+        return;
+    }
+
+    free(reader->message);
+    free(reader);
+}
+
+void
+_frame_reader_reset(lb_frame_reader* reader)
+{
+    reader->header_size = 0;
+    reader->length = 0;
+    reader->received = 0;
+}
+
+void
+_frame_reader_push(lb_frame_reader* reader, const uint8_t* payload, size_t size)
+{
+    size_t take;
+
+    reader->stats.bytes += size;
+
+    while (size > 0) {
+        if (reader->header_size < LB_FRAME_HEADER_SIZE) {
+            reader->header[reader->header_size++] = *payload++;
+            size--;
+            if (reader->header_size < LB_FRAME_HEADER_SIZE) {
+                continue;
+            }
+            reader->length = reader->header[0] | (reader->header[1] << 8);
+            reader->received = 0;
+            if (reader->length > reader->max_size) {
+                reader->stats.oversized++;
+            }
+        } else {
+            take = reader->length - reader->received;
+            if (take > size) {
+                take = size;
+            }
+            if (reader->length <= reader->max_size) {
+                memcpy(reader->message + reader->received, payload, take);
+            }
+            reader->received += take;
+            payload += take;
+            size -= take;
+        }
+
+        if (reader->received == reader->length) {
+            reader->header_size = 0;
+            if (reader->length <= reader->max_size) {
+                reader->stats.messages++;
+                reader->callback(reader->message, reader->length, reader->userdata);
+            }
+        }
+    }
+}
+
+void
+_frame_reader_stats(const lb_frame_reader* reader, lb_frame_reader_stats* stats_ret)
+{
+    *stats_ret = reader->stats;
+}
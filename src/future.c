@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2016 Intel Corporation.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Completion state of the asynchronous operations.
+ *
+ * A future owns the bus slot or event source of the step it is waiting on, dropping them cancels
+ * that step. littleb.c handles replies from deferred event sources, so results are only applied
+ * and callbacks only called from the event loop, and completes the future with the result, which
+ * calls the completion callback once. The application owns the future and frees it
+ * whether or not it completed.
+ */
+
+#include <string.h>
+
+#include "littleb_internal.h"
+
+static void
+_future_init(lb_future* future, lb_future_op_t op, const char* path)
+{
+    future->op = op;
+    future->path = _string_table_ref(path);
+    future->result = -LB_ERROR_NO_RESOURCES;
+}
+
+lb_result_t
+_future_new(lb_future_op_t op, const char* path, lb_future** future_ret)
+{
+    lb_future* future = (lb_future*) calloc(1, sizeof(lb_future));
+
+    if (future == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for future", __FUNCTION__);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    _future_init(future, op, path);
+    *future_ret = future;
+    return LB_SUCCESS;
+}
+
+lb_result_t
+_future_take(struct lb_future_pool* pool, lb_future_op_t op, const char* path, lb_future** future_ret)
+{
+    lb_future* future = pool->spares;
+    uint8_t* value;
+    size_t capacity;
+
+    if (future == NULL) {
+        return _future_new(op, path, future_ret);
+    }
+    pool->spares = future->next;
+    pool->size--;
+
+    // only the value buffer is kept, writes copy into it without growing it again
+    value = future->value;
+    capacity = future->value_capacity;
+    memset(future, 0, sizeof(lb_future));
+    future->value = value;
+    future->value_capacity = capacity;
+
+    _future_init(future, op, path);
+    *future_ret = future;
+    return LB_SUCCESS;
+}
+
+void
+_future_recycle(struct lb_future_pool* pool, lb_future* future)
+{
+    if (future == NULL) {
+        return;
+    }
+
+    if (pool->size >= LB_FUTURE_POOL_MAX) {
+        _future_free(future);
+        return;
+    }
+
+    _future_release(future);
+    future->value_reply = sd_bus_message_unref(future->value_reply);
+    _string_table_release(future->path);
+    future->path = NULL;
+
+    future->next = pool->spares;
+    pool->spares = future;
+    pool->size++;
+}
+
+void
+_future_pool_free(struct lb_future_pool* pool)
+{
+    lb_future* future;
+
+    while ((future = pool->spares) != NULL) {
+        pool->spares = future->next;
+        _future_free(future);
+    }
+    pool->size = 0;
+}
+
+void
+_future_release(lb_future* future)
+{
+    future->slot = sd_bus_slot_unref(future->slot);
+    future->reply = sd_bus_message_unref(future->reply);
+    future->source = sd_event_source_unref(future->source);
+    if (future->queue != NULL) {
+        _gatt_queue_remove(future->queue, future);
+    }
+    if (future->stream != NULL) {
+        future->stream->flush = NULL;
+        future->stream = NULL;
+    }
+    if (future->transaction != NULL) {
+        _transaction_remove(future->transaction);
+    }
+}
+
+void
+_future_complete(lb_future* future, lb_result_t result)
+{
+    if (future->done) {
+        return;
+    }
+
+    _future_release(future);
+    future->done = true;
+    future->result = result;
+
+    // last, the callback may free the future
+    if (future->callback != NULL) {
+        future->callback(future, future->userdata);
+    }
+}
+
+lb_result_t
+_future_set_value(lb_future* future, const void* value, size_t size)
+{
+    uint8_t* buffer = future->value;
+
+    if (size > future->value_capacity) {
+        buffer = (uint8_t*) realloc(future->value, size);
+        if (buffer == NULL) {
+            syslog(LOG_ERR, "%s: Error allocating memory for future value", __FUNCTION__);
+            return -LB_ERROR_MEMEORY_ALLOCATION;
+        }
+        future->value = buffer;
+        future->value_capacity = size;
+    }
+
+    if (size > 0) {
+        memcpy(buffer, value, size);
+    }
+    future->value_size = size;
+    return LB_SUCCESS;
+}
+
+void
+_future_free(lb_future* future)
+{
+    if (future == NULL) {
+        return;
+    }
+
+    _future_release(future);
+    sd_bus_message_unref(future->value_reply);
+    free(future->value);
+    _string_table_release(future->path);
+    free(future);
+}
@@ -0,0 +1,814 @@
+/*
+ * Copyright (c) 2016 Intel Corporation.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Persistent GATT layout cache.
+ *
+ * File layout, all integers in host byte order:
+ *
+ *   header | devices[] | services[] | characteristics[] | string pool
+ *
+ * Devices are sorted by address so a lookup is a binary search on the mapped file. Services and
+ * characteristics are referenced by index ranges and all strings are offsets into a NUL terminated
+ * pool in which every string is stored once. Entries are trusted as is, if BlueZ later reports
+ * one of the cached objects as unknown the device is invalidated and rediscovered.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "littleb_internal.h"
+
+#define GATT_CACHE_MAGIC 0x4347424c /* "LBGC" */
+#define GATT_CACHE_VERSION 1
+#define FNV1A_OFFSET_BASIS 0xcbf29ce484222325ULL
+
+struct gatt_cache_header {
+    uint32_t magic;                 /**< GATT_CACHE_MAGIC */
+    uint32_t version;               /**< GATT_CACHE_VERSION */
+    uint32_t file_size;             /**< total size of the file */
+    uint32_t devices_count;         /**< count of device entries */
+    uint32_t services_count;        /**< count of service entries */
+    uint32_t characteristics_count; /**< count of characteristic entries */
+    uint32_t strings_size;          /**< size of the string pool */
+    uint32_t reserved;
+    uint64_t hash; /**< FNV-1a of everything following the header */
+};
+
+struct gatt_cache_device {
+    uint32_t address;        /**< string offset of the device address */
+    uint32_t first_service;  /**< index of the first service of the device */
+    uint32_t services_count; /**< count of services in the device */
+};
+
+struct gatt_cache_service {
+    uint32_t path;                  /**< string offset of the service path */
+    uint32_t uuid;                  /**< string offset of the service uuid */
+    uint32_t primary;               /**< is the service primary */
+    uint32_t first_characteristic;  /**< index of the first characteristic of the service */
+    uint32_t characteristics_count; /**< count of characteristics in the service */
+};
+
+struct gatt_cache_characteristic {
+    uint32_t path; /**< string offset of the characteristic path */
+    uint32_t uuid; /**< string offset of the characteristic uuid */
+};
+
+struct lb_gatt_cache {
+    char* path;                                        /**< path of the cache file */
+    void* map;                                         /**< mapped file, NULL if none */
+    size_t map_size;                                   /**< size of the mapping */
+    const struct gatt_cache_header* header;            /**< header in the mapping */
+    const struct gatt_cache_device* devices;           /**< device table in the mapping */
+    const struct gatt_cache_service* services;         /**< service table in the mapping */
+    const struct gatt_cache_characteristic* characteristics; /**< characteristic table */
+    const char* strings;                               /**< string pool in the mapping */
+    bool* stale;                                       /**< per mapped device, dropped on save */
+    bool dirty;                                        /**< cache needs to be written */
+};
+
+struct gatt_cache_builder {
+    struct gatt_cache_device* devices;
+    uint32_t devices_count;
+    uint32_t devices_capacity;
+    struct gatt_cache_service* services;
+    uint32_t services_count;
+    uint32_t services_capacity;
+    struct gatt_cache_characteristic* characteristics;
+    uint32_t characteristics_count;
+    uint32_t characteristics_capacity;
+    char* strings;
+    uint32_t strings_size;
+    uint32_t strings_capacity;
+    uint32_t* slots; /**< open addressing table of string offsets + 1, 0 is empty */
+    uint32_t slots_capacity;
+    uint32_t slots_used;
+};
+
+static uint64_t
+_fnv1a(uint64_t hash, const void* data, size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*) data;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static bool
+_gatt_cache_validate(struct lb_gatt_cache* cache)
+{
+    const struct gatt_cache_header* header = (const struct gatt_cache_header*) cache->map;
+    uint64_t tables_size;
+
+    if (cache->map_size < sizeof(struct gatt_cache_header)) {
+        syslog(LOG_ERR, "%s: cache %s is truncated", __FUNCTION__, cache->path);
+        return false;
+    }
+
+    if (header->magic != GATT_CACHE_MAGIC || header->version != GATT_CACHE_VERSION) {
+        syslog(LOG_ERR, "%s: cache %s has an unknown format", __FUNCTION__, cache->path);
+        return false;
+    }
+
+    tables_size = (uint64_t) header->devices_count * sizeof(struct gatt_cache_device) +
+                  (uint64_t) header->services_count * sizeof(struct gatt_cache_service) +
+                  (uint64_t) header->characteristics_count * sizeof(struct gatt_cache_characteristic);
+    if (header->file_size != cache->map_size ||
+        sizeof(struct gatt_cache_header) + tables_size + header->strings_size != cache->map_size ||
+        header->strings_size == 0) {
+        syslog(LOG_ERR, "%s: cache %s has inconsistent sizes", __FUNCTION__, cache->path);
+        return false;
+    }
+
+    if (_fnv1a(FNV1A_OFFSET_BASIS, (const uint8_t*) cache->map + sizeof(struct gatt_cache_header),
+               cache->map_size - sizeof(struct gatt_cache_header)) != header->hash) {
+        syslog(LOG_ERR, "%s: cache %s hash mismatch", __FUNCTION__, cache->path);
+        return false;
+    }
+
+    cache->header = header;
+    cache->devices = (const struct gatt_cache_device*) (header + 1);
+    cache->services = (const struct gatt_cache_service*) (cache->devices + header->devices_count);
+    cache->characteristics =
+    (const struct gatt_cache_characteristic*) (cache->services + header->services_count);
+    cache->strings = (const char*) (cache->characteristics + header->characteristics_count);
+
+    /* a terminated pool makes every in range offset a valid string */
+    if (cache->strings[header->strings_size - 1] != '\0') {
+        syslog(LOG_ERR, "%s: cache %s string pool is not terminated", __FUNCTION__, cache->path);
+        return false;
+    }
+
+    return true;
+}
+
+lb_result_t
+_gatt_cache_open(const char* path, struct lb_gatt_cache** cache_ret)
+{
+    struct lb_gatt_cache* cache;
+    struct stat st;
+    int fd;
+
+    if (path == NULL) {
+        syslog(LOG_ERR, "%s: path is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    cache = (struct lb_gatt_cache*) calloc(1, sizeof(struct lb_gatt_cache));
+    if (cache == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for gatt cache", __FUNCTION__);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    cache->path = strdup(path);
+    if (cache->path == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for gatt cache path", __FUNCTION__);
+        free(cache);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    *cache_ret = cache;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            syslog(LOG_ERR, "%s: Failed to open %s: %s", __FUNCTION__, path, strerror(errno));
+        }
+        return LB_SUCCESS;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return LB_SUCCESS;
+    }
+
+    cache->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (cache->map == MAP_FAILED) {
+        syslog(LOG_ERR, "%s: Failed to map %s: %s", __FUNCTION__, path, strerror(errno));
+        cache->map = NULL;
+        return LB_SUCCESS;
+    }
+    cache->map_size = st.st_size;
+
+    if (!_gatt_cache_validate(cache)) {
+        /* rewrite the cache from scratch on the next save */
+        munmap(cache->map, cache->map_size);
+        cache->map = NULL;
+        cache->map_size = 0;
+        cache->header = NULL;
+        cache->dirty = true;
+        return LB_SUCCESS;
+    }
+
+    if (cache->header->devices_count > 0) {
+        cache->stale = (bool*) calloc(cache->header->devices_count, sizeof(bool));
+        if (cache->stale == NULL) {
+            syslog(LOG_ERR, "%s: Error allocating memory for stale entries", __FUNCTION__);
+            _gatt_cache_close(cache);
+            *cache_ret = NULL;
+            return -LB_ERROR_MEMEORY_ALLOCATION;
+        }
+    }
+
+    return LB_SUCCESS;
+}
+
+void
+_gatt_cache_close(struct lb_gatt_cache* cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+
+    if (cache->map != NULL) {
+        munmap(cache->map, cache->map_size);
+    }
+    free(cache->stale);
+    free(cache->path);
+    free(cache);
+}
+
+static int
+_gatt_cache_find_device(struct lb_gatt_cache* cache, const char* address)
+{
+    int low = 0, high, middle, cmp;
+
+    if (cache->header == NULL || address == NULL) {
+        return -1;
+    }
+
+    high = (int) cache->header->devices_count - 1;
+    while (low <= high) {
+        middle = low + (high - low) / 2;
+        if (cache->devices[middle].address >= cache->header->strings_size) {
+            return -1;
+        }
+        cmp = strcmp(address, cache->strings + cache->devices[middle].address);
+        if (cmp == 0) {
+            return middle;
+        } else if (cmp < 0) {
+            high = middle - 1;
+        } else {
+            low = middle + 1;
+        }
+    }
+
+    return -1;
+}
+
+static bool
+_gatt_cache_device_in_range(struct lb_gatt_cache* cache, const struct gatt_cache_device* device)
+{
+    const struct gatt_cache_header* header = cache->header;
+    uint32_t i;
+
+    if ((uint64_t) device->first_service + device->services_count > header->services_count) {
+        return false;
+    }
+
+    for (i = device->first_service; i < device->first_service + device->services_count; i++) {
+        const struct gatt_cache_service* service = &cache->services[i];
+        uint32_t j;
+
+        if (service->path >= header->strings_size || service->uuid >= header->strings_size ||
+            (uint64_t) service->first_characteristic + service->characteristics_count >
+            header->characteristics_count) {
+            return false;
+        }
+        for (j = service->first_characteristic;
+             j < service->first_characteristic + service->characteristics_count; j++) {
+            if (cache->characteristics[j].path >= header->strings_size ||
+                cache->characteristics[j].uuid >= header->strings_size) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+lb_result_t
+_gatt_cache_populate(struct lb_gatt_cache* cache,
+                     struct lb_string_table* strings,
+                     lb_bl_device* dev)
+{
+    const struct gatt_cache_device* device;
+    lb_ble_service** services;
+    uint32_t i, j;
+    int index;
+
+    if (cache == NULL || dev == NULL) {
+        return -LB_ERROR_NO_RESOURCES;
+    }
+
+    index = _gatt_cache_find_device(cache, dev->address);
+    if (index < 0 || cache->stale[index]) {
+        return -LB_ERROR_NO_RESOURCES;
+    }
+
+    device = &cache->devices[index];
+    if (device->services_count == 0) {
+        return -LB_ERROR_NO_RESOURCES;
+    }
+
+    if (!_gatt_cache_device_in_range(cache, device)) {
+        syslog(LOG_ERR, "%s: cache entry of %s is corrupted", __FUNCTION__, dev->address);
+        _gatt_cache_invalidate(cache, dev->address);
+        return -LB_ERROR_NO_RESOURCES;
+    }
+
+    services = (lb_ble_service**) calloc(device->services_count, sizeof(lb_ble_service*));
+    if (services == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for services", __FUNCTION__);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+    dev->services = services;
+    dev->services_size = device->services_count;
+
+    for (i = 0; i < device->services_count; i++) {
+        const struct gatt_cache_service* cached = &cache->services[device->first_service + i];
+        lb_ble_service* service = (lb_ble_service*) calloc(1, sizeof(lb_service_entry));
+        if (service == NULL) {
+            goto fail;
+        }
+        services[i] = service;
+
+        service->service_path = _string_table_intern(strings, cache->strings + cached->path);
+        service->uuid = _string_table_intern(strings, cache->strings + cached->uuid);
+        service->primary = cached->primary ? true : false;
+        if (service->service_path == NULL || service->uuid == NULL) {
+            goto fail;
+        }
+
+        if (cached->characteristics_count == 0) {
+            continue;
+        }
+
+        service->characteristics =
+        (lb_ble_char**) calloc(cached->characteristics_count, sizeof(lb_ble_char*));
+        if (service->characteristics == NULL) {
+            goto fail;
+        }
+
+        for (j = 0; j < cached->characteristics_count; j++) {
+            const struct gatt_cache_characteristic* cached_char =
+            &cache->characteristics[cached->first_characteristic + j];
+            lb_ble_char* characteristic = (lb_ble_char*) calloc(1, sizeof(lb_char_entry));
+            if (characteristic == NULL) {
+                goto fail;
+            }
+            service->characteristics[j] = characteristic;
+            service->characteristics_size++;
+
+            characteristic->char_path =
+            _string_table_intern(strings, cache->strings + cached_char->path);
+            characteristic->uuid = _string_table_intern(strings, cache->strings + cached_char->uuid);
+            if (characteristic->char_path == NULL || characteristic->uuid == NULL) {
+                goto fail;
+            }
+        }
+    }
+
+    return LB_SUCCESS;
+
+fail:
+    syslog(LOG_ERR, "%s: Error allocating memory for cached services", __FUNCTION__);
+    _free_device_services(dev);
+    return -LB_ERROR_MEMEORY_ALLOCATION;
+}
+
+void
+_gatt_cache_invalidate(struct lb_gatt_cache* cache, const char* address)
+{
+    int index;
+
+    if (cache == NULL) {
+        return;
+    }
+
+    index = _gatt_cache_find_device(cache, address);
+    if (index >= 0 && !cache->stale[index]) {
+        cache->stale[index] = true;
+        cache->dirty = true;
+    }
+}
+
+void
+_gatt_cache_mark_dirty(struct lb_gatt_cache* cache)
+{
+    if (cache != NULL) {
+        cache->dirty = true;
+    }
+}
+
+static bool
+_builder_grow(void** array, uint32_t* capacity, uint32_t needed, size_t element_size)
+{
+    uint32_t new_capacity;
+    void* new_array;
+
+    if (needed <= *capacity) {
+        return true;
+    }
+
+    new_capacity = (*capacity == 0) ? 16 : *capacity;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+
+    new_array = realloc(*array, (size_t) new_capacity * element_size);
+    if (new_array == NULL) {
+        return false;
+    }
+
+    *array = new_array;
+    *capacity = new_capacity;
+    return true;
+}
+
+static bool
+_builder_rehash(struct gatt_cache_builder* builder)
+{
+    uint32_t new_capacity = (builder->slots_capacity == 0) ? 64 : builder->slots_capacity * 2;
+    uint32_t* slots = (uint32_t*) calloc(new_capacity, sizeof(uint32_t));
+    uint32_t i;
+
+    if (slots == NULL) {
+        return false;
+    }
+
+    for (i = 0; i < builder->slots_capacity; i++) {
+        uint32_t offset = builder->slots[i];
+        if (offset != 0) {
+            const char* str = builder->strings + offset - 1;
+            uint32_t slot =
+            (uint32_t) _fnv1a(FNV1A_OFFSET_BASIS, str, strlen(str)) & (new_capacity - 1);
+            while (slots[slot] != 0) {
+                slot = (slot + 1) & (new_capacity - 1);
+            }
+            slots[slot] = offset;
+        }
+    }
+
+    free(builder->slots);
+    builder->slots = slots;
+    builder->slots_capacity = new_capacity;
+    return true;
+}
+
+static bool
+_builder_add_string(struct gatt_cache_builder* builder, const char* str, uint32_t* offset_ret)
+{
+    size_t len = strlen(str);
+    uint32_t slot;
+
+    if ((builder->slots_used + 1) * 2 > builder->slots_capacity && !_builder_rehash(builder)) {
+        return false;
+    }
+
+    slot = (uint32_t) _fnv1a(FNV1A_OFFSET_BASIS, str, len) & (builder->slots_capacity - 1);
+    while (builder->slots[slot] != 0) {
+        if (strcmp(builder->strings + builder->slots[slot] - 1, str) == 0) {
+            *offset_ret = builder->slots[slot] - 1;
+            return true;
+        }
+        slot = (slot + 1) & (builder->slots_capacity - 1);
+    }
+
+    if (!_builder_grow((void**) &builder->strings, &builder->strings_capacity,
+                       builder->strings_size + len + 1, sizeof(char))) {
+        return false;
+    }
+
+    memcpy(builder->strings + builder->strings_size, str, len + 1);
+    *offset_ret = builder->strings_size;
+    builder->slots[slot] = builder->strings_size + 1;
+    builder->slots_used++;
+    builder->strings_size += len + 1;
+    return true;
+}
+
+static bool
+_builder_add_device(struct gatt_cache_builder* builder, const char* address, uint32_t services_count)
+{
+    struct gatt_cache_device* device;
+
+    if (!_builder_grow((void**) &builder->devices, &builder->devices_capacity,
+                       builder->devices_count + 1, sizeof(struct gatt_cache_device))) {
+        return false;
+    }
+
+    device = &builder->devices[builder->devices_count];
+    if (!_builder_add_string(builder, address, &device->address)) {
+        return false;
+    }
+    device->first_service = builder->services_count;
+    device->services_count = services_count;
+    builder->devices_count++;
+    return true;
+}
+
+static bool
+_builder_add_service(struct gatt_cache_builder* builder,
+                     const char* path,
+                     const char* uuid,
+                     bool primary,
+                     uint32_t characteristics_count)
+{
+    struct gatt_cache_service* service;
+
+    if (!_builder_grow((void**) &builder->services, &builder->services_capacity,
+                       builder->services_count + 1, sizeof(struct gatt_cache_service))) {
+        return false;
+    }
+
+    service = &builder->services[builder->services_count];
+    if (!_builder_add_string(builder, path, &service->path) ||
+        !_builder_add_string(builder, uuid, &service->uuid)) {
+        return false;
+    }
+    service->primary = primary ? 1 : 0;
+    service->first_characteristic = builder->characteristics_count;
+    service->characteristics_count = characteristics_count;
+    builder->services_count++;
+    return true;
+}
+
+static bool
+_builder_add_characteristic(struct gatt_cache_builder* builder, const char* path, const char* uuid)
+{
+    struct gatt_cache_characteristic* characteristic;
+
+    if (!_builder_grow((void**) &builder->characteristics, &builder->characteristics_capacity,
+                       builder->characteristics_count + 1, sizeof(struct gatt_cache_characteristic))) {
+        return false;
+    }
+
+    characteristic = &builder->characteristics[builder->characteristics_count];
+    if (!_builder_add_string(builder, path, &characteristic->path) ||
+        !_builder_add_string(builder, uuid, &characteristic->uuid)) {
+        return false;
+    }
+    builder->characteristics_count++;
+    return true;
+}
+
+static bool
+_builder_add_live_device(struct gatt_cache_builder* builder, lb_bl_device* dev)
+{
+    int i, j;
+
+    if (!_builder_add_device(builder, dev->address, dev->services_size)) {
+        return false;
+    }
+
+    for (i = 0; i < dev->services_size; i++) {
+        lb_ble_service* service = dev->services[i];
+        if (!_builder_add_service(builder, service->service_path, service->uuid, service->primary,
+                                  service->characteristics_size)) {
+            return false;
+        }
+        for (j = 0; j < service->characteristics_size; j++) {
+            if (!_builder_add_characteristic(builder, service->characteristics[j]->char_path,
+                                             service->characteristics[j]->uuid)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static bool
+_builder_add_mapped_device(struct gatt_cache_builder* builder,
+                           struct lb_gatt_cache* cache,
+                           const struct gatt_cache_device* device)
+{
+    uint32_t i, j;
+
+    if (!_builder_add_device(builder, cache->strings + device->address, device->services_count)) {
+        return false;
+    }
+
+    for (i = device->first_service; i < device->first_service + device->services_count; i++) {
+        const struct gatt_cache_service* service = &cache->services[i];
+        if (!_builder_add_service(builder, cache->strings + service->path,
+                                  cache->strings + service->uuid, service->primary,
+                                  service->characteristics_count)) {
+            return false;
+        }
+        for (j = service->first_characteristic;
+             j < service->first_characteristic + service->characteristics_count; j++) {
+            if (!_builder_add_characteristic(builder, cache->strings + cache->characteristics[j].path,
+                                             cache->strings + cache->characteristics[j].uuid)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static void
+_builder_free(struct gatt_cache_builder* builder)
+{
+    free(builder->devices);
+    free(builder->services);
+    free(builder->characteristics);
+    free(builder->strings);
+    free(builder->slots);
+}
+
+static const char* sort_strings = NULL;
+
+static int
+_compare_devices(const void* a, const void* b)
+{
+    const struct gatt_cache_device* first = (const struct gatt_cache_device*) a;
+    const struct gatt_cache_device* second = (const struct gatt_cache_device*) b;
+
+    return strcmp(sort_strings + first->address, sort_strings + second->address);
+}
+
+static bool
+_is_device_cacheable(lb_bl_device* dev)
+{
+    return dev != NULL && dev->services_size > 0 && dev->address != NULL &&
+           strcmp(dev->address, "null") != 0;
+}
+
+static bool
+_write_all(int fd, const void* data, size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*) data;
+    ssize_t written;
+
+    while (size > 0) {
+        written = write(fd, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        bytes += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+lb_result_t
+_gatt_cache_save(struct lb_gatt_cache* cache, lb_bl_device** devices, int devices_size)
+{
+    struct gatt_cache_builder builder;
+    struct gatt_cache_header header;
+    char* tmp_path = NULL;
+    uint64_t hash;
+    uint32_t i;
+    int j, fd = -1;
+    lb_result_t result = -LB_ERROR_UNSPECIFIED;
+
+    if (cache == NULL) {
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    if (!cache->dirty) {
+        return LB_SUCCESS;
+    }
+
+    memset(&builder, 0, sizeof(builder));
+
+    for (j = 0; j < devices_size; j++) {
+        if (_is_device_cacheable(devices[j]) && !_builder_add_live_device(&builder, devices[j])) {
+            syslog(LOG_ERR, "%s: Error allocating memory for cache entries", __FUNCTION__);
+            result = -LB_ERROR_MEMEORY_ALLOCATION;
+            goto out;
+        }
+    }
+
+    /* keep still valid entries of devices that were not discovered in this run */
+    for (i = 0; cache->header != NULL && i < cache->header->devices_count; i++) {
+        const char* address = cache->strings + cache->devices[i].address;
+        bool live = false;
+
+        if (cache->stale[i] || !_gatt_cache_device_in_range(cache, &cache->devices[i])) {
+            continue;
+        }
+        for (j = 0; j < devices_size && !live; j++) {
+            live = _is_device_cacheable(devices[j]) && strcmp(devices[j]->address, address) == 0;
+        }
+        if (!live && !_builder_add_mapped_device(&builder, cache, &cache->devices[i])) {
+            syslog(LOG_ERR, "%s: Error allocating memory for cache entries", __FUNCTION__);
+            result = -LB_ERROR_MEMEORY_ALLOCATION;
+            goto out;
+        }
+    }
+
+    if (builder.strings_size == 0) {
+        builder.strings = (char*) calloc(1, sizeof(char));
+        if (builder.strings == NULL) {
+            result = -LB_ERROR_MEMEORY_ALLOCATION;
+            goto out;
+        }
+        builder.strings_size = 1;
+    }
+
+    sort_strings = builder.strings;
+    qsort(builder.devices, builder.devices_count, sizeof(struct gatt_cache_device), _compare_devices);
+    sort_strings = NULL;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = GATT_CACHE_MAGIC;
+    header.version = GATT_CACHE_VERSION;
+    header.devices_count = builder.devices_count;
+    header.services_count = builder.services_count;
+    header.characteristics_count = builder.characteristics_count;
+    header.strings_size = builder.strings_size;
+    header.file_size = sizeof(header) + builder.devices_count * sizeof(struct gatt_cache_device) +
+                       builder.services_count * sizeof(struct gatt_cache_service) +
+                       builder.characteristics_count * sizeof(struct gatt_cache_characteristic) +
+                       builder.strings_size;
+
+    hash = _fnv1a(FNV1A_OFFSET_BASIS, builder.devices,
+                  builder.devices_count * sizeof(struct gatt_cache_device));
+    hash = _fnv1a(hash, builder.services, builder.services_count * sizeof(struct gatt_cache_service));
+    hash = _fnv1a(hash, builder.characteristics,
+                  builder.characteristics_count * sizeof(struct gatt_cache_characteristic));
+    hash = _fnv1a(hash, builder.strings, builder.strings_size);
+    header.hash = hash;
+
+    tmp_path = (char*) malloc(strlen(cache->path) + 5);
+    if (tmp_path == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for temporary path", __FUNCTION__);
+        result = -LB_ERROR_MEMEORY_ALLOCATION;
+        goto out;
+    }
+    sprintf(tmp_path, "%s.tmp", cache->path);
+
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        syslog(LOG_ERR, "%s: Failed to create %s: %s", __FUNCTION__, tmp_path, strerror(errno));
+        goto out;
+    }
+
+    if (!_write_all(fd, &header, sizeof(header)) ||
+        !_write_all(fd, builder.devices, builder.devices_count * sizeof(struct gatt_cache_device)) ||
+        !_write_all(fd, builder.services, builder.services_count * sizeof(struct gatt_cache_service)) ||
+        !_write_all(fd, builder.characteristics,
+                    builder.characteristics_count * sizeof(struct gatt_cache_characteristic)) ||
+        !_write_all(fd, builder.strings, builder.strings_size)) {
+        syslog(LOG_ERR, "%s: Failed to write %s: %s", __FUNCTION__, tmp_path, strerror(errno));
+        unlink(tmp_path);
+        goto out;
+    }
+
+    /* the current mapping stays valid, it keeps referencing the replaced inode */
+    if (close(fd) < 0 || rename(tmp_path, cache->path) < 0) {
+        fd = -1;
+        syslog(LOG_ERR, "%s: Failed to replace %s: %s", __FUNCTION__, cache->path, strerror(errno));
+        unlink(tmp_path);
+        goto out;
+    }
+    fd = -1;
+
+    cache->dirty = false;
+    result = LB_SUCCESS;
+
+out:
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(tmp_path);
+    _builder_free(&builder);
+    return result;
+}
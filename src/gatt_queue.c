@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2016 Intel Corporation.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Per device queue of GATT operations.
+ *
+ * BlueZ rejects a GATT request on a device while another one is pending, so the reads and writes
+ * of a device wait here and littleb.c sends them one at a time, the next one from the reply of the
+ * previous so the link never idles while work is queued. Each priority class is a FIFO of futures
+ * linked through the futures themselves, no control operation waits behind a bulk one. An
+ * operation whose deadline passed while it waited completes with LB_ERROR_TIMEOUT instead of
+ * being sent.
+ */
+
+#include "littleb_internal.h"
+
+void
+_gatt_queue_push(struct lb_gatt_queue* queue, lb_future* future)
+{
+    lb_priority_t priority = future->priority;
+
+    future->queue = queue;
+    future->next = NULL;
+    if (queue->tail[priority] == NULL) {
+        queue->head[priority] = future;
+    } else {
+        queue->tail[priority]->next = future;
+    }
+    queue->tail[priority] = future;
+
+    queue->stats.depth++;
+    if (queue->stats.depth > queue->stats.max_depth) {
+        queue->stats.max_depth = queue->stats.depth;
+    }
+}
+
+static void
+_gatt_queue_unlink(struct lb_gatt_queue* queue, lb_future* future, lb_future* prev)
+{
+    lb_priority_t priority = future->priority;
+
+    if (prev == NULL) {
+        queue->head[priority] = future->next;
+    } else {
+        prev->next = future->next;
+    }
+    if (queue->tail[priority] == future) {
+        queue->tail[priority] = prev;
+    }
+
+    future->next = NULL;
+    future->queue = NULL;
+    queue->stats.depth--;
+}
+
+void
+_gatt_queue_remove(struct lb_gatt_queue* queue, lb_future* future)
+{
+    lb_future* prev = NULL;
+    lb_future* it;
+
+    if (queue->in_flight == future) {
+        queue->in_flight = NULL;
+        future->queue = NULL;
+        return;
+    }
+
+    for (it = queue->head[future->priority]; it != NULL; prev = it, it = it->next) {
+        if (it == future) {
+            _gatt_queue_unlink(queue, future, prev);
+            return;
+        }
+    }
+}
+
+lb_future*
+_gatt_queue_pop(struct lb_gatt_queue* queue, uint64_t now)
+{
+    lb_future* future;
+    int priority = 0;
+
+    if (queue->closed) {
+        return NULL;
+    }
+
+    while (queue->in_flight == NULL && priority < LB_PRIORITY_CLASSES) {
+        future = queue->head[priority];
+        if (future == NULL) {
+            priority++;
+            continue;
+        }
+        _gatt_queue_unlink(queue, future, NULL);
+
+        if (future->deadline != 0 && now >= future->deadline) {
+            queue->stats.expired++;
+            _future_complete(future, -LB_ERROR_TIMEOUT);
+            // the callback may have queued a more urgent operation or sent one already
+            priority = 0;
+            continue;
+        }
+
+        future->queue = queue;
+        queue->in_flight = future;
+        queue->stats.dispatched++;
+        return future;
+    }
+
+    return NULL;
+}
+
+bool
+_gatt_queue_pending(const struct lb_gatt_queue* queue)
+{
+    return queue->in_flight == NULL && queue->stats.depth > 0;
+}
+
+void
+_gatt_queue_fail(struct lb_gatt_queue* queue, lb_result_t result)
+{
+    lb_future* future;
+    int priority;
+
+    queue->closed = true;
+    if (queue->in_flight != NULL) {
+        future = queue->in_flight;
+        _gatt_queue_remove(queue, future);
+        _future_complete(future, result);
+    }
+
+    for (priority = 0; priority < LB_PRIORITY_CLASSES; priority++) {
+        while ((future = queue->head[priority]) != NULL) {
+            _gatt_queue_unlink(queue, future, NULL);
+            _future_complete(future, result);
+        }
+    }
+}
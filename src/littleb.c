@@ -21,14 +21,24 @@
  * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
  * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+
 #include "littleb.h"
 #include "littleb_internal_types.h"
 
 static sd_event* event = NULL;
 static pthread_t event_thread;
+static bool event_thread_started = false;
 static event_matches_callbacks** events_matches_array = NULL;
 static uint event_arr_size = 0;
 static lb_context lb_ctx = NULL;
+static char* gatt_cache_file = NULL;
 
 void*
 _run_event_loop(void* arg)
@@ -106,1474 +116,6647 @@ _is_bus_connected()
     }
 }
 
-lb_result_t
-_get_root_objects(const char** objects)
+uint64_t
+_now_usec()
 {
-    int r = 0, i = 0;
-    const char* device_path;
-    sd_bus_error error = SD_BUS_ERROR_NULL;
-    sd_bus_message* reply = NULL;
-
-    if (!_is_bus_connected(lb_ctx)) {
-        syslog(LOG_ERR, "%s: Bus is not opened", __FUNCTION__);
-        sd_bus_error_free(&error);
-        return -LB_ERROR_INVALID_BUS;
-    }
-
-    r = sd_bus_call_method(lb_ctx->bus, BLUEZ_DEST, "/", "org.freedesktop.DBus.ObjectManager",
-                           "GetManagedObjects", &error, &reply, NULL);
-    if (r < 0) {
-        syslog(LOG_ERR, "%s: sd_bus_call_method GetManagedObjects failed with error: %s",
-               __FUNCTION__, error.message);
-        sd_bus_error_free(&error);
-        sd_bus_message_unref(reply);
-        return -LB_ERROR_SD_BUS_CALL_FAIL;
-    }
-
-    /* Parse the response message */
-    //"a{oa{sa{sv}}}"
-    r = sd_bus_message_enter_container(reply, 'a', "{oa{sa{sv}}}");
-    if (r < 0) {
-        syslog(LOG_ERR, "%s: sd_bus_message_enter_container {oa{sa{sv}}} failed with error: %s",
-               __FUNCTION__, strerror(-r));
-        sd_bus_error_free(&error);
-        sd_bus_message_unref(reply);
-        return -LB_ERROR_UNSPECIFIED;
-    }
-
-    while ((r = sd_bus_message_enter_container(reply, 'e', "oa{sa{sv}}")) > 0) {
-        r = sd_bus_message_read_basic(reply, 'o', &device_path);
-        if (r < 0) {
-            syslog(LOG_ERR, "%s: sd_bus_message_read_basic failed with error: %s", __FUNCTION__, strerror(-r));
-            sd_bus_error_free(&error);
-            sd_bus_message_unref(reply);
-        } else {
-            char* new_device_path = (char*) malloc(strlen(device_path) + 1);
-            if (new_device_path == NULL) {
-                syslog(LOG_ERR, "%s: Error allocating memory for object name", __FUNCTION__);
-                sd_bus_error_free(&error);
-                sd_bus_message_unref(reply);
-                return -LB_ERROR_MEMEORY_ALLOCATION;
-            }
-            objects[i] = strcpy(new_device_path, device_path);
-            i++;
-        }
+    struct timespec ts;
 
-        r = sd_bus_message_skip(reply, "a{sa{sv}}");
-        if (r < 0) {
-            syslog(LOG_ERR, "%s: sd_bus_message_skip failed with error: %s", __FUNCTION__, strerror(-r));
-            sd_bus_error_free(&error);
-            sd_bus_message_unref(reply);
-            return -LB_ERROR_UNSPECIFIED;
-        }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
 
-        r = sd_bus_message_exit_container(reply);
-        if (r < 0) {
-            syslog(LOG_ERR, "%s: sd_bus_message_exit_container oa{sa{sv}} failed with error: %s",
-                   __FUNCTION__, strerror(-r));
-            sd_bus_error_free(&error);
-            sd_bus_message_unref(reply);
-            return -LB_ERROR_UNSPECIFIED;
-        }
+/**
+ * Reply timeout of a call
+ *
+ * @param options of the call, NULL for the context default
+ * @return usec to wait for the reply, 0 for the sd-bus default
+ */
+uint64_t
+_call_timeout(const lb_call_options* options)
+{
+    if (options != NULL && options->timeout_ms > 0) {
+        return (uint64_t) options->timeout_ms * 1000;
     }
 
-    if (r < 0) {
-        syslog(LOG_ERR, "%s: sd_bus_message_enter_container oa{sa{sv}} failed with error: %s",
-               __FUNCTION__, strerror(-r));
-        sd_bus_error_free(&error);
-        sd_bus_message_unref(reply);
-        return -LB_ERROR_UNSPECIFIED;
-    }
+    return lb_ctx->call_timeout;
+}
 
-    r = sd_bus_message_exit_container(reply);
-    if (r < 0) {
-        syslog(LOG_ERR, "%s: sd_bus_message_exit_container {oa{sa{sv}}} failed with error: %s",
-               __FUNCTION__, strerror(-r));
-        sd_bus_error_free(&error);
-        sd_bus_message_unref(reply);
-        return -LB_ERROR_UNSPECIFIED;
-    }
+bool
+_call_options_valid(const lb_call_options* options)
+{
+    return options == NULL || (options->priority >= 0 && options->priority < LB_PRIORITY_CLASSES);
+}
 
-    sd_bus_error_free(&error);
-    sd_bus_message_unref(reply);
-    return LB_SUCCESS;
+/**
+ * Result of a failed call, a reply that did not arrive in time is told apart
+ *
+ * @param r negative errno returned by sd_bus_call
+ * @return -LB_ERROR_TIMEOUT or -LB_ERROR_SD_BUS_CALL_FAIL
+ */
+lb_result_t
+_call_result(int r)
+{
+    return (r == -ETIMEDOUT) ? -LB_ERROR_TIMEOUT : -LB_ERROR_SD_BUS_CALL_FAIL;
 }
 
-const char*
-_get_device_name(const char* device_path)
+/**
+ * sd_bus_call_method on BlueZ with a reply timeout
+ *
+ * @param path of the object
+ * @param interface of the method
+ * @param member method name
+ * @param timeout usec to wait for the reply, 0 for the sd-bus default
+ * @param error to populate on failure
+ * @param reply to populate with the reply, NULL to drop it
+ * @param types signature of the arguments, NULL for none
+ * @return negative errno on failure
+ */
+int
+_call_method(const char* path,
+             const char* interface,
+             const char* member,
+             uint64_t timeout,
+             sd_bus_error* error,
+             sd_bus_message** reply,
+             const char* types,
+             ...)
 {
-    sd_bus_error error = SD_BUS_ERROR_NULL;
     int r;
-    char* name;
+    va_list ap;
+    sd_bus_message* call = NULL;
 
-    r = sd_bus_get_property_string(lb_ctx->bus, BLUEZ_DEST, device_path, BLUEZ_DEVICE, "Name", &error, &name);
-    if (r < 0) {
-        syslog(LOG_ERR, "%s: sd_bus_get_property_string Name on device %s failed with error: %s",
-               __FUNCTION__, device_path, error.message);
-        sd_bus_error_free(&error);
-        return NULL;
+    r = sd_bus_message_new_method_call(lb_ctx->bus, &call, BLUEZ_DEST, path, interface, member);
+    if (r >= 0 && types != NULL) {
+        va_start(ap, types);
+        r = sd_bus_message_appendv(call, types, ap);
+        va_end(ap);
     }
+    if (r >= 0) {
+        r = sd_bus_call(lb_ctx->bus, call, timeout, error, reply);
+    } else {
+        sd_bus_error_set_errno(error, r);
+    }
+    sd_bus_message_unref(call);
 
-    sd_bus_error_free(&error);
-    return (const char*) name;
+    return r;
 }
 
-const char*
-_get_device_address(const char* device_path)
+void
+_process_pending_events()
 {
-    sd_bus_error error = SD_BUS_ERROR_NULL;
     int r;
-    char* address;
 
-    r = sd_bus_get_property_string(lb_ctx->bus, BLUEZ_DEST, device_path, BLUEZ_DEVICE, "Address",
-                                   &error, &address);
+    // dispatch the signals queued on our bus while we were blocked in method calls
+    do {
+        r = sd_bus_process(lb_ctx->bus, NULL);
+    } while (r > 0);
+
     if (r < 0) {
-        syslog(LOG_ERR, "%s: sd_bus_get_property_string Address on device %s failed with error: %s",
-               __FUNCTION__, device_path, error.message);
-        sd_bus_error_free(&error);
-        return NULL;
+        syslog(LOG_ERR, "%s: Failed to process bus: %s", __FUNCTION__, strerror(-r));
     }
-
-    sd_bus_error_free(&error);
-    return (const char*) address;
 }
 
-const char*
-_get_service_uuid(const char* service_path)
+int
+_event_prepare()
 {
-    sd_bus_error error = SD_BUS_ERROR_NULL;
     int r;
-    char* name;
 
-    r = sd_bus_get_property_string(lb_ctx->bus, BLUEZ_DEST, service_path, "org.bluez.GattService1",
-                                   "UUID", &error, &name);
-    if (r < 0) {
-        syslog(LOG_ERR, "%s: sd_bus_get_property_string UUID on service %s failed with error: %s",
-               __FUNCTION__, service_path, error.message);
-        sd_bus_error_free(&error);
-        return NULL;
+    // sd_event only moves INITIAL -> ARMED -> PENDING -> INITIAL, pick up wherever the last call
+    // left it
+    switch (sd_event_get_state(lb_ctx->event)) {
+        case SD_EVENT_PENDING:
+            return 1;
+        case SD_EVENT_ARMED:
+            r = sd_event_wait(lb_ctx->event, 0);
+            if (r != 0) {
+                return r;
+            }
+            break;
+        default:
+            break;
     }
 
-    sd_bus_error_free(&error);
-    return (const char*) name;
+    return sd_event_prepare(lb_ctx->event);
 }
 
-const char*
-_get_characteristic_uuid(const char* characteristic_path)
+/**
+ * Bring the loop back to it's initial state, dispatching at most one ready source
+ *
+ * @return 1 if a source was dispatched, callers must check their condition again before blocking
+ */
+int
+_event_reset()
 {
-    sd_bus_error error = SD_BUS_ERROR_NULL;
-    int r;
-    char* name;
-
-    r = sd_bus_get_property_string(lb_ctx->bus, BLUEZ_DEST, characteristic_path,
-                                   BLUEZ_GATT_CHARACTERISTICS, "UUID", &error, &name);
-    if (r < 0) {
-        syslog(LOG_ERR,
-               "%s: sd_bus_get_property_string UUID on characteristic: %s failed with error: %s",
-               __FUNCTION__, characteristic_path, error.message);
-        sd_bus_error_free(&error);
-        return NULL;
+    int r = _event_prepare();
+
+    if (r > 0) {
+        r = sd_event_dispatch(lb_ctx->event);
+    } else if (r == 0) {
+        // nothing ready, give the armed loop back to INITIAL without blocking
+        r = sd_event_wait(lb_ctx->event, 0);
+        if (r > 0) {
+            r = sd_event_dispatch(lb_ctx->event);
+        }
     }
 
-    sd_bus_error_free(&error);
-    return (const char*) name;
+    return r;
 }
 
 bool
-_is_string_in_device_introspection(const char* device_path, const char* str)
+_loop_busy()
 {
-    sd_bus_error error = SD_BUS_ERROR_NULL;
-    sd_bus_message* reply = NULL;
+    return lb_ctx->loop_running && !pthread_equal(lb_ctx->loop_thread, pthread_self());
+}
 
-    int r;
-    bool result = false;
-    const char* introspect_xml;
+void
+_wake_loop()
+{
+    uint64_t one = 1;
 
-    if (!_is_bus_connected(lb_ctx)) {
-        syslog(LOG_ERR, "%s: Bus is not opened", __FUNCTION__);
-        sd_bus_error_free(&error);
-        return -LB_ERROR_INVALID_BUS;
+    if (write(lb_ctx->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        syslog(LOG_ERR, "%s: Failed to wake the event loop: %s", __FUNCTION__, strerror(errno));
     }
+}
 
-    r = sd_bus_call_method(lb_ctx->bus, BLUEZ_DEST, device_path,
-                           "org.freedesktop.DBus.Introspectable", "Introspect", &error, &reply, NULL);
-    if (r < 0) {
-        syslog(LOG_ERR, "%s: sd_bus_call_method Introspect on device %s failed with error: %s",
-               __FUNCTION__, device_path, error.message);
-        sd_bus_error_free(&error);
-        sd_bus_message_unref(reply);
-        return false;
-    }
+int
+_on_loop_wake(sd_event_source* source, int fd, uint32_t revents, void* userdata)
+{
+    uint64_t count;
 
-    r = sd_bus_message_read_basic(reply, 's', &introspect_xml);
-    if (r < 0) {
-        syslog(LOG_ERR, "%s: sd_bus_message_read_basic failed with error: %s", __FUNCTION__, strerror(-r));
-        sd_bus_error_free(&error);
-        sd_bus_message_unref(reply);
-        return false;
+    // only there to return from sd_event_wait, the thread wanting the bus takes over
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        syslog(LOG_ERR, "%s: Failed to read wake counter: %s", __FUNCTION__, strerror(errno));
     }
 
-    result = (strstr(introspect_xml, str) != NULL) ? true : false;
+    return 0;
+}
 
-    sd_bus_error_free(&error);
-    sd_bus_message_unref(reply);
+/**
+ * Take the context lock once no other thread blocks in the loop, bus and event are then ours until
+ * _context_unlock. The lock is recursive, lock_depth is above 1 when called back from the loop.
+ *
+ * @return Result of operation
+ */
+lb_result_t
+_context_lock()
+{
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
 
-    return result;
+    pthread_mutex_lock(&(lb_ctx->lock));
+    if (_loop_busy()) {
+        lb_ctx->lock_waiters++;
+        do {
+            _wake_loop();
+            pthread_cond_wait(&(lb_ctx->loop_released), &(lb_ctx->lock));
+        } while (_loop_busy());
+        lb_ctx->lock_waiters--;
+    }
+    lb_ctx->lock_depth++;
+
+    return LB_SUCCESS;
 }
 
-bool
-_is_bl_device(const char* device_path)
+void
+_context_unlock()
 {
-    return _is_string_in_device_introspection(device_path, BLUEZ_DEVICE);
+    lb_ctx->lock_depth--;
+    pthread_cond_broadcast(&(lb_ctx->loop_released));
+    pthread_mutex_unlock(&(lb_ctx->lock));
 }
 
-bool
-_is_ble_device(const char* device_path)
+/**
+ * Release the context lock until loop_released is broadcast or usec passed
+ *
+ * @param usec to wait at most, UINT64_MAX to wait forever
+ */
+void
+_context_wait(uint64_t usec)
 {
-    const char** objects;
-    int i = 0, r = 0;
-    bool result = false;
-
-    if (!_is_bl_device(device_path)) {
-        syslog(LOG_ERR, "%s: not a bl device", __FUNCTION__);
-        return false;
+    struct timespec ts;
+    uint64_t at;
+    int depth = lb_ctx->lock_depth;
+
+    // the depth belongs to whoever holds the lock meanwhile
+    lb_ctx->lock_depth = 0;
+    if (usec == UINT64_MAX) {
+        pthread_cond_wait(&(lb_ctx->loop_released), &(lb_ctx->lock));
+    } else {
+        at = _now_usec() + usec;
+        ts.tv_sec = at / 1000000;
+        ts.tv_nsec = (at % 1000000) * 1000;
+        pthread_cond_timedwait(&(lb_ctx->loop_released), &(lb_ctx->lock), &ts);
     }
+    lb_ctx->lock_depth = depth;
+}
 
-    lb_bl_device* device = NULL;
-    r = lb_get_device_by_device_path(device_path, &device);
-    if (r < 0) {
-        fprintf(stderr, "ERROR: Device %s not found\n", device_path);
+/**
+ * One sd_event_run with the context lock held, released while blocked if it is not nested
+ *
+ * @param usec to block at most
+ * @return sd_event_run result
+ */
+int
+_event_iterate(uint64_t usec)
+{
+    int depth, r = _event_reset();
+
+    if (r != 0) {
+        return r;
     }
 
-    if (device != NULL && device->services_size > 0)
-        return true;
+    r = sd_event_prepare(lb_ctx->event);
+    if (r == 0 && lb_ctx->lock_depth == 1) {
+        // other threads queue operations meanwhile, they wake us up to use the bus themselves
+        depth = lb_ctx->lock_depth;
+        lb_ctx->lock_depth = 0;
+        lb_ctx->loop_running = true;
+        lb_ctx->loop_thread = pthread_self();
+        pthread_mutex_unlock(&(lb_ctx->lock));
 
-    objects = (const char**) calloc(MAX_OBJECTS, MAX_OBJECTS * sizeof(const char*));
-    if (objects == NULL) {
-        syslog(LOG_ERR, "%s: Error allocating memory for objects array", __FUNCTION__);
-        return -LB_ERROR_MEMEORY_ALLOCATION;
-    }
+        r = sd_event_wait(lb_ctx->event, usec);
 
-    r = _get_root_objects(objects);
-    if (r < 0) {
-        syslog(LOG_ERR, "%s: Error getting root objects", __FUNCTION__);
-        return false;
+        pthread_mutex_lock(&(lb_ctx->lock));
+        lb_ctx->loop_running = false;
+        lb_ctx->lock_depth = depth;
+        pthread_cond_broadcast(&(lb_ctx->loop_released));
+    } else if (r == 0) {
+        r = sd_event_wait(lb_ctx->event, usec);
     }
-
-    while (objects[i] != NULL) {
-        if ((strstr(objects[i], device_path) != NULL) && (strstr(objects[i], "service") != NULL)) {
-            result = true;
-        }
-        free((char*) objects[i]);
-        i++;
+    if (r > 0) {
+        r = sd_event_dispatch(lb_ctx->event);
     }
-    free(objects);
 
-    return result;
+    return r;
 }
 
 bool
-_is_ble_service(const char* service_path)
+_is_path_below(const char* path, const char* parent)
 {
-    return _is_string_in_device_introspection(service_path, BLUEZ_GATT_SERVICE);
-}
+    size_t len = strlen(parent);
 
-bool
-_is_ble_characteristic(const char* service_path)
-{
-    return _is_string_in_device_introspection(service_path, BLUEZ_GATT_CHARACTERISTICS);
+    return strncmp(path, parent, len) == 0 && path[len] == '/';
 }
 
-bool
-_is_service_primary(const char* service_path)
+lb_ble_char*
+_find_characteristic_by_path(const char* characteristic_path)
 {
-    sd_bus_error error = SD_BUS_ERROR_NULL;
-    int r;
-    bool primary;
+    int i, j, k;
 
-    r = sd_bus_get_property_trivial(lb_ctx->bus, BLUEZ_DEST, service_path, "org.bluez.GattService1",
-                                    "Primary", &error, 'b', &primary);
-    if (r < 0) {
-        syslog(LOG_ERR,
-               "%s: sd_bus_get_property_trivial Primary on service %s failed with error: %s",
-               __FUNCTION__, service_path, error.message);
-        sd_bus_error_free(&error);
+    if (characteristic_path == NULL) {
         return NULL;
     }
 
-    sd_bus_error_free(&error);
-    return primary;
-}
-
-bool
-_is_device_paired(const char* device_path)
-{
-    sd_bus_error error = SD_BUS_ERROR_NULL;
-    int r;
-    bool paired;
-
-    r = sd_bus_get_property_trivial(lb_ctx->bus, BLUEZ_DEST, device_path, BLUEZ_DEVICE, "Paired",
-                                    &error, 'b', &paired);
-    if (r < 0) {
-        syslog(LOG_ERR, "%s: sd_bus_get_property_trivial Paired on device %s failed with error: %s",
-               __FUNCTION__, device_path, error.message);
-        sd_bus_error_free(&error);
+    // paths we never interned can't belong to any of our characteristics
+    characteristic_path = _string_table_find(lb_ctx->strings, characteristic_path);
+    if (characteristic_path == NULL) {
         return NULL;
     }
 
-    sd_bus_error_free(&error);
-    return paired;
+    for (i = 0; i < lb_ctx->devices_size; i++) {
+        lb_bl_device* dev = lb_ctx->devices[i];
+        if (!_is_path_below(characteristic_path, dev->device_path))
+            continue;
+        for (j = 0; j < dev->services_size; j++) {
+            for (k = 0; k < dev->services[j]->characteristics_size; k++) {
+                if (characteristic_path == dev->services[j]->characteristics[k]->char_path)
+                    return dev->services[j]->characteristics[k];
+            }
+        }
+    }
+
+    return NULL;
 }
 
 lb_result_t
-_add_new_characteristic(lb_ble_service* service, const char* characteristic_path)
+_update_characteristic_value(lb_ble_char* characteristic, const void* value, size_t size)
 {
-    int current_index = service->characteristics_size;
-    if (service->characteristics_size == 0 || service->characteristics == NULL) {
-        service->characteristics = (lb_ble_char**) malloc(sizeof(lb_ble_char*));
-        if (service->characteristics == NULL) {
-            syslog(LOG_ERR, "%s: Error allocating memory for characteristics", __FUNCTION__);
-            return -LB_ERROR_MEMEORY_ALLOCATION;
-        }
-        service->characteristics_size++;
-    } else {
-        service->characteristics_size++;
-        service->characteristics =
-        realloc(service->characteristics, (service->characteristics_size) * sizeof(lb_ble_char*));
-        if (service->characteristics == NULL) {
-            syslog(LOG_ERR, "%s: Error reallocating memory for characteristics", __FUNCTION__);
+    if (size > characteristic->value_capacity) {
+        uint8_t* new_value = (uint8_t*) realloc(characteristic->value, size);
+        if (new_value == NULL) {
+            syslog(LOG_ERR, "%s: Error allocating memory for characteristic value", __FUNCTION__);
             return -LB_ERROR_MEMEORY_ALLOCATION;
         }
+        characteristic->value = new_value;
+        characteristic->value_capacity = size;
     }
 
-    lb_ble_char* new_characteristic = (lb_ble_char*) malloc(sizeof(lb_ble_char));
-    if (new_characteristic == NULL) {
-        syslog(LOG_ERR, "%s: Error allocating memory for new characteristic", __FUNCTION__);
-        service->characteristics_size--;
-        return -LB_ERROR_MEMEORY_ALLOCATION;
-    }
-
-    new_characteristic->char_path = strdup(characteristic_path);
-    if (new_characteristic->char_path == NULL) {
-        syslog(LOG_ERR, "%s: Error allocating memory for new characteristic", __FUNCTION__);
-        service->characteristics_size--;
-        return -LB_ERROR_MEMEORY_ALLOCATION;
-    }
-
-    const char* uuid = _get_characteristic_uuid(characteristic_path);
-    if (uuid == NULL) {
-        syslog(LOG_ERR, "%s: Error couldn't find characteristic uuid", __FUNCTION__);
-        new_characteristic->uuid = strdup("null");
-        if (new_characteristic->uuid == NULL) {
-            syslog(LOG_ERR, "%s: Error allocating memory for new characteristic uuid", __FUNCTION__);
-            service->characteristics_size--;
-            return -LB_ERROR_MEMEORY_ALLOCATION;
-        }
-    } else {
-        new_characteristic->uuid = uuid;
+    if (size > 0) {
+        memcpy(characteristic->value, value, size);
     }
-
-    service->characteristics[current_index] = new_characteristic;
+    characteristic->value_size = size;
+    characteristic->value_timestamp = _now_usec();
 
     return LB_SUCCESS;
 }
 
-lb_result_t
-_add_new_service(lb_bl_device* dev, const char* service_path)
+int
+_on_characteristic_properties_changed(sd_bus_message* message, void* userdata, sd_bus_error* error)
 {
-    if (!_is_ble_device(dev->device_path)) {
-        syslog(LOG_ERR, "%s: not a ble device", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
+    int r;
+    const char* property;
+    const void* value;
+    size_t size;
+    lb_ble_char* characteristic = _find_characteristic_by_path(sd_bus_message_get_path(message));
+
+    if (characteristic == NULL) {
+        return 0;
     }
 
-    int current_index = dev->services_size;
-    if (dev->services_size == 0 || dev->services == NULL) {
-        dev->services = (lb_ble_service**) malloc(sizeof(lb_ble_service*));
-        if (dev->services == NULL) {
-            syslog(LOG_ERR, "%s: Error allocating memory for services", __FUNCTION__);
-            return -LB_ERROR_MEMEORY_ALLOCATION;
-        }
-        dev->services_size++;
-    } else {
-        dev->services_size++;
-        dev->services = realloc(dev->services, (dev->services_size) * sizeof(lb_ble_service*));
-        if (dev->services == NULL) {
-            syslog(LOG_ERR, "%s: Error reallocating memory for services", __FUNCTION__);
-            return -LB_ERROR_MEMEORY_ALLOCATION;
-        }
-    }
-
-    lb_ble_service* new_service = (lb_ble_service*) malloc(sizeof(lb_ble_service));
-    if (new_service == NULL) {
-        syslog(LOG_ERR, "%s: Error allocating memory for new_service", __FUNCTION__);
-        dev->services_size--;
-        return -LB_ERROR_MEMEORY_ALLOCATION;
+    r = sd_bus_message_skip(message, "s");
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_message_skip failed with error: %s", __FUNCTION__, strerror(-r));
+        return 0;
     }
 
-    new_service->service_path = strdup(service_path);
-    if (new_service->service_path == NULL) {
-        syslog(LOG_ERR, "%s: Error allocating memory for new service", __FUNCTION__);
-        return -LB_ERROR_MEMEORY_ALLOCATION;
+    r = sd_bus_message_enter_container(message, 'a', "{sv}");
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_message_enter_container {sv} failed with error: %s",
+               __FUNCTION__, strerror(-r));
+        return 0;
     }
 
-    const char* uuid = _get_service_uuid(service_path);
-    if (uuid == NULL) {
-        syslog(LOG_ERR, "%s: Error couldn't find service uuid", __FUNCTION__);
-        new_service->uuid = strdup("null");
-        if (new_service->uuid == NULL) {
-            syslog(LOG_ERR, "%s: Error allocating memory for new service uuid", __FUNCTION__);
-            dev->services_size--;
-            return -LB_ERROR_MEMEORY_ALLOCATION;
+    while ((r = sd_bus_message_enter_container(message, 'e', "sv")) > 0) {
+        r = sd_bus_message_read_basic(message, 's', &property);
+        if (r < 0)
+            break;
+
+        if (strcmp(property, "Value") == 0) {
+            r = sd_bus_message_enter_container(message, 'v', "ay");
+            if (r < 0)
+                break;
+            r = sd_bus_message_read_array(message, 'y', &value, &size);
+            if (r < 0)
+                break;
+            _update_characteristic_value(characteristic, value, size);
+            r = sd_bus_message_exit_container(message);
+        } else if (strcmp(property, "MTU") == 0) {
+            // renegotiated, later streams size their chunks to it
+            r = sd_bus_message_read(message, "v", "q", &(((lb_char_entry*) characteristic)->mtu));
+        } else {
+            r = sd_bus_message_skip(message, "v");
         }
-    } else {
-        new_service->uuid = uuid;
-    }
+        if (r < 0)
+            break;
 
-    new_service->primary = _is_service_primary(service_path);
-
-    new_service->characteristics = NULL;
-    new_service->characteristics_size = 0;
+        r = sd_bus_message_exit_container(message);
+        if (r < 0)
+            break;
+    }
 
-    dev->services[current_index] = new_service;
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed to parse PropertiesChanged of %s: %s", __FUNCTION__,
+               characteristic->char_path, strerror(-r));
+    }
 
-    return LB_SUCCESS;
+    return 0;
 }
 
 lb_result_t
-_add_new_device(const char* device_path)
+_object_iter_attach(lb_object_iter* iter, sd_bus_message* reply)
 {
-    int current_index = lb_ctx->devices_size;
-    if (lb_ctx->devices_size == 0 || lb_ctx->devices == NULL) {
-        lb_ctx->devices = (lb_bl_device**) malloc(sizeof(lb_bl_device*));
-        if (lb_ctx->devices == NULL) {
-            syslog(LOG_ERR, "%s: Error allocating memory for devices", __FUNCTION__);
-            return -LB_ERROR_MEMEORY_ALLOCATION;
-        }
-        lb_ctx->devices_size++;
-    } else {
-        lb_ctx->devices_size++;
-        lb_ctx->devices = realloc(lb_ctx->devices, (lb_ctx->devices_size) * sizeof(lb_bl_device*));
-        if (lb_ctx->devices == NULL) {
-            syslog(LOG_ERR, "%s: Error reallocating memory for devices", __FUNCTION__);
-            return -LB_ERROR_MEMEORY_ALLOCATION;
-        }
-    }
-
-    lb_bl_device* new_device = (lb_bl_device*) malloc(sizeof(lb_bl_device));
-    if (new_device == NULL) {
-        syslog(LOG_ERR, "%s: Error allocating memory for new_device", __FUNCTION__);
-        lb_ctx->devices_size--;
-        return -LB_ERROR_MEMEORY_ALLOCATION;
-    }
-
-    new_device->device_path = strdup(device_path);
-    if (new_device->device_path == NULL) {
-        syslog(LOG_ERR, "%s: Error allocating memory for new_device", __FUNCTION__);
-        lb_ctx->devices_size--;
-        return -LB_ERROR_MEMEORY_ALLOCATION;
-    }
+    int r;
 
-    const char* name = _get_device_name(device_path);
-    if (name == NULL) {
-        syslog(LOG_ERR, "%s: Error couldn't find device name", __FUNCTION__);
-        new_device->name = strdup("null");
-        if (new_device->name == NULL) {
-            syslog(LOG_ERR, "%s: Error allocating memory for new device", __FUNCTION__);
-            lb_ctx->devices_size--;
-            return -LB_ERROR_MEMEORY_ALLOCATION;
-        }
+    iter->reply = sd_bus_message_ref(reply);
 
-    } else {
-        new_device->name = name;
-    }
-    const char* address = _get_device_address(device_path);
-    if (address == NULL) {
-        syslog(LOG_ERR, "%s: Error couldn't find device address", __FUNCTION__);
-        new_device->address = "null";
-    } else {
-        new_device->address = address;
+    // a new reply is read from the start, only the object array has to be entered
+    r = sd_bus_message_enter_container(iter->reply, 'a', "{oa{sa{sv}}}");
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_message_enter_container {oa{sa{sv}}} failed with error: %s",
+               __FUNCTION__, strerror(-r));
+        iter->reply = sd_bus_message_unref(iter->reply);
+        return -LB_ERROR_UNSPECIFIED;
     }
 
-    new_device->services = NULL;
-    new_device->services_size = 0;
-
-    // new_device->address = convert_device_path_to_address(device_path);
-    lb_ctx->devices[current_index] = new_device;
-
+    iter->path = NULL;
+    iter->interface = NULL;
+    iter->depth = 0;
+    iter->properties_pending = false;
     return LB_SUCCESS;
 }
 
 lb_result_t
-_scan_devices(int seconds)
+_object_iter_init(lb_object_iter* iter)
 {
-    int r = 0;
+    int r;
+    sd_bus_message* reply = NULL;
     sd_bus_error error = SD_BUS_ERROR_NULL;
 
+    iter->reply = NULL;
+
     if (!_is_bus_connected(lb_ctx)) {
         syslog(LOG_ERR, "%s: Bus is not opened", __FUNCTION__);
-        sd_bus_error_free(&error);
         return -LB_ERROR_INVALID_BUS;
     }
 
-    r = sd_bus_call_method(lb_ctx->bus, BLUEZ_DEST, "/org/bluez/hci0", "org.bluez.Adapter1",
-                           "StartDiscovery", &error, NULL, NULL);
+    r = _call_method("/", "org.freedesktop.DBus.ObjectManager", "GetManagedObjects",
+                     lb_ctx->call_timeout, &error, &reply, NULL);
     if (r < 0) {
-        syslog(LOG_ERR, "%s: sd_bus_call_method StartDiscovery failed with error: %s", __FUNCTION__,
-               error.message);
+        syslog(LOG_ERR, "%s: sd_bus_call_method GetManagedObjects failed with error: %s",
+               __FUNCTION__, error.message);
         sd_bus_error_free(&error);
-        return -LB_ERROR_SD_BUS_CALL_FAIL;
+        sd_bus_message_unref(reply);
+        return _call_result(r);
     }
+    sd_bus_error_free(&error);
 
-    sleep(seconds);
-
-    r = sd_bus_call_method(lb_ctx->bus, BLUEZ_DEST, "/org/bluez/hci0", "org.bluez.Adapter1",
-                           "StopDiscovery", &error, NULL, NULL);
-    if (r < 0) {
-        syslog(LOG_ERR, "%s: sd_bus_call_method StopDiscovery failed with error: %s", __FUNCTION__,
-               error.message);
-        sd_bus_error_free(&error);
-        return -LB_ERROR_SD_BUS_CALL_FAIL;
-    }
+    r = _object_iter_attach(iter, reply);
+    sd_bus_message_unref(reply);
+    return r;
+}
 
-    sd_bus_error_free(&error);
-    return LB_SUCCESS;
+void
+_object_iter_finish(lb_object_iter* iter)
+{
+    iter->reply = sd_bus_message_unref(iter->reply);
+    iter->path = NULL;
+    iter->interface = NULL;
 }
 
-lb_result_t
-_open_system_bus()
+int
+_object_iter_close_interface(lb_object_iter* iter)
 {
     int r;
 
-    /* Connect to the system bus */
-    r = sd_bus_open_system(&(lb_ctx->bus));
-    if (r < 0) {
-        syslog(LOG_ERR, "%s: Failed to connect to system bus: %s", __FUNCTION__, strerror(-r));
+    if (iter->properties_pending) {
+        r = sd_bus_message_skip(iter->reply, "a{sv}");
+        if (r < 0)
+            return r;
+        iter->properties_pending = false;
     }
 
-    return r;
+    r = sd_bus_message_exit_container(iter->reply);
+    if (r < 0)
+        return r;
+
+    iter->interface = NULL;
+    iter->depth = 2;
+    return 0;
 }
 
-lb_result_t
-_close_system_bus()
+/**
+ * Move to the next object
+ *
+ * @return 1 with iter->path set, 0 after the last object, negative on a malformed reply
+ */
+int
+_object_iter_next(lb_object_iter* iter)
 {
+    int r;
 
-    sd_bus_unref(lb_ctx->bus);
-    return LB_SUCCESS;
+    if (iter->depth == 3) {
+        r = _object_iter_close_interface(iter);
+        if (r < 0)
+            return r;
+    }
+
+    if (iter->depth == 2) {
+        while ((r = sd_bus_message_skip(iter->reply, "{sa{sv}}")) > 0)
+            ;
+        if (r < 0)
+            return r;
+        r = sd_bus_message_exit_container(iter->reply);
+        if (r < 0)
+            return r;
+        iter->depth = 1;
+    } else if (iter->depth == 1) {
+        r = sd_bus_message_skip(iter->reply, "a{sa{sv}}");
+        if (r < 0)
+            return r;
+    }
+
+    if (iter->depth == 1) {
+        r = sd_bus_message_exit_container(iter->reply);
+        if (r < 0)
+            return r;
+        iter->depth = 0;
+    }
+
+    iter->path = NULL;
+    r = sd_bus_message_enter_container(iter->reply, 'e', "oa{sa{sv}}");
+    if (r <= 0)
+        return r;
+
+    r = sd_bus_message_read_basic(iter->reply, 'o', &(iter->path));
+    if (r < 0)
+        return r;
+
+    iter->depth = 1;
+    return 1;
 }
 
-lb_result_t
-lb_context_new()
+/**
+ * Move to the next interface of the current object
+ *
+ * @return 1 with iter->interface set, 0 after the last interface, negative on a malformed reply
+ */
+int
+_object_iter_next_interface(lb_object_iter* iter)
 {
-    int r = 0;
+    int r;
 
-    if (lb_ctx != NULL) {
-        syslog(LOG_ERR, "%s: Context already initialized", __FUNCTION__);
-        return -LB_ERROR_INVALID_CONTEXT;
+    if (iter->depth == 3) {
+        r = _object_iter_close_interface(iter);
+        if (r < 0)
+            return r;
+    } else if (iter->depth == 1) {
+        r = sd_bus_message_enter_container(iter->reply, 'a', "{sa{sv}}");
+        if (r < 0)
+            return r;
+        iter->depth = 2;
     }
 
-    lb_ctx = (lb_context) malloc(sizeof(struct bl_context));
-    if (lb_ctx == NULL) {
-        syslog(LOG_ERR, "%s: Error allocating memory for lb_context", __FUNCTION__);
-        return -LB_ERROR_INVALID_CONTEXT;
+    if (iter->depth != 2) {
+        return 0;
     }
 
-    lb_ctx->bus = NULL;
-    lb_ctx->devices = NULL;
-    lb_ctx->devices_size = 0;
+    r = sd_bus_message_enter_container(iter->reply, 'e', "sa{sv}");
+    if (r <= 0)
+        return r;
 
-    r = _open_system_bus();
-    if (r < 0) {
-        syslog(LOG_ERR, "%s: Failed to open system bus: %s", __FUNCTION__, strerror(-r));
-        return -LB_ERROR_INVALID_CONTEXT;
-    }
+    r = sd_bus_message_read_basic(iter->reply, 's', &(iter->interface));
+    if (r < 0)
+        return r;
 
-    return LB_SUCCESS;
+    iter->depth = 3;
+    iter->properties_pending = true;
+    return 1;
 }
 
-lb_result_t
-lb_context_free()
+/**
+ * Find an interface of the current object, interfaces before it are skipped
+ *
+ * @return true if the object implements the interface, iter is then positioned on it
+ */
+bool
+_object_iter_has_interface(lb_object_iter* iter, const char* interface)
 {
-    int r = 0, i = 0, j = 0, k = 0;
-
-    if (lb_ctx == NULL) {
-        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_CONTEXT;
+    while (_object_iter_next_interface(iter) > 0) {
+        if (strcmp(iter->interface, interface) == 0)
+            return true;
     }
 
-    r = _close_system_bus(lb_ctx);
-    if (r < 0) {
-        syslog(LOG_ERR, "%s: Failed to close system bus: %s", __FUNCTION__, strerror(-r));
-        return -LB_ERROR_UNSPECIFIED;
-    }
+    return false;
+}
 
-    for (i = 0; i < lb_ctx->devices_size; i++) {
-        for (j = 0; j < lb_ctx->devices[i]->services_size; j++) {
-            for (k = 0; k < lb_ctx->devices[i]->services[j]->characteristics_size; k++) {
-                if (lb_ctx->devices[i]->services[j]->characteristics[k]->char_path != NULL)
-                    free((char*) lb_ctx->devices[i]->services[j]->characteristics[k]->char_path);
-                if (lb_ctx->devices[i]->services[j]->characteristics[k]->uuid != NULL)
-                    free((char*) lb_ctx->devices[i]->services[j]->characteristics[k]->uuid);
-                if (lb_ctx->devices[i]->services[j]->characteristics[k] != NULL)
-                    free(lb_ctx->devices[i]->services[j]->characteristics[k]);
-            }
-            if (lb_ctx->devices[i]->services[j]->service_path != NULL)
-                free((char*) lb_ctx->devices[i]->services[j]->service_path);
-            if (lb_ctx->devices[i]->services[j]->uuid != NULL)
-                free((char*) lb_ctx->devices[i]->services[j]->uuid);
-            if (lb_ctx->devices[i]->services[j]->characteristics != NULL)
-                free(lb_ctx->devices[i]->services[j]->characteristics);
-            if (lb_ctx->devices[i]->services[j] != NULL)
-                free(lb_ctx->devices[i]->services[j]);
-        }
-        if (lb_ctx->devices[i]->address != NULL)
-            free((char*) lb_ctx->devices[i]->address);
-        if (lb_ctx->devices[i]->device_path != NULL)
-            free((char*) lb_ctx->devices[i]->device_path);
-        if (lb_ctx->devices[i]->name != NULL)
-            free((char*) lb_ctx->devices[i]->name);
-        if (lb_ctx->devices[i]->services != NULL)
-            free(lb_ctx->devices[i]->services);
-        if (lb_ctx->devices[i] != NULL)
-            free(lb_ctx->devices[i]);
+/**
+ * Hand out the a{sv} properties of the current interface, the caller has to read all of them
+ *
+ * @return message positioned on the properties, NULL if they were already handed out
+ */
+sd_bus_message*
+_object_iter_properties(lb_object_iter* iter)
+{
+    if (iter->depth != 3 || !iter->properties_pending) {
+        return NULL;
     }
-    if (lb_ctx->devices != NULL)
-        free(lb_ctx->devices);
-    free(lb_ctx);
 
-    lb_ctx = NULL;
-    return LB_SUCCESS;
+    iter->properties_pending = false;
+    return iter->reply;
 }
 
 lb_result_t
-lb_init()
+_parse_gatt_properties(sd_bus_message* message,
+                       const char** uuid,
+                       bool* primary,
+                       const void** value,
+                       size_t* value_size)
 {
-    if (lb_context_new() != LB_SUCCESS)
-        return LB_ERROR_INVALID_CONTEXT;
+    int r, b;
+    const char* property;
 
-    return LB_SUCCESS;
+    r = sd_bus_message_enter_container(message, 'a', "{sv}");
+    if (r < 0)
+        return r;
+
+    while ((r = sd_bus_message_enter_container(message, 'e', "sv")) > 0) {
+        r = sd_bus_message_read_basic(message, 's', &property);
+        if (r < 0)
+            return r;
+
+        if (strcmp(property, "UUID") == 0) {
+            r = sd_bus_message_read(message, "v", "s", uuid);
+        } else if (strcmp(property, "Primary") == 0 && primary != NULL) {
+            r = sd_bus_message_read(message, "v", "b", &b);
+            *primary = b;
+        } else if (strcmp(property, "Value") == 0 && value != NULL) {
+            r = sd_bus_message_enter_container(message, 'v', "ay");
+            if (r >= 0)
+                r = sd_bus_message_read_array(message, 'y', value, value_size);
+            if (r >= 0)
+                r = sd_bus_message_exit_container(message);
+        } else {
+            r = sd_bus_message_skip(message, "v");
+        }
+        if (r < 0)
+            return r;
+
+        r = sd_bus_message_exit_container(message);
+        if (r < 0)
+            return r;
+    }
+    if (r < 0)
+        return r;
+
+    return sd_bus_message_exit_container(message);
 }
 
 lb_result_t
-lb_destroy()
+_replace_string_property(sd_bus_message* message, const char** field)
 {
-    int i, r;
+    int r;
+    const char* value;
+    const char* new_value;
 
-    pthread_cancel(event_thread);
-    pthread_join(event_thread, NULL);
+    r = sd_bus_message_read(message, "v", "s", &value);
+    if (r < 0)
+        return r;
 
-    r = sd_event_exit(event, SIGINT);
-    if (r < 0) {
-        syslog(LOG_ERR, "%s: failed to stop event loop", __FUNCTION__);
+    new_value = _string_table_intern(lb_ctx->strings, value);
+    if (new_value == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for property", __FUNCTION__);
+        return -ENOMEM;
     }
-    sd_event_unref(event);
 
-    if (events_matches_array != NULL) {
-        for (i = 0; i < event_arr_size; i++) {
-            free(events_matches_array[i]);
+    _string_table_release(*field);
+    *field = new_value;
+
+    return 0;
+}
+
+int
+_parse_manufacturer_data(sd_bus_message* message, lb_bl_device_properties* properties)
+{
+    int r;
+    uint16_t id;
+    const void* data;
+    size_t size;
+    uint8_t* new_data;
+
+    r = sd_bus_message_enter_container(message, 'v', "a{qv}");
+    if (r < 0)
+        return r;
+
+    r = sd_bus_message_enter_container(message, 'a', "{qv}");
+    if (r < 0)
+        return r;
+
+    properties->known &= ~LB_DEVICE_PROPERTY_MANUFACTURER_DATA;
+
+    // only the first record is kept, devices advertise a single company identifier in practice
+    r = sd_bus_message_enter_container(message, 'e', "qv");
+    if (r > 0) {
+        r = sd_bus_message_read_basic(message, 'q', &id);
+        if (r < 0)
+            return r;
+        r = sd_bus_message_enter_container(message, 'v', "ay");
+        if (r < 0)
+            return r;
+        r = sd_bus_message_read_array(message, 'y', &data, &size);
+        if (r < 0)
+            return r;
+        r = sd_bus_message_exit_container(message);
+        if (r < 0)
+            return r;
+        r = sd_bus_message_exit_container(message);
+        if (r < 0)
+            return r;
+
+        if (size > properties->manufacturer_data_size || properties->manufacturer_data == NULL) {
+            new_data = (uint8_t*) realloc(properties->manufacturer_data, size > 0 ? size : 1);
+            if (new_data == NULL) {
+                syslog(LOG_ERR, "%s: Error allocating memory for manufacturer data", __FUNCTION__);
+                return -ENOMEM;
+            }
+            properties->manufacturer_data = new_data;
         }
-        free(events_matches_array);
+        memcpy(properties->manufacturer_data, data, size);
+        properties->manufacturer_data_size = size;
+        properties->manufacturer_id = id;
+        properties->known |= LB_DEVICE_PROPERTY_MANUFACTURER_DATA;
     }
+    if (r < 0)
+        return r;
 
-    lb_context_free();
+    // skip the remaining records
+    while ((r = sd_bus_message_skip(message, "{qv}")) > 0)
+        ;
+    if (r < 0)
+        return r;
 
-    return LB_SUCCESS;
+    r = sd_bus_message_exit_container(message);
+    if (r < 0)
+        return r;
+
+    return sd_bus_message_exit_container(message);
 }
 
-lb_result_t
-lb_get_bl_devices(int seconds)
+int
+_parse_device_properties(lb_bl_device* dev, sd_bus_message* message)
 {
-    const char** objects;
-    int i = 0, r = 0;
+    int r;
+    int b;
+    int seen = 0;
+    const char* property;
+    lb_bl_device_properties* properties = &(dev->properties);
 
-    if (lb_ctx == NULL) {
-        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_CONTEXT;
+    r = sd_bus_message_enter_container(message, 'a', "{sv}");
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_message_enter_container {sv} failed with error: %s",
+               __FUNCTION__, strerror(-r));
+        return -LB_ERROR_UNSPECIFIED;
     }
 
-    if (lb_ctx->devices != NULL) {
-        free(lb_ctx->devices);
-    }
+    while ((r = sd_bus_message_enter_container(message, 'e', "sv")) > 0) {
+        r = sd_bus_message_read_basic(message, 's', &property);
+        if (r < 0)
+            break;
+
+        if (strcmp(property, "Name") == 0) {
+            r = _replace_string_property(message, &(dev->name));
+        } else if (strcmp(property, "Address") == 0) {
+            r = _replace_string_property(message, &(dev->address));
+        } else if (strcmp(property, "RSSI") == 0) {
+            r = sd_bus_message_read(message, "v", "n", &(properties->rssi));
+            if (r >= 0)
+                properties->known |= LB_DEVICE_PROPERTY_RSSI;
+            seen++;
+        } else if (strcmp(property, "TxPower") == 0) {
+            r = sd_bus_message_read(message, "v", "n", &(properties->tx_power));
+            if (r >= 0)
+                properties->known |= LB_DEVICE_PROPERTY_TX_POWER;
+            seen++;
+        } else if (strcmp(property, "Appearance") == 0) {
+            r = sd_bus_message_read(message, "v", "q", &(properties->appearance));
+            if (r >= 0)
+                properties->known |= LB_DEVICE_PROPERTY_APPEARANCE;
+        } else if (strcmp(property, "Connected") == 0) {
+            r = sd_bus_message_read(message, "v", "b", &b);
+            properties->connected = b;
+        } else if (strcmp(property, "Paired") == 0) {
+            r = sd_bus_message_read(message, "v", "b", &b);
+            properties->paired = b;
+        } else if (strcmp(property, "Trusted") == 0) {
+            r = sd_bus_message_read(message, "v", "b", &b);
+            properties->trusted = b;
+        } else if (strcmp(property, "ServicesResolved") == 0) {
+            r = sd_bus_message_read(message, "v", "b", &b);
+            properties->services_resolved = b;
+        } else if (strcmp(property, "ManufacturerData") == 0) {
+            r = _parse_manufacturer_data(message, properties);
+            seen++;
+        } else if (strcmp(property, "ServiceData") == 0) {
+            r = sd_bus_message_skip(message, "v");
+            seen++;
+        } else {
+            r = sd_bus_message_skip(message, "v");
+        }
+        if (r < 0)
+            break;
 
-    objects = (const char**) calloc(MAX_OBJECTS, MAX_OBJECTS * sizeof(const char*));
-    if (objects == NULL) {
-        syslog(LOG_ERR, "%s: Error allocating memory for objects array", __FUNCTION__);
-        return -LB_ERROR_MEMEORY_ALLOCATION;
+        r = sd_bus_message_exit_container(message);
+        if (r < 0)
+            break;
     }
 
-    r = _scan_devices(seconds);
     if (r < 0) {
-        syslog(LOG_ERR, "%s: Error getting root objects", __FUNCTION__);
+        syslog(LOG_ERR, "%s: Failed to parse properties of device %s: %s", __FUNCTION__,
+               dev->device_path, strerror(-r));
         return -LB_ERROR_UNSPECIFIED;
     }
 
-    r = _get_root_objects(objects);
+    r = sd_bus_message_exit_container(message);
     if (r < 0) {
-        syslog(LOG_ERR, "%s: Error getting root objects", __FUNCTION__);
+        syslog(LOG_ERR, "%s: sd_bus_message_exit_container {sv} failed with error: %s",
+               __FUNCTION__, strerror(-r));
         return -LB_ERROR_UNSPECIFIED;
     }
 
-    while (objects[i] != NULL) {
-        if (_is_bl_device(objects[i])) {
-            _add_new_device(objects[i]);
-        }
-        free((char*) objects[i]);
-        i++;
-    }
-
-    free(objects);
-
-    return LB_SUCCESS;
+    properties->timestamp = _now_usec();
+    return seen;
 }
 
 lb_result_t
-lb_connect_device(lb_bl_device* dev)
+_get_device_properties(lb_bl_device* dev)
 {
     int r;
     sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message* reply = NULL;
 
-    if (lb_ctx == NULL) {
-        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_CONTEXT;
+    // GetAll lists every property BlueZ has, one it does not list is not known anymore
+    dev->properties.known = 0;
+    r = _call_method(dev->device_path, "org.freedesktop.DBus.Properties", "GetAll",
+                     lb_ctx->call_timeout, &error, &reply, "s", BLUEZ_DEVICE);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_call_method GetAll on device %s failed with error: %s",
+               __FUNCTION__, dev->device_path, error.message);
+        sd_bus_error_free(&error);
+        sd_bus_message_unref(reply);
+        return _call_result(r);
     }
 
-    if (dev == NULL) {
-        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
+    r = _parse_device_properties(dev, reply);
+
+    sd_bus_error_free(&error);
+    sd_bus_message_unref(reply);
+    return (r < 0) ? r : LB_SUCCESS;
+}
+
+lb_bl_device*
+_find_device_by_path(const char* device_path)
+{
+    int row;
+
+    if (device_path == NULL) {
+        return NULL;
     }
 
-    if (!_is_bus_connected(lb_ctx)) {
-        syslog(LOG_ERR, "%s: Bus is not opened", __FUNCTION__);
-        sd_bus_error_free(&error);
-        return -LB_ERROR_INVALID_BUS;
+    device_path = _string_table_find(lb_ctx->strings, device_path);
+    if (device_path == NULL) {
+        return NULL;
     }
 
-    r = sd_bus_call_method(lb_ctx->bus, BLUEZ_DEST, dev->device_path, BLUEZ_DEVICE, "Connect",
-                           &error, NULL, NULL);
+    row = _device_table_find(&(lb_ctx->device_table), device_path);
+    return (row < 0) ? NULL : lb_ctx->devices[row];
+}
+
+void
+_sync_device_row(lb_bl_device* dev)
+{
+    lb_result_t r = _device_table_set(&(lb_ctx->device_table), ((lb_device_entry*) dev)->row, dev);
 
     if (r < 0) {
-        syslog(LOG_ERR, "%s: sd_bus_call_method Connect on device %s failed with error: %s",
-               __FUNCTION__, dev->device_path, error.message);
-        sd_bus_error_free(&error);
-        return -LB_ERROR_SD_BUS_CALL_FAIL;
+        syslog(LOG_ERR, "%s: Failed to update device table row of %s", __FUNCTION__,
+               dev->device_path);
     }
+}
 
-    sd_bus_error_free(&error);
-    return LB_SUCCESS;
+void
+_free_device(lb_bl_device* dev)
+{
+    _gatt_queue_fail(&(((lb_device_entry*) dev)->queue), -LB_ERROR_INVALID_DEVICE);
+    _free_device_services(dev);
+    if (dev->properties.manufacturer_data != NULL)
+        free(dev->properties.manufacturer_data);
+    _string_table_release(dev->device_path);
+    _string_table_release(dev->name);
+    _string_table_release(dev->address);
+    free((lb_device_entry*) dev);
 }
 
-lb_result_t
-lb_disconnect_device(lb_bl_device* dev)
+void
+_remove_device(int index)
 {
-    int r;
-    sd_bus_error error = SD_BUS_ERROR_NULL;
+    lb_bl_device* dev = lb_ctx->devices[index];
+    int last = lb_ctx->devices_size - 1;
 
-    if (lb_ctx == NULL) {
-        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_CONTEXT;
+    if (lb_ctx->presence != NULL) {
+        _timer_wheel_cancel(lb_ctx->presence, &((lb_device_entry*) dev)->presence);
     }
 
-    if (dev == NULL) {
-        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
+    // the last device moves into the hole so the list and the device table stay dense
+    if (index != last) {
+        lb_ctx->devices[index] = lb_ctx->devices[last];
+        ((lb_device_entry*) lb_ctx->devices[index])->row = index;
+        _sync_device_row(lb_ctx->devices[index]);
     }
+    lb_ctx->devices_size--;
+    _device_table_truncate(&(lb_ctx->device_table), lb_ctx->devices_size);
 
-    if (!_is_bus_connected(lb_ctx)) {
-        syslog(LOG_ERR, "%s: Bus is not opened", __FUNCTION__);
-        sd_bus_error_free(&error);
-        return -LB_ERROR_INVALID_BUS;
+    _free_device(dev);
+}
+
+uint64_t
+_presence_idle_usec()
+{
+    return (uint64_t) lb_ctx->presence_options.idle_timeout_ms * 1000;
+}
+
+void
+_schedule_presence(lb_device_entry* entry, uint64_t expires)
+{
+    bool idle = _timer_wheel_size(lb_ctx->presence) == 0;
+
+    _timer_wheel_schedule(lb_ctx->presence, &(entry->presence), expires);
+
+    // the timer only runs while something is scheduled
+    if (idle) {
+        sd_event_source_set_time(lb_ctx->presence_source, _timer_wheel_next_tick(lb_ctx->presence));
+        sd_event_source_set_enabled(lb_ctx->presence_source, SD_EVENT_ONESHOT);
     }
+}
 
-    r = sd_bus_call_method(lb_ctx->bus, BLUEZ_DEST, dev->device_path, BLUEZ_DEVICE, "Disconnect",
-                           &error, NULL, NULL);
+void
+_device_seen(lb_bl_device* dev)
+{
+    lb_device_entry* entry = (lb_device_entry*) dev;
+    uint64_t expires;
 
-    if (r < 0) {
-        syslog(LOG_ERR, "%s: sd_bus_call_method Disconnect on device: %s failed with error: %s",
-               __FUNCTION__, dev->device_path, error.message);
-        sd_bus_error_free(&error);
-        return -LB_ERROR_SD_BUS_CALL_FAIL;
+    dev->properties.last_seen = _now_usec();
+
+    // a scheduled device checks it's last_seen when it's timer expires, refreshing is a store
+    if (lb_ctx->presence != NULL && entry->presence.next == NULL) {
+        expires = dev->properties.last_seen;
+        if (entry->announced)
+            expires += _presence_idle_usec();
+        _schedule_presence(entry, expires);
     }
+}
 
-    sd_bus_error_free(&error);
-    return LB_SUCCESS;
+void
+_on_presence_expired(struct lb_timer_node* node, void* userdata)
+{
+    lb_device_entry* entry =
+    (lb_device_entry*) ((char*) node - offsetof(lb_device_entry, presence));
+    lb_bl_device* dev = &(entry->device);
+    uint64_t now = *(uint64_t*) userdata;
+    uint64_t expires = dev->properties.last_seen + _presence_idle_usec();
+    lb_presence_options* options = &(lb_ctx->presence_options);
+
+    if (!(dev->flags & LB_DEVICE_FLAG_REMOVED) && expires > now) {
+        if (!entry->announced) {
+            entry->announced = true;
+            if (options->on_enter != NULL)
+                options->on_enter(dev, options->userdata);
+        }
+        _timer_wheel_schedule(lb_ctx->presence, node, expires);
+        return;
+    }
+
+    if (entry->announced && options->on_leave != NULL) {
+        options->on_leave(dev, options->userdata);
+    }
+    _remove_device(entry->row);
 }
 
-lb_result_t
-lb_pair_device(lb_bl_device* dev)
+int
+_on_presence_tick(sd_event_source* source, uint64_t usec, void* userdata)
 {
-    int r;
-    sd_bus_error error = SD_BUS_ERROR_NULL;
+    uint64_t now = _now_usec();
 
-    if (lb_ctx == NULL) {
-        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_CONTEXT;
+    _timer_wheel_advance(lb_ctx->presence, now, _on_presence_expired, &now);
+
+    if (_timer_wheel_size(lb_ctx->presence) > 0) {
+        sd_event_source_set_time(source, _timer_wheel_next_tick(lb_ctx->presence));
+        sd_event_source_set_enabled(source, SD_EVENT_ONESHOT);
     }
 
-    if (dev == NULL) {
-        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
+    return 0;
+}
+
+void
+_free_presence_tracking()
+{
+    int i;
+    lb_device_entry* entry;
+
+    for (i = 0; i < lb_ctx->devices_size; i++) {
+        entry = (lb_device_entry*) lb_ctx->devices[i];
+        _timer_wheel_cancel(lb_ctx->presence, &(entry->presence));
+        entry->announced = false;
     }
 
-    if (!_is_bus_connected(lb_ctx)) {
-        syslog(LOG_ERR, "%s: Bus is not opened", __FUNCTION__);
-        sd_bus_error_free(&error);
-        return -LB_ERROR_INVALID_BUS;
+    lb_ctx->presence_source = sd_event_source_unref(lb_ctx->presence_source);
+    _timer_wheel_free(lb_ctx->presence);
+    lb_ctx->presence = NULL;
+}
+
+bool
+_signals_presence(sd_bus_message* message)
+{
+    int r;
+    bool seen = false;
+    const char* property;
+
+    r = sd_bus_message_skip(message, "s");
+    if (r >= 0) {
+        r = sd_bus_message_enter_container(message, 'a', "{sv}");
     }
 
-    r = sd_bus_call_method(lb_ctx->bus, BLUEZ_DEST, dev->device_path, BLUEZ_DEVICE, "Pair", &error, NULL, NULL);
+    while (r >= 0 && !seen && (r = sd_bus_message_enter_container(message, 'e', "sv")) > 0) {
+        r = sd_bus_message_read_basic(message, 's', &property);
+        if (r < 0)
+            break;
+        seen = strcmp(property, "RSSI") == 0 || strcmp(property, "TxPower") == 0 ||
+               strcmp(property, "ManufacturerData") == 0 || strcmp(property, "ServiceData") == 0;
 
-    if (r < 0) {
-        syslog(LOG_ERR, "%s: sd_bus_call_method Pair on device %s failed with error: %s",
-               __FUNCTION__, dev->device_path, error.message);
-        sd_bus_error_free(&error);
-        return -LB_ERROR_SD_BUS_CALL_FAIL;
+        r = sd_bus_message_skip(message, "v");
+        if (r >= 0)
+            r = sd_bus_message_exit_container(message);
     }
 
-    sd_bus_error_free(&error);
-    return LB_SUCCESS;
+    sd_bus_message_rewind(message, true);
+    return seen;
 }
 
 lb_result_t
-lb_unpair_device(lb_bl_device* dev)
+_add_new_device(const char* device_path, sd_bus_message* properties, lb_bl_device** dev_ret)
 {
     int r;
-    sd_bus_error error = SD_BUS_ERROR_NULL;
-
-    if (lb_ctx == NULL) {
-        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_CONTEXT;
+    int current_index = lb_ctx->devices_size;
+    if (lb_ctx->devices_size == 0 || lb_ctx->devices == NULL) {
+        lb_ctx->devices = (lb_bl_device**) malloc(sizeof(lb_bl_device*));
+        if (lb_ctx->devices == NULL) {
+            syslog(LOG_ERR, "%s: Error allocating memory for devices", __FUNCTION__);
+            return -LB_ERROR_MEMEORY_ALLOCATION;
+        }
+        lb_ctx->devices_size++;
+    } else {
+        lb_ctx->devices_size++;
+        lb_ctx->devices = realloc(lb_ctx->devices, (lb_ctx->devices_size) * sizeof(lb_bl_device*));
+        if (lb_ctx->devices == NULL) {
+            syslog(LOG_ERR, "%s: Error reallocating memory for devices", __FUNCTION__);
+            return -LB_ERROR_MEMEORY_ALLOCATION;
+        }
     }
 
-    if (dev == NULL) {
-        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
+    lb_device_entry* new_entry = (lb_device_entry*) malloc(sizeof(lb_device_entry));
+    if (new_entry == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for new_device", __FUNCTION__);
+        lb_ctx->devices_size--;
+        return -LB_ERROR_MEMEORY_ALLOCATION;
     }
+    new_entry->row = current_index;
+    memset(&(new_entry->presence), 0, sizeof(struct lb_timer_node));
+    new_entry->announced = false;
+    new_entry->generation = lb_ctx->generation;
+    memset(&(new_entry->queue), 0, sizeof(struct lb_gatt_queue));
+    lb_bl_device* new_device = &(new_entry->device);
 
-    if (!_is_bus_connected(lb_ctx)) {
-        syslog(LOG_ERR, "%s: Bus is not opened", __FUNCTION__);
-        sd_bus_error_free(&error);
-        return -LB_ERROR_INVALID_BUS;
+    new_device->device_path = _string_table_intern(lb_ctx->strings, device_path);
+    if (new_device->device_path == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for new_device", __FUNCTION__);
+        lb_ctx->devices_size--;
+        free(new_entry);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
     }
 
-    r = sd_bus_call_method(lb_ctx->bus, BLUEZ_DEST, dev->device_path, BLUEZ_DEVICE, "CancelPairing",
-                           &error, NULL, NULL);
+    new_device->name = NULL;
+    new_device->address = NULL;
+    new_device->flags = LB_DEVICE_FLAG_BL;
+    memset(&(new_device->properties), 0, sizeof(lb_bl_device_properties));
 
+    // properties come along with the managed objects, only ask BlueZ when they did not
+    if (properties != NULL) {
+        r = _parse_device_properties(new_device, properties);
+    } else {
+        r = _get_device_properties(new_device);
+    }
     if (r < 0) {
-        syslog(LOG_ERR, "%s: sd_bus_call_method CancelPairing on device %s failed with error: %s",
-               __FUNCTION__, dev->device_path, error.message);
-        sd_bus_error_free(&error);
-        return -LB_ERROR_SD_BUS_CALL_FAIL;
+        syslog(LOG_ERR, "%s: Error couldn't get device properties", __FUNCTION__);
     }
 
-    sd_bus_error_free(&error);
+    if (new_device->name == NULL) {
+        new_device->name = _string_table_intern(lb_ctx->strings, "null");
+    }
+    if (new_device->address == NULL) {
+        new_device->address = _string_table_intern(lb_ctx->strings, "null");
+    }
+    if (new_device->name == NULL || new_device->address == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for new device", __FUNCTION__);
+        lb_ctx->devices_size--;
+        free(new_device->properties.manufacturer_data);
+        _string_table_release(new_device->device_path);
+        _string_table_release(new_device->name);
+        _string_table_release(new_device->address);
+        free(new_entry);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    new_device->services = NULL;
+    new_device->services_size = 0;
+
+    // new_device->address = convert_device_path_to_address(device_path);
+    lb_ctx->devices[current_index] = new_device;
+    _device_seen(new_device);
+    _sync_device_row(new_device);
+
+    if (dev_ret != NULL) {
+        *dev_ret = new_device;
+    }
     return LB_SUCCESS;
 }
 
-lb_result_t
-lb_get_ble_device_services(lb_bl_device* dev)
+int
+_on_device_properties_changed(sd_bus_message* message, void* userdata, sd_bus_error* error)
 {
-    int i = 0, r = 0;
-    sd_bus_error error = SD_BUS_ERROR_NULL;
+    int r;
+    const char* property;
+    lb_bl_device* dev = _find_device_by_path(sd_bus_message_get_path(message));
 
-    if (lb_ctx == NULL) {
-        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_CONTEXT;
+    // while tracking presence every device BlueZ hears from is added back
+    if (dev == NULL) {
+        if (lb_ctx->presence == NULL || !_signals_presence(message) ||
+            _add_new_device(sd_bus_message_get_path(message), NULL, &dev) < 0) {
+            return 0;
+        }
     }
 
-    if (dev == NULL) {
-        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
+    r = sd_bus_message_skip(message, "s");
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_message_skip failed with error: %s", __FUNCTION__, strerror(-r));
+        return 0;
     }
 
-    if (!_is_bl_device(dev->device_path)) {
-        syslog(LOG_ERR, "%s: device %s not a bl device", __FUNCTION__, dev->device_path);
-        sd_bus_error_free(&error);
-        return -LB_ERROR_INVALID_DEVICE;
+    r = _parse_device_properties(dev, message);
+    if (r > 0) {
+        _device_seen(dev);
+    }
+    _sync_device_row(dev);
+    if (r < 0) {
+        return 0;
     }
 
-    if (!_is_device_paired(dev->device_path)) {
-        r = lb_pair_device(dev);
-        if (r < 0) {
-            syslog(LOG_ERR, "%s: error pairing device", __FUNCTION__);
-            sd_bus_error_free(&error);
-            return -LB_ERROR_UNSPECIFIED;
+    // RSSI and TxPower are invalidated when the device goes out of range
+    r = sd_bus_message_enter_container(message, 'a', "s");
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_message_enter_container s failed with error: %s",
+               __FUNCTION__, strerror(-r));
+        return 0;
+    }
+
+    while ((r = sd_bus_message_read_basic(message, 's', &property)) > 0) {
+        if (strcmp(property, "RSSI") == 0) {
+            dev->properties.known &= ~LB_DEVICE_PROPERTY_RSSI;
+        } else if (strcmp(property, "TxPower") == 0) {
+            dev->properties.known &= ~LB_DEVICE_PROPERTY_TX_POWER;
+        } else if (strcmp(property, "ManufacturerData") == 0) {
+            dev->properties.known &= ~LB_DEVICE_PROPERTY_MANUFACTURER_DATA;
         }
     }
 
-    if (dev->services != NULL) {
-        free(dev->services);
+    sd_bus_message_exit_container(message);
+    _sync_device_row(dev);
+    return 0;
+}
+
+lb_bl_device*
+_find_device_owning_path(const char* object_path)
+{
+    char device_path[MAX_LEN];
+    const char* component = strstr(object_path, "/dev_");
+    const char* end;
+    size_t len;
+
+    if (component == NULL) {
+        return NULL;
     }
 
-    const char** objects = (const char**) calloc(MAX_OBJECTS, MAX_OBJECTS * sizeof(const char*));
-    if (objects == NULL) {
-        syslog(LOG_ERR, "%s: Error allocating memory for objects array", __FUNCTION__);
-        sd_bus_error_free(&error);
-        return -LB_ERROR_MEMEORY_ALLOCATION;
+    // the device is the object path cut after it's dev_XX_XX_XX_XX_XX_XX component
+    end = strchr(component + 1, '/');
+    len = (end != NULL) ? (size_t)(end - object_path) : strlen(object_path);
+    if (len >= sizeof(device_path)) {
+        return NULL;
     }
+    memcpy(device_path, object_path, len);
+    device_path[len] = '\0';
+
+    return _find_device_by_path(device_path);
+}
+
+int
+_on_interfaces_added(sd_bus_message* message, void* userdata, sd_bus_error* error)
+{
+    int r;
+    const char* object_path;
+    const char* interface;
+    lb_bl_device* dev;
 
-    r = _get_root_objects(objects);
+    r = sd_bus_message_read_basic(message, 'o', &object_path);
     if (r < 0) {
-        syslog(LOG_ERR, "%s: Error getting root objects", __FUNCTION__);
-        if (objects != NULL)
-            free(objects);
-        sd_bus_error_free(&error);
-        return -LB_ERROR_UNSPECIFIED;
+        syslog(LOG_ERR, "%s: sd_bus_message_read_basic failed with error: %s", __FUNCTION__, strerror(-r));
+        return 0;
     }
 
-    while (objects[i] != NULL) {
-        if (strstr(objects[i], dev->device_path) && _is_ble_service(objects[i])) {
-            const char* service_path = objects[i];
-            r = _add_new_service(dev, service_path);
-            if (r < 0) {
-                syslog(LOG_ERR, "%s: Error adding ble service", __FUNCTION__);
+    r = sd_bus_message_enter_container(message, 'a', "{sa{sv}}");
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_message_enter_container {sa{sv}} failed with error: %s",
+               __FUNCTION__, strerror(-r));
+        return 0;
+    }
+
+    while ((r = sd_bus_message_enter_container(message, 'e', "sa{sv}")) > 0) {
+        r = sd_bus_message_read_basic(message, 's', &interface);
+        if (r < 0)
+            break;
+
+        if (strcmp(interface, BLUEZ_DEVICE) == 0) {
+            dev = _find_device_by_path(object_path);
+            if (dev != NULL) {
+                dev->flags = (dev->flags & ~LB_DEVICE_FLAG_REMOVED) | LB_DEVICE_FLAG_BL;
+                _device_seen(dev);
+                _sync_device_row(dev);
+            } else if (lb_ctx->presence != NULL) {
+                // the properties are parsed by _add_new_device
+                r = _add_new_device(object_path, message, NULL);
+                if (r < 0)
+                    break;
+                r = sd_bus_message_exit_container(message);
+                if (r < 0)
+                    break;
                 continue;
             }
-            int j = 0;
-            while (objects[j] != NULL) {
-                if (strstr(objects[j], service_path) && _is_ble_characteristic(objects[j])) {
-                    lb_ble_service* new_service = NULL;
-                    r = lb_get_ble_service_by_service_path(dev, service_path, &new_service);
-                    if (r < 0) {
-                        syslog(LOG_ERR, "%s: Error getting ble service", __FUNCTION__);
-                        continue;
-                    }
-                    _add_new_characteristic(new_service, objects[j]);
-                    if (r < 0) {
-                        syslog(LOG_ERR, "%s: Error adding ble characteristic", __FUNCTION__);
-                        continue;
-                    }
-                }
-                j++;
+        } else if (strcmp(interface, BLUEZ_GATT_SERVICE) == 0) {
+            dev = _find_device_owning_path(object_path);
+            if (dev != NULL) {
+                dev->flags |= LB_DEVICE_FLAG_BLE;
+                _sync_device_row(dev);
             }
         }
 
-        i++;
-    }
+        r = sd_bus_message_skip(message, "a{sv}");
+        if (r < 0)
+            break;
 
-    i = 0;
-    while (objects[i] != NULL) {
-        free((char*) objects[i]);
-        i++;
+        r = sd_bus_message_exit_container(message);
+        if (r < 0)
+            break;
     }
-    free(objects);
 
-    sd_bus_error_free(&error);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed to parse InterfacesAdded of %s: %s", __FUNCTION__, object_path,
+               strerror(-r));
+    }
 
-    return LB_SUCCESS;
+    return 0;
 }
 
-lb_result_t
-lb_get_ble_characteristic_by_characteristic_path(lb_bl_device* dev,
-                                                 const char* characteristic_path,
-                                                 lb_ble_char** ble_characteristic_ret)
+int
+_on_interfaces_removed(sd_bus_message* message, void* userdata, sd_bus_error* error)
 {
-    int i, j;
+    int r;
+    const char* object_path;
+    const char* interface;
+    lb_bl_device* dev;
 
-    if (lb_ctx == NULL) {
-        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_CONTEXT;
+    r = sd_bus_message_read_basic(message, 'o', &object_path);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_message_read_basic failed with error: %s", __FUNCTION__, strerror(-r));
+        return 0;
     }
 
-    if (dev == NULL) {
-        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
+    r = sd_bus_message_enter_container(message, 'a', "s");
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_message_enter_container s failed with error: %s",
+               __FUNCTION__, strerror(-r));
+        return 0;
+    }
+
+    while ((r = sd_bus_message_read_basic(message, 's', &interface)) > 0) {
+        if (strcmp(interface, BLUEZ_DEVICE) == 0) {
+            dev = _find_device_by_path(object_path);
+            if (dev != NULL) {
+                dev->flags = LB_DEVICE_FLAG_REMOVED;
+                _sync_device_row(dev);
+                // it leaves on the next tick unless BlueZ adds it back first
+                if (lb_ctx->presence != NULL) {
+                    _schedule_presence((lb_device_entry*) dev, _now_usec());
+                }
+            }
+        } else if (strcmp(interface, BLUEZ_GATT_SERVICE) == 0 ||
+                   strcmp(interface, BLUEZ_GATT_CHARACTERISTICS) == 0) {
+            // the known layout is not complete anymore, it is revalidated on next use
+            dev = _find_device_owning_path(object_path);
+            if (dev != NULL) {
+                dev->flags &= ~LB_DEVICE_FLAG_BLE;
+                _sync_device_row(dev);
+            }
+        }
     }
 
-    if (characteristic_path == NULL) {
-        syslog(LOG_ERR, "%s: characteristic_path is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed to parse InterfacesRemoved of %s: %s", __FUNCTION__,
+               object_path, strerror(-r));
     }
 
-    for (i = 0; i < dev->services_size; i++) {
-        for (j = 0; dev->services[i]->characteristics_size; j++) {
-            if (strncmp(characteristic_path, dev->services[i]->characteristics[j]->char_path,
-                        strlen(characteristic_path)) == 0) {
-                *ble_characteristic_ret = dev->services[i]->characteristics[j];
-                return LB_SUCCESS;
-            }
-        }
-    }
-    return -LB_ERROR_UNSPECIFIED;
+    return 0;
 }
 
-lb_result_t
-lb_get_ble_characteristic_by_uuid(lb_bl_device* dev, const char* uuid, lb_ble_char** ble_characteristic_ret)
+bool
+_is_string_in_device_introspection(const char* device_path, const char* str)
 {
-    int i, j;
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message* reply = NULL;
 
-    if (lb_ctx == NULL) {
-        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_CONTEXT;
+    int r;
+    bool result = false;
+    const char* introspect_xml;
+
+    if (!_is_bus_connected(lb_ctx)) {
+        syslog(LOG_ERR, "%s: Bus is not opened", __FUNCTION__);
+        sd_bus_error_free(&error);
+        return -LB_ERROR_INVALID_BUS;
+    }
+
+    r = _call_method(device_path, "org.freedesktop.DBus.Introspectable", "Introspect",
+                     lb_ctx->call_timeout, &error, &reply, NULL);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_call_method Introspect on device %s failed with error: %s",
+               __FUNCTION__, device_path, error.message);
+        sd_bus_error_free(&error);
+        sd_bus_message_unref(reply);
+        return false;
+    }
+
+    r = sd_bus_message_read_basic(reply, 's', &introspect_xml);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_message_read_basic failed with error: %s", __FUNCTION__, strerror(-r));
+        sd_bus_error_free(&error);
+        sd_bus_message_unref(reply);
+        return false;
+    }
+
+    result = (strstr(introspect_xml, str) != NULL) ? true : false;
+
+    sd_bus_error_free(&error);
+    sd_bus_message_unref(reply);
+
+    return result;
+}
+
+bool
+_is_bl_device(const char* device_path)
+{
+    return _is_string_in_device_introspection(device_path, BLUEZ_DEVICE);
+}
+
+bool
+_is_ble_device(const char* device_path)
+{
+    int r = 0;
+    bool result = false;
+    lb_object_iter iter;
+
+    if (!_is_bl_device(device_path)) {
+        syslog(LOG_ERR, "%s: not a bl device", __FUNCTION__);
+        return false;
+    }
+
+    lb_bl_device* device = NULL;
+    r = lb_get_device_by_device_path(device_path, &device);
+    if (r < 0) {
+        fprintf(stderr, "ERROR: Device %s not found\n", device_path);
+    }
+
+    if (device != NULL && device->services_size > 0)
+        return true;
+
+    r = _object_iter_init(&iter);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Error getting root objects", __FUNCTION__);
+        return false;
+    }
+
+    while (!result && (r = _object_iter_next(&iter)) > 0) {
+        if (_is_path_below(iter.path, device_path) && _object_iter_has_interface(&iter, BLUEZ_GATT_SERVICE)) {
+            result = true;
+        }
+    }
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed to parse managed objects: %s", __FUNCTION__, strerror(-r));
+    }
+
+    _object_iter_finish(&iter);
+    return result;
+}
+
+bool
+_is_ble_device_ready(lb_bl_device* dev)
+{
+    // flags are kept up to date by the interface signals, no round trip is needed. the signals are
+    // processed by the public entry points, never here: this is also called while services are added
+    if (dev->flags & LB_DEVICE_FLAG_REMOVED) {
+        return false;
+    }
+
+    if (!(dev->flags & LB_DEVICE_FLAG_BLE)) {
+        // not seen with services yet, validate over the bus once
+        if (!_is_ble_device(dev->device_path)) {
+            return false;
+        }
+        dev->flags |= LB_DEVICE_FLAG_BL | LB_DEVICE_FLAG_BLE;
+        _sync_device_row(dev);
+    }
+
+    return true;
+}
+
+void _latest_write_free(struct lb_latest_write* latest);
+void _free_service(lb_ble_service* service);
+
+void
+_free_device_services(lb_bl_device* dev)
+{
+    int i;
+
+    for (i = 0; i < dev->services_size; i++) {
+        if (dev->services[i] != NULL)
+            _free_service(dev->services[i]);
+    }
+    if (dev->services != NULL)
+        free(dev->services);
+
+    dev->services = NULL;
+    dev->services_size = 0;
+}
+
+bool
+_is_stale_object_error(const sd_bus_error* error)
+{
+    return sd_bus_error_has_name(error, "org.freedesktop.DBus.Error.UnknownObject") ||
+           sd_bus_error_has_name(error, "org.freedesktop.DBus.Error.UnknownMethod");
+}
+
+void
+_invalidate_device_services(lb_bl_device* dev)
+{
+    syslog(LOG_INFO, "%s: services of device %s are stale", __FUNCTION__, dev->device_path);
+    _gatt_cache_invalidate(lb_ctx->gatt_cache, dev->address);
+    _free_device_services(dev);
+    dev->flags &= ~LB_DEVICE_FLAG_BLE;
+    _sync_device_row(dev);
+}
+
+lb_result_t
+_add_new_characteristic(lb_ble_service* service, const char* characteristic_path, const char* uuid)
+{
+    int current_index = service->characteristics_size;
+    if (service->characteristics_size == 0 || service->characteristics == NULL) {
+        service->characteristics = (lb_ble_char**) malloc(sizeof(lb_ble_char*));
+        if (service->characteristics == NULL) {
+            syslog(LOG_ERR, "%s: Error allocating memory for characteristics", __FUNCTION__);
+            return -LB_ERROR_MEMEORY_ALLOCATION;
+        }
+        service->characteristics_size++;
+    } else {
+        service->characteristics_size++;
+        service->characteristics =
+        realloc(service->characteristics, (service->characteristics_size) * sizeof(lb_ble_char*));
+        if (service->characteristics == NULL) {
+            syslog(LOG_ERR, "%s: Error reallocating memory for characteristics", __FUNCTION__);
+            return -LB_ERROR_MEMEORY_ALLOCATION;
+        }
+    }
+
+    lb_ble_char* new_characteristic = (lb_ble_char*) malloc(sizeof(lb_char_entry));
+    if (new_characteristic == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for new characteristic", __FUNCTION__);
+        service->characteristics_size--;
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    ((lb_char_entry*) new_characteristic)->generation = lb_ctx->generation;
+    ((lb_char_entry*) new_characteristic)->mtu = 0;
+    ((lb_char_entry*) new_characteristic)->latest = NULL;
+    ((lb_char_entry*) new_characteristic)->transactions = NULL;
+    new_characteristic->value = NULL;
+    new_characteristic->value_size = 0;
+    new_characteristic->value_capacity = 0;
+    new_characteristic->value_timestamp = 0;
+
+    new_characteristic->char_path = _string_table_intern(lb_ctx->strings, characteristic_path);
+    if (new_characteristic->char_path == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for new characteristic", __FUNCTION__);
+        service->characteristics_size--;
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    if (uuid == NULL) {
+        syslog(LOG_ERR, "%s: Error couldn't find characteristic uuid", __FUNCTION__);
+        uuid = "null";
+    }
+    new_characteristic->uuid = _string_table_intern(lb_ctx->strings, uuid);
+    if (new_characteristic->uuid == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for new characteristic uuid", __FUNCTION__);
+        service->characteristics_size--;
+        _string_table_release(new_characteristic->char_path);
+        free((lb_char_entry*) new_characteristic);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    service->characteristics[current_index] = new_characteristic;
+
+    return LB_SUCCESS;
+}
+
+lb_result_t
+_add_new_service(lb_bl_device* dev, const char* service_path, const char* uuid, bool primary)
+{
+    if (!_is_ble_device_ready(dev)) {
+        syslog(LOG_ERR, "%s: not a ble device", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    int current_index = dev->services_size;
+    if (dev->services_size == 0 || dev->services == NULL) {
+        dev->services = (lb_ble_service**) malloc(sizeof(lb_ble_service*));
+        if (dev->services == NULL) {
+            syslog(LOG_ERR, "%s: Error allocating memory for services", __FUNCTION__);
+            return -LB_ERROR_MEMEORY_ALLOCATION;
+        }
+        dev->services_size++;
+    } else {
+        dev->services_size++;
+        dev->services = realloc(dev->services, (dev->services_size) * sizeof(lb_ble_service*));
+        if (dev->services == NULL) {
+            syslog(LOG_ERR, "%s: Error reallocating memory for services", __FUNCTION__);
+            return -LB_ERROR_MEMEORY_ALLOCATION;
+        }
+    }
+
+    lb_ble_service* new_service = (lb_ble_service*) malloc(sizeof(lb_service_entry));
+    if (new_service == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for new_service", __FUNCTION__);
+        dev->services_size--;
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+    ((lb_service_entry*) new_service)->generation = lb_ctx->generation;
+
+    new_service->service_path = _string_table_intern(lb_ctx->strings, service_path);
+    if (new_service->service_path == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for new service", __FUNCTION__);
+        dev->services_size--;
+        free((lb_service_entry*) new_service);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    if (uuid == NULL) {
+        syslog(LOG_ERR, "%s: Error couldn't find service uuid", __FUNCTION__);
+        uuid = "null";
+    }
+    new_service->uuid = _string_table_intern(lb_ctx->strings, uuid);
+    if (new_service->uuid == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for new service uuid", __FUNCTION__);
+        dev->services_size--;
+        _string_table_release(new_service->service_path);
+        free((lb_service_entry*) new_service);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    new_service->primary = primary;
+
+    new_service->characteristics = NULL;
+    new_service->characteristics_size = 0;
+
+    dev->services[current_index] = new_service;
+
+    return LB_SUCCESS;
+}
+
+lb_ble_service*
+_find_service_by_interned_path(lb_bl_device* dev, const char* service_path)
+{
+    int i;
+
+    for (i = 0; i < dev->services_size; i++) {
+        if (dev->services[i]->service_path == service_path)
+            return dev->services[i];
+    }
+
+    return NULL;
+}
+
+int
+_set_device_service(lb_bl_device* dev, const char* service_path, const char* uuid, bool primary)
+{
+    int r;
+    lb_ble_service* service;
+
+    // a path that is not interned has no service yet
+    service = _find_service_by_interned_path(dev, _string_table_find(lb_ctx->strings, service_path));
+    if (service == NULL) {
+        r = _add_new_service(dev, service_path, uuid, primary);
+        return (r < 0) ? r : 1;
+    }
+    ((lb_service_entry*) service)->generation = lb_ctx->generation;
+
+    // fill in the service created by one of it's characteristics, or found by a previous scan
+    if (uuid != NULL) {
+        uuid = _string_table_intern(lb_ctx->strings, uuid);
+        if (uuid == NULL) {
+            syslog(LOG_ERR, "%s: Error allocating memory for service uuid", __FUNCTION__);
+            return -LB_ERROR_MEMEORY_ALLOCATION;
+        }
+        _string_table_release(service->uuid);
+        service->uuid = uuid;
+    }
+    service->primary = primary;
+
+    return LB_SUCCESS;
+}
+
+int
+_add_characteristic_to_device(lb_bl_device* dev,
+                              const char* characteristic_path,
+                              const char* uuid,
+                              lb_ble_char** characteristic_ret)
+{
+    int r, i, added = 0;
+    const char* service_path;
+    const char* interned;
+    const char* separator = strrchr(characteristic_path, '/');
+    lb_ble_service* service;
+    lb_ble_char* characteristic;
+
+    if (separator == NULL) {
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    service_path =
+    _string_table_intern_len(lb_ctx->strings, characteristic_path, separator - characteristic_path);
+    if (service_path == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for service path", __FUNCTION__);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    service = _find_service_by_interned_path(dev, service_path);
+    if (service == NULL) {
+        r = _add_new_service(dev, service_path, "null", false);
+        if (r < 0) {
+            _string_table_release(service_path);
+            return r;
+        }
+        service = dev->services[dev->services_size - 1];
+        added = 1;
+    }
+    // the service holds it's own reference
+    _string_table_release(service_path);
+    ((lb_service_entry*) service)->generation = lb_ctx->generation;
+
+    // a characteristic found by a previous scan keeps it's struct and cached value
+    interned = _string_table_find(lb_ctx->strings, characteristic_path);
+    for (i = 0; i < service->characteristics_size; i++) {
+        characteristic = service->characteristics[i];
+        if (characteristic->char_path != interned) {
+            continue;
+        }
+        if (uuid != NULL) {
+            uuid = _string_table_intern(lb_ctx->strings, uuid);
+            if (uuid == NULL) {
+                syslog(LOG_ERR, "%s: Error allocating memory for uuid", __FUNCTION__);
+                return -LB_ERROR_MEMEORY_ALLOCATION;
+            }
+            added |= (characteristic->uuid != uuid);
+            _string_table_release(characteristic->uuid);
+            characteristic->uuid = uuid;
+        }
+        ((lb_char_entry*) characteristic)->generation = lb_ctx->generation;
+        *characteristic_ret = characteristic;
+        return added;
+    }
+
+    r = _add_new_characteristic(service, characteristic_path, uuid);
+    if (r < 0) {
+        return r;
+    }
+    *characteristic_ret = service->characteristics[service->characteristics_size - 1];
+    return 1;
+}
+
+void
+_free_characteristic(lb_ble_char* characteristic)
+{
+    _latest_write_free(((lb_char_entry*) characteristic)->latest);
+    _transactions_free(((lb_char_entry*) characteristic)->transactions);
+    if (characteristic->value != NULL)
+        free(characteristic->value);
+    _string_table_release(characteristic->char_path);
+    _string_table_release(characteristic->uuid);
+    free((lb_char_entry*) characteristic);
+}
+
+void
+_free_service(lb_ble_service* service)
+{
+    int i;
+
+    for (i = 0; i < service->characteristics_size; i++) {
+        if (service->characteristics[i] != NULL)
+            _free_characteristic(service->characteristics[i]);
+    }
+    if (service->characteristics != NULL)
+        free(service->characteristics);
+    _string_table_release(service->service_path);
+    _string_table_release(service->uuid);
+    free((lb_service_entry*) service);
+}
+
+int
+_remove_stale_services(lb_bl_device* dev)
+{
+    int i, j, kept, kept_chars, removed = 0;
+    lb_ble_service* service;
+
+    // compact in place so the surviving services and characteristics keep their order
+    for (i = 0, kept = 0; i < dev->services_size; i++) {
+        service = dev->services[i];
+        if (((lb_service_entry*) service)->generation != lb_ctx->generation) {
+            _free_service(service);
+            removed++;
+            continue;
+        }
+
+        for (j = 0, kept_chars = 0; j < service->characteristics_size; j++) {
+            if (((lb_char_entry*) service->characteristics[j])->generation != lb_ctx->generation) {
+                _free_characteristic(service->characteristics[j]);
+                removed++;
+                continue;
+            }
+            service->characteristics[kept_chars++] = service->characteristics[j];
+        }
+        service->characteristics_size = kept_chars;
+        if (kept_chars == 0) {
+            free(service->characteristics);
+            service->characteristics = NULL;
+        }
+        dev->services[kept++] = service;
+    }
+    dev->services_size = kept;
+    if (kept == 0) {
+        free(dev->services);
+        dev->services = NULL;
+    }
+
+    return removed;
+}
+
+static void
+_copy_advertisement_data(uint8_t* dest, uint8_t* dest_size, const void* data, size_t size)
+{
+    if (size > LB_ADVERTISEMENT_DATA_SIZE) {
+        size = LB_ADVERTISEMENT_DATA_SIZE;
+    }
+    memcpy(dest, data, size);
+    *dest_size = (uint8_t) size;
+}
+
+int
+_parse_advertisement_manufacturer_data(sd_bus_message* message, lb_advertisement* latest)
+{
+    int r;
+    uint16_t id;
+    const void* data;
+    size_t size;
+
+    r = sd_bus_message_enter_container(message, 'v', "a{qv}");
+    if (r < 0)
+        return r;
+
+    r = sd_bus_message_enter_container(message, 'a', "{qv}");
+    if (r < 0)
+        return r;
+
+    // like the device properties only the first record is kept
+    r = sd_bus_message_enter_container(message, 'e', "qv");
+    if (r > 0) {
+        r = sd_bus_message_read_basic(message, 'q', &id);
+        if (r < 0)
+            return r;
+        r = sd_bus_message_enter_container(message, 'v', "ay");
+        if (r < 0)
+            return r;
+        r = sd_bus_message_read_array(message, 'y', &data, &size);
+        if (r < 0)
+            return r;
+        r = sd_bus_message_exit_container(message);
+        if (r < 0)
+            return r;
+        r = sd_bus_message_exit_container(message);
+        if (r < 0)
+            return r;
+
+        latest->manufacturer_id = id;
+        _copy_advertisement_data(latest->manufacturer_data, &latest->manufacturer_data_size, data, size);
+        latest->known |= LB_DEVICE_PROPERTY_MANUFACTURER_DATA;
+    }
+    if (r < 0)
+        return r;
+
+    // skip the remaining records
+    while ((r = sd_bus_message_skip(message, "{qv}")) > 0)
+        ;
+    if (r < 0)
+        return r;
+
+    r = sd_bus_message_exit_container(message);
+    if (r < 0)
+        return r;
+
+    return sd_bus_message_exit_container(message);
+}
+
+int
+_parse_advertisement_service_data(sd_bus_message* message, lb_advertisement* latest)
+{
+    int r;
+    const char* uuid;
+    const void* data;
+    size_t size;
+
+    r = sd_bus_message_enter_container(message, 'v', "a{sv}");
+    if (r < 0)
+        return r;
+
+    r = sd_bus_message_enter_container(message, 'a', "{sv}");
+    if (r < 0)
+        return r;
+
+    r = sd_bus_message_enter_container(message, 'e', "sv");
+    if (r > 0) {
+        r = sd_bus_message_read_basic(message, 's', &uuid);
+        if (r < 0)
+            return r;
+        r = sd_bus_message_enter_container(message, 'v', "ay");
+        if (r < 0)
+            return r;
+        r = sd_bus_message_read_array(message, 'y', &data, &size);
+        if (r < 0)
+            return r;
+        r = sd_bus_message_exit_container(message);
+        if (r < 0)
+            return r;
+        r = sd_bus_message_exit_container(message);
+        if (r < 0)
+            return r;
+
+        snprintf(latest->service_uuid, sizeof(latest->service_uuid), "%s", uuid);
+        _copy_advertisement_data(latest->service_data, &latest->service_data_size, data, size);
+        latest->known |= LB_DEVICE_PROPERTY_SERVICE_DATA;
+    }
+    if (r < 0)
+        return r;
+
+    while ((r = sd_bus_message_skip(message, "{sv}")) > 0)
+        ;
+    if (r < 0)
+        return r;
+
+    r = sd_bus_message_exit_container(message);
+    if (r < 0)
+        return r;
+
+    return sd_bus_message_exit_container(message);
+}
+
+/**
+ * Update the latest advertisement of a device from a Device1 property dictionary
+ *
+ * @return count of advertisement fields found, negative errno on parse failure
+ */
+int
+_parse_advertisement_properties(sd_bus_message* message, lb_advertisement* latest)
+{
+    int r, found = 0;
+    const char* property;
+
+    r = sd_bus_message_enter_container(message, 'a', "{sv}");
+    if (r < 0)
+        return r;
+
+    while ((r = sd_bus_message_enter_container(message, 'e', "sv")) > 0) {
+        r = sd_bus_message_read_basic(message, 's', &property);
+        if (r < 0)
+            return r;
+
+        if (strcmp(property, "RSSI") == 0) {
+            r = sd_bus_message_read(message, "v", "n", &latest->rssi);
+            if (r >= 0)
+                latest->known |= LB_DEVICE_PROPERTY_RSSI;
+            found++;
+        } else if (strcmp(property, "ManufacturerData") == 0) {
+            r = _parse_advertisement_manufacturer_data(message, latest);
+            found++;
+        } else if (strcmp(property, "ServiceData") == 0) {
+            r = _parse_advertisement_service_data(message, latest);
+            found++;
+        } else {
+            r = sd_bus_message_skip(message, "v");
+        }
+        if (r < 0)
+            return r;
+
+        r = sd_bus_message_exit_container(message);
+        if (r < 0)
+            return r;
+    }
+    if (r < 0)
+        return r;
+
+    r = sd_bus_message_exit_container(message);
+    if (r < 0)
+        return r;
+
+    return found;
+}
+
+void
+_ingest_advertisement(const char* object_path, sd_bus_message* properties)
+{
+    int r;
+    const char* path;
+    lb_advertisement* latest;
+
+    path = _string_table_intern(lb_ctx->strings, object_path);
+    if (path == NULL) {
+        return;
+    }
+
+    // a new advertiser takes it's own reference
+    latest = _advertisement_queue_advertiser(lb_ctx->advertisements, path, _now_usec());
+    _string_table_release(path);
+    if (latest == NULL) {
+        return;
+    }
+
+    r = _parse_advertisement_properties(properties, latest);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed to parse advertisement of %s: %s", __FUNCTION__, object_path,
+               strerror(-r));
+        return;
+    }
+
+    if (r > 0) {
+        _advertisement_queue_push(lb_ctx->advertisements, latest, _now_usec());
+    }
+}
+
+int
+_on_advertisement_changed(sd_bus_message* message, void* userdata, sd_bus_error* error)
+{
+    int r;
+
+    if (lb_ctx->advertisements == NULL) {
+        return 0;
+    }
+
+    r = sd_bus_message_skip(message, "s");
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_message_skip failed with error: %s", __FUNCTION__, strerror(-r));
+        return 0;
+    }
+
+    _ingest_advertisement(sd_bus_message_get_path(message), message);
+    return 0;
+}
+
+int
+_on_advertisement_added(sd_bus_message* message, void* userdata, sd_bus_error* error)
+{
+    int r;
+    const char* object_path;
+    const char* interface;
+
+    if (lb_ctx->advertisements == NULL) {
+        return 0;
+    }
+
+    r = sd_bus_message_read_basic(message, 'o', &object_path);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_message_read_basic failed with error: %s", __FUNCTION__, strerror(-r));
+        return 0;
+    }
+
+    r = sd_bus_message_enter_container(message, 'a', "{sa{sv}}");
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_message_enter_container {sa{sv}} failed with error: %s",
+               __FUNCTION__, strerror(-r));
+        return 0;
+    }
+
+    while ((r = sd_bus_message_enter_container(message, 'e', "sa{sv}")) > 0) {
+        r = sd_bus_message_read_basic(message, 's', &interface);
+        if (r < 0)
+            break;
+
+        // a newly found device carries it's first advertisement in the Device1 properties
+        if (strcmp(interface, BLUEZ_DEVICE) == 0) {
+            _ingest_advertisement(object_path, message);
+            break;
+        }
+
+        r = sd_bus_message_skip(message, "a{sv}");
+        if (r < 0)
+            break;
+
+        r = sd_bus_message_exit_container(message);
+        if (r < 0)
+            break;
+    }
+
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed to parse InterfacesAdded of %s: %s", __FUNCTION__, object_path,
+               strerror(-r));
+    }
+
+    return 0;
+}
+
+void
+_free_advertisement_scan()
+{
+    lb_ctx->advertisement_changed_slot = sd_bus_slot_unref(lb_ctx->advertisement_changed_slot);
+    lb_ctx->advertisement_added_slot = sd_bus_slot_unref(lb_ctx->advertisement_added_slot);
+    _advertisement_queue_free(lb_ctx->advertisements);
+    lb_ctx->advertisements = NULL;
+}
+
+lb_result_t
+_start_discovery()
+{
+    int r = 0;
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+
+    // scans and trackers share one discovery session
+    if (lb_ctx->discovery_users++ > 0) {
+        return LB_SUCCESS;
+    }
+
+    r = _call_method("/org/bluez/hci0", "org.bluez.Adapter1", "StartDiscovery",
+                     lb_ctx->call_timeout, &error, NULL, NULL);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_call_method StartDiscovery failed with error: %s", __FUNCTION__,
+               error.message);
+        sd_bus_error_free(&error);
+        lb_ctx->discovery_users--;
+        return _call_result(r);
+    }
+
+    sd_bus_error_free(&error);
+    return LB_SUCCESS;
+}
+
+lb_result_t
+_stop_discovery()
+{
+    int r = 0;
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+
+    if (--lb_ctx->discovery_users > 0) {
+        return LB_SUCCESS;
+    }
+
+    r = _call_method("/org/bluez/hci0", "org.bluez.Adapter1", "StopDiscovery",
+                     lb_ctx->call_timeout, &error, NULL, NULL);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_call_method StopDiscovery failed with error: %s", __FUNCTION__,
+               error.message);
+        sd_bus_error_free(&error);
+        return _call_result(r);
+    }
+
+    sd_bus_error_free(&error);
+    return LB_SUCCESS;
+}
+
+lb_result_t
+_scan_devices(int seconds)
+{
+    int r = 0;
+
+    if (!_is_bus_connected(lb_ctx)) {
+        syslog(LOG_ERR, "%s: Bus is not opened", __FUNCTION__);
+        return -LB_ERROR_INVALID_BUS;
+    }
+
+    r = _start_discovery();
+    if (r < 0) {
+        return r;
+    }
+
+    sleep(seconds);
+
+    return _stop_discovery();
+}
+
+lb_result_t
+_open_system_bus()
+{
+    int r;
+
+    /* Connect to the system bus */
+    r = sd_bus_open_system(&(lb_ctx->bus));
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed to connect to system bus: %s", __FUNCTION__, strerror(-r));
+    }
+
+    return r;
+}
+
+lb_result_t
+_close_system_bus()
+{
+
+    sd_bus_unref(lb_ctx->bus);
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_context_new()
+{
+    int r = 0;
+    pthread_mutexattr_t lock_attr;
+    pthread_condattr_t cond_attr;
+
+    if (lb_ctx != NULL) {
+        syslog(LOG_ERR, "%s: Context already initialized", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    lb_ctx = (lb_context) malloc(sizeof(struct bl_context));
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for lb_context", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    lb_ctx->bus = NULL;
+    lb_ctx->event = NULL;
+    lb_ctx->external_loop = false;
+    lb_ctx->devices = NULL;
+    lb_ctx->devices_size = 0;
+    lb_ctx->gatt_cache = NULL;
+    lb_ctx->strings = NULL;
+    memset(&(lb_ctx->device_table), 0, sizeof(struct lb_device_table));
+    lb_ctx->advertisements = NULL;
+    lb_ctx->advertisement_changed_slot = NULL;
+    lb_ctx->advertisement_added_slot = NULL;
+    lb_ctx->discovery_users = 0;
+    lb_ctx->generation = 0;
+    lb_ctx->presence = NULL;
+    lb_ctx->presence_source = NULL;
+    memset(&(lb_ctx->presence_options), 0, sizeof(lb_presence_options));
+    lb_ctx->char_changed_slot = NULL;
+    lb_ctx->device_changed_slot = NULL;
+    lb_ctx->objects_added_slot = NULL;
+    lb_ctx->objects_removed_slot = NULL;
+    lb_ctx->value_cache_hits = 0;
+    lb_ctx->value_cache_misses = 0;
+    lb_ctx->loop_running = false;
+    lb_ctx->lock_depth = 0;
+    lb_ctx->lock_waiters = 0;
+    lb_ctx->wake_source = NULL;
+    lb_ctx->call_timeout = 0;
+    memset(&(lb_ctx->futures), 0, sizeof(struct lb_future_pool));
+
+    pthread_mutexattr_init(&lock_attr);
+    pthread_mutexattr_settype(&lock_attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&(lb_ctx->lock), &lock_attr);
+    pthread_mutexattr_destroy(&lock_attr);
+
+    // _context_wait deadlines are CLOCK_MONOTONIC like every other timestamp
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&(lb_ctx->loop_released), &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    lb_ctx->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (lb_ctx->wake_fd < 0) {
+        syslog(LOG_ERR, "%s: Failed to create wake eventfd: %s", __FUNCTION__, strerror(errno));
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    r = _string_table_new(&(lb_ctx->strings));
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed to create string table", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    r = _open_system_bus();
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed to open system bus: %s", __FUNCTION__, strerror(-r));
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    r = sd_event_new(&(lb_ctx->event));
+    if (r >= 0) {
+        r = sd_bus_attach_event(lb_ctx->bus, lb_ctx->event, SD_EVENT_PRIORITY_NORMAL);
+    }
+    if (r >= 0) {
+        r = sd_event_add_io(lb_ctx->event, &(lb_ctx->wake_source), lb_ctx->wake_fd, EPOLLIN,
+                            _on_loop_wake, NULL);
+    }
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed to set up event loop: %s", __FUNCTION__, strerror(-r));
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    r = sd_bus_add_match(lb_ctx->bus, &(lb_ctx->char_changed_slot),
+                         "type='signal',sender='org.bluez',"
+                         "interface='org.freedesktop.DBus.Properties',member='PropertiesChanged',"
+                         "arg0='org.bluez.GattCharacteristic1'",
+                         _on_characteristic_properties_changed, NULL);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed on sd_bus_add_match with error %d", __FUNCTION__, r);
+    }
+
+    r = sd_bus_add_match(lb_ctx->bus, &(lb_ctx->device_changed_slot),
+                         "type='signal',sender='org.bluez',"
+                         "interface='org.freedesktop.DBus.Properties',member='PropertiesChanged',"
+                         "arg0='org.bluez.Device1'",
+                         _on_device_properties_changed, NULL);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed on sd_bus_add_match with error %d", __FUNCTION__, r);
+    }
+
+    r = sd_bus_add_match(lb_ctx->bus, &(lb_ctx->objects_added_slot),
+                         "type='signal',sender='org.bluez',"
+                         "interface='org.freedesktop.DBus.ObjectManager',member='InterfacesAdded'",
+                         _on_interfaces_added, NULL);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed on sd_bus_add_match with error %d", __FUNCTION__, r);
+    }
+
+    r = sd_bus_add_match(lb_ctx->bus, &(lb_ctx->objects_removed_slot),
+                         "type='signal',sender='org.bluez',"
+                         "interface='org.freedesktop.DBus.ObjectManager',member='InterfacesRemoved'",
+                         _on_interfaces_removed, NULL);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed on sd_bus_add_match with error %d", __FUNCTION__, r);
+    }
+
+    if (gatt_cache_file != NULL) {
+        r = _gatt_cache_open(gatt_cache_file, &(lb_ctx->gatt_cache));
+        if (r < 0) {
+            syslog(LOG_ERR, "%s: Failed to open gatt cache %s", __FUNCTION__, gatt_cache_file);
+        }
+    }
+
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_context_free()
+{
+    int r = 0, i = 0;
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    sd_bus_slot_unref(lb_ctx->char_changed_slot);
+    sd_bus_slot_unref(lb_ctx->device_changed_slot);
+    sd_bus_slot_unref(lb_ctx->objects_added_slot);
+    sd_bus_slot_unref(lb_ctx->objects_removed_slot);
+    if (lb_ctx->advertisements != NULL) {
+        _free_advertisement_scan();
+    }
+    if (lb_ctx->presence != NULL) {
+        _free_presence_tracking();
+    }
+
+    sd_event_source_unref(lb_ctx->wake_source);
+    sd_bus_detach_event(lb_ctx->bus);
+    sd_event_unref(lb_ctx->event);
+    r = _close_system_bus(lb_ctx);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed to close system bus: %s", __FUNCTION__, strerror(-r));
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    if (lb_ctx->gatt_cache != NULL) {
+        r = _gatt_cache_save(lb_ctx->gatt_cache, lb_ctx->devices, lb_ctx->devices_size);
+        if (r < 0) {
+            syslog(LOG_ERR, "%s: Failed to save gatt cache", __FUNCTION__);
+        }
+        _gatt_cache_close(lb_ctx->gatt_cache);
+    }
+
+    for (i = 0; i < lb_ctx->devices_size; i++) {
+        _free_device(lb_ctx->devices[i]);
+    }
+    if (lb_ctx->devices != NULL)
+        free(lb_ctx->devices);
+    _device_table_free(&(lb_ctx->device_table));
+    _future_pool_free(&(lb_ctx->futures));
+    _string_table_free(lb_ctx->strings);
+    close(lb_ctx->wake_fd);
+    pthread_cond_destroy(&(lb_ctx->loop_released));
+    pthread_mutex_destroy(&(lb_ctx->lock));
+    free(lb_ctx);
+
+    lb_ctx = NULL;
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_init()
+{
+    if (lb_context_new() != LB_SUCCESS)
+        return LB_ERROR_INVALID_CONTEXT;
+
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_destroy()
+{
+    int i, r;
+
+    if (event_thread_started) {
+        pthread_cancel(event_thread);
+        pthread_join(event_thread, NULL);
+        event_thread_started = false;
+    }
+
+    r = sd_event_exit(event, SIGINT);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: failed to stop event loop", __FUNCTION__);
+    }
+    sd_event_unref(event);
+
+    if (events_matches_array != NULL) {
+        for (i = 0; i < event_arr_size; i++) {
+            free(events_matches_array[i]);
+        }
+        free(events_matches_array);
+    }
+
+    lb_context_free();
+
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_set_gatt_cache_file(const char* path)
+{
+    char* new_path = NULL;
+
+    if (lb_ctx != NULL) {
+        syslog(LOG_ERR, "%s: gatt cache must be set before lb_init", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (path != NULL) {
+        new_path = strdup(path);
+        if (new_path == NULL) {
+            syslog(LOG_ERR, "%s: Error allocating memory for gatt cache path", __FUNCTION__);
+            return -LB_ERROR_MEMEORY_ALLOCATION;
+        }
+    }
+
+    free(gatt_cache_file);
+    gatt_cache_file = new_path;
+
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_save_gatt_cache()
+{
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (lb_ctx->gatt_cache == NULL) {
+        syslog(LOG_ERR, "%s: gatt cache is not enabled", __FUNCTION__);
+        return -LB_ERROR_NO_RESOURCES;
+    }
+
+    return _gatt_cache_save(lb_ctx->gatt_cache, lb_ctx->devices, lb_ctx->devices_size);
+}
+
+lb_result_t
+lb_set_call_timeout(unsigned int timeout_ms)
+{
+    int r;
+
+    r = _context_lock();
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return r;
+    }
+
+    lb_ctx->call_timeout = (uint64_t) timeout_ms * 1000;
+
+    _context_unlock();
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_get_call_timeout(unsigned int* timeout_ms_ret)
+{
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (timeout_ms_ret == NULL) {
+        syslog(LOG_ERR, "%s: timeout_ms_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    *timeout_ms_ret = (unsigned int) (lb_ctx->call_timeout / 1000);
+    return LB_SUCCESS;
+}
+
+lb_result_t
+_reconcile_devices(lb_object_iter* iter)
+{
+    int r = 0, i;
+    lb_bl_device* dev;
+
+    // devices still reported are updated in place and stamped, the rest is swept after
+    lb_ctx->generation++;
+
+    while ((r = _object_iter_next(iter)) > 0) {
+        if (!_object_iter_has_interface(iter, BLUEZ_DEVICE)) {
+            continue;
+        }
+
+        dev = _find_device_by_path(iter->path);
+        if (dev == NULL) {
+            _add_new_device(iter->path, _object_iter_properties(iter), NULL);
+            continue;
+        }
+
+        if (_parse_device_properties(dev, _object_iter_properties(iter)) < 0) {
+            syslog(LOG_ERR, "%s: Error couldn't get device properties", __FUNCTION__);
+        }
+        dev->flags = (dev->flags & ~LB_DEVICE_FLAG_REMOVED) | LB_DEVICE_FLAG_BL;
+        // listing a cached device is not a sighting, last_seen stays with the presence signals
+        ((lb_device_entry*) dev)->generation = lb_ctx->generation;
+        _sync_device_row(dev);
+    }
+
+    _object_iter_finish(iter);
+
+    // a partial reply must not drop what it did not list
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed to parse managed objects: %s", __FUNCTION__, strerror(-r));
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    // backwards, the device moved into a freed index was already checked
+    for (i = lb_ctx->devices_size - 1; i >= 0; i--) {
+        dev = lb_ctx->devices[i];
+        if (((lb_device_entry*) dev)->generation == lb_ctx->generation) {
+            continue;
+        }
+
+        if (lb_ctx->presence != NULL) {
+            // leaves through the presence timer so on_leave is called
+            dev->flags = LB_DEVICE_FLAG_REMOVED;
+            _sync_device_row(dev);
+            _schedule_presence((lb_device_entry*) dev, _now_usec());
+        } else {
+            _remove_device(i);
+        }
+    }
+
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_get_bl_devices(int seconds)
+{
+    int r = 0;
+    lb_object_iter iter;
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    r = _scan_devices(seconds);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Error getting root objects", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = _object_iter_init(&iter);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Error getting root objects", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    return _reconcile_devices(&iter);
+}
+
+lb_result_t
+lb_connect_device(lb_bl_device* dev)
+{
+    return lb_connect_device_with_options(dev, NULL);
+}
+
+lb_result_t
+lb_connect_device_with_options(lb_bl_device* dev, const lb_call_options* options)
+{
+    int r;
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (dev == NULL) {
+        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    if (!_is_bus_connected(lb_ctx)) {
+        syslog(LOG_ERR, "%s: Bus is not opened", __FUNCTION__);
+        sd_bus_error_free(&error);
+        return -LB_ERROR_INVALID_BUS;
+    }
+
+    r = _call_method(dev->device_path, BLUEZ_DEVICE, "Connect", _call_timeout(options), &error,
+                     NULL, NULL);
+
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_call_method Connect on device %s failed with error: %s",
+               __FUNCTION__, dev->device_path, error.message);
+        sd_bus_error_free(&error);
+        return _call_result(r);
+    }
+
+    sd_bus_error_free(&error);
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_disconnect_device(lb_bl_device* dev)
+{
+    return lb_disconnect_device_with_options(dev, NULL);
+}
+
+lb_result_t
+lb_disconnect_device_with_options(lb_bl_device* dev, const lb_call_options* options)
+{
+    int r;
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (dev == NULL) {
+        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    if (!_is_bus_connected(lb_ctx)) {
+        syslog(LOG_ERR, "%s: Bus is not opened", __FUNCTION__);
+        sd_bus_error_free(&error);
+        return -LB_ERROR_INVALID_BUS;
+    }
+
+    r = _call_method(dev->device_path, BLUEZ_DEVICE, "Disconnect", _call_timeout(options), &error,
+                     NULL, NULL);
+
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_call_method Disconnect on device: %s failed with error: %s",
+               __FUNCTION__, dev->device_path, error.message);
+        sd_bus_error_free(&error);
+        return _call_result(r);
+    }
+
+    sd_bus_error_free(&error);
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_pair_device(lb_bl_device* dev)
+{
+    return lb_pair_device_with_options(dev, NULL);
+}
+
+lb_result_t
+lb_pair_device_with_options(lb_bl_device* dev, const lb_call_options* options)
+{
+    int r;
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (dev == NULL) {
+        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    if (!_is_bus_connected(lb_ctx)) {
+        syslog(LOG_ERR, "%s: Bus is not opened", __FUNCTION__);
+        sd_bus_error_free(&error);
+        return -LB_ERROR_INVALID_BUS;
+    }
+
+    r = _call_method(dev->device_path, BLUEZ_DEVICE, "Pair", _call_timeout(options), &error, NULL,
+                     NULL);
+
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_call_method Pair on device %s failed with error: %s",
+               __FUNCTION__, dev->device_path, error.message);
+        sd_bus_error_free(&error);
+        return _call_result(r);
+    }
+
+    sd_bus_error_free(&error);
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_unpair_device(lb_bl_device* dev)
+{
+    return lb_unpair_device_with_options(dev, NULL);
+}
+
+lb_result_t
+lb_unpair_device_with_options(lb_bl_device* dev, const lb_call_options* options)
+{
+    int r;
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (dev == NULL) {
+        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    if (!_is_bus_connected(lb_ctx)) {
+        syslog(LOG_ERR, "%s: Bus is not opened", __FUNCTION__);
+        sd_bus_error_free(&error);
+        return -LB_ERROR_INVALID_BUS;
+    }
+
+    r = _call_method(dev->device_path, BLUEZ_DEVICE, "CancelPairing", _call_timeout(options),
+                     &error, NULL, NULL);
+
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_call_method CancelPairing on device %s failed with error: %s",
+               __FUNCTION__, dev->device_path, error.message);
+        sd_bus_error_free(&error);
+        return _call_result(r);
+    }
+
+    sd_bus_error_free(&error);
+    return LB_SUCCESS;
+}
+
+lb_result_t
+_reconcile_device_services(lb_bl_device* dev, lb_object_iter* iter)
+{
+    int r = 0, changed = 0;
+    bool primary, is_service;
+    const char* uuid;
+    const void* value;
+    size_t value_size;
+    lb_ble_char* characteristic;
+
+    // objects still reported are stamped and kept with their cached values, the rest is swept after
+    lb_ctx->generation++;
+
+    // a single pass, characteristics listed before their service create it and it is filled later
+    while ((r = _object_iter_next(iter)) > 0) {
+        if (!_is_path_below(iter->path, dev->device_path)) {
+            continue;
+        }
+
+        while ((r = _object_iter_next_interface(iter)) > 0) {
+            if (strcmp(iter->interface, BLUEZ_GATT_SERVICE) == 0) {
+                is_service = true;
+            } else if (strcmp(iter->interface, BLUEZ_GATT_CHARACTERISTICS) == 0) {
+                is_service = false;
+            } else {
+                continue;
+            }
+
+            uuid = NULL;
+            primary = false;
+            value_size = 0;
+            r = _parse_gatt_properties(_object_iter_properties(iter), &uuid, &primary, &value, &value_size);
+            if (r < 0) {
+                syslog(LOG_ERR, "%s: Error parsing properties of %s", __FUNCTION__, iter->path);
+                break;
+            }
+
+            dev->flags |= LB_DEVICE_FLAG_BLE;
+            if (is_service) {
+                r = _set_device_service(dev, iter->path, uuid, primary);
+            } else {
+                r = _add_characteristic_to_device(dev, iter->path, uuid, &characteristic);
+                // seed the cache with the value BlueZ holds, a value of our own is kept up to date
+                // by PropertiesChanged already
+                if (r >= 0 && value_size > 0 && characteristic->value_timestamp == 0) {
+                    _update_characteristic_value(characteristic, value, value_size);
+                }
+            }
+            if (r < 0) {
+                syslog(LOG_ERR, "%s: Error adding %s", __FUNCTION__, iter->path);
+                r = 0;
+            }
+            changed += r;
+            r = 0;
+            break;
+        }
+        if (r < 0) {
+            break;
+        }
+    }
+
+    _object_iter_finish(iter);
+
+    // a partial reply must not drop what it did not list
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed to parse managed objects: %s", __FUNCTION__, strerror(-r));
+        _sync_device_row(dev);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    changed += _remove_stale_services(dev);
+    if (dev->services_size == 0) {
+        dev->flags &= ~LB_DEVICE_FLAG_BLE;
+    }
+    _sync_device_row(dev);
+
+    // the live layout replaces the cached one when the cache is saved
+    if (changed > 0) {
+        _gatt_cache_mark_dirty(lb_ctx->gatt_cache);
+    }
+
+    return LB_SUCCESS;
+}
+
+int
+_check_services_device(lb_bl_device* dev)
+{
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (dev == NULL) {
+        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    // trust a cached layout, it is validated lazily when one of it's objects turns out stale
+    if (dev->services_size == 0 && _gatt_cache_populate(lb_ctx->gatt_cache, lb_ctx->strings, dev) == LB_SUCCESS) {
+        dev->flags |= LB_DEVICE_FLAG_BL | LB_DEVICE_FLAG_BLE;
+        _sync_device_row(dev);
+        return 1;
+    }
+
+    _process_pending_events();
+    if ((dev->flags & LB_DEVICE_FLAG_REMOVED) ||
+        (!(dev->flags & LB_DEVICE_FLAG_BL) && !_is_bl_device(dev->device_path))) {
+        syslog(LOG_ERR, "%s: device %s not a bl device", __FUNCTION__, dev->device_path);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_get_ble_device_services(lb_bl_device* dev)
+{
+    int r;
+    lb_object_iter iter;
+
+    // 1 when the cached layout was used
+    r = _check_services_device(dev);
+    if (r != LB_SUCCESS) {
+        return (r > 0) ? LB_SUCCESS : r;
+    }
+
+    if (!dev->properties.paired) {
+        r = lb_pair_device(dev);
+        if (r < 0) {
+            syslog(LOG_ERR, "%s: error pairing device", __FUNCTION__);
+            return -LB_ERROR_UNSPECIFIED;
+        }
+    }
+
+    r = _object_iter_init(&iter);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Error getting root objects", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    return _reconcile_device_services(dev, &iter);
+}
+
+lb_result_t
+lb_get_ble_characteristic_by_characteristic_path(lb_bl_device* dev,
+                                                 const char* characteristic_path,
+                                                 lb_ble_char** ble_characteristic_ret)
+{
+    int i, j;
+    const char* key;
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (dev == NULL) {
+        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    if (characteristic_path == NULL) {
+        syslog(LOG_ERR, "%s: characteristic_path is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    key = _string_table_find(lb_ctx->strings, characteristic_path);
+    for (i = 0; key != NULL && i < dev->services_size; i++) {
+        for (j = 0; j < dev->services[i]->characteristics_size; j++) {
+            if (key == dev->services[i]->characteristics[j]->char_path) {
+                *ble_characteristic_ret = dev->services[i]->characteristics[j];
+                return LB_SUCCESS;
+            }
+        }
+    }
+
+    // compatibility with callers passing a prefix of the path
+    for (i = 0; i < dev->services_size; i++) {
+        for (j = 0; j < dev->services[i]->characteristics_size; j++) {
+            if (strncmp(characteristic_path, dev->services[i]->characteristics[j]->char_path,
+                        strlen(characteristic_path)) == 0) {
+                *ble_characteristic_ret = dev->services[i]->characteristics[j];
+                return LB_SUCCESS;
+            }
+        }
+    }
+    return -LB_ERROR_UNSPECIFIED;
+}
+
+lb_result_t
+lb_get_ble_characteristic_by_uuid(lb_bl_device* dev, const char* uuid, lb_ble_char** ble_characteristic_ret)
+{
+    int i, j;
+    const char* key;
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (dev == NULL) {
+        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    if (uuid == NULL) {
+        syslog(LOG_ERR, "%s: uuid is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    _process_pending_events();
+
+    if (!_is_ble_device_ready(dev)) {
+        syslog(LOG_ERR, "%s: not a ble device", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    key = _string_table_find(lb_ctx->strings, uuid);
+    for (i = 0; key != NULL && i < dev->services_size; i++) {
+        for (j = 0; j < dev->services[i]->characteristics_size; j++) {
+            if (key == dev->services[i]->characteristics[j]->uuid) {
+                *ble_characteristic_ret = dev->services[i]->characteristics[j];
+                return LB_SUCCESS;
+            }
+        }
+    }
+
+    // compatibility with callers passing a prefix of the uuid
+    for (i = 0; i < dev->services_size; i++) {
+        for (j = 0; j < dev->services[i]->characteristics_size; j++) {
+            if (strncmp(uuid, dev->services[i]->characteristics[j]->uuid, strlen(uuid)) == 0) {
+                *ble_characteristic_ret = dev->services[i]->characteristics[j];
+                return LB_SUCCESS;
+            }
+        }
+    }
+    return -LB_ERROR_UNSPECIFIED;
+}
+
+lb_result_t
+lb_get_ble_service_by_service_path(lb_bl_device* dev, const char* service_path, lb_ble_service** ble_service_ret)
+{
+    int i;
+    const char* key;
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (dev == NULL) {
+        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    if (service_path == NULL) {
+        syslog(LOG_ERR, "%s: service_path is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    key = _string_table_find(lb_ctx->strings, service_path);
+    for (i = 0; key != NULL && i < dev->services_size; i++) {
+        if (key == dev->services[i]->service_path) {
+            *ble_service_ret = dev->services[i];
+            return LB_SUCCESS;
+        }
+    }
+
+    // compatibility with callers passing a prefix of the path
+    for (i = 0; i < dev->services_size; i++) {
+        if (strncmp(service_path, dev->services[i]->service_path, strlen(service_path)) == 0) {
+            *ble_service_ret = dev->services[i];
+            return LB_SUCCESS;
+        }
+    }
+    return -LB_ERROR_UNSPECIFIED;
+}
+
+lb_result_t
+lb_get_ble_service_by_uuid(lb_bl_device* dev, const char* uuid, lb_ble_service** ble_service_ret)
+{
+    int i;
+    const char* key;
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (dev == NULL) {
+        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    if (uuid == NULL) {
+        syslog(LOG_ERR, "%s: uuid is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    _process_pending_events();
+
+    if (!_is_ble_device_ready(dev)) {
+        syslog(LOG_ERR, "%s: not a ble device", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    key = _string_table_find(lb_ctx->strings, uuid);
+    for (i = 0; key != NULL && i < dev->services_size; i++) {
+        if (key == dev->services[i]->uuid) {
+            *ble_service_ret = dev->services[i];
+            return LB_SUCCESS;
+        }
+    }
+
+    // compatibility with callers passing a prefix of the uuid
+    for (i = 0; i < dev->services_size; i++) {
+        if (strncmp(uuid, dev->services[i]->uuid, strlen(uuid)) == 0) {
+            *ble_service_ret = dev->services[i];
+            return LB_SUCCESS;
+        }
+    }
+    return -LB_ERROR_UNSPECIFIED;
+}
+
+lb_result_t
+lb_get_device_by_device_path(const char* device_path, lb_bl_device** bl_device_ret)
+{
+    int i;
+    const char* key;
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (device_path == NULL) {
+        syslog(LOG_ERR, "%s: device_path is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    key = _string_table_find(lb_ctx->strings, device_path);
+    for (i = 0; key != NULL && i < lb_ctx->devices_size; i++) {
+        if (key == lb_ctx->devices[i]->device_path) {
+            *bl_device_ret = lb_ctx->devices[i];
+            return LB_SUCCESS;
+        }
+    }
+
+    // compatibility with callers passing a prefix of the path
+    for (i = 0; i < lb_ctx->devices_size; i++) {
+        if (strncmp(device_path, lb_ctx->devices[i]->device_path, strlen(device_path)) == 0) {
+            *bl_device_ret = lb_ctx->devices[i];
+            return LB_SUCCESS;
+        }
+    }
+    return -LB_ERROR_UNSPECIFIED;
+}
+
+lb_result_t
+lb_get_device_by_device_name(const char* name, lb_bl_device** bl_device_ret)
+{
+    int i;
+    const char* key;
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (name == NULL) {
+        syslog(LOG_ERR, "%s: name is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    key = _string_table_find(lb_ctx->strings, name);
+    for (i = 0; key != NULL && i < lb_ctx->devices_size; i++) {
+        if (key == lb_ctx->devices[i]->name) {
+            *bl_device_ret = lb_ctx->devices[i];
+            return LB_SUCCESS;
+        }
+    }
+
+    // compatibility with callers passing a prefix of the name
+    for (i = 0; i < lb_ctx->devices_size; i++) {
+        if (strncmp(name, lb_ctx->devices[i]->name, strlen(name)) == 0) {
+            *bl_device_ret = lb_ctx->devices[i];
+            return LB_SUCCESS;
+        }
+    }
+    return -LB_ERROR_UNSPECIFIED;
+}
+
+lb_result_t
+lb_get_device_by_device_address(const char* address, lb_bl_device** bl_device_ret)
+{
+    int i;
+    const char* key;
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (address == NULL) {
+        syslog(LOG_ERR, "%s: address is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    key = _string_table_find(lb_ctx->strings, address);
+    for (i = 0; key != NULL && i < lb_ctx->devices_size; i++) {
+        if (key == lb_ctx->devices[i]->address) {
+            *bl_device_ret = lb_ctx->devices[i];
+            return LB_SUCCESS;
+        }
+    }
+
+    // compatibility with callers passing a prefix of the address
+    for (i = 0; i < lb_ctx->devices_size; i++) {
+        if (strncmp(address, lb_ctx->devices[i]->address, strlen(address)) == 0) {
+            *bl_device_ret = lb_ctx->devices[i];
+            return LB_SUCCESS;
+        }
+    }
+    return -LB_ERROR_UNSPECIFIED;
+}
+
+lb_result_t
+lb_get_device_by_index(int index, lb_bl_device** bl_device_ret)
+{
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (index < 0 || index >= lb_ctx->devices_size) {
+        syslog(LOG_ERR, "%s: index %d out of range", __FUNCTION__, index);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    *bl_device_ret = lb_ctx->devices[index];
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_filter_devices(const lb_device_filter* filter, int* indices, int capacity, int* count_ret)
+{
+    int octets, count;
+    struct lb_device_query query = { 0, 0, NULL, INT16_MIN, 0, 0, 0 };
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (count_ret == NULL || (indices == NULL && capacity > 0)) {
+        syslog(LOG_ERR, "%s: indices or count_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    if (filter != NULL) {
+        if (filter->address_prefix != NULL) {
+            octets = _pack_address(filter->address_prefix, &query.address_prefix);
+            if (octets < 0) {
+                syslog(LOG_ERR, "%s: malformed address prefix %s", __FUNCTION__,
+                       filter->address_prefix);
+                return -LB_ERROR_UNSPECIFIED;
+            }
+            query.address_mask = ~(0xffffffffffffULL >> (8 * octets)) & 0xffffffffffffULL;
+        }
+
+        if (filter->name != NULL) {
+            // a name that was never interned can't match any device
+            query.name = _string_table_find(lb_ctx->strings, filter->name);
+            if (query.name == NULL) {
+                *count_ret = 0;
+                return LB_SUCCESS;
+            }
+        }
+
+        if (filter->min_rssi != 0) {
+            query.min_rssi = filter->min_rssi;
+        }
+        query.flags_set = filter->flags_set;
+        query.flags_clear = filter->flags_clear;
+        query.seen_since = filter->seen_since;
+    }
+
+    _process_pending_events();
+
+    count = _device_table_filter(&(lb_ctx->device_table), &query, indices, capacity);
+    *count_ret = count;
+
+    return (count > capacity) ? -LB_ERROR_NO_RESOURCES : LB_SUCCESS;
+}
+
+lb_result_t
+lb_get_device_properties(lb_bl_device* dev, const lb_bl_device_properties** properties_ret)
+{
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (dev == NULL) {
+        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    _process_pending_events();
+
+    *properties_ret = &(dev->properties);
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_refresh_device_properties(lb_bl_device* dev)
+{
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (dev == NULL) {
+        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    if (!_is_bus_connected(lb_ctx)) {
+        syslog(LOG_ERR, "%s: Bus is not opened", __FUNCTION__);
+        return -LB_ERROR_INVALID_BUS;
+    }
+
+    return _get_device_properties(dev);
+}
+
+lb_result_t _gatt_queue_op(lb_bl_device* dev,
+                           lb_ble_char* characteristic,
+                           lb_future_op_t op,
+                           const uint8_t* value,
+                           int size,
+                           const lb_call_options* options,
+                           bool keep_reply,
+                           lb_future** future_ret);
+
+/**
+ * Wait for a queued GATT operation without holding the context lock, which is taken back after
+ *
+ * @param future of the operation, freed
+ * @param reply_ret to populate with the reply kept by a read, NULL for a write
+ * @return Result of operation
+ */
+lb_result_t
+_gatt_wait(lb_future* future, sd_bus_message** reply_ret)
+{
+    int r;
+
+    // the caller holds the lock exactly once, other threads need it to send their operations
+    _context_unlock();
+    r = lb_future_wait(future, -1);
+    _context_lock();
+
+    if (r >= 0 && reply_ret != NULL) {
+        *reply_ret = future->value_reply;
+        future->value_reply = NULL;
+    }
+    lb_future_free(future);
+
+    return r;
+}
+
+lb_result_t
+_write_characteristic_value(lb_bl_device* dev,
+                            lb_ble_char* characteristic,
+                            int size,
+                            const uint8_t* value,
+                            const lb_call_options* options)
+{
+    int r;
+    sd_bus_message* func_call = NULL;
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    lb_future* future = NULL;
+
+    if (lb_ctx->lock_depth == 1) {
+        r = _gatt_queue_op(dev, characteristic, LB_FUTURE_WRITE, value, size, options, false, &future);
+        if (r < 0) {
+            return r;
+        }
+        return _gatt_wait(future, NULL);
+    }
+
+    // called back from the loop, which can not run again to wait for the queue
+    r = sd_bus_message_new_method_call(lb_ctx->bus, &func_call, BLUEZ_DEST, characteristic->char_path,
+                                       BLUEZ_GATT_CHARACTERISTICS, "WriteValue");
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed to create message call", __FUNCTION__);
+        sd_bus_message_unref(func_call);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = sd_bus_message_append_array(func_call, 'y', value, size);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed to append array to message call", __FUNCTION__);
+        sd_bus_message_unref(func_call);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = sd_bus_message_append(func_call, "a{sv}", 0, NULL);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed to append a{sv} to message call", __FUNCTION__);
+        sd_bus_message_unref(func_call);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = sd_bus_call(lb_ctx->bus, func_call, _call_timeout(options), &error, NULL);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_call WriteValue on device %s failed with error: %s",
+               __FUNCTION__, characteristic->char_path, error.message);
+        if (_is_stale_object_error(&error)) {
+            _invalidate_device_services(dev);
+        }
+        sd_bus_error_free(&error);
+        sd_bus_message_unref(func_call);
+        return _call_result(r);
+    }
+
+    sd_bus_error_free(&error);
+    sd_bus_message_unref(func_call);
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_write_to_characteristic(lb_bl_device* dev, const char* uuid, int size, uint8_t* value)
+{
+    return lb_write_to_characteristic_with_options(dev, uuid, size, value, NULL);
+}
+
+lb_result_t
+lb_write_to_characteristic_with_options(lb_bl_device* dev,
+                                        const char* uuid,
+                                        int size,
+                                        const uint8_t* value,
+                                        const lb_call_options* options)
+{
+    int r;
+    lb_ble_char* characteristics = NULL;
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (dev == NULL) {
+        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    if (uuid == NULL) {
+        syslog(LOG_ERR, "%s: uuid is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    if (!_call_options_valid(options)) {
+        syslog(LOG_ERR, "%s: invalid priority", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    if (size < 0 || size > LB_ATT_MAX_VALUE_SIZE) {
+        syslog(LOG_ERR, "%s: %d bytes do not fit an attribute value, use a stream", __FUNCTION__, size);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    _context_lock();
+
+    if (!_is_bus_connected(lb_ctx)) {
+        syslog(LOG_ERR, "%s: Bus is not opened", __FUNCTION__);
+        _context_unlock();
+        return -LB_ERROR_INVALID_BUS;
+    }
+
+    r = lb_get_ble_characteristic_by_uuid(dev, uuid, &characteristics);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed to get characteristic", __FUNCTION__);
+        _context_unlock();
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = _write_characteristic_value(dev, characteristics, size, value, options);
+
+    _context_unlock();
+    return r;
+}
+
+lb_result_t
+_read_characteristic_value(lb_bl_device* dev,
+                           lb_ble_char* characteristic,
+                           const lb_call_options* options,
+                           sd_bus_message** reply_ret,
+                           const void** value,
+                           size_t* size)
+{
+    int r;
+    sd_bus_message* reply = NULL;
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    lb_future* future = NULL;
+
+    if (lb_ctx->lock_depth == 1) {
+        // the lock is dropped while waiting, callers look the characteristic up again after
+        r = _gatt_queue_op(dev, characteristic, LB_FUTURE_READ, NULL, 0, options, true, &future);
+        if (r >= 0) {
+            r = _gatt_wait(future, &reply);
+        }
+    } else {
+        // called back from the loop, which can not run again to wait for the queue
+        r = _call_method(characteristic->char_path, BLUEZ_GATT_CHARACTERISTICS, "ReadValue",
+                         _call_timeout(options), &error, &reply, "a{sv}", NULL);
+        if (r < 0) {
+            syslog(LOG_ERR, "%s: sd_bus_call_method ReadValue on device %s failed with error: %s",
+                   __FUNCTION__, characteristic->char_path, error.message);
+            if (_is_stale_object_error(&error)) {
+                _invalidate_device_services(dev);
+            }
+            r = _call_result(r);
+        }
+    }
+    if (r < 0) {
+        sd_bus_error_free(&error);
+        sd_bus_message_unref(reply);
+        return r;
+    }
+
+    r = sd_bus_message_read_array(reply, 'y', value, size);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed to read byte array message", __FUNCTION__);
+        sd_bus_error_free(&error);
+        sd_bus_message_unref(reply);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    sd_bus_error_free(&error);
+    *reply_ret = reply;
+    return LB_SUCCESS;
+}
+
+lb_result_t
+_get_readable_characteristic(lb_bl_device* dev, const char* uuid, lb_ble_char** characteristic_ret)
+{
+    int r;
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (dev == NULL) {
+        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    if (uuid == NULL) {
+        syslog(LOG_ERR, "%s: uuid is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    if (!_is_bus_connected(lb_ctx)) {
+        syslog(LOG_ERR, "%s: Bus is not opened", __FUNCTION__);
+        return -LB_ERROR_INVALID_BUS;
+    }
+
+    _process_pending_events();
+
+    if (!_is_ble_device_ready(dev)) {
+        syslog(LOG_ERR, "%s: not a ble device", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    r = lb_get_ble_characteristic_by_uuid(dev, uuid, characteristic_ret);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed to get characteristic", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    return LB_SUCCESS;
+}
+
+/**
+ * Get the ATT MTU of the link to a characteristic, read once from BlueZ and cached
+ *
+ * @param characteristic to get the MTU of
+ * @return the MTU, LB_ATT_DEFAULT_MTU if BlueZ does not expose it
+ */
+uint16_t
+_characteristic_mtu(lb_ble_char* characteristic)
+{
+    int r;
+    uint16_t mtu = 0;
+    lb_char_entry* entry = (lb_char_entry*) characteristic;
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message* reply = NULL;
+
+    if (entry->mtu != 0) {
+        return entry->mtu;
+    }
+
+    r = _call_method(characteristic->char_path, "org.freedesktop.DBus.Properties", "Get",
+                     lb_ctx->call_timeout, &error, &reply, "ss", BLUEZ_GATT_CHARACTERISTICS, "MTU");
+    if (r >= 0) {
+        r = sd_bus_message_read(reply, "v", "q", &mtu);
+    }
+    if (r < 0 || mtu < LB_ATT_DEFAULT_MTU) {
+        // BlueZ before 5.62 has no MTU property
+        syslog(LOG_INFO, "%s: no MTU for %s, using %d", __FUNCTION__, characteristic->char_path,
+               LB_ATT_DEFAULT_MTU);
+        mtu = LB_ATT_DEFAULT_MTU;
+    }
+
+    sd_bus_error_free(&error);
+    sd_bus_message_unref(reply);
+    entry->mtu = mtu;
+    return mtu;
+}
+
+lb_result_t
+lb_get_characteristic_mtu(lb_bl_device* dev, const char* uuid, uint16_t* mtu_ret)
+{
+    int r;
+    lb_ble_char* characteristic = NULL;
+
+    if (mtu_ret == NULL) {
+        syslog(LOG_ERR, "%s: mtu_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = _context_lock();
+    if (r < 0) {
+        return r;
+    }
+
+    r = _get_readable_characteristic(dev, uuid, &characteristic);
+    if (r >= 0) {
+        *mtu_ret = _characteristic_mtu(characteristic);
+    }
+
+    _context_unlock();
+    return r;
+}
+
+lb_result_t
+lb_read_from_characteristic(lb_bl_device* dev, const char* uuid, size_t* size, uint8_t** result)
+{
+    return lb_read_from_characteristic_cached(dev, uuid, LB_READ_REMOTE, 0, size, result);
+}
+
+lb_result_t
+_read_from_characteristic_cached(lb_bl_device* dev,
+                                 const char* uuid,
+                                 lb_read_policy_t policy,
+                                 unsigned int max_age_ms,
+                                 const lb_call_options* options,
+                                 size_t* size,
+                                 uint8_t** result)
+{
+    int r;
+    const void* value = NULL;
+    const char* path;
+    sd_bus_message* reply = NULL;
+    lb_ble_char* characteristics = NULL;
+
+    r = _get_readable_characteristic(dev, uuid, &characteristics);
+    if (r < 0) {
+        return r;
+    }
+
+    if (policy != LB_READ_REMOTE) {
+        if (characteristics->value_timestamp != 0 &&
+            (policy == LB_READ_CACHED_ONLY ||
+             _now_usec() - characteristics->value_timestamp <= (uint64_t) max_age_ms * 1000)) {
+            lb_ctx->value_cache_hits++;
+            *size = characteristics->value_size;
+            *result = characteristics->value;
+            return LB_SUCCESS;
+        }
+
+        lb_ctx->value_cache_misses++;
+        if (policy == LB_READ_CACHED_ONLY) {
+            return -LB_ERROR_NO_RESOURCES;
+        }
+    }
+
+    // a rescan can free the characteristic while the read waits, only it's path is kept across
+    path = _string_table_ref(characteristics->char_path);
+    r = _read_characteristic_value(dev, characteristics, options, &reply, &value, size);
+    if (r >= 0) {
+        characteristics = _find_characteristic_by_path(path);
+        if (characteristics == NULL) {
+            syslog(LOG_ERR, "%s: characteristic %s was removed while reading", __FUNCTION__, path);
+            sd_bus_message_unref(reply);
+            r = -LB_ERROR_INVALID_DEVICE;
+        }
+    }
+    _string_table_release(path);
+    if (r < 0) {
+        return r;
+    }
+
+    // keep the value past the reply lifetime
+    r = _update_characteristic_value(characteristics, value, *size);
+    if (r < 0) {
+        sd_bus_message_unref(reply);
+        return r;
+    }
+    *result = characteristics->value;
+
+    sd_bus_message_unref(reply);
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_read_from_characteristic_cached(lb_bl_device* dev,
+                                   const char* uuid,
+                                   lb_read_policy_t policy,
+                                   unsigned int max_age_ms,
+                                   size_t* size,
+                                   uint8_t** result)
+{
+    int r;
+
+    r = _context_lock();
+    if (r < 0) {
+        return r;
+    }
+
+    r = _read_from_characteristic_cached(dev, uuid, policy, max_age_ms, NULL, size, result);
+
+    _context_unlock();
+    return r;
+}
+
+lb_result_t
+lb_read_from_characteristic_with_options(lb_bl_device* dev,
+                                         const char* uuid,
+                                         const lb_call_options* options,
+                                         size_t* size,
+                                         uint8_t** result)
+{
+    int r;
+
+    if (!_call_options_valid(options)) {
+        syslog(LOG_ERR, "%s: invalid priority", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = _context_lock();
+    if (r < 0) {
+        return r;
+    }
+
+    r = _read_from_characteristic_cached(dev, uuid, LB_READ_REMOTE, 0, options, size, result);
+
+    _context_unlock();
+    return r;
+}
+
+lb_result_t
+_read_from_characteristic_into(lb_bl_device* dev,
+                               const char* uuid,
+                               uint8_t* buffer,
+                               size_t capacity,
+                               size_t* size)
+{
+    int r;
+    const void* value = NULL;
+    sd_bus_message* reply = NULL;
+    lb_ble_char* characteristics = NULL;
+
+    if (buffer == NULL && capacity > 0) {
+        syslog(LOG_ERR, "%s: buffer is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = _get_readable_characteristic(dev, uuid, &characteristics);
+    if (r < 0) {
+        return r;
+    }
+
+    r = _read_characteristic_value(dev, characteristics, NULL, &reply, &value, size);
+    if (r < 0) {
+        return r;
+    }
+
+    if (*size > capacity) {
+        syslog(LOG_ERR, "%s: value of %zu bytes does not fit in %zu bytes", __FUNCTION__, *size, capacity);
+        sd_bus_message_unref(reply);
+        return -LB_ERROR_NO_RESOURCES;
+    }
+
+    if (*size > 0) {
+        memcpy(buffer, value, *size);
+    }
+
+    sd_bus_message_unref(reply);
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_read_from_characteristic_into(lb_bl_device* dev,
+                                 const char* uuid,
+                                 uint8_t* buffer,
+                                 size_t capacity,
+                                 size_t* size)
+{
+    int r;
+
+    r = _context_lock();
+    if (r < 0) {
+        return r;
+    }
+
+    r = _read_from_characteristic_into(dev, uuid, buffer, capacity, size);
+
+    _context_unlock();
+    return r;
+}
+
+lb_result_t
+_read_from_characteristic_view(lb_bl_device* dev, const char* uuid, lb_read_view* view)
+{
+    int r;
+    const void* value = NULL;
+    size_t size = 0;
+    sd_bus_message* reply = NULL;
+    lb_ble_char* characteristics = NULL;
+
+    if (view == NULL) {
+        syslog(LOG_ERR, "%s: view is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    view->data = NULL;
+    view->size = 0;
+    view->message = NULL;
+
+    r = _get_readable_characteristic(dev, uuid, &characteristics);
+    if (r < 0) {
+        return r;
+    }
+
+    r = _read_characteristic_value(dev, characteristics, NULL, &reply, &value, &size);
+    if (r < 0) {
+        return r;
+    }
+
+    // the reply reference is handed over to the view
+    view->data = value;
+    view->size = size;
+    view->message = reply;
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_read_from_characteristic_view(lb_bl_device* dev, const char* uuid, lb_read_view* view)
+{
+    int r;
+
+    r = _context_lock();
+    if (r < 0) {
+        return r;
+    }
+
+    r = _read_from_characteristic_view(dev, uuid, view);
+
+    _context_unlock();
+    return r;
+}
+
+lb_result_t
+lb_read_release(lb_read_view* view)
+{
+    if (view == NULL) {
+        syslog(LOG_ERR, "%s: view is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    sd_bus_message_unref(view->message);
+    view->data = NULL;
+    view->size = 0;
+    view->message = NULL;
+    return LB_SUCCESS;
+}
+
+lb_result_t _wait_futures(lb_future** futures, int count, bool all, int timeout_ms, int* index_ret);
+
+/**
+ * Pack a value read by lb_read_batch behind the values before it
+ *
+ * @param result of the read to complete
+ * @param value read
+ * @param size of value in bytes
+ * @param buffer to pack into
+ * @param capacity of buffer in bytes
+ * @param used bytes of buffer taken, advanced past the value if it fits
+ */
+void
+_read_batch_gather(lb_read_result* result,
+                   const void* value,
+                   size_t size,
+                   uint8_t* buffer,
+                   size_t capacity,
+                   size_t* used)
+{
+    result->offset = *used;
+    result->size = size;
+    if (size > capacity - *used) {
+        syslog(LOG_ERR, "%s: value of %zu bytes does not fit in %zu bytes", __FUNCTION__, size,
+               capacity - *used);
+        result->result = -LB_ERROR_NO_RESOURCES;
+        return;
+    }
+
+    if (size > 0) {
+        memcpy(buffer + *used, value, size);
+    }
+    *used += size;
+    result->result = LB_SUCCESS;
+}
+
+lb_result_t
+lb_read_batch(const lb_read_op* ops,
+              int count,
+              const lb_call_options* options,
+              uint8_t* buffer,
+              size_t capacity,
+              lb_read_result* results)
+{
+    int r, waited, i;
+    bool queued;
+    size_t used = 0, size = 0;
+    const void* value = NULL;
+    sd_bus_message* reply = NULL;
+    lb_ble_char* characteristic = NULL;
+    lb_future** futures = NULL;
+
+    if (count <= 0) {
+        return LB_SUCCESS;
+    }
+
+    if (ops == NULL || results == NULL) {
+        syslog(LOG_ERR, "%s: ops or results is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    if (buffer == NULL && capacity > 0) {
+        syslog(LOG_ERR, "%s: buffer is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    if (!_call_options_valid(options)) {
+        syslog(LOG_ERR, "%s: invalid priority", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    futures = (lb_future**) calloc((size_t) count, sizeof(lb_future*));
+    if (futures == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for futures", __FUNCTION__);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    r = _context_lock();
+    if (r < 0) {
+        free(futures);
+        return r;
+    }
+
+    // called back from the loop, which can not run again to wait for the queues, the reads are
+    // made one after the other
+    queued = lb_ctx->lock_depth == 1;
+    for (i = 0; i < count; i++) {
+        memset(&results[i], 0, sizeof(lb_read_result));
+        r = _get_readable_characteristic(ops[i].dev, ops[i].uuid, &characteristic);
+        if (r >= 0 && queued) {
+            r = _gatt_queue_op(ops[i].dev, characteristic, LB_FUTURE_READ, NULL, 0, options, true,
+                               &futures[i]);
+        } else if (r >= 0) {
+            r = _read_characteristic_value(ops[i].dev, characteristic, options, &reply, &value, &size);
+            if (r >= 0) {
+                _read_batch_gather(&results[i], value, size, buffer, capacity, &used);
+                sd_bus_message_unref(reply);
+                continue;
+            }
+        }
+        results[i].result = r;
+    }
+
+    if (queued) {
+        // every read has a timeout, other threads need the lock meanwhile to send theirs
+        _context_unlock();
+        waited = _wait_futures(futures, count, true, -1, NULL);
+        _context_lock();
+
+        // a read still pending when the wait failed takes the failure of the wait
+        for (i = 0; i < count; i++) {
+            if (futures[i] == NULL) {
+                continue;
+            }
+            results[i].result = futures[i]->done ? futures[i]->result : waited;
+            r = results[i].result;
+            if (r >= 0) {
+                r = sd_bus_message_read_array(futures[i]->value_reply, 'y', &value, &size);
+                if (r < 0) {
+                    syslog(LOG_ERR, "%s: Failed to read byte array message", __FUNCTION__);
+                    results[i].result = -LB_ERROR_UNSPECIFIED;
+                } else {
+                    _read_batch_gather(&results[i], value, size, buffer, capacity, &used);
+                }
+            }
+            lb_future_free(futures[i]);
+        }
+    }
+
+    r = LB_SUCCESS;
+    for (i = 0; i < count && r >= 0; i++) {
+        r = results[i].result;
+    }
+
+    _context_unlock();
+    free(futures);
+    return r;
+}
+
+lb_result_t
+lb_get_value_cache_stats(uint64_t* hits, uint64_t* misses)
+{
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (hits != NULL)
+        *hits = lb_ctx->value_cache_hits;
+    if (misses != NULL)
+        *misses = lb_ctx->value_cache_misses;
+
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_get_string_table_stats(uint64_t* strings, uint64_t* bytes)
+{
+    int r;
+
+    r = _context_lock();
+    if (r < 0) {
+        return r;
+    }
+
+    _string_table_stats(lb_ctx->strings, strings, bytes);
+
+    _context_unlock();
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_start_advertisement_scan(const lb_advertisement_options* options)
+{
+    int r;
+    int ring_size = 1024;
+    uint64_t dedup_window = 0;
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (lb_ctx->advertisements != NULL) {
+        syslog(LOG_ERR, "%s: advertisement scan already running", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    if (options != NULL) {
+        if (options->ring_size > 0)
+            ring_size = options->ring_size;
+        if (options->dedup_window_ms > 0)
+            dedup_window = (uint64_t) options->dedup_window_ms * 1000;
+    }
+
+    r = _advertisement_queue_new(ring_size, dedup_window, &(lb_ctx->advertisements));
+    if (r < 0) {
+        return r;
+    }
+
+    r = sd_bus_add_match(lb_ctx->bus, &(lb_ctx->advertisement_changed_slot),
+                         "type='signal',sender='org.bluez',"
+                         "interface='org.freedesktop.DBus.Properties',member='PropertiesChanged',"
+                         "arg0='org.bluez.Device1'",
+                         _on_advertisement_changed, NULL);
+    if (r >= 0) {
+        r = sd_bus_add_match(lb_ctx->bus, &(lb_ctx->advertisement_added_slot),
+                             "type='signal',sender='org.bluez',"
+                             "interface='org.freedesktop.DBus.ObjectManager',member='InterfacesAdded'",
+                             _on_advertisement_added, NULL);
+    }
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed on sd_bus_add_match with error %d", __FUNCTION__, r);
+        _free_advertisement_scan();
+        return -LB_ERROR_SD_BUS_CALL_FAIL;
+    }
+
+    // without DuplicateData BlueZ only reports advertisements whose content changed
+    r = _call_method("/org/bluez/hci0", "org.bluez.Adapter1", "SetDiscoveryFilter", lb_ctx->call_timeout,
+                     &error, NULL, "a{sv}", 2, "Transport", "s", "le", "DuplicateData", "b", 1);
+    if (r < 0) {
+        syslog(LOG_INFO, "%s: SetDiscoveryFilter failed, BlueZ may drop repeated advertisements: %s",
+               __FUNCTION__, error.message ? error.message : strerror(-r));
+    }
+    sd_bus_error_free(&error);
+
+    r = _start_discovery();
+    if (r < 0) {
+        _free_advertisement_scan();
+        return r;
+    }
+
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_stop_advertisement_scan()
+{
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (lb_ctx->advertisements == NULL) {
+        syslog(LOG_ERR, "%s: advertisement scan is not running", __FUNCTION__);
+        return -LB_ERROR_NO_RESOURCES;
+    }
+
+    _free_advertisement_scan();
+
+    return _stop_discovery();
+}
+
+lb_result_t
+lb_read_advertisements(lb_advertisement* records, int capacity, int timeout_ms, int* count_ret)
+{
+    int r;
+    uint64_t now, deadline;
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (records == NULL || count_ret == NULL) {
+        syslog(LOG_ERR, "%s: records or count_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    if (lb_ctx->advertisements == NULL) {
+        syslog(LOG_ERR, "%s: advertisement scan is not running", __FUNCTION__);
+        return -LB_ERROR_NO_RESOURCES;
+    }
+
+    _process_pending_events();
+
+    deadline = _now_usec() + (uint64_t) (timeout_ms > 0 ? timeout_ms : 0) * 1000;
+    while (_advertisement_queue_empty(lb_ctx->advertisements)) {
+        now = _now_usec();
+        if (now >= deadline) {
+            break;
+        }
+
+        // the presence timer runs on the same loop
+        r = _event_reset();
+        if (r == 0) {
+            r = sd_event_run(lb_ctx->event, deadline - now);
+        }
+        if (r < 0) {
+            syslog(LOG_ERR, "%s: sd_event_run failed with error: %s", __FUNCTION__, strerror(-r));
+            return -LB_ERROR_SD_BUS_CALL_FAIL;
+        }
+        _process_pending_events();
+    }
+
+    *count_ret = _advertisement_queue_pop(lb_ctx->advertisements, records, capacity);
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_get_advertisement_stats(lb_advertisement_stats* stats_ret)
+{
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (lb_ctx->advertisements == NULL) {
+        syslog(LOG_ERR, "%s: advertisement scan is not running", __FUNCTION__);
+        return -LB_ERROR_NO_RESOURCES;
+    }
+
+    _advertisement_queue_stats(lb_ctx->advertisements, stats_ret);
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_start_presence_tracking(const lb_presence_options* options)
+{
+    int r, i;
+    uint64_t tick, now = _now_usec();
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (lb_ctx->presence != NULL) {
+        syslog(LOG_ERR, "%s: presence tracking already running", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    memset(&(lb_ctx->presence_options), 0, sizeof(lb_presence_options));
+    if (options != NULL) {
+        lb_ctx->presence_options = *options;
+    }
+    if (lb_ctx->presence_options.idle_timeout_ms <= 0) {
+        lb_ctx->presence_options.idle_timeout_ms = 30000;
+    }
+
+    // a 32nd of the idle timeout, between 10 and 250 ms
+    tick = _presence_idle_usec() / 32;
+    tick = (tick < 10000) ? 10000 : (tick > 250000) ? 250000 : tick;
+
+    r = _timer_wheel_new(tick, now, &(lb_ctx->presence));
+    if (r < 0) {
+        return r;
+    }
+
+    r = sd_event_add_time(lb_ctx->event, &(lb_ctx->presence_source), CLOCK_MONOTONIC, now + tick,
+                          tick / 4, _on_presence_tick, NULL);
+    if (r >= 0) {
+        // expiry first, a flood of signals must not keep devices from leaving
+        r = sd_event_source_set_priority(lb_ctx->presence_source, SD_EVENT_PRIORITY_IMPORTANT);
+    }
+    if (r >= 0) {
+        r = sd_event_source_set_enabled(lb_ctx->presence_source, SD_EVENT_OFF);
+    }
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: Failed to add presence timer: %s", __FUNCTION__, strerror(-r));
+        _free_presence_tracking();
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = _start_discovery();
+    if (r < 0) {
+        _free_presence_tracking();
+        return r;
+    }
+
+    // announced on the first tick, like the devices found from now on
+    for (i = 0; i < lb_ctx->devices_size; i++) {
+        _schedule_presence((lb_device_entry*) lb_ctx->devices[i], now);
+    }
+
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_stop_presence_tracking()
+{
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (lb_ctx->presence == NULL) {
+        syslog(LOG_ERR, "%s: presence tracking is not running", __FUNCTION__);
+        return -LB_ERROR_NO_RESOURCES;
+    }
+
+    _free_presence_tracking();
+
+    return _stop_discovery();
+}
+
+lb_result_t
+lb_process_events(int timeout_ms)
+{
+    int r;
+
+    r = _context_lock();
+    if (r < 0) {
+        return r;
+    }
+
+    _process_pending_events();
+
+    // lb_process may have left the loop armed, _event_iterate picks it up from there
+    r = _event_iterate((uint64_t) (timeout_ms > 0 ? timeout_ms : 0) * 1000);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_event_run failed with error: %s", __FUNCTION__, strerror(-r));
+        _context_unlock();
+        return -LB_ERROR_SD_BUS_CALL_FAIL;
+    }
+
+    _process_pending_events();
+    _context_unlock();
+    return LB_SUCCESS;
+}
+
+int
+lb_get_fd()
+{
+    int fd;
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    // the bus and every timer of the context are sources of this one epoll descriptor
+    fd = sd_event_get_fd(lb_ctx->event);
+    if (fd < 0) {
+        syslog(LOG_ERR, "%s: sd_event_get_fd failed with error: %s", __FUNCTION__, strerror(-fd));
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    lb_ctx->external_loop = true;
+    return fd;
+}
+
+int
+lb_get_events()
+{
+    return POLLIN;
+}
+
+lb_result_t
+lb_get_timeout_us(uint64_t* timeout_ret)
+{
+    uint64_t timeout, now;
+    int r;
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (timeout_ret == NULL) {
+        syslog(LOG_ERR, "%s: timeout_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    _context_lock();
+
+    // arming the loop programs the timers into the descriptor, only work already queued needs a
+    // timeout
+    r = _event_prepare();
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_event_prepare failed with error: %s", __FUNCTION__, strerror(-r));
+        _context_unlock();
+        return -LB_ERROR_SD_BUS_CALL_FAIL;
+    }
+    if (r > 0) {
+        *timeout_ret = 0;
+        _context_unlock();
+        return LB_SUCCESS;
+    }
+
+    r = sd_bus_get_timeout(lb_ctx->bus, &timeout);
+    _context_unlock();
+    if (r <= 0 || timeout == UINT64_MAX) {
+        *timeout_ret = UINT64_MAX;
+        return LB_SUCCESS;
+    }
+
+    now = _now_usec();
+    *timeout_ret = (timeout > now) ? timeout - now : 0;
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_process()
+{
+    int i, r;
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    _context_lock();
+    _process_pending_events();
+
+    // bounded so a signal flood can not starve the application loop, a loop left pending reports
+    // a zero timeout
+    for (i = 0; i < LB_PROCESS_DISPATCH_MAX; i++) {
+        r = _event_prepare();
+        if (r <= 0) {
+            break;
+        }
+        r = sd_event_dispatch(lb_ctx->event);
+        if (r < 0) {
+            break;
+        }
+    }
+    _context_unlock();
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: failed to dispatch events: %s", __FUNCTION__, strerror(-r));
+        return -LB_ERROR_SD_BUS_CALL_FAIL;
+    }
+
+    return LB_SUCCESS;
+}
+
+void
+_future_fail(lb_future* future, lb_result_t result)
+{
+    if (future->discovering) {
+        future->discovering = false;
+        _stop_discovery();
+    }
+
+    _future_complete(future, result);
+}
+
+int _on_future_reply(sd_bus_message* reply, void* userdata, sd_bus_error* ret_error);
+
+lb_result_t
+_future_call(lb_future* future, const char* path, const char* interface, const char* member)
+{
+    int r;
+    sd_bus_message* call = NULL;
+
+    r = sd_bus_message_new_method_call(lb_ctx->bus, &call, BLUEZ_DEST, path, interface, member);
+    if (r >= 0 && future->op == LB_FUTURE_WRITE) {
+        r = sd_bus_message_append_array(call, 'y', future->value, future->value_size);
+    }
+    if (r >= 0 && (future->op == LB_FUTURE_READ || future->op == LB_FUTURE_WRITE)) {
+        r = sd_bus_message_append(call, "a{sv}", 0, NULL);
+    }
+    if (r >= 0) {
+        r = sd_bus_call_async(lb_ctx->bus, &(future->slot), call, _on_future_reply, future,
+                              (future->timeout > 0) ? future->timeout : lb_ctx->call_timeout);
+    }
+    sd_bus_message_unref(call);
+
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_call_async %s on %s failed with error: %s", __FUNCTION__, member,
+               path, strerror(-r));
+        return -LB_ERROR_SD_BUS_CALL_FAIL;
+    }
+
+    return LB_SUCCESS;
+}
+
+void
+_gatt_dispatch(struct lb_gatt_queue* queue)
+{
+    lb_future* future;
+    lb_result_t r;
+
+    // a failed send frees the link again, the next operation is tried
+    while ((future = _gatt_queue_pop(queue, _now_usec())) != NULL) {
+        r = _future_call(future, future->path, BLUEZ_GATT_CHARACTERISTICS,
+                         (future->op == LB_FUTURE_WRITE) ? "WriteValue" : "ReadValue");
+        if (r < 0) {
+            _future_complete(future, r);
+        }
+    }
+}
+
+/**
+ * Queue a GATT operation on the device, the context lock must be held
+ *
+ * @param dev owning characteristic
+ * @param characteristic to operate on
+ * @param op LB_FUTURE_READ or LB_FUTURE_WRITE
+ * @param value to write, copied
+ * @param size of value
+ * @param options of the operation, NULL for the defaults
+ * @param keep_reply keep the reply of a read in the future instead of copying the value
+ * @param future_ret to populate with the future of the operation
+ * @return Result of operation
+ */
+lb_result_t
+_gatt_queue_op(lb_bl_device* dev,
+               lb_ble_char* characteristic,
+               lb_future_op_t op,
+               const uint8_t* value,
+               int size,
+               const lb_call_options* options,
+               bool keep_reply,
+               lb_future** future_ret)
+{
+    int r;
+    lb_future* future = NULL;
+    struct lb_gatt_queue* queue = &(((lb_device_entry*) dev)->queue);
+
+    // the callback of an operation failed by _free_device must not queue on the freed device
+    if (queue->closed) {
+        syslog(LOG_ERR, "%s: device %s is being removed", __FUNCTION__, dev->device_path);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    // futures freed by lb_future_free are reused, so does their value buffer
+    r = _future_take(&(lb_ctx->futures), op, characteristic->char_path, &future);
+    if (r >= 0 && op == LB_FUTURE_WRITE) {
+        r = _future_set_value(future, value, (size_t) size);
+    }
+    if (r < 0) {
+        _future_recycle(&(lb_ctx->futures), future);
+        return r;
+    }
+
+    future->priority = (options != NULL) ? options->priority : LB_PRIORITY_BULK;
+    if (options != NULL && options->deadline_ms > 0) {
+        future->deadline = _now_usec() + (uint64_t) options->deadline_ms * 1000;
+    }
+    if (options != NULL) {
+        future->timeout = (uint64_t) options->timeout_ms * 1000;
+    }
+    future->keep_reply = keep_reply;
+
+    _gatt_queue_push(queue, future);
+    _gatt_dispatch(queue);
+
+    *future_ret = future;
+    return LB_SUCCESS;
+}
+
+lb_result_t
+_future_list_objects(lb_future* future)
+{
+    future->stage = LB_FUTURE_STAGE_OBJECTS;
+    return _future_call(future, "/", "org.freedesktop.DBus.ObjectManager", "GetManagedObjects");
+}
+
+lb_result_t
+_future_apply_reply(lb_future* future, sd_bus_message* reply)
+{
+    int r;
+    const void* value = NULL;
+    size_t size = 0;
+    lb_object_iter iter;
+    lb_bl_device* dev;
+    lb_ble_char* characteristic = NULL;
+
+    switch (future->op) {
+        case LB_FUTURE_CONNECT:
+        case LB_FUTURE_PAIR:
+        case LB_FUTURE_WRITE:
+        case LB_FUTURE_FLUSH:
+        case LB_FUTURE_TRANSACT:
+            return LB_SUCCESS;
+
+        case LB_FUTURE_READ:
+            if (future->keep_reply) {
+                // a synchronous read takes the value straight out of the reply
+                future->value_reply = sd_bus_message_ref(reply);
+                return LB_SUCCESS;
+            }
+
+            r = sd_bus_message_read_array(reply, 'y', &value, &size);
+            if (r < 0) {
+                syslog(LOG_ERR, "%s: Failed to read byte array message", __FUNCTION__);
+                return -LB_ERROR_UNSPECIFIED;
+            }
+            r = _future_set_value(future, value, size);
+            if (r < 0) {
+                return r;
+            }
+
+            // keep the value cache as fresh as a synchronous read does
+            dev = _find_device_owning_path(future->path);
+            if (dev != NULL &&
+                lb_get_ble_characteristic_by_characteristic_path(dev, future->path, &characteristic) == LB_SUCCESS) {
+                return _update_characteristic_value(characteristic, value, size);
+            }
+            return LB_SUCCESS;
+
+        case LB_FUTURE_SCAN_DEVICES:
+        case LB_FUTURE_SERVICES:
+            if (future->stage != LB_FUTURE_STAGE_OBJECTS) {
+                // paired, the services are listed next
+                r = _future_list_objects(future);
+                return (r < 0) ? r : 1;
+            }
+
+            r = _object_iter_attach(&iter, reply);
+            if (r < 0) {
+                return r;
+            }
+            if (future->op == LB_FUTURE_SCAN_DEVICES) {
+                return _reconcile_devices(&iter);
+            }
+
+            // the device may have left while the call was pending
+            dev = _find_device_by_path(future->path);
+            if (dev == NULL) {
+                syslog(LOG_ERR, "%s: device %s is gone", __FUNCTION__, future->path);
+                _object_iter_finish(&iter);
+                return -LB_ERROR_INVALID_DEVICE;
+            }
+            return _reconcile_device_services(dev, &iter);
+    }
+
+    return -LB_ERROR_UNSPECIFIED;
+}
+
+int
+_on_future_step(sd_event_source* source, void* userdata)
+{
+    lb_future* future = (lb_future*) userdata;
+    sd_bus_message* reply = future->reply;
+    const sd_bus_error* error = sd_bus_message_get_error(reply);
+    struct lb_gatt_queue* queue = future->queue;
+    lb_bl_device* dev;
+    int r;
+
+    future->reply = NULL;
+    future->source = sd_event_source_unref(future->source);
+
+    // the link is free, send the next operation before handling this reply
+    if (queue != NULL) {
+        _gatt_queue_remove(queue, future);
+        _gatt_dispatch(queue);
+    }
+
+    if (error != NULL) {
+        syslog(LOG_ERR, "%s: call on %s failed with error: %s", __FUNCTION__,
+               future->path != NULL ? future->path : "/", error->message);
+        if ((future->op == LB_FUTURE_READ || future->op == LB_FUTURE_WRITE) &&
+            _is_stale_object_error(error)) {
+            dev = _find_device_owning_path(future->path);
+            if (dev != NULL) {
+                _invalidate_device_services(dev);
+            }
+        }
+        // sd-bus answers a call that timed out with a NoReply error of it's own
+        r = _call_result(-sd_bus_error_get_errno(error));
+        sd_bus_message_unref(reply);
+        _future_fail(future, r);
+        return 0;
+    }
+
+    // 1 when the next call of the operation is pending
+    r = _future_apply_reply(future, reply);
+    sd_bus_message_unref(reply);
+    if (r <= 0) {
+        _future_complete(future, r);
+    }
+
+    return 0;
+}
+
+int
+_on_future_reply(sd_bus_message* reply, void* userdata, sd_bus_error* ret_error)
+{
+    lb_future* future = (lb_future*) userdata;
+    struct lb_gatt_queue* queue = future->queue;
+    int r;
+
+    future->slot = sd_bus_slot_unref(future->slot);
+
+    // replies, errors included, are dispatched from calls taking a device too: the queue and the
+    // devices are only updated and callbacks only called from the event loop
+    future->reply = sd_bus_message_ref(reply);
+    r = sd_event_add_defer(lb_ctx->event, &(future->source), _on_future_step, future);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_event_add_defer failed with error: %s", __FUNCTION__, strerror(-r));
+        // nothing can be deferred, fail it here and free the link for the next operation
+        _future_fail(future, -LB_ERROR_NO_RESOURCES);
+        if (queue != NULL) {
+            _gatt_dispatch(queue);
+        }
+    }
+
+    return 0;
+}
+
+int
+_on_future_scan_done(sd_event_source* source, uint64_t usec, void* userdata)
+{
+    lb_future* future = (lb_future*) userdata;
+    int r;
+
+    future->source = sd_event_source_unref(future->source);
+    future->discovering = false;
+
+    r = _stop_discovery();
+    if (r >= 0) {
+        r = _future_list_objects(future);
+    }
+    if (r < 0) {
+        _future_complete(future, r);
+    }
+
+    return 0;
+}
+
+lb_result_t
+_device_call_async(lb_bl_device* dev, lb_future_op_t op, const char* member, lb_future** future_ret)
+{
+    int r;
+    lb_future* future = NULL;
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (dev == NULL) {
+        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    if (future_ret == NULL) {
+        syslog(LOG_ERR, "%s: future_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    if (!_is_bus_connected(lb_ctx)) {
+        syslog(LOG_ERR, "%s: Bus is not opened", __FUNCTION__);
+        return -LB_ERROR_INVALID_BUS;
+    }
+
+    r = _future_new(op, dev->device_path, &future);
+    if (r < 0) {
+        return r;
+    }
+
+    r = _future_call(future, dev->device_path, BLUEZ_DEVICE, member);
+    if (r < 0) {
+        _future_free(future);
+        return r;
+    }
+
+    *future_ret = future;
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_get_bl_devices_async(int seconds, lb_future** future_ret)
+{
+    int r;
+    lb_future* future = NULL;
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (future_ret == NULL) {
+        syslog(LOG_ERR, "%s: future_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    if (!_is_bus_connected(lb_ctx)) {
+        syslog(LOG_ERR, "%s: Bus is not opened", __FUNCTION__);
+        return -LB_ERROR_INVALID_BUS;
+    }
+
+    r = _future_new(LB_FUTURE_SCAN_DEVICES, NULL, &future);
+    if (r < 0) {
+        return r;
+    }
+
+    r = _start_discovery();
+    if (r < 0) {
+        _future_free(future);
+        return r;
+    }
+    future->discovering = true;
+
+    r = sd_event_add_time(lb_ctx->event, &(future->source), CLOCK_MONOTONIC,
+                          _now_usec() + (uint64_t) (seconds > 0 ? seconds : 0) * 1000000, 1000,
+                          _on_future_scan_done, future);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_event_add_time failed with error: %s", __FUNCTION__, strerror(-r));
+        _future_fail(future, -LB_ERROR_NO_RESOURCES);
+        _future_free(future);
+        return -LB_ERROR_NO_RESOURCES;
+    }
+
+    *future_ret = future;
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_connect_device_async(lb_bl_device* dev, lb_future** future_ret)
+{
+    return _device_call_async(dev, LB_FUTURE_CONNECT, "Connect", future_ret);
+}
+
+lb_result_t
+lb_pair_device_async(lb_bl_device* dev, lb_future** future_ret)
+{
+    return _device_call_async(dev, LB_FUTURE_PAIR, "Pair", future_ret);
+}
+
+lb_result_t
+lb_get_ble_device_services_async(lb_bl_device* dev, lb_future** future_ret)
+{
+    int r, cached;
+    lb_future* future = NULL;
+
+    if (future_ret == NULL) {
+        syslog(LOG_ERR, "%s: future_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    // 1 when the cached layout was used
+    cached = _check_services_device(dev);
+    if (cached < 0) {
+        return cached;
+    }
+
+    if (!_is_bus_connected(lb_ctx)) {
+        syslog(LOG_ERR, "%s: Bus is not opened", __FUNCTION__);
+        return -LB_ERROR_INVALID_BUS;
+    }
+
+    r = _future_new(LB_FUTURE_SERVICES, dev->device_path, &future);
+    if (r < 0) {
+        return r;
+    }
+
+    if (cached > 0) {
+        _future_complete(future, LB_SUCCESS);
+    } else if (!dev->properties.paired) {
+        r = _future_call(future, dev->device_path, BLUEZ_DEVICE, "Pair");
+    } else {
+        r = _future_list_objects(future);
+    }
+    if (r < 0) {
+        _future_free(future);
+        return r;
+    }
+
+    *future_ret = future;
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_read_from_characteristic_async(lb_bl_device* dev, const char* uuid, lb_future** future_ret)
+{
+    return lb_read_from_characteristic_queued(dev, uuid, NULL, future_ret);
+}
+
+lb_result_t
+lb_read_from_characteristic_queued(lb_bl_device* dev,
+                                   const char* uuid,
+                                   const lb_call_options* options,
+                                   lb_future** future_ret)
+{
+    int r;
+    lb_ble_char* characteristic = NULL;
+
+    if (future_ret == NULL) {
+        syslog(LOG_ERR, "%s: future_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    if (!_call_options_valid(options)) {
+        syslog(LOG_ERR, "%s: invalid priority", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = _context_lock();
+    if (r < 0) {
+        return r;
+    }
+
+    r = _get_readable_characteristic(dev, uuid, &characteristic);
+    if (r >= 0) {
+        r = _gatt_queue_op(dev, characteristic, LB_FUTURE_READ, NULL, 0, options, false, future_ret);
+    }
+
+    _context_unlock();
+    return r;
+}
+
+lb_result_t
+lb_write_to_characteristic_queued(lb_bl_device* dev,
+                                  const char* uuid,
+                                  int size,
+                                  const uint8_t* value,
+                                  const lb_call_options* options,
+                                  lb_future** future_ret)
+{
+    int r;
+    lb_ble_char* characteristic = NULL;
+
+    if (future_ret == NULL) {
+        syslog(LOG_ERR, "%s: future_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    if (size < 0 || (value == NULL && size > 0)) {
+        syslog(LOG_ERR, "%s: value is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    if (!_call_options_valid(options)) {
+        syslog(LOG_ERR, "%s: invalid priority", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = _context_lock();
+    if (r < 0) {
+        return r;
+    }
+
+    r = _get_readable_characteristic(dev, uuid, &characteristic);
+    if (r >= 0) {
+        r = _gatt_queue_op(dev, characteristic, LB_FUTURE_WRITE, value, size, options, false, future_ret);
+    }
+
+    _context_unlock();
+    return r;
+}
+
+lb_result_t
+lb_get_gatt_queue_stats(lb_bl_device* dev, lb_gatt_queue_stats* stats_ret)
+{
+    int r;
+
+    if (dev == NULL) {
+        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    if (stats_ret == NULL) {
+        syslog(LOG_ERR, "%s: stats_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = _context_lock();
+    if (r < 0) {
+        return r;
+    }
+
+    *stats_ret = ((lb_device_entry*) dev)->queue.stats;
+
+    _context_unlock();
+    return LB_SUCCESS;
+}
+
+/**
+ * Arguments of lb_future_wait_any and lb_future_wait_all checked by _futures_ready
+ */
+struct futures_wait {
+    lb_future** futures; /**< futures waited for, NULL entries are skipped */
+    int count;           /**< entries in futures */
+    bool all;            /**< wait for every future instead of the first */
+    int* index_ret;      /**< populated with the future done first if not all */
+};
+
+bool
+_futures_ready(void* data)
+{
+    struct futures_wait* wait = (struct futures_wait*) data;
+    int i;
+
+    for (i = 0; i < wait->count; i++) {
+        if (wait->futures[i] == NULL) {
+            continue;
+        }
+        if (!wait->futures[i]->done && wait->all) {
+            return false;
+        }
+        if (wait->futures[i]->done && !wait->all) {
+            *(wait->index_ret) = i;
+            return true;
+        }
+    }
+
+    return wait->all;
+}
+
+/**
+ * Run the event loop until a condition holds, the context lock must be held. Another thread
+ * running the loop meanwhile is waited for instead.
+ *
+ * @param ready condition, checked before every iteration
+ * @param data passed to ready
+ * @param timeout_ms to wait at most, negative to wait forever
+ * @return Result of operation, -LB_ERROR_TIMEOUT if ready did not hold in time
+ */
+lb_result_t
+_wait_until(bool (*ready)(void* data), void* data, int timeout_ms)
+{
+    int r = 0;
+    bool nested = lb_ctx->lock_depth > 1;
+    uint64_t now, deadline, usec = UINT64_MAX;
+
+    _process_pending_events();
+
+    deadline = _now_usec() + (uint64_t) (timeout_ms > 0 ? timeout_ms : 0) * 1000;
+    while (!ready(data)) {
+        if (timeout_ms >= 0) {
+            now = _now_usec();
+            if (now >= deadline) {
+                r = -LB_ERROR_TIMEOUT;
+                break;
+            }
+            usec = deadline - now;
+        }
+
+        // another thread runs the loop or waits for the bus, it makes our progress as well
+        if (!nested && (_loop_busy() || lb_ctx->lock_waiters > 0)) {
+            _context_wait(usec);
+            continue;
+        }
+
+        r = _event_iterate(usec);
+        if (r < 0) {
+            syslog(LOG_ERR, "%s: sd_event_run failed with error: %s", __FUNCTION__, strerror(-r));
+            r = -LB_ERROR_SD_BUS_CALL_FAIL;
+            break;
+        }
+        _process_pending_events();
+    }
+
+    return (r < 0) ? r : LB_SUCCESS;
+}
+
+lb_result_t
+_wait_futures(lb_future** futures, int count, bool all, int timeout_ms, int* index_ret)
+{
+    int r, i;
+    struct futures_wait wait = { futures, count, all, index_ret };
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (futures == NULL || count <= 0) {
+        syslog(LOG_ERR, "%s: no futures to wait for", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    // any of nothing never completes
+    for (i = 0; !all && i < count && futures[i] == NULL; i++)
+        ;
+    if (i == count) {
+        syslog(LOG_ERR, "%s: no futures to wait for", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = _context_lock();
+    if (r < 0) {
+        return r;
+    }
+
+    r = _wait_until(_futures_ready, &wait, timeout_ms);
+
+    _context_unlock();
+    return r;
+}
+
+lb_result_t
+lb_future_wait(lb_future* future, int timeout_ms)
+{
+    int r;
+
+    r = _wait_futures(&future, 1, true, timeout_ms, NULL);
+    if (r < 0) {
+        return r;
+    }
+
+    return future->result;
+}
+
+lb_result_t
+lb_future_wait_any(lb_future** futures, int count, int timeout_ms, int* index_ret)
+{
+    if (index_ret == NULL) {
+        syslog(LOG_ERR, "%s: index_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    return _wait_futures(futures, count, false, timeout_ms, index_ret);
+}
+
+lb_result_t
+lb_future_wait_all(lb_future** futures, int count, int timeout_ms)
+{
+    return _wait_futures(futures, count, true, timeout_ms, NULL);
+}
+
+bool
+lb_future_is_done(const lb_future* future)
+{
+    return future != NULL && future->done;
+}
+
+lb_result_t
+lb_future_result(const lb_future* future)
+{
+    if (future == NULL) {
+        syslog(LOG_ERR, "%s: future is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    return future->done ? future->result : -LB_ERROR_NO_RESOURCES;
+}
+
+lb_result_t
+lb_future_get_value(const lb_future* future, const uint8_t** value_ret, size_t* size_ret)
+{
+    if (future == NULL || value_ret == NULL || size_ret == NULL) {
+        syslog(LOG_ERR, "%s: future, value_ret or size_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    if ((future->op != LB_FUTURE_READ && future->op != LB_FUTURE_TRANSACT) || !future->done ||
+        future->result < 0) {
+        syslog(LOG_ERR, "%s: future holds no value", __FUNCTION__);
+        return -LB_ERROR_NO_RESOURCES;
+    }
+
+    *value_ret = future->value;
+    *size_ret = future->value_size;
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_future_set_callback(lb_future* future, lb_future_callback callback, void* userdata)
+{
+    int r;
+
+    if (future == NULL) {
+        syslog(LOG_ERR, "%s: future is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = _context_lock();
+    if (r < 0) {
+        return r;
+    }
+
+    // the loop may be completing the future on another thread
+    future->callback = callback;
+    future->userdata = userdata;
+
+    if (future->done && callback != NULL) {
+        callback(future, userdata);
+    }
+
+    _context_unlock();
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_future_cancel(lb_future* future)
+{
+    int r;
+    struct lb_gatt_queue* queue;
+
+    if (future == NULL) {
+        syslog(LOG_ERR, "%s: future is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = _context_lock();
+    if (r < 0) {
+        return r;
+    }
+
+    // cancelling the operation in flight frees the link for the next one
+    queue = future->queue;
+    _future_fail(future, -LB_ERROR_CANCELLED);
+    if (queue != NULL) {
+        _gatt_dispatch(queue);
+    }
+
+    _context_unlock();
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_future_free(lb_future* future)
+{
+    struct lb_gatt_queue* queue;
+
+    if (future == NULL) {
+        return LB_SUCCESS;
+    }
+
+    // a future may outlive the context, nothing of it is pending anymore then and it's path went
+    // with the string table
+    if (lb_ctx == NULL) {
+        future->path = NULL;
+        _future_free(future);
+        return LB_SUCCESS;
+    }
+
+    _context_lock();
+
+    queue = future->queue;
+    if (!future->done) {
+        future->callback = NULL;
+        _future_fail(future, -LB_ERROR_CANCELLED);
+    }
+    _future_recycle(&(lb_ctx->futures), future);
+    if (queue != NULL) {
+        _gatt_dispatch(queue);
+    }
+
+    _context_unlock();
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_register_characteristic_read_event(lb_bl_device* dev,
+                                      const char* uuid,
+                                      sd_bus_message_handler_t callback,
+                                      void* userdata)
+{
+    return lb_register_characteristic_read_event_with_options(dev, uuid, callback, userdata, NULL);
+}
+
+lb_result_t
+lb_register_characteristic_read_event_with_options(lb_bl_device* dev,
+                                                   const char* uuid,
+                                                   sd_bus_message_handler_t callback,
+                                                   void* userdata,
+                                                   const lb_call_options* options)
+{
+    int r;
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    lb_ble_char* ble_char_new = NULL;
+    char match[68];
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (dev == NULL) {
+        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    if (uuid == NULL) {
+        syslog(LOG_ERR, "%s: uuid is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    if (callback == NULL) {
+        syslog(LOG_ERR, "%s: callback is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_DEVICE;
+    }
+
+    r = lb_get_ble_characteristic_by_uuid(dev, uuid, &ble_char_new);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: could find characteristic: %s", __FUNCTION__, uuid);
+        sd_bus_error_free(&error);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = _call_method(ble_char_new->char_path, BLUEZ_GATT_CHARACTERISTICS, "StartNotify",
+                     _call_timeout(options), &error, NULL, NULL);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_call_method StartNotify on device %s failed with error: %s",
+               __FUNCTION__, ble_char_new->char_path, error.message);
+        sd_bus_error_free(&error);
+        return _call_result(r);
+    }
+
+    snprintf(match, 67, "path='%s'", ble_char_new->char_path);
+
+    // the application loop dispatches our bus, no thread or second connection needed
+    if (lb_ctx->external_loop) {
+        r = sd_bus_add_match(lb_ctx->bus, NULL, match, callback, userdata);
+        if (r < 0) {
+            syslog(LOG_ERR, "%s: Failed on sd_bus_add_match with error %d", __FUNCTION__, r);
+            return -LB_ERROR_SD_BUS_CALL_FAIL;
+        }
+        return LB_SUCCESS;
+    }
+
+    int current_index = event_arr_size;
+    if (event_arr_size == 0 || events_matches_array == NULL) {
+        events_matches_array = (event_matches_callbacks**) malloc(sizeof(event_matches_callbacks*));
+        if (events_matches_array == NULL) {
+            syslog(LOG_ERR, "%s: Error allocating memory for events_matches_array", __FUNCTION__);
+            return -LB_ERROR_MEMEORY_ALLOCATION;
+        }
+        event_arr_size++;
+    } else {
+        event_arr_size++;
+        events_matches_array =
+        realloc(events_matches_array, event_arr_size * sizeof(event_matches_callbacks*));
+        if (events_matches_array == NULL) {
+            syslog(LOG_ERR, "%s: Error reallocating memory for events_matches_array", __FUNCTION__);
+            return -LB_ERROR_MEMEORY_ALLOCATION;
+        }
+    }
+
+    event_matches_callbacks* new_event_pair =
+    (event_matches_callbacks*) malloc(sizeof(event_matches_callbacks));
+    if (new_event_pair == NULL) {
+        syslog(LOG_ERR, "%s: Error reallocating memory for events_matches_array", __FUNCTION__);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+    new_event_pair->event = match;
+    new_event_pair->callback = &callback;
+    new_event_pair->userdata = userdata;
+    events_matches_array[current_index] = new_event_pair;
+
+    pthread_create(&event_thread, NULL, _run_event_loop, &(lb_ctx->bus));
+    event_thread_started = true;
+    // wait for thread to start
+    sleep(2);
+
+    sd_bus_error_free(&error);
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_parse_uart_service_message(sd_bus_message* message, const void** result, size_t* size)
+{
+    int r;
+
+    if (message == NULL) {
+        syslog(LOG_ERR, "%s: message is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    r = sd_bus_message_skip(message, "s");
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_message_skip failed with error: %s", __FUNCTION__, strerror(-r));
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = sd_bus_message_enter_container(message, 'a', "{sv}");
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_message_enter_container {sv} failed with error: %s",
+               __FUNCTION__, strerror(-r));
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+
+    while ((r = sd_bus_message_enter_container(message, 'e', "sv")) > 0) {
+        r = sd_bus_message_skip(message, "s");
+        if (r < 0) {
+            syslog(LOG_ERR, "%s: sd_bus_message_skip failed with error: %s", __FUNCTION__, strerror(-r));
+            return -LB_ERROR_UNSPECIFIED;
+        }
+
+        r = sd_bus_message_enter_container(message, 'v', "ay");
+        if (r < 0) {
+            syslog(LOG_ERR, "%s: sd_bus_message_enter_container v failed with error: %s",
+                   __FUNCTION__, strerror(-r));
+            return -LB_ERROR_UNSPECIFIED;
+        }
+
+
+        r = sd_bus_message_read_array(message, 'y', result, size);
+        if (r < 0) {
+            syslog(LOG_ERR, "%s: Failed to read byte array message with error: %s", __FUNCTION__,
+                   strerror(-r));
+            return -LB_ERROR_UNSPECIFIED;
+        }
+
+        r = sd_bus_message_exit_container(message);
+        if (r < 0) {
+            syslog(LOG_ERR, "%s: sd_bus_message_exit_container v failed with error: %s",
+                   __FUNCTION__, strerror(-r));
+            return -LB_ERROR_UNSPECIFIED;
+        }
+
+        r = sd_bus_message_exit_container(message);
+        if (r < 0) {
+            syslog(LOG_ERR, "%s: sd_bus_message_exit_container sv failed with error: %s",
+                   __FUNCTION__, strerror(-r));
+            return -LB_ERROR_UNSPECIFIED;
+        }
+    }
+
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_message_enter_container sv failed with error: %s", __FUNCTION__,
+               strerror(-r));
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = sd_bus_message_exit_container(message);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: sd_bus_message_exit_container {sv} failed with error: %s",
+               __FUNCTION__, strerror(-r));
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_decode_payloads(const lb_payload_layout* layout,
+                   const void* const* payloads,
+                   const size_t* sizes,
+                   int count,
+                   float* const* channels,
+                   int capacity,
+                   int* frames_ret)
+{
+    if (layout == NULL || !_payload_layout_valid(layout)) {
+        syslog(LOG_ERR, "%s: invalid payload layout", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    if ((count > 0 && (payloads == NULL || sizes == NULL || channels == NULL)) || frames_ret == NULL) {
+        syslog(LOG_ERR, "%s: invalid parameters", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    return _decode_payloads(layout, payloads, sizes, count, channels, capacity, frames_ret);
+}
+
+const char*
+lb_decoder_kernel()
+{
+    return _decoder_kernel_name();
+}
+
+lb_result_t
+lb_decoder_new(const lb_payload_layout* layout,
+               int batch_frames,
+               lb_samples_callback callback,
+               void* userdata,
+               lb_decoder** decoder_ret)
+{
+    if (layout == NULL || !_payload_layout_valid(layout)) {
+        syslog(LOG_ERR, "%s: invalid payload layout", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    if (batch_frames < 1 || callback == NULL || decoder_ret == NULL) {
+        syslog(LOG_ERR, "%s: invalid parameters", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    return _decoder_new(layout, batch_frames, callback, userdata, decoder_ret);
+}
+
+lb_result_t
+lb_decoder_push(lb_decoder* decoder, const void* payload, size_t size)
+{
+    if (decoder == NULL || (payload == NULL && size > 0)) {
+        syslog(LOG_ERR, "%s: invalid parameters", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    _decoder_push(decoder, (const uint8_t*) payload, size);
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_decoder_flush(lb_decoder* decoder)
+{
+    if (decoder == NULL) {
+        syslog(LOG_ERR, "%s: decoder is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    _decoder_flush(decoder);
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_decoder_free(lb_decoder* decoder)
+{
+    _decoder_free(decoder);
+    return LB_SUCCESS;
+}
+
+static int
+_on_decoder_notify(sd_bus_message* message, void* userdata, sd_bus_error* error)
+{
+    const void* value = NULL;
+    size_t size = 0;
+
+    if (!sd_bus_message_is_signal(message, "org.freedesktop.DBus.Properties", "PropertiesChanged")) {
+        return 0;
+    }
+
+    if (lb_parse_uart_service_message(message, &value, &size) < 0) {
+        return 0;
+    }
+
+    _decoder_push((lb_decoder*) userdata, (const uint8_t*) value, size);
+    return 0;
+}
+
+lb_result_t
+lb_register_characteristic_decoder(lb_bl_device* dev, const char* uuid, lb_decoder* decoder)
+{
+    if (decoder == NULL) {
+        syslog(LOG_ERR, "%s: decoder is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    return lb_register_characteristic_read_event(dev, uuid, _on_decoder_notify, decoder);
+}
+
+int _on_stream_reply(sd_bus_message* reply, void* userdata, sd_bus_error* ret_error);
+int _on_stream_resume(sd_event_source* source, uint64_t usec, void* userdata);
+
+/**
+ * Fail a stream, it's pending writes are dropped and a pending flush completes with the error
+ * from _stream_notify
+ *
+ * @param stream to fail
+ * @param result to fail with
+ */
+void
+_stream_fail(struct lb_stream* stream, lb_result_t result)
+{
+    stream->result = result;
+    _stream_release(stream);
+}
+
+/**
+ * Run the callbacks due on a stream, a stream closed by one of them is freed once they returned
+ *
+ * @param stream to call back for
+ * @param writable the producer waits for room
+ * @return false if the stream was closed and freed
+ */
+bool
+_stream_notify(struct lb_stream* stream, bool writable)
+{
+    stream->dispatching = true;
+    if (stream->flush != NULL && !stream->closed && (stream->result < 0 || _stream_drained(stream))) {
+        _future_complete(stream->flush, stream->result);
+    }
+    if (writable && stream->result >= 0 && !stream->closed && stream->callback != NULL) {
+        stream->callback(stream, _stream_room(stream), stream->userdata);
+    }
+    if (stream->result < 0 && stream->blocked && !stream->closed && stream->callback != NULL) {
+        // a producer waiting for room learns of the failure from it's next lb_stream_write
+        stream->blocked = false;
+        stream->callback(stream, 0, stream->userdata);
+    }
+    if (stream->closed && stream->flush != NULL) {
+        _future_complete(stream->flush, -LB_ERROR_CANCELLED);
+    }
+    stream->dispatching = false;
+
+    if (stream->closed) {
+        _stream_free(stream);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Send writes while the stream has credits, the context lock must be held
+ *
+ * @param stream to send from
+ */
+void
+_stream_pump(struct lb_stream* stream)
+{
+    int r = 0;
+    uint64_t now = _now_usec();
+    sd_bus_message* call;
+    struct lb_stream_write* write;
+
+    while ((write = _stream_next(stream, now)) != NULL) {
+        call = NULL;
+        r = sd_bus_message_new_method_call(lb_ctx->bus, &call, BLUEZ_DEST, stream->path,
+                                           BLUEZ_GATT_CHARACTERISTICS, "WriteValue");
+        if (r >= 0) {
+            r = sd_bus_message_append_array(call, 'y', stream->chunk, write->size);
+        }
+        if (r >= 0) {
+            r = sd_bus_message_append(call, "a{sv}", 1, "type", "s", "command");
+        }
+        if (r >= 0) {
+            r = sd_bus_call_async(lb_ctx->bus, &(write->slot), call, _on_stream_reply, write,
+                                  lb_ctx->call_timeout);
+        }
+        sd_bus_message_unref(call);
+        if (r < 0) {
+            syslog(LOG_ERR, "%s: WriteValue on %s failed with error: %s", __FUNCTION__,
+                   stream->path, strerror(-r));
+            _stream_fail(stream, -LB_ERROR_SD_BUS_CALL_FAIL);
+            return;
+        }
+    }
+
+    // paused after a refusal, nothing else would wake the stream up if no write is in flight
+    if (stream->resume_at > now && stream->resume_source == NULL) {
+        r = sd_event_add_time(lb_ctx->event, &(stream->resume_source), CLOCK_MONOTONIC,
+                              stream->resume_at, 1, _on_stream_resume, stream);
+        if (r < 0) {
+            syslog(LOG_ERR, "%s: sd_event_add_time failed with error: %s", __FUNCTION__, strerror(-r));
+            _stream_fail(stream, -LB_ERROR_NO_RESOURCES);
+        }
+    }
+}
+
+int
+_on_stream_resume(sd_event_source* source, uint64_t usec, void* userdata)
+{
+    struct lb_stream* stream = (struct lb_stream*) userdata;
+
+    stream->resume_source = sd_event_source_unref(stream->resume_source);
+    _stream_pump(stream);
+    _stream_notify(stream, false);
+
+    return 0;
+}
+
+int
+_on_stream_reply(sd_bus_message* reply, void* userdata, sd_bus_error* ret_error)
+{
+    struct lb_stream_write* write = (struct lb_stream_write*) userdata;
+    struct lb_stream* stream = write->stream;
+    const sd_bus_error* error = sd_bus_message_get_error(reply);
+    bool congested, writable;
+
+    write->slot = sd_bus_slot_unref(write->slot);
+
+    // BlueZ fails a write without response it could not queue for the controller, with the same
+    // error name it uses for a link that is gone
+    congested = error != NULL &&
+                (sd_bus_error_has_name(error, "org.bluez.Error.Failed") ||
+                 sd_bus_error_has_name(error, "org.bluez.Error.InProgress")) &&
+                (error->message == NULL || strcmp(error->message, "Not connected") != 0);
+    if (error != NULL && !congested) {
+        syslog(LOG_ERR, "%s: WriteValue on %s failed with error: %s", __FUNCTION__, stream->path,
+               error->message);
+        _stream_fail(stream, _call_result(-sd_bus_error_get_errno(error)));
+        _stream_notify(stream, false);
+        return 0;
+    }
+
+    writable = _stream_complete(stream, write, !congested, _now_usec());
+    if (stream->result < 0) {
+        _stream_fail(stream, stream->result);
+    }
+    _stream_pump(stream);
+    _stream_notify(stream, writable);
+
+    return 0;
+}
+
+lb_result_t
+lb_stream_open(lb_bl_device* dev, const char* uuid, const lb_stream_options* options, lb_stream** stream_ret)
+{
+    int r;
+    lb_ble_char* characteristic = NULL;
+    lb_stream_options resolved = { 0, 0, 0 };
+
+    if (lb_ctx == NULL) {
+        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
+        return -LB_ERROR_INVALID_CONTEXT;
+    }
+
+    if (stream_ret == NULL) {
+        syslog(LOG_ERR, "%s: stream_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = _context_lock();
+    if (r < 0) {
+        return r;
+    }
+
+    r = _get_readable_characteristic(dev, uuid, &characteristic);
+    if (r >= 0) {
+        if (options != NULL) {
+            resolved = *options;
+        }
+        // a write without response is cut to MTU - 3 by the kernel, never send more
+        if (resolved.chunk_size == 0) {
+            resolved.chunk_size = _characteristic_mtu(characteristic) - 3;
+        }
+        r = _stream_new(characteristic->char_path, &resolved, stream_ret);
+    }
+
+    _context_unlock();
+    return r;
+}
+
+lb_result_t
+lb_stream_write(lb_stream* stream, const uint8_t* data, size_t size, size_t* written_ret)
+{
+    int r;
+
+    if (stream == NULL || written_ret == NULL) {
+        syslog(LOG_ERR, "%s: stream or written_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    if (data == NULL && size > 0) {
+        syslog(LOG_ERR, "%s: data is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = _context_lock();
+    if (r < 0) {
+        return r;
+    }
+
+    if (stream->result < 0) {
+        r = stream->result;
+        _context_unlock();
+        return r;
+    }
+
+    *written_ret = _stream_push(stream, data, size);
+    _stream_pump(stream);
+    r = stream->result;
+    _stream_notify(stream, false);
+
+    _context_unlock();
+    return r;
+}
+
+lb_result_t
+lb_stream_write_message(lb_stream* stream, const uint8_t* data, size_t size, size_t* written_ret)
+{
+    int r;
+
+    if (stream == NULL || written_ret == NULL) {
+        syslog(LOG_ERR, "%s: stream or written_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    if ((data == NULL && size > 0) || size > LB_FRAME_MAX_SIZE) {
+        syslog(LOG_ERR, "%s: invalid message", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = _context_lock();
+    if (r < 0) {
+        return r;
+    }
+
+    if (stream->result < 0) {
+        r = stream->result;
+        _context_unlock();
+        return r;
+    }
+
+    if (stream->message_left != 0 && size != stream->message_left) {
+        syslog(LOG_ERR, "%s: %zu bytes of the previous message are missing", __FUNCTION__,
+               stream->message_left);
+        _context_unlock();
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    *written_ret = _stream_push_message(stream, data, size);
+    _stream_pump(stream);
+    r = stream->result;
+    _stream_notify(stream, false);
+
+    _context_unlock();
+    return r;
+}
+
+lb_result_t
+lb_stream_set_callback(lb_stream* stream, lb_stream_callback callback, void* userdata)
+{
+    int r;
+
+    if (stream == NULL) {
+        syslog(LOG_ERR, "%s: stream is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = _context_lock();
+    if (r < 0) {
+        return r;
+    }
+
+    stream->callback = callback;
+    stream->userdata = userdata;
+
+    _context_unlock();
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_stream_flush(lb_stream* stream, lb_future** future_ret)
+{
+    int r;
+    lb_future* future = NULL;
+
+    if (stream == NULL || future_ret == NULL) {
+        syslog(LOG_ERR, "%s: stream or future_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = _context_lock();
+    if (r < 0) {
+        return r;
+    }
+
+    if (stream->flush != NULL) {
+        syslog(LOG_ERR, "%s: a flush is already pending", __FUNCTION__);
+        _context_unlock();
+        return -LB_ERROR_NO_RESOURCES;
+    }
+
+    r = _future_new(LB_FUTURE_FLUSH, stream->path, &future);
+    if (r < 0) {
+        _context_unlock();
+        return r;
+    }
+
+    if (stream->result < 0 || _stream_drained(stream)) {
+        _future_complete(future, stream->result);
+    } else {
+        future->stream = stream;
+        stream->flush = future;
+    }
+
+    *future_ret = future;
+    _context_unlock();
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_stream_get_stats(lb_stream* stream, lb_stream_stats* stats_ret)
+{
+    int r;
+
+    if (stream == NULL || stats_ret == NULL) {
+        syslog(LOG_ERR, "%s: stream or stats_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = _context_lock();
+    if (r < 0) {
+        return r;
+    }
+
+    _stream_stats(stream, stats_ret);
+
+    _context_unlock();
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_stream_close(lb_stream* stream)
+{
+    if (stream == NULL) {
+        return LB_SUCCESS;
+    }
+
+    // a stream may outlive the context, nothing of it is pending anymore then and it's path went
+    // with the string table
+    if (lb_ctx == NULL) {
+        stream->path = NULL;
+        _stream_free(stream);
+        return LB_SUCCESS;
+    }
+
+    _context_lock();
+
+    // closed from one of it's callbacks, _stream_notify frees it once they returned
+    _stream_release(stream);
+    stream->closed = true;
+    if (!stream->dispatching) {
+        _stream_notify(stream, false);
+    }
+
+    _context_unlock();
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_frame_reader_new(size_t max_size, lb_frame_callback callback, void* userdata, lb_frame_reader** reader_ret)
+{
+    if (max_size > LB_FRAME_MAX_SIZE || callback == NULL || reader_ret == NULL) {
+        syslog(LOG_ERR, "%s: invalid parameters", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    return _frame_reader_new(max_size, callback, userdata, reader_ret);
+}
+
+lb_result_t
+lb_frame_reader_push(lb_frame_reader* reader, const void* payload, size_t size)
+{
+    if (reader == NULL || (payload == NULL && size > 0)) {
+        syslog(LOG_ERR, "%s: invalid parameters", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    _frame_reader_push(reader, (const uint8_t*) payload, size);
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_frame_reader_reset(lb_frame_reader* reader)
+{
+    if (reader == NULL) {
+        syslog(LOG_ERR, "%s: reader is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    _frame_reader_reset(reader);
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_frame_reader_get_stats(lb_frame_reader* reader, lb_frame_reader_stats* stats_ret)
+{
+    if (reader == NULL || stats_ret == NULL) {
+        syslog(LOG_ERR, "%s: reader or stats_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
     }
 
-    if (dev == NULL) {
-        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
+    _frame_reader_stats(reader, stats_ret);
+    return LB_SUCCESS;
+}
+
+lb_result_t
+lb_frame_reader_free(lb_frame_reader* reader)
+{
+    _frame_reader_free(reader);
+    return LB_SUCCESS;
+}
+
+static int
+_on_frame_notify(sd_bus_message* message, void* userdata, sd_bus_error* error)
+{
+    const void* value = NULL;
+    size_t size = 0;
+
+    if (!sd_bus_message_is_signal(message, "org.freedesktop.DBus.Properties", "PropertiesChanged")) {
+        return 0;
     }
 
-    if (uuid == NULL) {
-        syslog(LOG_ERR, "%s: uuid is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
+    if (lb_parse_uart_service_message(message, &value, &size) < 0) {
+        return 0;
     }
 
-    if (!_is_ble_device(dev->device_path)) {
-        syslog(LOG_ERR, "%s: not a ble device", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
+    _frame_reader_push((lb_frame_reader*) userdata, (const uint8_t*) value, size);
+    return 0;
+}
+
+lb_result_t
+lb_register_characteristic_frame_reader(lb_bl_device* dev, const char* uuid, lb_frame_reader* reader)
+{
+    if (reader == NULL) {
+        syslog(LOG_ERR, "%s: reader is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
     }
 
-    for (i = 0; i < dev->services_size; i++) {
-        for (j = 0; j < dev->services[i]->characteristics_size; j++) {
-            if (strncmp(uuid, dev->services[i]->characteristics[j]->uuid, strlen(uuid)) == 0) {
-                *ble_characteristic_ret = dev->services[i]->characteristics[j];
-                return LB_SUCCESS;
-            }
-        }
+    return lb_register_characteristic_read_event(dev, uuid, _on_frame_notify, reader);
+}
+
+static int
+_on_uart_notify(sd_bus_message* message, void* userdata, sd_bus_error* error)
+{
+    struct lb_uart* uart = (struct lb_uart*) userdata;
+    const void* value = NULL;
+    size_t size = 0;
+
+    if (lb_parse_uart_service_message(message, &value, &size) < 0) {
+        return 0;
     }
-    return -LB_ERROR_UNSPECIFIED;
+
+    _uart_receive(uart, (const uint8_t*) value, size);
+    _uart_signal(uart);
+    return 0;
+}
+
+static void
+_on_uart_room(lb_stream* stream, size_t room, void* userdata)
+{
+    struct lb_uart* uart = (struct lb_uart*) userdata;
+
+    uart->writable = true;
+    _uart_signal(uart);
+}
+
+static bool
+_uart_readable(void* data)
+{
+    struct lb_uart* uart = (struct lb_uart*) data;
+
+    return uart->rx_head != uart->rx_tail;
+}
+
+static bool
+_uart_writable(void* data)
+{
+    struct lb_uart* uart = (struct lb_uart*) data;
+
+    return _stream_room(uart->tx) > 0 || uart->tx->result < 0;
 }
 
 lb_result_t
-lb_get_ble_service_by_service_path(lb_bl_device* dev, const char* service_path, lb_ble_service** ble_service_ret)
+lb_uart_open(lb_bl_device* dev, const lb_uart_options* options, lb_uart** uart_ret)
 {
-    int i;
+    int r;
+    char match[256];
+    lb_ble_char* tx = NULL;
+    struct lb_uart* uart = NULL;
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    lb_stream_options stream_options = { 0, 0, 0 };
 
-    if (lb_ctx == NULL) {
-        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_CONTEXT;
+    if (uart_ret == NULL) {
+        syslog(LOG_ERR, "%s: uart_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
     }
 
-    if (dev == NULL) {
-        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
+    if (options != NULL) {
+        stream_options.window = options->window;
+        stream_options.buffer_size = options->tx_buffer_size;
     }
 
-    if (service_path == NULL) {
-        syslog(LOG_ERR, "%s: service_path is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
+    r = _context_lock();
+    if (r < 0) {
+        return r;
     }
 
-    for (i = 0; i < dev->services_size; i++) {
-        if (strncmp(service_path, dev->services[i]->service_path, strlen(service_path)) == 0) {
-            *ble_service_ret = dev->services[i];
-            return LB_SUCCESS;
+    r = _get_readable_characteristic(dev, LB_UART_TX_UUID, &tx);
+    if (r >= 0) {
+        r = _uart_new(options != NULL ? options->rx_buffer_size : 0, &uart);
+    }
+    if (r >= 0) {
+        r = lb_stream_open(dev, LB_UART_RX_UUID, &stream_options, &(uart->tx));
+    }
+    if (r >= 0) {
+        r = lb_stream_set_callback(uart->tx, _on_uart_room, uart);
+    }
+    if (r >= 0) {
+        uart->tx_path = _string_table_ref(tx->char_path);
+        snprintf(match, sizeof(match),
+                 "type='signal',sender='org.bluez',interface='org.freedesktop.DBus.Properties',"
+                 "member='PropertiesChanged',path='%s'",
+                 tx->char_path);
+        r = sd_bus_add_match(lb_ctx->bus, &(uart->notify_slot), match, _on_uart_notify, uart);
+        if (r < 0) {
+            syslog(LOG_ERR, "%s: Failed on sd_bus_add_match with error %d", __FUNCTION__, r);
+            r = -LB_ERROR_SD_BUS_CALL_FAIL;
         }
     }
-    return -LB_ERROR_UNSPECIFIED;
+    if (r >= 0) {
+        // subscribed first, nothing the device sends right after StartNotify is missed
+        r = _call_method(tx->char_path, BLUEZ_GATT_CHARACTERISTICS, "StartNotify",
+                         lb_ctx->call_timeout, &error, NULL, NULL);
+        if (r < 0) {
+            syslog(LOG_ERR, "%s: StartNotify on %s failed with error: %s", __FUNCTION__,
+                   tx->char_path, error.message);
+            r = _call_result(r);
+        }
+    }
+
+    if (r < 0 && uart != NULL) {
+        sd_bus_slot_unref(uart->notify_slot);
+        lb_stream_close(uart->tx);
+        _uart_free(uart);
+    } else if (r >= 0) {
+        *uart_ret = uart;
+        r = LB_SUCCESS;
+    }
+
+    sd_bus_error_free(&error);
+    _context_unlock();
+    return r;
 }
 
 lb_result_t
-lb_get_ble_service_by_uuid(lb_bl_device* dev, const char* uuid, lb_ble_service** ble_service_ret)
+lb_uart_read(lb_uart* uart, uint8_t* buffer, size_t size, int timeout_ms, size_t* read_ret)
 {
-    int i;
+    int r;
 
-    if (lb_ctx == NULL) {
-        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_CONTEXT;
+    if (uart == NULL || read_ret == NULL) {
+        syslog(LOG_ERR, "%s: uart or read_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
     }
 
-    if (dev == NULL) {
-        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
+    if (buffer == NULL && size > 0) {
+        syslog(LOG_ERR, "%s: buffer is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
     }
 
-    if (uuid == NULL) {
-        syslog(LOG_ERR, "%s: uuid is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
+    r = _context_lock();
+    if (r < 0) {
+        return r;
     }
 
-    if (!_is_ble_device(dev->device_path)) {
-        syslog(LOG_ERR, "%s: not a ble device", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
+    // queued notifications are dispatched even without blocking
+    r = _wait_until(_uart_readable, uart, timeout_ms);
+    if (r == -LB_ERROR_TIMEOUT) {
+        r = LB_SUCCESS;
     }
-
-    for (i = 0; i < dev->services_size; i++) {
-        if (strncmp(uuid, dev->services[i]->uuid, strlen(uuid)) == 0) {
-            *ble_service_ret = dev->services[i];
-            return LB_SUCCESS;
-        }
+    if (r >= 0) {
+        *read_ret = _uart_read(uart, buffer, size);
+        _uart_signal(uart);
     }
-    return -LB_ERROR_UNSPECIFIED;
+
+    _context_unlock();
+    return r;
 }
 
 lb_result_t
-lb_get_device_by_device_path(const char* device_path, lb_bl_device** bl_device_ret)
+lb_uart_write(lb_uart* uart, const uint8_t* data, size_t size, int timeout_ms, size_t* written_ret)
 {
-    int i;
+    int r, wait_ms = -1;
+    size_t written = 0;
+    uint64_t now, deadline = _now_usec() + (uint64_t) (timeout_ms > 0 ? timeout_ms : 0) * 1000;
 
-    if (lb_ctx == NULL) {
-        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_CONTEXT;
+    if (uart == NULL || written_ret == NULL) {
+        syslog(LOG_ERR, "%s: uart or written_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
     }
 
-    if (device_path == NULL) {
-        syslog(LOG_ERR, "%s: device_path is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
+    if (data == NULL && size > 0) {
+        syslog(LOG_ERR, "%s: data is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
     }
 
-    for (i = 0; i < lb_ctx->devices_size; i++) {
-        if (strncmp(device_path, lb_ctx->devices[i]->device_path, strlen(device_path)) == 0) {
-            *bl_device_ret = lb_ctx->devices[i];
-            return LB_SUCCESS;
+    r = _context_lock();
+    if (r < 0) {
+        return r;
+    }
+
+    r = uart->tx->result;
+    while (r >= 0) {
+        written += _stream_push(uart->tx, data + written, size - written);
+        _stream_pump(uart->tx);
+        r = uart->tx->result;
+        if (r < 0 || written == size || timeout_ms == 0) {
+            break;
+        }
+
+        if (timeout_ms > 0) {
+            now = _now_usec();
+            if (now >= deadline) {
+                break;
+            }
+            wait_ms = (int) ((deadline - now + 999) / 1000);
+        }
+
+        // replies retire writes from the loop and make room
+        r = _wait_until(_uart_writable, uart, wait_ms);
+        if (r == -LB_ERROR_TIMEOUT) {
+            r = LB_SUCCESS;
+            break;
+        }
+        if (r >= 0) {
+            r = uart->tx->result;
         }
     }
-    return -LB_ERROR_UNSPECIFIED;
+
+    // a short write is signaled again once the stream has room
+    uart->writable = false;
+    _uart_signal(uart);
+    *written_ret = written;
+
+    _context_unlock();
+    return r;
+}
+
+int
+lb_uart_get_fd(lb_uart* uart)
+{
+    if (uart == NULL) {
+        syslog(LOG_ERR, "%s: uart is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    return uart->event_fd;
 }
 
 lb_result_t
-lb_get_device_by_device_name(const char* name, lb_bl_device** bl_device_ret)
+lb_uart_get_stats(lb_uart* uart, lb_uart_stats* stats_ret)
 {
-    int i;
+    int r;
+
+    if (uart == NULL || stats_ret == NULL) {
+        syslog(LOG_ERR, "%s: uart or stats_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
+    }
+
+    r = _context_lock();
+    if (r < 0) {
+        return r;
+    }
+
+    _uart_stats(uart, stats_ret);
+
+    _context_unlock();
+    return LB_SUCCESS;
+}
 
+lb_result_t
+lb_uart_close(lb_uart* uart)
+{
+    int r;
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+
+    if (uart == NULL) {
+        return LB_SUCCESS;
+    }
+
+    // like a stream a UART may outlive the context
     if (lb_ctx == NULL) {
-        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_CONTEXT;
+        uart->tx_path = NULL;
+        sd_bus_slot_unref(uart->notify_slot);
+        lb_stream_close(uart->tx);
+        _uart_free(uart);
+        return LB_SUCCESS;
     }
 
-    if (name == NULL) {
-        syslog(LOG_ERR, "%s: name is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
+    _context_lock();
+
+    uart->notify_slot = sd_bus_slot_unref(uart->notify_slot);
+    r = _call_method(uart->tx_path, BLUEZ_GATT_CHARACTERISTICS, "StopNotify", lb_ctx->call_timeout,
+                     &error, NULL, NULL);
+    if (r < 0) {
+        syslog(LOG_ERR, "%s: StopNotify on %s failed with error: %s", __FUNCTION__, uart->tx_path,
+               error.message);
     }
+    lb_stream_close(uart->tx);
+    _uart_free(uart);
 
-    for (i = 0; i < lb_ctx->devices_size; i++) {
-        if (strncmp(name, lb_ctx->devices[i]->name, strlen(name)) == 0) {
-            *bl_device_ret = lb_ctx->devices[i];
-            return LB_SUCCESS;
-        }
+    sd_bus_error_free(&error);
+    _context_unlock();
+    return LB_SUCCESS;
+}
+
+void
+_on_latest_write_orphaned(lb_future* future, void* userdata)
+{
+    _future_free(future);
+}
+
+/**
+ * Free the latest value wins state of a characteristic, a write in flight completes on it's own
+ *
+ * @param latest to free, can be NULL
+ */
+void
+_latest_write_free(struct lb_latest_write* latest)
+{
+    if (latest == NULL) {
+        return;
+    }
+
+    if (latest->in_flight != NULL) {
+        latest->in_flight->callback = _on_latest_write_orphaned;
+        latest->in_flight->userdata = NULL;
+    }
+    free(latest->pending);
+    free(latest);
+}
+
+void _on_latest_write_done(lb_future* future, void* userdata);
+
+/**
+ * Queue the pending value of a characteristic
+ *
+ * @param latest with a pending value and no write in flight
+ */
+void
+_latest_write_send(struct lb_latest_write* latest)
+{
+    int r;
+
+    latest->has_pending = false;
+    r = _gatt_queue_op(latest->dev, latest->characteristic, LB_FUTURE_WRITE, latest->pending,
+                       (int) latest->pending_size, &(latest->options), false, &(latest->in_flight));
+    if (r < 0) {
+        latest->in_flight = NULL;
+        latest->stats.failed++;
+        latest->stats.last_result = r;
+        return;
+    }
+
+    latest->in_flight->callback = _on_latest_write_done;
+    latest->in_flight->userdata = latest;
+
+    // a write that could not be sent completed before it had a callback
+    if (latest->in_flight->done) {
+        _on_latest_write_done(latest->in_flight, latest);
+    }
+}
+
+void
+_on_latest_write_done(lb_future* future, void* userdata)
+{
+    struct lb_latest_write* latest = (struct lb_latest_write*) userdata;
+
+    latest->in_flight = NULL;
+    latest->stats.last_result = future->result;
+    if (future->result < 0) {
+        latest->stats.failed++;
+    } else {
+        latest->stats.written++;
+    }
+    _future_free(future);
+
+    if (latest->has_pending) {
+        _latest_write_send(latest);
     }
-    return -LB_ERROR_UNSPECIFIED;
 }
 
 lb_result_t
-lb_get_device_by_device_address(const char* address, lb_bl_device** bl_device_ret)
+lb_write_to_characteristic_latest(lb_bl_device* dev,
+                                  const char* uuid,
+                                  int size,
+                                  const uint8_t* value,
+                                  const lb_call_options* options)
 {
-    int i;
+    int r;
+    uint8_t* pending;
+    lb_ble_char* characteristic = NULL;
+    lb_char_entry* entry;
+    struct lb_latest_write* latest;
 
-    if (lb_ctx == NULL) {
-        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_CONTEXT;
+    if (size < 0 || size > LB_ATT_MAX_VALUE_SIZE || (value == NULL && size > 0)) {
+        syslog(LOG_ERR, "%s: invalid value", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
     }
 
-    if (address == NULL) {
-        syslog(LOG_ERR, "%s: address is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
+    if (!_call_options_valid(options)) {
+        syslog(LOG_ERR, "%s: invalid priority", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
     }
 
-    for (i = 0; i < lb_ctx->devices_size; i++) {
-        if (strncmp(address, lb_ctx->devices[i]->address, strlen(address)) == 0) {
-            *bl_device_ret = lb_ctx->devices[i];
-            return LB_SUCCESS;
+    r = _context_lock();
+    if (r < 0) {
+        return r;
+    }
+
+    r = _get_readable_characteristic(dev, uuid, &characteristic);
+    if (r < 0) {
+        _context_unlock();
+        return r;
+    }
+
+    entry = (lb_char_entry*) characteristic;
+    if (entry->latest == NULL) {
+        entry->latest = (struct lb_latest_write*) calloc(1, sizeof(struct lb_latest_write));
+        if (entry->latest == NULL) {
+            syslog(LOG_ERR, "%s: Error allocating memory for latest write", __FUNCTION__);
+            _context_unlock();
+            return -LB_ERROR_MEMEORY_ALLOCATION;
+        }
+        entry->latest->dev = dev;
+        entry->latest->characteristic = characteristic;
+        entry->latest->options.priority = LB_PRIORITY_BULK;
+    }
+    latest = entry->latest;
+    latest->stats.submitted++;
+    if (options != NULL) {
+        latest->options = *options;
+    }
+
+    // not sent yet, the queued write takes the newer value and nothing waits behind it
+    if (latest->in_flight != NULL && latest->in_flight->queue != NULL &&
+        latest->in_flight->queue->in_flight != latest->in_flight) {
+        r = _future_set_value(latest->in_flight, value, (size_t) size);
+        if (r >= 0) {
+            latest->stats.elided++;
+        }
+        _context_unlock();
+        return r;
+    }
+
+    if ((size_t) size > latest->pending_capacity) {
+        pending = (uint8_t*) realloc(latest->pending, (size_t) size);
+        if (pending == NULL) {
+            syslog(LOG_ERR, "%s: Error allocating memory for latest write", __FUNCTION__);
+            _context_unlock();
+            return -LB_ERROR_MEMEORY_ALLOCATION;
         }
+        latest->pending = pending;
+        latest->pending_capacity = (size_t) size;
+    }
+    if (size > 0) {
+        memcpy(latest->pending, value, (size_t) size);
+    }
+    latest->pending_size = (size_t) size;
+    if (latest->has_pending) {
+        latest->stats.elided++;
+    }
+    latest->has_pending = true;
+
+    if (latest->in_flight == NULL) {
+        _latest_write_send(latest);
+    }
+
+    _context_unlock();
+    return LB_SUCCESS;
+}
+
+static bool
+_latest_write_idle(void* data)
+{
+    struct lb_latest_write* latest = (struct lb_latest_write*) data;
+
+    return latest->in_flight == NULL && !latest->has_pending;
+}
+
+/**
+ * Characteristic lb_wait_latest_write waits on, looked up again after every iteration
+ */
+struct latest_write_wait {
+    lb_bl_device* dev;              /**< device searched */
+    const char* uuid;               /**< of the characteristic */
+    struct lb_latest_write* latest; /**< state found last, NULL once the characteristic is gone */
+};
+
+static bool
+_latest_write_settled(void* data)
+{
+    struct latest_write_wait* wait = (struct latest_write_wait*) data;
+    lb_ble_char* characteristic = NULL;
+
+    // a rescan can drop the characteristic while the loop runs
+    if (lb_get_ble_characteristic_by_uuid(wait->dev, wait->uuid, &characteristic) < 0) {
+        wait->latest = NULL;
+        return true;
     }
-    return -LB_ERROR_UNSPECIFIED;
+
+    wait->latest = ((lb_char_entry*) characteristic)->latest;
+    return wait->latest == NULL || _latest_write_idle(wait->latest);
 }
 
 lb_result_t
-lb_write_to_characteristic(lb_bl_device* dev, const char* uuid, int size, uint8_t* value)
+lb_wait_latest_write(lb_bl_device* dev, const char* uuid, int timeout_ms)
 {
     int r;
-    sd_bus_message* func_call = NULL;
-    sd_bus_error error = SD_BUS_ERROR_NULL;
-    lb_ble_char* characteristics = NULL;
+    lb_ble_char* characteristic = NULL;
+    struct latest_write_wait wait = { dev, uuid, NULL };
 
-    if (lb_ctx == NULL) {
-        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_CONTEXT;
+    r = _context_lock();
+    if (r < 0) {
+        return r;
     }
 
-    if (dev == NULL) {
-        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
+    r = _get_readable_characteristic(dev, uuid, &characteristic);
+    if (r >= 0 && ((lb_char_entry*) characteristic)->latest != NULL) {
+        r = _wait_until(_latest_write_settled, &wait, timeout_ms);
+        if (r >= 0) {
+            r = (wait.latest != NULL) ? wait.latest->stats.last_result : -LB_ERROR_CANCELLED;
+        }
     }
 
-    if (uuid == NULL) {
-        syslog(LOG_ERR, "%s: uuid is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
-    }
+    _context_unlock();
+    return r;
+}
 
-    if (!_is_bus_connected(lb_ctx)) {
-        syslog(LOG_ERR, "%s: Bus is not opened", __FUNCTION__);
-        sd_bus_error_free(&error);
-        return -LB_ERROR_INVALID_BUS;
-    }
+lb_result_t
+lb_get_latest_write_stats(lb_bl_device* dev, const char* uuid, lb_latest_write_stats* stats_ret)
+{
+    int r;
+    lb_ble_char* characteristic = NULL;
+    struct lb_latest_write* latest;
 
-    r = lb_get_ble_characteristic_by_uuid(dev, uuid, &characteristics);
-    if (r < 0) {
-        syslog(LOG_ERR, "%s: Failed to get characteristic", __FUNCTION__);
-        sd_bus_error_free(&error);
+    if (stats_ret == NULL) {
+        syslog(LOG_ERR, "%s: stats_ret is null", __FUNCTION__);
         return -LB_ERROR_UNSPECIFIED;
     }
 
-    r = sd_bus_message_new_method_call(lb_ctx->bus, &func_call, BLUEZ_DEST, characteristics->char_path,
-                                       BLUEZ_GATT_CHARACTERISTICS, "WriteValue");
+    r = _context_lock();
     if (r < 0) {
-        syslog(LOG_ERR, "%s: Failed to create message call", __FUNCTION__);
-        sd_bus_error_free(&error);
-        sd_bus_message_unref(func_call);
-        return -LB_ERROR_UNSPECIFIED;
+        return r;
     }
 
-    r = sd_bus_message_append_array(func_call, 'y', value, size);
-    if (r < 0) {
-        syslog(LOG_ERR, "%s: Failed to append array to message call", __FUNCTION__);
-        sd_bus_error_free(&error);
-        sd_bus_message_unref(func_call);
-        return -LB_ERROR_UNSPECIFIED;
+    r = _get_readable_characteristic(dev, uuid, &characteristic);
+    if (r >= 0) {
+        latest = ((lb_char_entry*) characteristic)->latest;
+        memset(stats_ret, 0, sizeof(lb_latest_write_stats));
+        if (latest != NULL) {
+            *stats_ret = latest->stats;
+            stats_ret->busy = !_latest_write_idle(latest);
+        }
     }
 
-    /*
-    r = sd_bus_message_append(func_call, "a{sv}", 0, NULL);
-    if (r < 0) {
-        syslog(LOG_ERR, "%s: Failed to append a{sv} to message call", __FUNCTION__);
-        sd_bus_error_free(&error);
-        sd_bus_message_unref(func_call);
-        return -LB_ERROR_UNSPECIFIED;
-    }
-    */
+    _context_unlock();
+    return r;
+}
 
-    r = sd_bus_call(lb_ctx->bus, func_call, 0, &error, NULL);
-    if (r < 0) {
-        syslog(LOG_ERR, "%s: sd_bus_call WriteValue on device %s failed with error: %s",
-               __FUNCTION__, characteristics->char_path, error.message);
-        sd_bus_error_free(&error);
-        sd_bus_message_unref(func_call);
-        return -LB_ERROR_SD_BUS_CALL_FAIL;
-    }
-    r = sd_bus_process(lb_ctx->bus, NULL);
-    if (r < 0) {
-        syslog(LOG_ERR, "Failed to process bus: %s\n", strerror(-r));
-        sd_bus_error_free(&error);
-        sd_bus_message_unref(func_call);
-        return -LB_ERROR_SD_BUS_CALL_FAIL;
+static int
+_on_transaction_notify(sd_bus_message* message, void* userdata, sd_bus_error* error)
+{
+    const void* value = NULL;
+    size_t size = 0;
+
+    // a change of Notifying alone has no value to offer
+    if (lb_parse_uart_service_message(message, &value, &size) < 0 || value == NULL) {
+        return 0;
     }
 
-    sd_bus_error_free(&error);
-    sd_bus_message_unref(func_call);
-    return LB_SUCCESS;
+    _transactions_receive((struct lb_transactions*) userdata, (const uint8_t*) value, size);
+    return 0;
 }
 
+/**
+ * Get the transactions of a characteristic, it's notifications are enabled on the first call
+ *
+ * @param characteristic notifying the responses
+ * @param framed whether the responses are framed messages
+ * @param transactions_ret to populate with the transactions
+ * @return Result of operation
+ */
 lb_result_t
-lb_read_from_characteristic(lb_bl_device* dev, const char* uuid, size_t* size, uint8_t** result)
+_get_transactions(lb_ble_char* characteristic, bool framed, struct lb_transactions** transactions_ret)
 {
     int r;
-    sd_bus_message* reply = NULL;
+    char match[256];
+    lb_char_entry* entry = (lb_char_entry*) characteristic;
+    struct lb_transactions* transactions = entry->transactions;
     sd_bus_error error = SD_BUS_ERROR_NULL;
-    lb_ble_char* characteristics = NULL;
-
-    if (lb_ctx == NULL) {
-        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_CONTEXT;
-    }
-
-    if (dev == NULL) {
-        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
-    }
-
-    if (uuid == NULL) {
-        syslog(LOG_ERR, "%s: uuid is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
-    }
-
-    if (!_is_bus_connected(lb_ctx)) {
-        syslog(LOG_ERR, "%s: Bus is not opened", __FUNCTION__);
-        sd_bus_error_free(&error);
-        return -LB_ERROR_INVALID_BUS;
-    }
 
-    if (!_is_ble_device(dev->device_path)) {
-        syslog(LOG_ERR, "%s: not a ble device", __FUNCTION__);
-        sd_bus_error_free(&error);
-        return -LB_ERROR_INVALID_DEVICE;
+    if (transactions != NULL) {
+        if (transactions->framed != framed) {
+            syslog(LOG_ERR, "%s: transactions on %s disagree on framing", __FUNCTION__,
+                   characteristic->char_path);
+            return -LB_ERROR_UNSPECIFIED;
+        }
+        *transactions_ret = transactions;
+        return LB_SUCCESS;
     }
 
-    r = lb_get_ble_characteristic_by_uuid(dev, uuid, &characteristics);
+    r = _transactions_new(characteristic->char_path, framed, &transactions);
     if (r < 0) {
-        syslog(LOG_ERR, "%s: Failed to get characteristic", __FUNCTION__);
-        sd_bus_error_free(&error);
-        return -LB_ERROR_UNSPECIFIED;
+        return r;
     }
 
-    r = sd_bus_call_method(lb_ctx->bus, BLUEZ_DEST, characteristics->char_path,
-                           BLUEZ_GATT_CHARACTERISTICS, "ReadValue", &error, &reply, "a{sv}", NULL);
+    snprintf(match, sizeof(match),
+             "type='signal',sender='org.bluez',interface='org.freedesktop.DBus.Properties',"
+             "member='PropertiesChanged',path='%s'",
+             characteristic->char_path);
+    r = sd_bus_add_match(lb_ctx->bus, &(transactions->notify_slot), match, _on_transaction_notify,
+                         transactions);
     if (r < 0) {
-        syslog(LOG_ERR, "%s: sd_bus_call_method ReadValue on device %s failed with error: %s",
-               __FUNCTION__, characteristics->char_path, error.message);
-        sd_bus_error_free(&error);
-        sd_bus_message_unref(reply);
+        syslog(LOG_ERR, "%s: Failed on sd_bus_add_match with error %d", __FUNCTION__, r);
+        _transactions_free(transactions);
         return -LB_ERROR_SD_BUS_CALL_FAIL;
     }
 
-    r = sd_bus_message_read_array(reply, 'y', (const void**) result, size);
+    // subscribed first, a response notified right after StartNotify is not missed
+    r = _call_method(characteristic->char_path, BLUEZ_GATT_CHARACTERISTICS, "StartNotify",
+                     lb_ctx->call_timeout, &error, NULL, NULL);
     if (r < 0) {
-        syslog(LOG_ERR, "%s: Failed to read byte array message", __FUNCTION__);
+        syslog(LOG_ERR, "%s: StartNotify on %s failed with error: %s", __FUNCTION__,
+               characteristic->char_path, error.message);
         sd_bus_error_free(&error);
-        sd_bus_message_unref(reply);
-        return -LB_ERROR_UNSPECIFIED;
+        _transactions_free(transactions);
+        return _call_result(r);
     }
 
-    sd_bus_error_free(&error);
-    sd_bus_message_unref(reply);
+    entry->transactions = transactions;
+    *transactions_ret = transactions;
     return LB_SUCCESS;
 }
 
-lb_result_t
-lb_register_characteristic_read_event(lb_bl_device* dev,
-                                      const char* uuid,
-                                      sd_bus_message_handler_t callback,
-                                      void* userdata)
+int
+_on_transaction_timeout(sd_event_source* source, uint64_t usec, void* userdata)
 {
-    int r;
-    sd_bus_error error = SD_BUS_ERROR_NULL;
-    lb_ble_char* ble_char_new = NULL;
-    char match[68];
+    lb_future* future = (lb_future*) userdata;
 
-    if (lb_ctx == NULL) {
-        syslog(LOG_ERR, "%s: lb_ctx is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_CONTEXT;
-    }
+    future->transaction->owner->stats.timed_out++;
+    _future_complete(future, -LB_ERROR_TIMEOUT);
+    return 0;
+}
 
-    if (dev == NULL) {
-        syslog(LOG_ERR, "%s: bl_device is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
+void
+_on_transaction_written(lb_future* write, void* userdata)
+{
+    struct lb_transaction* transaction = (struct lb_transaction*) userdata;
+
+    // NULL once the transaction completed, the write only has to be freed
+    if (transaction != NULL) {
+        transaction->write = NULL;
+        if (write->result < 0) {
+            transaction->owner->stats.failed++;
+            _future_complete(transaction->future, write->result);
+        }
     }
+    _future_free(write);
+}
 
-    if (uuid == NULL) {
-        syslog(LOG_ERR, "%s: uuid is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
+lb_result_t
+lb_transact_async(lb_bl_device* dev,
+                  const char* tx_uuid,
+                  const char* rx_uuid,
+                  const uint8_t* request,
+                  size_t size,
+                  const lb_transact_matcher* matcher,
+                  int timeout_ms,
+                  lb_future** future_ret)
+{
+    int r;
+    bool framed = (matcher != NULL && matcher->framed);
+    size_t header_size = framed ? LB_FRAME_HEADER_SIZE : 0;
+    uint8_t payload[LB_FRAME_HEADER_SIZE + LB_ATT_MAX_VALUE_SIZE];
+    uint64_t timeout;
+    lb_ble_char* tx = NULL;
+    lb_ble_char* rx = NULL;
+    struct lb_transactions* transactions = NULL;
+    struct lb_transaction* transaction = NULL;
+    lb_future* future = NULL;
+    lb_future* write = NULL;
+
+    if (future_ret == NULL) {
+        syslog(LOG_ERR, "%s: future_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
     }
 
-    if (callback == NULL) {
-        syslog(LOG_ERR, "%s: callback is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_DEVICE;
+    if (request == NULL && size > 0) {
+        syslog(LOG_ERR, "%s: request is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
     }
 
-    r = lb_get_ble_characteristic_by_uuid(dev, uuid, &ble_char_new);
-    if (r < 0) {
-        syslog(LOG_ERR, "%s: could find characteristic: %s", __FUNCTION__, uuid);
-        sd_bus_error_free(&error);
+    if (size + header_size > LB_ATT_MAX_VALUE_SIZE) {
+        syslog(LOG_ERR, "%s: request of %zu bytes does not fit one write", __FUNCTION__, size);
         return -LB_ERROR_UNSPECIFIED;
     }
 
-    r = sd_bus_call_method(lb_ctx->bus, BLUEZ_DEST, ble_char_new->char_path,
-                           BLUEZ_GATT_CHARACTERISTICS, "StartNotify", &error, NULL, NULL);
+    r = _context_lock();
     if (r < 0) {
-        syslog(LOG_ERR, "%s: sd_bus_call_method StartNotify on device %s failed with error: %s",
-               __FUNCTION__, ble_char_new->char_path, error.message);
-        sd_bus_error_free(&error);
-        return -LB_ERROR_SD_BUS_CALL_FAIL;
+        return r;
     }
 
-    snprintf(match, 67, "path='%s'", ble_char_new->char_path);
-
-    int current_index = event_arr_size;
-    if (event_arr_size == 0 || events_matches_array == NULL) {
-        events_matches_array = (event_matches_callbacks**) malloc(sizeof(event_matches_callbacks*));
-        if (events_matches_array == NULL) {
-            syslog(LOG_ERR, "%s: Error allocating memory for events_matches_array", __FUNCTION__);
-            return -LB_ERROR_MEMEORY_ALLOCATION;
+    r = _get_readable_characteristic(dev, tx_uuid, &tx);
+    if (r >= 0) {
+        r = _get_readable_characteristic(dev, rx_uuid, &rx);
+    }
+    if (r >= 0) {
+        r = _get_transactions(rx, framed, &transactions);
+    }
+    if (r >= 0) {
+        r = _future_new(LB_FUTURE_TRANSACT, rx->char_path, &future);
+    }
+    if (r >= 0) {
+        r = _transaction_add(transactions, future, request, size, matcher, &transaction);
+    }
+    if (r >= 0 && timeout_ms >= 0) {
+        timeout = (timeout_ms > 0) ? (uint64_t) timeout_ms * 1000 : lb_ctx->call_timeout;
+        if (timeout == 0) {
+            timeout = LB_TRANSACT_DEFAULT_TIMEOUT;
         }
-        event_arr_size++;
-    } else {
-        event_arr_size++;
-        events_matches_array =
-        realloc(events_matches_array, event_arr_size * sizeof(event_matches_callbacks*));
-        if (events_matches_array == NULL) {
-            syslog(LOG_ERR, "%s: Error reallocating memory for events_matches_array", __FUNCTION__);
-            return -LB_ERROR_MEMEORY_ALLOCATION;
+        r = sd_event_add_time(lb_ctx->event, &(future->source), CLOCK_MONOTONIC,
+                              _now_usec() + timeout, 1000, _on_transaction_timeout, future);
+        if (r < 0) {
+            syslog(LOG_ERR, "%s: sd_event_add_time failed with error: %s", __FUNCTION__, strerror(-r));
+            r = -LB_ERROR_NO_RESOURCES;
         }
     }
-
-    event_matches_callbacks* new_event_pair =
-    (event_matches_callbacks*) malloc(sizeof(event_matches_callbacks));
-    if (new_event_pair == NULL) {
-        syslog(LOG_ERR, "%s: Error reallocating memory for events_matches_array", __FUNCTION__);
-        return -LB_ERROR_MEMEORY_ALLOCATION;
+    if (r >= 0) {
+        // pending before the request leaves, the response may overtake the write's reply
+        if (framed) {
+            payload[0] = (uint8_t) (size & 0xff);
+            payload[1] = (uint8_t) (size >> 8);
+        }
+        if (size > 0) {
+            memcpy(payload + header_size, request, size);
+        }
+        r = _gatt_queue_op(dev, tx, LB_FUTURE_WRITE, payload, (int) (size + header_size), NULL,
+                           false, &write);
+    }
+    if (r >= 0) {
+        transaction->write = write;
+        write->callback = _on_transaction_written;
+        write->userdata = transaction;
+        // a write that could not be sent completed before it had a callback
+        if (write->done) {
+            _on_transaction_written(write, transaction);
+        }
+        *future_ret = future;
+        r = LB_SUCCESS;
+    } else {
+        _future_free(future);
     }
-    new_event_pair->event = match;
-    new_event_pair->callback = &callback;
-    new_event_pair->userdata = userdata;
-    events_matches_array[current_index] = new_event_pair;
-
-    pthread_create(&event_thread, NULL, _run_event_loop, &(lb_ctx->bus));
-    // wait for thread to start
-    sleep(2);
 
-    sd_bus_error_free(&error);
-    return LB_SUCCESS;
+    _context_unlock();
+    return r;
 }
 
 lb_result_t
-lb_parse_uart_service_message(sd_bus_message* message, const void** result, size_t* size)
+lb_transact(lb_bl_device* dev,
+            const char* tx_uuid,
+            const char* rx_uuid,
+            const uint8_t* request,
+            size_t size,
+            const lb_transact_matcher* matcher,
+            int timeout_ms,
+            uint8_t* response,
+            size_t capacity,
+            size_t* response_size_ret)
 {
     int r;
+    lb_future* future = NULL;
 
-    if (message == NULL) {
-        syslog(LOG_ERR, "%s: message is null", __FUNCTION__);
-        return -LB_ERROR_INVALID_CONTEXT;
-    }
-
-    r = sd_bus_message_skip(message, "s");
-    if (r < 0) {
-        syslog(LOG_ERR, "%s: sd_bus_message_skip failed with error: %s", __FUNCTION__, strerror(-r));
+    if (response_size_ret == NULL || (response == NULL && capacity > 0)) {
+        syslog(LOG_ERR, "%s: response or response_size_ret is null", __FUNCTION__);
         return -LB_ERROR_UNSPECIFIED;
     }
 
-    r = sd_bus_message_enter_container(message, 'a', "{sv}");
+    r = lb_transact_async(dev, tx_uuid, rx_uuid, request, size, matcher, timeout_ms, &future);
     if (r < 0) {
-        syslog(LOG_ERR, "%s: sd_bus_message_enter_container {sv} failed with error: %s",
-               __FUNCTION__, strerror(-r));
-        return -LB_ERROR_UNSPECIFIED;
+        return r;
     }
 
-
-    while ((r = sd_bus_message_enter_container(message, 'e', "sv")) > 0) {
-        r = sd_bus_message_skip(message, "s");
-        if (r < 0) {
-            syslog(LOG_ERR, "%s: sd_bus_message_skip failed with error: %s", __FUNCTION__, strerror(-r));
-            return -LB_ERROR_UNSPECIFIED;
-        }
-
-        r = sd_bus_message_enter_container(message, 'v', "ay");
-        if (r < 0) {
-            syslog(LOG_ERR, "%s: sd_bus_message_enter_container v failed with error: %s",
-                   __FUNCTION__, strerror(-r));
-            return -LB_ERROR_UNSPECIFIED;
+    // the transaction times out on it's own
+    r = lb_future_wait(future, -1);
+    if (r >= 0) {
+        *response_size_ret = future->value_size;
+        if (future->value_size > capacity) {
+            r = -LB_ERROR_NO_RESOURCES;
+        } else if (future->value_size > 0) {
+            memcpy(response, future->value, future->value_size);
         }
+    }
 
+    lb_future_free(future);
+    return r;
+}
 
-        r = sd_bus_message_read_array(message, 'y', result, size);
-        if (r < 0) {
-            syslog(LOG_ERR, "%s: Failed to read byte array message with error: %s", __FUNCTION__,
-                   strerror(-r));
-            return -LB_ERROR_UNSPECIFIED;
-        }
-
-        r = sd_bus_message_exit_container(message);
-        if (r < 0) {
-            syslog(LOG_ERR, "%s: sd_bus_message_exit_container v failed with error: %s",
-                   __FUNCTION__, strerror(-r));
-            return -LB_ERROR_UNSPECIFIED;
-        }
+lb_result_t
+lb_get_transact_stats(lb_bl_device* dev, const char* rx_uuid, lb_transact_stats* stats_ret)
+{
+    int r;
+    lb_ble_char* characteristic = NULL;
+    struct lb_transactions* transactions;
 
-        r = sd_bus_message_exit_container(message);
-        if (r < 0) {
-            syslog(LOG_ERR, "%s: sd_bus_message_exit_container sv failed with error: %s",
-                   __FUNCTION__, strerror(-r));
-            return -LB_ERROR_UNSPECIFIED;
-        }
+    if (stats_ret == NULL) {
+        syslog(LOG_ERR, "%s: stats_ret is null", __FUNCTION__);
+        return -LB_ERROR_UNSPECIFIED;
     }
 
+    r = _context_lock();
     if (r < 0) {
-        syslog(LOG_ERR, "%s: sd_bus_message_enter_container sv failed with error: %s", __FUNCTION__,
-               strerror(-r));
-        return -LB_ERROR_UNSPECIFIED;
+        return r;
     }
 
-    r = sd_bus_message_exit_container(message);
-    if (r < 0) {
-        syslog(LOG_ERR, "%s: sd_bus_message_exit_container {sv} failed with error: %s",
-               __FUNCTION__, strerror(-r));
-        return -LB_ERROR_UNSPECIFIED;
+    r = _get_readable_characteristic(dev, rx_uuid, &characteristic);
+    if (r >= 0) {
+        transactions = ((lb_char_entry*) characteristic)->transactions;
+        memset(stats_ret, 0, sizeof(lb_transact_stats));
+        if (transactions != NULL) {
+            *stats_ret = transactions->stats;
+        }
     }
 
-    return LB_SUCCESS;
+    _context_unlock();
+    return r;
 }
@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2016 Intel Corporation.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Credit window of a write without response stream.
+ *
+ * Bytes accepted from the producer wait in a ring until littleb.c hands them to WriteValue calls
+ * of type command, one chunk each. A write holds a credit until BlueZ replies, which it does once
+ * the chunk is queued for the controller, so the window bounds what sits in BlueZ and the kernel
+ * and the replies clock the next writes out at the rate the link drains. A write BlueZ refuses
+ * rewinds the stream: once every write in flight is answered, it and every newer write are sent
+ * again one at a time in send order, whatever BlueZ answered to the newer ones, before any new
+ * data. The window is halved and sending pauses for one smoothed completion time; every window of
+ * accepted writes grows it back by one credit. BlueZ refuses everything while the controller
+ * buffers are full, so the writes sent along with a refused one are normally refused too, one it
+ * took anyway reaches the device twice. Bytes leave the ring only once their write and every
+ * older one were accepted, nothing is lost on a refusal. A stream refused for
+ * STREAM_STALL_TIMEOUT without a write accepted fails with LB_ERROR_TIMEOUT.
+ */
+
+#include <string.h>
+
+#include "littleb_internal.h"
+
+#define STREAM_DEFAULT_WINDOW 8
+#define STREAM_DEFAULT_CHUNK_SIZE 20
+#define STREAM_DEFAULT_BUFFER_SIZE 16384
+#define STREAM_RATE_PERIOD 100000
+#define STREAM_MIN_PAUSE 1000
+#define STREAM_STALL_TIMEOUT 5000000
+
+lb_result_t
+_stream_new(const char* path, const lb_stream_options* options, struct lb_stream** stream_ret)
+{
+    struct lb_stream* stream;
+    size_t buffer_size = STREAM_DEFAULT_BUFFER_SIZE, capacity = 1;
+    int window = STREAM_DEFAULT_WINDOW;
+    size_t chunk_size = STREAM_DEFAULT_CHUNK_SIZE;
+
+    if (options != NULL) {
+        if (options->window > 0)
+            window = (int) options->window;
+        if (options->chunk_size > 0)
+            chunk_size = options->chunk_size;
+        if (options->buffer_size > 0)
+            buffer_size = options->buffer_size;
+    }
+
+    // a full window of chunks always fits, so a refused write never waits for room
+    if (buffer_size < chunk_size * (size_t) window) {
+        buffer_size = chunk_size * (size_t) window;
+    }
+    while (capacity < buffer_size) {
+        capacity *= 2;
+    }
+
+    stream = (struct lb_stream*) calloc(1, sizeof(struct lb_stream));
+    if (stream == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for stream", __FUNCTION__);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    stream->data = (uint8_t*) malloc(capacity);
+    stream->chunk = (uint8_t*) malloc(chunk_size);
+    stream->writes = (struct lb_stream_write*) calloc((size_t) window, sizeof(struct lb_stream_write));
+    if (stream->data == NULL || stream->chunk == NULL || stream->writes == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for stream", __FUNCTION__);
+        _stream_free(stream);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    stream->path = _string_table_ref(path);
+    stream->capacity = capacity;
+    stream->chunk_size = chunk_size;
+    stream->writes_size = window;
+    stream->window = window;
+    *stream_ret = stream;
+    return LB_SUCCESS;
+}
+
+void
+_stream_release(struct lb_stream* stream)
+{
+    int i;
+
+    for (i = 0; i < stream->writes_size; i++) {
+        stream->writes[i].slot = sd_bus_slot_unref(stream->writes[i].slot);
+    }
+    stream->resume_source = sd_event_source_unref(stream->resume_source);
+    stream->in_flight = 0;
+}
+
+void
+_stream_free(struct lb_stream* stream)
+{
+    if (stream == NULL) {
+        return;
+    }
+
+    if (stream->writes != NULL) {
+        _stream_release(stream);
+    }
+    free(stream->data);
+    free(stream->chunk);
+    free(stream->writes);
+    _string_table_release(stream->path);
+    free(stream);
+}
+
+size_t
+_stream_push(struct lb_stream* stream, const uint8_t* data, size_t size)
+{
+    size_t room = stream->capacity - (size_t)(stream->head - stream->acked);
+    size_t start, first;
+
+    if (size > room) {
+        size = room;
+        stream->blocked = true;
+        stream->stats.short_writes++;
+    }
+
+    // at most two copies, up to the end of the ring and the wrapped rest
+    start = stream->head & (stream->capacity - 1);
+    first = stream->capacity - start;
+    if (first > size) {
+        first = size;
+    }
+    memcpy(stream->data + start, data, first);
+    memcpy(stream->data, data + first, size - first);
+    stream->head += size;
+    stream->stats.bytes_accepted += size;
+
+    return size;
+}
+
+size_t
+_stream_push_message(struct lb_stream* stream, const uint8_t* data, size_t size)
+{
+    uint8_t header[LB_FRAME_HEADER_SIZE];
+    size_t room;
+
+    if (stream->message_left == 0) {
+        // a message none of which fits is not started, the caller offers it whole again
+        room = _stream_room(stream);
+        if (room < LB_FRAME_HEADER_SIZE + (size > 0 ? 1 : 0)) {
+            stream->blocked = true;
+            stream->stats.short_writes++;
+            return 0;
+        }
+        header[0] = (uint8_t)(size & 0xff);
+        header[1] = (uint8_t)(size >> 8);
+        _stream_push(stream, header, LB_FRAME_HEADER_SIZE);
+        stream->message_left = size;
+    }
+
+    size = _stream_push(stream, data, size);
+    stream->message_left -= size;
+    return size;
+}
+
+static void
+_stream_copy_chunk(struct lb_stream* stream, const struct lb_stream_write* write)
+{
+    size_t start = write->offset & (stream->capacity - 1);
+    size_t first = stream->capacity - start;
+
+    if (first > write->size) {
+        first = write->size;
+    }
+    memcpy(stream->chunk, stream->data + start, first);
+    memcpy(stream->chunk + first, stream->data, write->size - first);
+}
+
+struct lb_stream_write*
+_stream_next(struct lb_stream* stream, uint64_t now)
+{
+    struct lb_stream_write* write = NULL;
+    int i;
+
+    if (stream->result < 0 || stream->in_flight >= stream->window || now < stream->resume_at) {
+        return NULL;
+    }
+
+    // rewound writes go one at a time, oldest first, so none can overtake an older one again
+    for (i = 0; i < stream->count; i++) {
+        write = &stream->writes[(stream->first + i) % stream->writes_size];
+        if (write->state == LB_STREAM_WRITE_RETRY) {
+            if (stream->in_flight > 0) {
+                return NULL;
+            }
+            stream->stats.retries++;
+            break;
+        }
+        write = NULL;
+    }
+
+    if (write == NULL) {
+        if (stream->sent == stream->head || stream->count == stream->writes_size) {
+            return NULL;
+        }
+
+        write = &stream->writes[(stream->first + stream->count) % stream->writes_size];
+        write->offset = stream->sent;
+        write->size = (size_t)(stream->head - stream->sent);
+        if (write->size > stream->chunk_size) {
+            write->size = stream->chunk_size;
+        }
+        stream->sent += write->size;
+        stream->count++;
+    }
+
+    if (stream->rate_start == 0) {
+        stream->rate_start = now;
+    }
+
+    _stream_copy_chunk(stream, write);
+    write->stream = stream;
+    write->state = LB_STREAM_WRITE_IN_FLIGHT;
+    write->sent_at = now;
+    stream->in_flight++;
+    return write;
+}
+
+bool
+_stream_complete(struct lb_stream* stream, struct lb_stream_write* write, bool accepted, uint64_t now)
+{
+    uint64_t latency = now - write->sent_at;
+    struct lb_stream_write* oldest;
+    int i;
+
+    stream->in_flight--;
+    stream->stats.latency_us =
+    (stream->stats.latency_us == 0) ? latency : (7 * stream->stats.latency_us + latency) / 8;
+
+    // rewound by the refusal of an older write, it is sent again whatever BlueZ answered
+    if (write->state == LB_STREAM_WRITE_RETRY) {
+        return false;
+    }
+
+    if (!accepted) {
+        if (stream->refused_since == 0) {
+            stream->refused_since = now;
+        } else if (now - stream->refused_since >= STREAM_STALL_TIMEOUT) {
+            syslog(LOG_ERR, "%s: writes to %s refused for too long", __FUNCTION__, stream->path);
+            stream->result = -LB_ERROR_TIMEOUT;
+            return false;
+        }
+
+        // the device must not get newer bytes before these, rewind to the refused write
+        i = (int) (write - stream->writes);
+        for (i = (i - stream->first + stream->writes_size) % stream->writes_size; i < stream->count; i++) {
+            stream->writes[(stream->first + i) % stream->writes_size].state = LB_STREAM_WRITE_RETRY;
+        }
+
+        // the controller buffers are full, back off for the time a write takes to drain
+        stream->window = (stream->window > 1) ? stream->window / 2 : 1;
+        stream->window_acks = 0;
+        stream->resume_at =
+        now + ((stream->stats.latency_us > STREAM_MIN_PAUSE) ? stream->stats.latency_us : STREAM_MIN_PAUSE);
+        return false;
+    }
+
+    write->state = LB_STREAM_WRITE_DONE;
+    stream->refused_since = 0;
+    stream->stats.writes++;
+    if (++stream->window_acks >= stream->window && stream->window < stream->writes_size) {
+        stream->window++;
+        stream->window_acks = 0;
+    }
+
+    // retire in send order, a refused write holds back the newer ones
+    while (stream->count > 0) {
+        oldest = &stream->writes[stream->first];
+        if (oldest->state != LB_STREAM_WRITE_DONE) {
+            break;
+        }
+        stream->acked += oldest->size;
+        stream->stats.bytes_sent += oldest->size;
+        stream->rate_bytes += oldest->size;
+        oldest->state = LB_STREAM_WRITE_FREE;
+        stream->first = (stream->first + 1) % stream->writes_size;
+        stream->count--;
+    }
+
+    if (now - stream->rate_start >= STREAM_RATE_PERIOD) {
+        stream->stats.throughput = stream->rate_bytes * 1000000 / (now - stream->rate_start);
+        stream->rate_start = now;
+        stream->rate_bytes = 0;
+    }
+
+    // wake a producer that was turned away once half the ring is free again
+    if (stream->blocked && stream->head - stream->acked <= stream->capacity / 2) {
+        stream->blocked = false;
+        return true;
+    }
+    return false;
+}
+
+bool
+_stream_drained(const struct lb_stream* stream)
+{
+    return stream->acked == stream->head;
+}
+
+size_t
+_stream_room(const struct lb_stream* stream)
+{
+    return stream->capacity - (size_t)(stream->head - stream->acked);
+}
+
+void
+_stream_stats(const struct lb_stream* stream, lb_stream_stats* stats_ret)
+{
+    *stats_ret = stream->stats;
+    stats_ret->buffered = (size_t)(stream->head - stream->acked);
+    stats_ret->in_flight = stream->in_flight;
+    stats_ret->window = stream->window;
+}
@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2016 Intel Corporation.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Context wide string interner.
+ *
+ * Object paths, uuids, names and addresses are stored once and handed out as stable pointers, so two
+ * interned strings are equal exactly when their pointers are. Every string counts the references
+ * held on it by the objects pointing to it. A string nobody references anymore stays findable until
+ * the table would have to grow, then it is dropped instead, so the table follows the objects alive
+ * rather than every path ever seen.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "littleb_internal.h"
+
+#define FNV1A_OFFSET_BASIS 0xcbf29ce484222325ULL
+
+struct string_entry {
+    uint32_t refs; /**< references held on str */
+    char str[];
+};
+
+struct string_slot {
+    const char* str; /**< interned string, NULL if the slot is empty */
+    uint64_t hash;   /**< FNV-1a of str */
+};
+
+struct lb_string_table {
+    struct string_slot* slots; /**< open addressing table */
+    size_t slots_capacity;     /**< power of two */
+    size_t slots_used;         /**< count of stored strings, referenced or not */
+    size_t bytes;              /**< memory of the stored strings */
+};
+
+static struct string_entry*
+_string_entry(const char* str)
+{
+    return (struct string_entry*) (str - offsetof(struct string_entry, str));
+}
+
+static uint64_t
+_string_hash(const char* str, size_t len)
+{
+    uint64_t hash = FNV1A_OFFSET_BASIS;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (uint8_t) str[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static struct string_slot*
+_string_table_lookup(struct lb_string_table* table, const char* str, size_t len, uint64_t hash)
+{
+    size_t slot = hash & (table->slots_capacity - 1);
+
+    while (table->slots[slot].str != NULL) {
+        if (table->slots[slot].hash == hash && strncmp(table->slots[slot].str, str, len) == 0 &&
+            table->slots[slot].str[len] == '\0') {
+            break;
+        }
+        slot = (slot + 1) & (table->slots_capacity - 1);
+    }
+
+    return &table->slots[slot];
+}
+
+/**
+ * Drop the strings nobody references and move the rest into a new table, twice as large if they
+ * would fill the current one past half
+ */
+static bool
+_string_table_rehash(struct lb_string_table* table)
+{
+    size_t new_capacity = table->slots_capacity, kept = 0;
+    struct string_slot* slots;
+    size_t i, slot;
+
+    for (i = 0; i < table->slots_capacity; i++) {
+        if (table->slots[i].str != NULL && _string_entry(table->slots[i].str)->refs > 0) {
+            kept++;
+        }
+    }
+    if ((kept + 1) * 2 > new_capacity) {
+        new_capacity *= 2;
+    }
+
+    slots = (struct string_slot*) calloc(new_capacity, sizeof(struct string_slot));
+    if (slots == NULL) {
+        return false;
+    }
+
+    for (i = 0; i < table->slots_capacity; i++) {
+        if (table->slots[i].str == NULL) {
+            continue;
+        }
+        if (_string_entry(table->slots[i].str)->refs == 0) {
+            table->bytes -= sizeof(struct string_entry) + strlen(table->slots[i].str) + 1;
+            free(_string_entry(table->slots[i].str));
+            continue;
+        }
+        slot = table->slots[i].hash & (new_capacity - 1);
+        while (slots[slot].str != NULL) {
+            slot = (slot + 1) & (new_capacity - 1);
+        }
+        slots[slot] = table->slots[i];
+    }
+
+    free(table->slots);
+    table->slots = slots;
+    table->slots_capacity = new_capacity;
+    table->slots_used = kept;
+    return true;
+}
+
+lb_result_t
+_string_table_new(struct lb_string_table** table_ret)
+{
+    struct lb_string_table* table =
+    (struct lb_string_table*) calloc(1, sizeof(struct lb_string_table));
+
+    if (table == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for string table", __FUNCTION__);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    table->slots_capacity = 256;
+    table->slots = (struct string_slot*) calloc(table->slots_capacity, sizeof(struct string_slot));
+    if (table->slots == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for string table", __FUNCTION__);
+        free(table);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    *table_ret = table;
+    return LB_SUCCESS;
+}
+
+void
+_string_table_free(struct lb_string_table* table)
+{
+    size_t i;
+
+    if (table == NULL) {
+        return;
+    }
+
+    for (i = 0; i < table->slots_capacity; i++) {
+        if (table->slots[i].str != NULL) {
+            free(_string_entry(table->slots[i].str));
+        }
+    }
+
+    free(table->slots);
+    free(table);
+}
+
+const char*
+_string_table_intern_len(struct lb_string_table* table, const char* str, size_t len)
+{
+    uint64_t hash = _string_hash(str, len);
+    struct string_slot* slot = _string_table_lookup(table, str, len, hash);
+    struct string_entry* entry;
+
+    if (slot->str != NULL) {
+        _string_entry(slot->str)->refs++;
+        return slot->str;
+    }
+
+    // keep the table at most half full so probe sequences stay short
+    if ((table->slots_used + 1) * 2 > table->slots_capacity) {
+        if (!_string_table_rehash(table)) {
+            syslog(LOG_ERR, "%s: Error allocating memory for string table", __FUNCTION__);
+            return NULL;
+        }
+        slot = _string_table_lookup(table, str, len, hash);
+    }
+
+    entry = (struct string_entry*) malloc(sizeof(struct string_entry) + len + 1);
+    if (entry == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for string", __FUNCTION__);
+        return NULL;
+    }
+    entry->refs = 1;
+    memcpy(entry->str, str, len);
+    entry->str[len] = '\0';
+
+    slot->str = entry->str;
+    slot->hash = hash;
+    table->slots_used++;
+    table->bytes += sizeof(struct string_entry) + len + 1;
+
+    return slot->str;
+}
+
+const char*
+_string_table_intern(struct lb_string_table* table, const char* str)
+{
+    return _string_table_intern_len(table, str, strlen(str));
+}
+
+const char*
+_string_table_find(struct lb_string_table* table, const char* str)
+{
+    size_t len = strlen(str);
+
+    return _string_table_lookup(table, str, len, _string_hash(str, len))->str;
+}
+
+const char*
+_string_table_ref(const char* str)
+{
+    if (str != NULL) {
+        _string_entry(str)->refs++;
+    }
+
+    return str;
+}
+
+void
+_string_table_release(const char* str)
+{
+    if (str != NULL) {
+        _string_entry(str)->refs--;
+    }
+}
+
+void
+_string_table_stats(const struct lb_string_table* table, uint64_t* strings, uint64_t* bytes)
+{
+    if (strings != NULL)
+        *strings = table->slots_used;
+    if (bytes != NULL)
+        *bytes = table->bytes + table->slots_capacity * sizeof(struct string_slot);
+}
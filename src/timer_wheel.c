@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2016 Intel Corporation.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Hierarchical timer wheel.
+ *
+ * Four levels of slots, 256 ticks in the first level and 64 times the span of the level below in
+ * every other, like the classic kernel timer wheel. A node is linked into the slot of the level
+ * covering it's distance from the current tick, so scheduling and cancelling are a list link or
+ * unlink. Every 256 ticks one slot of the next level is cascaded into the levels below, making the
+ * amortized cost of a tick constant whatever the count of nodes scheduled.
+ */
+
+#include <string.h>
+
+#include "littleb_internal.h"
+
+#define WHEEL_LEVEL0_BITS 8
+#define WHEEL_LEVEL_BITS 6
+#define WHEEL_LEVELS 4
+#define WHEEL_LEVEL0_SIZE (1 << WHEEL_LEVEL0_BITS)
+#define WHEEL_LEVEL_SIZE (1 << WHEEL_LEVEL_BITS)
+#define WHEEL_MAX_DELTA ((1ULL << (WHEEL_LEVEL0_BITS + (WHEEL_LEVELS - 1) * WHEEL_LEVEL_BITS)) - 1)
+
+struct lb_timer_wheel {
+    struct lb_timer_node level0[WHEEL_LEVEL0_SIZE];                   /**< one slot per tick */
+    struct lb_timer_node levels[WHEEL_LEVELS - 1][WHEEL_LEVEL_SIZE]; /**< coarser slots */
+    uint64_t tick_usec; /**< length of a tick */
+    uint64_t start;     /**< CLOCK_MONOTONIC usec of tick 0 */
+    uint64_t tick;      /**< next tick to run */
+    int size;           /**< count of scheduled nodes */
+};
+
+static void
+_list_init(struct lb_timer_node* head)
+{
+    head->prev = head;
+    head->next = head;
+}
+
+static void
+_list_append(struct lb_timer_node* head, struct lb_timer_node* node)
+{
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static void
+_list_unlink(struct lb_timer_node* node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = NULL;
+    node->next = NULL;
+}
+
+static void
+_list_move(struct lb_timer_node* from, struct lb_timer_node* to)
+{
+    _list_init(to);
+    if (from->next == from) {
+        return;
+    }
+
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    _list_init(from);
+}
+
+static void
+_wheel_link(struct lb_timer_wheel* wheel, struct lb_timer_node* node)
+{
+    uint64_t expires = node->expires;
+    uint64_t delta;
+    int level, shift;
+
+    if (expires < wheel->tick) {
+        expires = wheel->tick;
+    }
+    delta = expires - wheel->tick;
+
+    if (delta < WHEEL_LEVEL0_SIZE) {
+        _list_append(&wheel->level0[expires & (WHEEL_LEVEL0_SIZE - 1)], node);
+        return;
+    }
+
+    if (delta > WHEEL_MAX_DELTA) {
+        expires = wheel->tick + WHEEL_MAX_DELTA;
+        node->expires = expires;
+    }
+
+    for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+        shift = WHEEL_LEVEL0_BITS + (level + 1) * WHEEL_LEVEL_BITS;
+        if (level == WHEEL_LEVELS - 2 || delta < (1ULL << shift)) {
+            shift -= WHEEL_LEVEL_BITS;
+            _list_append(&wheel->levels[level][(expires >> shift) & (WHEEL_LEVEL_SIZE - 1)], node);
+            return;
+        }
+    }
+}
+
+static int
+_wheel_cascade(struct lb_timer_wheel* wheel, int level)
+{
+    int shift = WHEEL_LEVEL0_BITS + level * WHEEL_LEVEL_BITS;
+    int index = (int) ((wheel->tick >> shift) & (WHEEL_LEVEL_SIZE - 1));
+    struct lb_timer_node pending, *node;
+
+    // every node of the slot is now close enough for a finer level
+    _list_move(&wheel->levels[level][index], &pending);
+    while (pending.next != &pending) {
+        node = pending.next;
+        _list_unlink(node);
+        _wheel_link(wheel, node);
+    }
+
+    return index;
+}
+
+lb_result_t
+_timer_wheel_new(uint64_t tick_usec, uint64_t now, struct lb_timer_wheel** wheel_ret)
+{
+    struct lb_timer_wheel* wheel;
+    int i, level;
+
+    wheel = (struct lb_timer_wheel*) calloc(1, sizeof(struct lb_timer_wheel));
+    if (wheel == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for timer wheel", __FUNCTION__);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    for (i = 0; i < WHEEL_LEVEL0_SIZE; i++) {
+        _list_init(&wheel->level0[i]);
+    }
+    for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+        for (i = 0; i < WHEEL_LEVEL_SIZE; i++) {
+            _list_init(&wheel->levels[level][i]);
+        }
+    }
+
+    wheel->tick_usec = tick_usec > 0 ? tick_usec : 1;
+    wheel->start = now;
+    *wheel_ret = wheel;
+    return LB_SUCCESS;
+}
+
+void
+_timer_wheel_free(struct lb_timer_wheel* wheel)
+{
+    free(wheel);
+}
+
+void
+_timer_wheel_schedule(struct lb_timer_wheel* wheel, struct lb_timer_node* node, uint64_t expires)
+{
+    if (node->next != NULL) {
+        _list_unlink(node);
+        wheel->size--;
+    }
+
+    // round up so a node never fires before it's time
+    node->expires = (expires > wheel->start) ?
+                    (expires - wheel->start + wheel->tick_usec - 1) / wheel->tick_usec :
+                    0;
+    _wheel_link(wheel, node);
+    wheel->size++;
+}
+
+void
+_timer_wheel_cancel(struct lb_timer_wheel* wheel, struct lb_timer_node* node)
+{
+    if (node->next == NULL) {
+        return;
+    }
+
+    _list_unlink(node);
+    wheel->size--;
+}
+
+int
+_timer_wheel_size(const struct lb_timer_wheel* wheel)
+{
+    return wheel->size;
+}
+
+uint64_t
+_timer_wheel_next_tick(const struct lb_timer_wheel* wheel)
+{
+    return wheel->start + wheel->tick * wheel->tick_usec;
+}
+
+void
+_timer_wheel_advance(struct lb_timer_wheel* wheel,
+                     uint64_t now,
+                     lb_timer_expired_t expired,
+                     void* userdata)
+{
+    uint64_t target;
+    int index;
+    struct lb_timer_node pending, *node;
+
+    if (now < wheel->start) {
+        return;
+    }
+    target = (now - wheel->start) / wheel->tick_usec;
+
+    while (wheel->tick <= target) {
+        index = (int) (wheel->tick & (WHEEL_LEVEL0_SIZE - 1));
+        if (index == 0 && _wheel_cascade(wheel, 0) == 0 && _wheel_cascade(wheel, 1) == 0) {
+            _wheel_cascade(wheel, 2);
+        }
+
+        // the callback may schedule nodes again, including into this very slot
+        _list_move(&wheel->level0[index], &pending);
+        wheel->tick++;
+        while (pending.next != &pending) {
+            node = pending.next;
+            _list_unlink(node);
+            wheel->size--;
+            expired(node, userdata);
+        }
+    }
+}
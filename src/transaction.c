@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2016 Intel Corporation.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Matching of notified responses to the requests that asked for them.
+ *
+ * The pending transactions of a characteristic form a list in the order they were started. A
+ * response, a notification or a message reassembled from them, walks the list from the oldest
+ * transaction and completes the first one it matches, so replies to equal requests are handed out
+ * in order. A transaction leaves the list whenever it's future is released, answered, timed out,
+ * cancelled or freed alike.
+ */
+
+#include <string.h>
+
+#include "littleb_internal.h"
+
+static bool
+_transaction_matches(const struct lb_transaction* transaction, const uint8_t* data, size_t size)
+{
+    const lb_transact_matcher* matcher = &(transaction->matcher);
+    size_t prefix = matcher->prefix_size;
+
+    if (matcher->match != NULL) {
+        return matcher->match(transaction->request, transaction->request_size, data, size,
+                              matcher->userdata);
+    }
+
+    if (prefix > transaction->request_size) {
+        prefix = transaction->request_size;
+    }
+    return size >= prefix && memcmp(transaction->request, data, prefix) == 0;
+}
+
+static void
+_transactions_offer(struct lb_transactions* transactions, const uint8_t* data, size_t size)
+{
+    struct lb_transaction* transaction;
+    lb_future* future;
+    lb_result_t r;
+
+    for (transaction = transactions->first; transaction != NULL; transaction = transaction->next) {
+        if (!_transaction_matches(transaction, data, size)) {
+            continue;
+        }
+
+        // completing removes the transaction, the list is not touched after
+        future = transaction->future;
+        transactions->stats.answered++;
+        r = _future_set_value(future, data, size);
+        _future_complete(future, (r < 0) ? r : LB_SUCCESS);
+        return;
+    }
+
+    transactions->stats.unmatched++;
+}
+
+static void
+_on_transaction_frame(const uint8_t* message, size_t size, void* userdata)
+{
+    _transactions_offer((struct lb_transactions*) userdata, message, size);
+}
+
+lb_result_t
+_transactions_new(const char* path, bool framed, struct lb_transactions** transactions_ret)
+{
+    struct lb_transactions* transactions;
+    lb_result_t r;
+
+    transactions = (struct lb_transactions*) calloc(1, sizeof(struct lb_transactions));
+    if (transactions == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for transactions", __FUNCTION__);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    if (framed) {
+        r = _frame_reader_new(LB_FRAME_MAX_SIZE, _on_transaction_frame, transactions,
+                              &(transactions->frames));
+        if (r < 0) {
+            free(transactions);
+            return r;
+        }
+    }
+
+    transactions->path = path;
+    transactions->framed = framed;
+    *transactions_ret = transactions;
+    return LB_SUCCESS;
+}
+
+void
+_transactions_free(struct lb_transactions* transactions)
+{
+    if (transactions == NULL) {
+        return;
+    }
+
+    // a completion callback may free other futures, the list is read again every time
+    while (transactions->first != NULL) {
+        _future_complete(transactions->first->future, -LB_ERROR_CANCELLED);
+    }
+
+    sd_bus_slot_unref(transactions->notify_slot);
+    _frame_reader_free(transactions->frames);
+    free(transactions);
+}
+
+lb_result_t
+_transaction_add(struct lb_transactions* transactions,
+                 lb_future* future,
+                 const uint8_t* request,
+                 size_t size,
+                 const lb_transact_matcher* matcher,
+                 struct lb_transaction** transaction_ret)
+{
+    struct lb_transaction* transaction;
+
+    transaction = (struct lb_transaction*) calloc(1, sizeof(struct lb_transaction));
+    if (transaction == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for transaction", __FUNCTION__);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    // one byte at least so an empty request is matched against a valid pointer
+    transaction->request = (uint8_t*) malloc(size > 0 ? size : 1);
+    if (transaction->request == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for transaction", __FUNCTION__);
+        free(transaction);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    if (size > 0) {
+        memcpy(transaction->request, request, size);
+    }
+    transaction->request_size = size;
+    if (matcher != NULL) {
+        transaction->matcher = *matcher;
+    }
+    transaction->future = future;
+    transaction->owner = transactions;
+
+    if (transactions->last != NULL) {
+        transactions->last->next = transaction;
+    } else {
+        transactions->first = transaction;
+    }
+    transactions->last = transaction;
+    transactions->stats.started++;
+    transactions->stats.pending++;
+
+    future->transaction = transaction;
+    *transaction_ret = transaction;
+    return LB_SUCCESS;
+}
+
+void
+_transaction_remove(struct lb_transaction* transaction)
+{
+    struct lb_transactions* transactions = transaction->owner;
+    struct lb_transaction** link = &(transactions->first);
+    struct lb_transaction* previous = NULL;
+    lb_future* write = transaction->write;
+
+    while (*link != transaction) {
+        previous = *link;
+        link = &((*link)->next);
+    }
+    *link = transaction->next;
+    if (transactions->last == transaction) {
+        transactions->last = previous;
+    }
+    transactions->stats.pending--;
+
+    // a request still queued is not worth sending, one on the air completes on it's own
+    if (write != NULL) {
+        if (write->queue != NULL && write->queue->in_flight != write) {
+            _future_free(write);
+        } else {
+            write->userdata = NULL;
+        }
+    }
+
+    transaction->future->transaction = NULL;
+    free(transaction->request);
+    free(transaction);
+}
+
+void
+_transactions_receive(struct lb_transactions* transactions, const uint8_t* data, size_t size)
+{
+    if (transactions->frames != NULL) {
+        _frame_reader_push(transactions->frames, data, size);
+    } else {
+        _transactions_offer(transactions, data, size);
+    }
+}
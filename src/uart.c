@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2016 Intel Corporation.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Receive side and readiness of a Nordic UART Service byte stream.
+ *
+ * Notifications are copied into a ring sized once at open, lb_uart_read copies them out again, so
+ * no allocation happens per notification. The eventfd mirrors _uart_ready as a level: it holds a
+ * count while there is something to do and is drained as soon as there is not, so a poll loop on
+ * it never spins and never misses a transition.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+
+#include "littleb_internal.h"
+
+#define UART_DEFAULT_RX_BUFFER_SIZE 16384
+
+lb_result_t
+_uart_new(size_t rx_buffer_size, struct lb_uart** uart_ret)
+{
+    struct lb_uart* uart;
+    size_t capacity = 1;
+
+    if (rx_buffer_size == 0) {
+        rx_buffer_size = UART_DEFAULT_RX_BUFFER_SIZE;
+    }
+    while (capacity < rx_buffer_size) {
+        capacity *= 2;
+    }
+
+    uart = (struct lb_uart*) calloc(1, sizeof(struct lb_uart));
+    if (uart == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for uart", __FUNCTION__);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    uart->rx = (uint8_t*) malloc(capacity);
+    if (uart->rx == NULL) {
+        syslog(LOG_ERR, "%s: Error allocating memory for uart", __FUNCTION__);
+        free(uart);
+        return -LB_ERROR_MEMEORY_ALLOCATION;
+    }
+
+    uart->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (uart->event_fd < 0) {
+        syslog(LOG_ERR, "%s: eventfd failed with error: %s", __FUNCTION__, strerror(errno));
+        free(uart->rx);
+        free(uart);
+        return -LB_ERROR_NO_RESOURCES;
+    }
+
+    uart->rx_capacity = capacity;
+    *uart_ret = uart;
+    return LB_SUCCESS;
+}
+
+void
+_uart_free(struct lb_uart* uart)
+{
+    if (uart == NULL) {
+        return;
+    }
+
+    close(uart->event_fd);
+    free(uart->rx);
+    _string_table_release(uart->tx_path);
+    free(uart);
+}
+
+void
+_uart_receive(struct lb_uart* uart, const uint8_t* data, size_t size)
+{
+    size_t room = uart->rx_capacity - (size_t)(uart->rx_head - uart->rx_tail);
+    size_t start, first;
+
+    uart->stats.notifications++;
+    uart->stats.rx_bytes += size;
+
+    // notifications are not flow controlled, what the reader did not make room for is lost
+    if (size > room) {
+        uart->stats.rx_dropped += size - room;
+        size = room;
+    }
+
+    start = uart->rx_head & (uart->rx_capacity - 1);
+    first = uart->rx_capacity - start;
+    if (first > size) {
+        first = size;
+    }
+    memcpy(uart->rx + start, data, first);
+    memcpy(uart->rx, data + first, size - first);
+    uart->rx_head += size;
+}
+
+size_t
+_uart_read(struct lb_uart* uart, uint8_t* buffer, size_t size)
+{
+    size_t available = (size_t)(uart->rx_head - uart->rx_tail);
+    size_t start, first;
+
+    if (size > available) {
+        size = available;
+    }
+
+    start = uart->rx_tail & (uart->rx_capacity - 1);
+    first = uart->rx_capacity - start;
+    if (first > size) {
+        first = size;
+    }
+    memcpy(buffer, uart->rx + start, first);
+    memcpy(buffer + first, uart->rx, size - first);
+    uart->rx_tail += size;
+
+    return size;
+}
+
+bool
+_uart_ready(const struct lb_uart* uart)
+{
+    return uart->rx_head != uart->rx_tail || uart->writable;
+}
+
+void
+_uart_signal(struct lb_uart* uart)
+{
+    uint64_t count = 1;
+    bool ready = _uart_ready(uart);
+
+    if (ready == uart->signaled) {
+        return;
+    }
+
+    if (ready) {
+        if (write(uart->event_fd, &count, sizeof(count)) < 0) {
+            syslog(LOG_ERR, "%s: Failed to signal uart: %s", __FUNCTION__, strerror(errno));
+            return;
+        }
+    } else if (read(uart->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        syslog(LOG_ERR, "%s: Failed to clear uart: %s", __FUNCTION__, strerror(errno));
+        return;
+    }
+    uart->signaled = ready;
+}
+
+void
+_uart_stats(const struct lb_uart* uart, lb_uart_stats* stats_ret)
+{
+    lb_stream_stats tx;
+
+    _stream_stats(uart->tx, &tx);
+    *stats_ret = uart->stats;
+    stats_ret->tx_bytes = tx.bytes_sent;
+    stats_ret->tx_writes = tx.writes;
+    stats_ret->rx_buffered = (size_t)(uart->rx_head - uart->rx_tail);
+    stats_ret->tx_buffered = tx.buffered;
+}